@@ -45,29 +45,45 @@ void on_request2 (uv_tcp_t *handle, struct HttpRequest const *request)
 
 struct mywork {
    uv_work_t work;
-   uv_tcp_t *handle;
+   struct RequestContext *context;
    char *uri;
 };
 
+void cancel_cb (struct RequestContext *context)
+{
+   // the client is gone; fails if the work has already started
+   struct mywork *mw = (struct mywork *)context->data;
+   uv_cancel ((uv_req_t *)&(mw->work));
+}
+
 void work_cb (uv_work_t* work)
 {
+   // runs on a worker thread; nothing of uvllhttpd may be called here
    struct mywork *mw = (struct mywork *)work;
-   printf ("uri: %s\n", mw->uri);
+   if (atomic_load (&(mw->context->cancelled))) return;
 
-   struct HttpResponse *response = uvllhttpd_response_init (mw->handle);
-   response->status = 200;
-   char contentType[] = "Content-Type: text/plain";
-   uvllhttpd_response_add_header (response, contentType, sizeof(contentType)-1);
-
-   char body[] = "Hello World";
-   uvllhttpd_response_append_body (response, body, sizeof(body)-1);
-
-   uvllhttpd_response_finish (response);
+   printf ("uri: %s\n", mw->uri);
 }
 
 void after_work_cb (uv_work_t* work, int status)
 {
    struct mywork *mw = (struct mywork *)work;
+
+   // NULL when the connection has been closed in the meantime
+   struct HttpResponse *response = uvllhttpd_context_response_init (mw->context);
+   if (response != NULL)
+   {
+      response->status = 200;
+      char contentType[] = "Content-Type: text/plain";
+      uvllhttpd_response_add_header (response, contentType, sizeof(contentType)-1);
+
+      char body[] = "Hello World";
+      uvllhttpd_response_append_body (response, body, sizeof(body)-1);
+
+      uvllhttpd_response_finish (response);
+   }
+
+   uvllhttpd_context_unref (mw->context);
    free (mw);
 }
 
@@ -76,7 +92,9 @@ void on_request3 (uv_tcp_t *handle, struct HttpRequest const *request)
    printf ("on_request3\n");
 
    struct mywork *mw = malloc (sizeof(struct mywork) + request->uri.len + 1);
-   mw->handle = handle;
+   mw->context = uvllhttpd_request_context (handle);
+   mw->context->data = mw;
+   mw->context->on_cancel = cancel_cb;
    mw->uri = (char *) mw + sizeof(struct mywork);
    strncpy (mw->uri, request->uri.base, request->uri.len);
    mw->uri[request->uri.len] = '\0';
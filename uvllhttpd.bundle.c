@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.bundle.h"
+
+struct BundleAsset const *uvllhttpd_bundle_find (struct AssetBundle const *bundle, char const *path, size_t length)
+{
+   if (bundle == NULL || bundle->asset_count == 0) return NULL;
+
+   uint64_t const hash = uvllhttpd_bundle_hash (path, length);
+   uint32_t const displacement = bundle->displacements[(hash >> 32) % bundle->bucket_count];
+   struct BundleAsset const *asset = &(bundle->assets[uvllhttpd_bundle_slot (hash, displacement, bundle->asset_count)]);
+
+   // every slot is taken, by the path hashing there if it is bundled at all
+   if (asset->path.len != length || memcmp (asset->path.base, path, length) != 0) return NULL;
+   return asset;
+}
+
+static bool is_list_separator (char c)
+{
+   return c == ',' || c == ' ' || c == '\t';
+}
+
+// whether the comma separated list names the token without q=0
+static bool list_accepts (uv_buf_t list, char const *token, size_t length)
+{
+   char const *p = list.base;
+   char const *end = list.base + list.len;
+
+   while (p < end)
+   {
+      while (p < end && is_list_separator (*p)) p++;
+      char const *item = p;
+      while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+      bool const match = (size_t)(p - item) == length && strncasecmp (item, token, length) == 0;
+
+      // parameters, of which only q matters
+      bool refused = false;
+      while (p < end && *p != ',')
+      {
+         if ((*p == 'q' || *p == 'Q') && p + 1 < end && p[1] == '=')
+         {
+            char const *q = p + 2;
+            refused = q < end && *q == '0';
+            for (q++; refused && q < end && *q != ',' && *q != ';' && *q != ' '; q++)
+            {
+               if (*q != '.' && *q != '0') refused = false;
+            }
+         }
+         p++;
+      }
+
+      if (match) return !refused;
+   }
+   return false;
+}
+
+static bool list_contains (uv_buf_t list, struct BundleBytes value)
+{
+   if (list.len == 1 && list.base[0] == '*') return true;
+
+   for (size_t i = 0; i + value.len <= list.len; i++)
+   {
+      if (memcmp (list.base + i, value.base, value.len) == 0) return true;
+   }
+   return false;
+}
+
+bool uvllhttpd_bundle_serve (uv_tcp_t *handle, struct HttpRequest const *request, struct AssetBundle const *bundle)
+{
+   if (handle == NULL || request == NULL || bundle == NULL) return false;
+   if (request->method != HTTP_GET && request->method != HTTP_HEAD) return false;
+
+   struct HttpUriParts parts;
+   uvllhttpd_request_split_uri (request, &parts);
+
+   struct BundleAsset const *asset = uvllhttpd_bundle_find (bundle, parts.path.base, parts.path.len);
+   if (asset == NULL) return false;
+
+   struct HttpResponse *response = uvllhttpd_response_init (handle);
+
+   struct HttpHeader const *if_none_match = uvllhttpd_request_find_header (request, "If-None-Match", 13);
+   if (if_none_match != NULL && list_contains (if_none_match->value, asset->etag))
+   {
+      response->status = 304;
+      response->_head.base = (char *)asset->not_modified.base;
+      response->_head.len = asset->not_modified.len;
+      uvllhttpd_response_finish (response);
+      return true;
+   }
+
+   struct HttpHeader const *accept_encoding = uvllhttpd_request_find_header (request, "Accept-Encoding", 15);
+   static char const * const tokens[BundleEncoding_count] = { "identity", "gzip", "br" };
+
+   struct BundleVariant const *variant = &(asset->variants[BundleEncoding_identity]);
+   for (int i = BundleEncoding_identity + 1; i < BundleEncoding_count && accept_encoding != NULL; i++)
+   {
+      struct BundleVariant const *v = &(asset->variants[i]);
+      if (v->head.len > 0 && v->body.len < variant->body.len &&
+            list_accepts (accept_encoding->value, tokens[i], strlen (tokens[i])))
+      {
+         variant = v;
+      }
+   }
+
+   response->status = 200;
+   response->_head.base = (char *)variant->head.base;
+   response->_head.len = variant->head.len;
+   if (request->method != HTTP_HEAD && variant->body.len > 0)
+   {
+      uvllhttpd_response_append_ref (response, variant->body.base, variant->body.len, NULL, NULL);
+   }
+   uvllhttpd_response_finish (response);
+   return true;
+}
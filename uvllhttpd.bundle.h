@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "uvllhttpd.h"
+
+// Files packed into the binary at build time by uvllhttpd-bundle; see
+// uvllhttpd_add_bundle in CMakeLists.txt. The generated source defines
+//    struct AssetBundle const <name>;
+// with every response preserialized, so that serving needs no filesystem.
+
+enum BundleEncoding {
+   BundleEncoding_identity,
+   BundleEncoding_gzip,
+   BundleEncoding_br,
+   BundleEncoding_count,
+};
+
+struct BundleBytes {
+   char const *base;
+   size_t len;
+};
+
+struct BundleVariant {
+   // status line and headers up to Content-Length; empty when the
+   // encoding did not make the file smaller
+   struct BundleBytes head;
+   struct BundleBytes body;
+};
+
+struct BundleAsset {
+   // "/" followed by the path relative to the bundled directory
+   struct BundleBytes path;
+   // quoted, as in the headers
+   struct BundleBytes etag;
+   struct BundleVariant variants[BundleEncoding_count];
+   // head of the 304 response to a matching If-None-Match
+   struct BundleBytes not_modified;
+};
+
+// Indexed by a perfect hash: the top half of the path's hash picks a
+// displacement, which mixed with the bottom half gives the asset's slot.
+struct AssetBundle {
+   size_t asset_count;
+   struct BundleAsset const *assets;
+   size_t bucket_count;
+   uint32_t const *displacements;
+};
+
+// Shared with the generator, which has to place assets where lookups look.
+static inline uint64_t uvllhttpd_bundle_hash (char const *s, size_t length)
+{
+   uint64_t hash = 0xcbf29ce484222325ULL;
+   for (size_t i = 0; i < length; i++)
+   {
+      hash ^= (unsigned char)s[i];
+      hash *= 0x100000001b3ULL;
+   }
+   return hash;
+}
+
+static inline size_t uvllhttpd_bundle_slot (uint64_t hash, uint32_t displacement, size_t asset_count)
+{
+   uint32_t x = (uint32_t)hash ^ displacement;
+   x ^= x >> 16;
+   x *= 0x85ebca6bU;
+   x ^= x >> 13;
+   x *= 0xc2b2ae35U;
+   x ^= x >> 16;
+   return x % asset_count;
+}
+
+// NULL if path is not bundled
+struct BundleAsset const *uvllhttpd_bundle_find (struct AssetBundle const *bundle, char const *path, size_t length);
+
+// Called from on_request: answers a GET or HEAD of a bundled path with the
+// smallest variant the client accepts, or 304 when If-None-Match matches.
+// Returns false without responding otherwise, so the handler can go on.
+bool uvllhttpd_bundle_serve (uv_tcp_t *handle, struct HttpRequest const *request, struct AssetBundle const *bundle);
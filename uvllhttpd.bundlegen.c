@@ -0,0 +1,413 @@
+// uvllhttpd-bundle <name> <directory> <output.c>
+//
+// Packs the files under directory into a C source defining
+// struct AssetBundle const <name>; see uvllhttpd.bundle.h.
+// Dot files are left out, and index.html also answers for its directory.
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+#ifdef UVLLHTTPD_BUNDLE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "uvllhttpd.bundle.h"
+
+struct file {
+   char *path;
+   unsigned char *data[BundleEncoding_count];
+   size_t size[BundleEncoding_count];
+   char const *content_type;
+   bool compressible;
+   uint64_t etag;
+};
+
+struct key {
+   char *path;
+   size_t file;
+   uint64_t hash;
+   size_t slot;
+};
+
+static struct file *files;
+static size_t file_count;
+static size_t root_length;
+
+static struct {
+   char const *extension;
+   char const *content_type;
+   bool compressible;
+} const types[] = {
+   { "html", "text/html; charset=utf-8", true },
+   { "htm", "text/html; charset=utf-8", true },
+   { "css", "text/css; charset=utf-8", true },
+   { "js", "text/javascript; charset=utf-8", true },
+   { "mjs", "text/javascript; charset=utf-8", true },
+   { "json", "application/json", true },
+   { "map", "application/json", true },
+   { "txt", "text/plain; charset=utf-8", true },
+   { "xml", "application/xml", true },
+   { "svg", "image/svg+xml", true },
+   { "wasm", "application/wasm", true },
+   { "ico", "image/x-icon", true },
+   { "png", "image/png", false },
+   { "jpg", "image/jpeg", false },
+   { "jpeg", "image/jpeg", false },
+   { "gif", "image/gif", false },
+   { "webp", "image/webp", false },
+   { "woff", "font/woff", false },
+   { "woff2", "font/woff2", false },
+   { "pdf", "application/pdf", false },
+};
+
+static void die (char const *message, char const *detail)
+{
+   fprintf (stderr, "uvllhttpd-bundle: %s%s%s\n", message, detail != NULL ? ": " : "", detail != NULL ? detail : "");
+   exit (1);
+}
+
+static void set_type (struct file *f)
+{
+   f->content_type = "application/octet-stream";
+   f->compressible = false;
+
+   char const *dot = strrchr (f->path, '.');
+   if (dot == NULL || strchr (dot, '/') != NULL) return;
+
+   for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+   {
+      if (strcasecmp (dot + 1, types[i].extension) == 0)
+      {
+         f->content_type = types[i].content_type;
+         f->compressible = types[i].compressible;
+         return;
+      }
+   }
+}
+
+static void compress_gzip (struct file *f)
+{
+   z_stream z = {0};
+   if (deflateInit2 (&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) die ("deflateInit2", NULL);
+
+   size_t const capacity = deflateBound (&z, f->size[BundleEncoding_identity]);
+   unsigned char *out = malloc (capacity);
+   z.next_in = f->data[BundleEncoding_identity];
+   z.avail_in = f->size[BundleEncoding_identity];
+   z.next_out = out;
+   z.avail_out = capacity;
+   if (deflate (&z, Z_FINISH) != Z_STREAM_END) die ("deflate", f->path);
+
+   f->data[BundleEncoding_gzip] = out;
+   f->size[BundleEncoding_gzip] = z.total_out;
+   deflateEnd (&z);
+}
+
+static void compress_br (struct file *f)
+{
+#ifdef UVLLHTTPD_BUNDLE_BROTLI
+   size_t size = BrotliEncoderMaxCompressedSize (f->size[BundleEncoding_identity]);
+   if (size == 0) size = f->size[BundleEncoding_identity] + 1024;
+   unsigned char *out = malloc (size);
+   if (!BrotliEncoderCompress (BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+            f->size[BundleEncoding_identity], f->data[BundleEncoding_identity], &size, out))
+   {
+      die ("brotli", f->path);
+   }
+   f->data[BundleEncoding_br] = out;
+   f->size[BundleEncoding_br] = size;
+#endif
+}
+
+static int add_file (char const *path, struct stat const *st, int flag, struct FTW *ftw)
+{
+   if (flag != FTW_F || !S_ISREG(st->st_mode)) return 0;
+   if (strstr (path + root_length, "/.") != NULL) return 0;
+
+   FILE *in = fopen (path, "rb");
+   if (in == NULL) die ("cannot open", path);
+
+   struct file f = {0};
+   f.path = strdup (path + root_length);
+   f.size[BundleEncoding_identity] = st->st_size;
+   f.data[BundleEncoding_identity] = malloc (st->st_size + 1);
+   if (fread (f.data[BundleEncoding_identity], 1, st->st_size, in) != (size_t)st->st_size) die ("cannot read", path);
+   fclose (in);
+
+   set_type (&f);
+   f.etag = uvllhttpd_bundle_hash ((char const *)f.data[BundleEncoding_identity], f.size[BundleEncoding_identity]);
+
+   if (f.compressible && f.size[BundleEncoding_identity] > 0)
+   {
+      compress_gzip (&f);
+      compress_br (&f);
+
+      // a variant is only worth sending if it saves something
+      for (int i = BundleEncoding_gzip; i < BundleEncoding_count; i++)
+      {
+         if (f.data[i] != NULL && f.size[i] >= f.size[BundleEncoding_identity])
+         {
+            free (f.data[i]);
+            f.data[i] = NULL;
+            f.size[i] = 0;
+         }
+      }
+   }
+
+   files = realloc (files, sizeof(struct file) * (file_count + 1));
+   files[file_count++] = f;
+   return 0;
+}
+
+static int compare_files (void const *a, void const *b)
+{
+   return strcmp (((struct file const *)a)->path, ((struct file const *)b)->path);
+}
+
+// keys of one displacement bucket, largest buckets placed first
+struct bucket {
+   size_t index;
+   size_t count;
+   size_t *keys;
+};
+
+static int compare_buckets (void const *a, void const *b)
+{
+   struct bucket const *x = a;
+   struct bucket const *y = b;
+   if (x->count != y->count) return x->count < y->count ? 1 : -1;
+   return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Displacements tried per bucket before giving up on the table size: two keys
+// whose hashes share a bucket and a bottom half never get separate slots.
+#define BUNDLE_DISPLACEMENT_ATTEMPTS (1u << 20)
+#define BUNDLE_TABLE_ATTEMPTS 8
+
+// NULL if a bucket could not be placed, *stuck then names one of its paths
+static uint32_t *build_hash (struct key *keys, size_t key_count, size_t bucket_count, char const **stuck)
+{
+   struct bucket *buckets = calloc (bucket_count, sizeof(struct bucket));
+   for (size_t i = 0; i < bucket_count; i++) buckets[i].index = i;
+   for (size_t i = 0; i < key_count; i++)
+   {
+      struct bucket *b = &(buckets[(keys[i].hash >> 32) % bucket_count]);
+      b->keys = realloc (b->keys, sizeof(size_t) * (b->count + 1));
+      b->keys[b->count++] = i;
+   }
+   qsort (buckets, bucket_count, sizeof(struct bucket), compare_buckets);
+
+   uint32_t *displacements = calloc (bucket_count, sizeof(uint32_t));
+   bool *taken = calloc (key_count, sizeof(bool));
+   size_t slots[key_count > 0 ? key_count : 1];
+
+   size_t i = 0;
+   for (; i < bucket_count && buckets[i].count > 0; i++)
+   {
+      struct bucket *b = &(buckets[i]);
+      uint32_t d = 0;
+      for (; d < BUNDLE_DISPLACEMENT_ATTEMPTS; d++)
+      {
+         size_t n = 0;
+         for (; n < b->count; n++)
+         {
+            size_t const slot = uvllhttpd_bundle_slot (keys[b->keys[n]].hash, d, key_count);
+            bool used = taken[slot];
+            for (size_t j = 0; j < n && !used; j++) used = slots[j] == slot;
+            if (used) break;
+            slots[n] = slot;
+         }
+         if (n == b->count) break;
+      }
+      if (d == BUNDLE_DISPLACEMENT_ATTEMPTS)
+      {
+         *stuck = keys[b->keys[0]].path;
+         break;
+      }
+
+      displacements[b->index] = d;
+      for (size_t n = 0; n < b->count; n++)
+      {
+         taken[slots[n]] = true;
+         keys[b->keys[n]].slot = slots[n];
+      }
+      free (b->keys);
+   }
+
+   bool const placed = i == bucket_count || buckets[i].count == 0;
+   for (; i < bucket_count; i++) free (buckets[i].keys);
+   free (taken);
+   free (buckets);
+   if (!placed)
+   {
+      free (displacements);
+      return NULL;
+   }
+   return displacements;
+}
+
+static void write_string (FILE *out, char const *s, size_t length)
+{
+   fputc ('"', out);
+   for (size_t i = 0; i < length; i++)
+   {
+      unsigned char const c = s[i];
+      if (c == '"' || c == '\\') fprintf (out, "\\%c", c);
+      else if (c == '\r') fputs ("\\r", out);
+      else if (c == '\n') fputs ("\\n", out);
+      else if (c < 0x20 || c >= 0x7f || c == '?') fprintf (out, "\\%03o", c);
+      else fputc (c, out);
+   }
+   fputc ('"', out);
+}
+
+static void write_bytes (FILE *out, char const *name, unsigned char const *data, size_t length)
+{
+   fprintf (out, "static unsigned char const %s[%zu] = {", name, length > 0 ? length : 1);
+   for (size_t i = 0; i < length; i++)
+   {
+      fprintf (out, "%s0x%02x,", i % 16 == 0 ? "\n   " : "", data[i]);
+   }
+   fputs (length > 0 ? "\n};\n" : "0};\n", out);
+}
+
+static char const * const encodings[BundleEncoding_count] = { "identity", "gzip", "br" };
+
+static void write_file (FILE *out, size_t index)
+{
+   struct file const *f = &(files[index]);
+   bool const varies = f->data[BundleEncoding_gzip] != NULL || f->data[BundleEncoding_br] != NULL;
+   char name[64];
+   char head[512];
+
+   fprintf (out, "\n// %s\n", f->path);
+   for (int i = 0; i < BundleEncoding_count; i++)
+   {
+      if (f->data[i] == NULL) continue;
+
+      snprintf (name, sizeof(name), "file%zu_%s", index, encodings[i]);
+      write_bytes (out, name, f->data[i], f->size[i]);
+
+      int n = snprintf (head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s%s%s%sETag: \"%016llx\"\r\n"
+            "Content-Length: %zu\r\n", f->content_type,
+            i != BundleEncoding_identity ? "Content-Encoding: " : "",
+            i != BundleEncoding_identity ? encodings[i] : "",
+            i != BundleEncoding_identity ? "\r\n" : "",
+            varies ? "Vary: Accept-Encoding\r\n" : "",
+            (unsigned long long)f->etag, f->size[i]);
+      fprintf (out, "static char const file%zu_head_%s[] = ", index, encodings[i]);
+      write_string (out, head, n);
+      fputs (";\n", out);
+   }
+
+   int n = snprintf (head, sizeof(head), "HTTP/1.1 304 Not Modified\r\n%sETag: \"%016llx\"\r\n",
+         varies ? "Vary: Accept-Encoding\r\n" : "", (unsigned long long)f->etag);
+   fprintf (out, "static char const file%zu_not_modified[] = ", index);
+   write_string (out, head, n);
+   fputs (";\n", out);
+}
+
+static void write_asset (FILE *out, struct key const *k)
+{
+   struct file const *f = &(files[k->file]);
+
+   fprintf (out, "   [%zu] = {\n      .path = { ", k->slot);
+   write_string (out, k->path, strlen (k->path));
+   fprintf (out, ", %zu },\n", strlen (k->path));
+   fprintf (out, "      .etag = { \"\\\"%016llx\\\"\", 18 },\n", (unsigned long long)f->etag);
+   fputs ("      .variants = {\n", out);
+   for (int i = 0; i < BundleEncoding_count; i++)
+   {
+      if (f->data[i] == NULL) continue;
+      fprintf (out, "         [BundleEncoding_%s] = {\n", encodings[i]);
+      fprintf (out, "            .head = { file%zu_head_%s, sizeof(file%zu_head_%s)-1 },\n",
+            k->file, encodings[i], k->file, encodings[i]);
+      fprintf (out, "            .body = { (char const *)file%zu_%s, %zu },\n", k->file, encodings[i], f->size[i]);
+      fputs ("         },\n", out);
+   }
+   fputs ("      },\n", out);
+   fprintf (out, "      .not_modified = { file%zu_not_modified, sizeof(file%zu_not_modified)-1 },\n", k->file, k->file);
+   fputs ("   },\n", out);
+}
+
+int main (int argc, char *argv[])
+{
+   if (argc != 4)
+   {
+      fprintf (stderr, "usage: uvllhttpd-bundle <name> <directory> <output.c>\n");
+      return 2;
+   }
+   char const *name = argv[1];
+   char const *root = argv[2];
+
+   root_length = strlen (root);
+   while (root_length > 1 && root[root_length - 1] == '/') root_length--;
+   if (nftw (root, add_file, 16, FTW_PHYS) != 0) die ("cannot walk", root);
+   qsort (files, file_count, sizeof(struct file), compare_files);
+
+   // every file under its path, index.html under its directory's too
+   struct key *keys = calloc (file_count * 2 + 1, sizeof(struct key));
+   size_t key_count = 0;
+   for (size_t i = 0; i < file_count; i++)
+   {
+      keys[key_count++] = (struct key) { .path = files[i].path, .file = i };
+
+      size_t const length = strlen (files[i].path);
+      if (length >= 11 && strcmp (files[i].path + length - 11, "/index.html") == 0)
+      {
+         keys[key_count++] = (struct key) { .path = strndup (files[i].path, length - 10), .file = i };
+      }
+   }
+   for (size_t i = 0; i < key_count; i++)
+   {
+      keys[i].hash = uvllhttpd_bundle_hash (keys[i].path, strlen (keys[i].path));
+      for (size_t j = 0; j < i; j++)
+      {
+         if (keys[j].hash == keys[i].hash) die ("paths with the same hash", keys[i].path);
+      }
+   }
+
+   // a bucket that cannot be placed is split up by a larger table
+   size_t bucket_count = key_count / 4 + 1;
+   char const *stuck = NULL;
+   uint32_t *displacements = build_hash (keys, key_count, bucket_count, &stuck);
+   for (int attempt = 1; displacements == NULL; attempt++)
+   {
+      if (attempt == BUNDLE_TABLE_ATTEMPTS) die ("no perfect hash found", stuck);
+      bucket_count = bucket_count * 2 + 1;
+      displacements = build_hash (keys, key_count, bucket_count, &stuck);
+   }
+
+   FILE *out = fopen (argv[3], "w");
+   if (out == NULL) die ("cannot create", argv[3]);
+
+   fprintf (out, "// Generated by uvllhttpd-bundle from %s, do not edit.\n\n", root);
+   fputs ("#include \"uvllhttpd.bundle.h\"\n", out);
+   for (size_t i = 0; i < file_count; i++) write_file (out, i);
+
+   fprintf (out, "\nstatic struct BundleAsset const assets[%zu] = {\n", key_count > 0 ? key_count : 1);
+   for (size_t i = 0; i < key_count; i++) write_asset (out, &(keys[i]));
+   if (key_count == 0) fputs ("   {0},\n", out);
+   fputs ("};\n", out);
+
+   fprintf (out, "\nstatic uint32_t const displacements[%zu] = {", bucket_count);
+   for (size_t i = 0; i < bucket_count; i++) fprintf (out, "%s%uU,", i % 8 == 0 ? "\n   " : " ", displacements[i]);
+   fputs ("\n};\n", out);
+
+   fprintf (out, "\nstruct AssetBundle const %s = {\n", name);
+   fprintf (out, "   .asset_count = %zu,\n", key_count);
+   fputs ("   .assets = assets,\n", out);
+   fprintf (out, "   .bucket_count = %zu,\n", bucket_count);
+   fputs ("   .displacements = displacements,\n};\n", out);
+
+   if (fclose (out) != 0) die ("cannot write", argv[3]);
+   return 0;
+}
@@ -1,24 +1,88 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 
 #include "uvllhttpd.h"
 #include "uvllhttpd.impl.h"
+#include "uvllhttpd.cache.h"
+#include "uvllhttpd.trace.h"
+#include "uvllhttpd.log.h"
+#include "uvllhttpd.websocket.h"
 
 static void close_cb (uv_handle_t *handle);
+static void drain_finish (struct HttpServer *server);
 static void alloc_buffer_cb (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
 static void read_cb (uv_stream_t *client, ssize_t nread, const uv_buf_t *buf);
+static struct HttpResponse *response_new (uvllhttpd_client_t *client);
+
+static void report_error (struct HttpServer *server, int error, char const *message)
+{
+   if (server->on_error != NULL) server->on_error (server, error, message);
+}
+
+static void peer_name (uvllhttpd_client_t *client)
+{
+   struct sockaddr_storage addr;
+   int length = sizeof(addr);
+   if (uv_tcp_getpeername (&(client->handle), (struct sockaddr *)&addr, &length) != 0) return;
+
+   if (addr.ss_family == AF_INET6)
+   {
+      uv_ip6_name ((struct sockaddr_in6 *)&addr, client->peer, sizeof(client->peer));
+   }
+   else if (addr.ss_family == AF_INET)
+   {
+      uv_ip4_name ((struct sockaddr_in *)&addr, client->peer, sizeof(client->peer));
+   }
+}
+
+bool uvllhttpd_client_start (struct HttpServer *server, uvllhttpd_client_t *client)
+{
+   client->server = server;
+   client->next_client = server->_clients;
+   if (server->_clients != NULL) server->_clients->prev_client = client;
+   server->_clients = client;
+   if (server->_draining)
+   {
+      // accepted just as the server stopped accepting
+      uvllhttpd_client_close (client);
+      return false;
+   }
+#ifdef UVLLHTTPD_TLS
+   if (server->tls != NULL)
+   {
+      client->tls = uvllhttpd_tls_connection_new (server->tls, client);
+      if (client->tls == NULL)
+      {
+         report_error (server, UV_ENOMEM, "TLS connection setup failed");
+         uvllhttpd_client_close (client);
+         return false;
+      }
+   }
+#endif
+   if (server->trace != NULL && server->trace->sample_rate > 0)
+   {
+      client->trace_connection = ++server->trace->_connection_count;
+      client->accepted_at = uv_hrtime ();
+   }
+   // once per connection, so that logging a request needs no system call
+   if (server->access_log != NULL) peer_name (client);
+   llhttp_init (&(client->parser), HTTP_REQUEST, &(server->_settings));
+   client->parser.data = client;
+   return true;
+}
 
 static void connection_cb (uv_stream_t *handle, int status)
 {
+   struct HttpServer *server = (struct HttpServer *)handle;
+
    if (status < 0)
    {
-      fprintf (stderr, "New connection error %s\n", uv_strerror(status));
+      report_error (server, status, uv_strerror (status));
       return;
    }
 
-   struct HttpServer *server = (struct HttpServer *)handle;
-
    uvllhttpd_client_t *client = calloc (1, sizeof(uvllhttpd_client_t));
    uv_tcp_init (server->loop, &(client->handle));
    if (uv_accept (
@@ -26,20 +90,280 @@ static void connection_cb (uv_stream_t *handle, int status)
             (uv_stream_t*) &(client->handle)
             ) == 0)
    {
-      client->server = server;
-      llhttp_init (&(client->parser), HTTP_REQUEST, &(server->_settings));
-      client->parser.data = client;
-
+      if (!uvllhttpd_client_start (server, client)) return;
       uv_read_start ((uv_stream_t*) &(client->handle), alloc_buffer_cb, read_cb);
    }
 }
 
+// stamps the records with the time the responses were written, if they were
+static void trace_commit (uvllhttpd_client_t *client, struct RequestTrace *records, bool written)
+{
+   if (records == NULL) return;
+
+   uint64_t const now = written ? uv_hrtime () : 0;
+   for (struct RequestTrace *r = records; r != NULL; r = r->_next) r->write_complete = now;
+
+   uvllhttpd_trace_commit (client->server->trace, records);
+}
+
+// the request was never answered
+static void context_drop_request (uvllhttpd_client_t *client, struct RequestContext *context)
+{
+   trace_commit (client, context->_trace, false);
+   context->_trace = NULL;
+   if (context->_log_request != NULL) free (context->_log_request);
+   context->_log_request = NULL;
+   if (context->_cache_fill != NULL) uvllhttpd_cache_abandon (context->_cache_fill);
+   context->_cache_fill = NULL;
+}
+
+void uvllhttpd_client_cancel_contexts (uvllhttpd_client_t *client)
+{
+   struct RequestContext *contexts = client->contexts;
+   client->contexts = NULL;
+   client->request_context = NULL;
+
+   // held, so that on_cancel may release any of them
+   for (struct RequestContext *c = contexts; c != NULL; c = c->_next)
+   {
+      context_drop_request (client, c);
+      c->_handle = NULL;
+      c->_refcount++;
+      atomic_store (&(c->cancelled), true);
+   }
+
+   while (contexts != NULL)
+   {
+      struct RequestContext *next = contexts->_next;
+      if (contexts->on_cancel != NULL) contexts->on_cancel (contexts);
+      uvllhttpd_context_unref (contexts);
+      contexts = next;
+   }
+}
+
 static void close_cb (uv_handle_t *handle)
 {
    uvllhttpd_client_t *client = (uvllhttpd_client_t *)handle;
 
    if (client->headers != NULL) free (client->headers);
+   if (client->websocket != NULL) uvllhttpd_websocket_free (client->websocket);
+   if (client->cache_fill != NULL || client->cache_wait != NULL) uvllhttpd_cache_client_closed (client);
+   if (client->out_pending)
+   {
+      uvllhttpd_client_t **p = &(client->server->_pending_writes);
+      while (*p != client) p = &((*p)->next_pending);
+      *p = client->next_pending;
+   }
+   if (client->out.base != NULL) free (client->out.base);
+   if (client->held.base != NULL) free (client->held.base);
+   trace_commit (client, client->trace, false);
+   trace_commit (client, client->out_traces, false);
+   if (client->log_request != NULL) free (client->log_request);
+   if (client->contexts != NULL) uvllhttpd_client_cancel_contexts (client);
+   if (client->sse != NULL) uvllhttpd_sse_client_closed (client->sse);
+#ifdef UVLLHTTPD_IO_URING
+   if (client->uring != NULL) uvllhttpd_uring_client_closed (client->uring);
+#endif
+#ifdef UVLLHTTPD_TLS
+   if (client->tls != NULL) uvllhttpd_tls_connection_free (client->tls);
+#endif
+#ifdef UVLLHTTPD_HTTP2
+   if (client->http2 != NULL) uvllhttpd_http2_free (client->http2);
+#endif
+
+   struct HttpServer *server = client->server;
+   if (client->prev_client != NULL) client->prev_client->next_client = client->next_client;
+   else if (server != NULL && server->_clients == client) server->_clients = client->next_client;
+   if (client->next_client != NULL) client->next_client->prev_client = client->prev_client;
 	free (client);
+
+   if (server != NULL && server->_draining == 1 && server->_clients == NULL) drain_finish (server);
+}
+
+void uvllhttpd_client_close (uvllhttpd_client_t *client)
+{
+#ifdef UVLLHTTPD_HTTP2
+   if (client->http2_stream != NULL)
+   {
+      uvllhttpd_http2_stream_close (client->http2_stream);
+      return;
+   }
+#endif
+   if (!uv_is_closing ((uv_handle_t*) &(client->handle)))
+   {
+      uv_close ((uv_handle_t*) &(client->handle), close_cb);
+   }
+}
+
+int uvllhttpd_client_try_write (uvllhttpd_client_t *client, uv_buf_t const bufs[], unsigned int nbufs)
+{
+   // only responses are written to a stream
+   if (client->http2_stream != NULL) return UV_ENOTSUP;
+#ifdef UVLLHTTPD_TLS
+   if (client->tls != NULL) return uvllhttpd_tls_try_write (client->tls, bufs, nbufs);
+#endif
+   return uv_try_write ((uv_stream_t*) &(client->handle), bufs, nbufs);
+}
+
+int uvllhttpd_client_write (uv_write_t *req, uvllhttpd_client_t *client, uv_buf_t const bufs[],
+      unsigned int nbufs, uv_write_cb cb)
+{
+   if (client->http2_stream != NULL) return UV_ENOTSUP;
+#ifdef UVLLHTTPD_TLS
+   if (client->tls != NULL) return uvllhttpd_tls_write (req, client->tls, bufs, nbufs, cb);
+#endif
+   return uv_write (req, (uv_stream_t*) &(client->handle), bufs, nbufs, cb);
+}
+
+struct flush_write {
+   uv_write_t req;
+   uvllhttpd_client_t *client;
+   char *base;
+   struct RequestTrace *traces;
+   uint8_t close_after;
+};
+
+static void flush_write_cb (uv_write_t *req, int status)
+{
+   struct flush_write *w = (struct flush_write *)req;
+
+   trace_commit (w->client, w->traces, status == 0);
+   if (w->close_after) uvllhttpd_client_close (w->client);
+   free (w->base);
+   free (w);
+}
+
+void uvllhttpd_client_flush (uvllhttpd_client_t *client)
+{
+   if (client->out.len == 0) return;
+
+   uv_buf_t const buf = client->out;
+   bool const close_after = client->close_after_flush;
+   struct RequestTrace *traces = client->out_traces;
+   client->out.len = 0;
+   client->close_after_flush = 0;
+   client->out_traces = NULL;
+
+   if (uv_is_closing ((uv_handle_t*) &(client->handle)))
+   {
+      trace_commit (client, traces, false);
+      return;
+   }
+
+   int n = uvllhttpd_client_try_write (client, &buf, 1);
+   if (n >= 0 && (size_t)n == buf.len)
+   {
+      // the buffer is kept for the next responses
+      trace_commit (client, traces, true);
+      if (close_after) uvllhttpd_client_close (client);
+      return;
+   }
+   if (n < 0) n = 0;
+
+   // the rest is written from the buffer itself, the connection starts a new one
+   client->out.base = NULL;
+   client->out_capacity = 0;
+
+   struct flush_write *w = malloc (sizeof(struct flush_write));
+   w->client = client;
+   w->base = buf.base;
+   w->traces = traces;
+   w->close_after = close_after;
+
+   uv_buf_t const rest = { .base = buf.base + n, .len = buf.len - n };
+   if (uvllhttpd_client_write (&(w->req), client, &rest, 1, flush_write_cb) != 0)
+   {
+      trace_commit (client, traces, false);
+      free (buf.base);
+      free (w);
+      uvllhttpd_client_close (client);
+   }
+}
+
+static void flush_pending_writes (struct HttpServer *server)
+{
+   uv_prepare_stop (&(server->_write_prepare));
+   uv_check_stop (&(server->_write_check));
+
+   while (server->_pending_writes != NULL)
+   {
+      uvllhttpd_client_t *client = server->_pending_writes;
+      server->_pending_writes = client->next_pending;
+      client->next_pending = NULL;
+      client->out_pending = 0;
+
+      uvllhttpd_client_flush (client);
+   }
+}
+
+// responses queued by callbacks run before polling are flushed before the loop blocks,
+// the ones queued by read callbacks right after polling
+static void write_prepare_cb (uv_prepare_t *handle)
+{
+   flush_pending_writes ((struct HttpServer *)handle->data);
+}
+
+static void write_check_cb (uv_check_t *handle)
+{
+   flush_pending_writes ((struct HttpServer *)handle->data);
+}
+
+static void client_coalesce (uvllhttpd_client_t *client, uv_buf_t const *bufs, size_t nbufs, size_t total)
+{
+   if (client->out.len + total > client->out_capacity)
+   {
+      size_t capacity = client->out_capacity > 0 ? client->out_capacity * 2 : client->server->write_coalesce_size * 4;
+      if (capacity < client->out.len + total) capacity = client->out.len + total;
+      client->out.base = realloc (client->out.base, capacity);
+      client->out_capacity = capacity;
+   }
+
+   for (size_t i = 0; i < nbufs; i++)
+   {
+      if (bufs[i].len == 0) continue;
+      memcpy (client->out.base + client->out.len, bufs[i].base, bufs[i].len);
+      client->out.len += bufs[i].len;
+   }
+
+   if (!client->out_pending)
+   {
+      struct HttpServer *server = client->server;
+      if (server->_pending_writes == NULL)
+      {
+         uv_prepare_start (&(server->_write_prepare), write_prepare_cb);
+         uv_check_start (&(server->_write_check), write_check_cb);
+      }
+      client->next_pending = server->_pending_writes;
+      server->_pending_writes = client;
+      client->out_pending = 1;
+   }
+}
+
+void uvllhttpd_client_pause (uvllhttpd_client_t *client)
+{
+   // HTTP/2 flow control paces a stream
+   if (client->http2_stream != NULL) return;
+#ifdef UVLLHTTPD_IO_URING
+   if (client->uring != NULL)
+   {
+      uvllhttpd_uring_client_pause (client->uring);
+      return;
+   }
+#endif
+   uv_read_stop ((uv_stream_t*) &(client->handle));
+}
+
+void uvllhttpd_client_resume (uvllhttpd_client_t *client)
+{
+   if (client->http2_stream != NULL || uv_is_closing ((uv_handle_t*) &(client->handle))) return;
+#ifdef UVLLHTTPD_IO_URING
+   if (client->uring != NULL)
+   {
+      uvllhttpd_uring_client_resume (client->uring);
+      return;
+   }
+#endif
+   uv_read_start ((uv_stream_t*) &(client->handle), alloc_buffer_cb, read_cb);
 }
 
 static void alloc_buffer_cb (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
@@ -48,30 +372,129 @@ static void alloc_buffer_cb (uv_handle_t *handle, size_t suggested_size, uv_buf_
 	buf->len = suggested_size;
 }
 
-static void read_cb (uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf)
+void uvllhttpd_client_read (uvllhttpd_client_t *client, char const *base, ssize_t nread)
 {
-   uvllhttpd_client_t *client = (uvllhttpd_client_t *)handle;
-	if (nread > 0)
+#ifdef UVLLHTTPD_TLS
+   if (client->tls != NULL)
+   {
+      uvllhttpd_tls_read (client->tls, base, nread);
+      return;
+   }
+#endif
+   uvllhttpd_client_received (client, base, nread);
+}
+
+static void client_hold (uvllhttpd_client_t *client, char const *base, size_t length)
+{
+   if (length == 0) return;
+
+   client->held.base = realloc (client->held.base, client->held.len + length);
+   memcpy (client->held.base + client->held.len, base, length);
+   client->held.len += length;
+}
+
+void uvllhttpd_client_unblock (uvllhttpd_client_t *client)
+{
+   if (!client->blocked) return;
+   client->blocked = 0;
+   if (uv_is_closing ((uv_handle_t*) &(client->handle))) return;
+
+   llhttp_resume (&(client->parser));
+   uv_buf_t const held = client->held;
+   client->held = (uv_buf_t) { .base = NULL, .len = 0 };
+   if (held.len > 0) uvllhttpd_client_received (client, held.base, held.len);
+   if (held.base != NULL) free (held.base);
+
+   // unless a held request blocked it again, or was the last one
+   if (!client->blocked && client->keep_alive) uvllhttpd_client_resume (client);
+}
+
+void uvllhttpd_client_received (uvllhttpd_client_t *client, char const *base, ssize_t nread)
+{
+	if (nread > 0 && client->sse != NULL)
+	{
+		// an event stream is only read to notice the client going away
+	}
+	else if (nread > 0 && client->websocket != NULL)
+	{
+		// taken over by an upgrade in an earlier read
+		uvllhttpd_websocket_feed (client->websocket, base, nread);
+	}
+#ifdef UVLLHTTPD_HTTP2
+	else if (nread > 0 && client->http2 != NULL)
+	{
+		uvllhttpd_http2_feed (client->http2, base, nread);
+	}
+	else if (nread > 0 && client->server->http2 && client->request_count == 0 && !client->in_message &&
+			uvllhttpd_http2_is_preface (base, nread))
+	{
+		// prior knowledge, HTTP/2 from the first byte
+		if (uvllhttpd_http2_start (client)) uvllhttpd_http2_feed (client->http2, base, nread);
+		else uvllhttpd_client_close (client);
+	}
+#endif
+	else if (nread > 0 && client->blocked)
+	{
+		// parsed once the request the connection waits on is answered
+		client_hold (client, base, nread);
+	}
+	else if (nread > 0)
    {
-		enum llhttp_errno err = llhttp_execute (&(client->parser), buf->base, nread);
+		enum llhttp_errno err = llhttp_execute (&(client->parser), base, nread);
+		while (err == HPE_PAUSED_UPGRADE && client->websocket == NULL && client->http2 == NULL)
+		{
+			// the handler declined the upgrade, keep on parsing as HTTP
+			char const *pos = llhttp_get_error_pos (&(client->parser));
+			llhttp_resume_after_upgrade (&(client->parser));
+			err = llhttp_execute (&(client->parser), pos, base + nread - pos);
+		}
+
 		if (err == HPE_OK)
 		{
 			// parsed successfully
 		}
+		else if (err == HPE_PAUSED && client->blocked)
+		{
+			char const *pos = llhttp_get_error_pos (&(client->parser));
+			client_hold (client, pos, base + nread - pos);
+		}
+		else if (err == HPE_PAUSED && !client->keep_alive)
+		{
+			// the last request on this connection has been dispatched,
+			// the connection is closed after its response is written
+		}
+		else if (err == HPE_PAUSED_UPGRADE)
+		{
+			// bytes following the upgrade request belong to the new protocol
+			char const *pos = llhttp_get_error_pos (&(client->parser));
+			if (pos < base + nread && client->websocket != NULL)
+			{
+				uvllhttpd_websocket_feed (client->websocket, pos, base + nread - pos);
+			}
+#ifdef UVLLHTTPD_HTTP2
+			else if (pos < base + nread)
+			{
+				uvllhttpd_http2_feed (client->http2, pos, base + nread - pos);
+			}
+#endif
+		}
 		else
 		{
-			fprintf (stderr, "Parse error: %s %s\n",
-               llhttp_errno_name (err), client->parser.reason);
-         uv_close ((uv_handle_t*) client, close_cb);
+			report_error (client->server, UV_EPROTO, client->parser.reason);
+         uvllhttpd_client_close (client);
 		}
 	}
 	else if (nread < 0)
 	{
 		if (nread != UV_EOF)
-			fprintf (stderr, "Read error %s\n", uv_err_name(nread));
-		uv_close ((uv_handle_t*) client, close_cb);
+			report_error (client->server, nread, uv_strerror (nread));
+		uvllhttpd_client_close (client);
 	}
+}
 
+static void read_cb (uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf)
+{
+   uvllhttpd_client_read ((uvllhttpd_client_t *)handle, buf->base, nread);
 	free (buf->base);
 }
 
@@ -88,7 +511,7 @@ static bool fill_data_to_buffer (uvllhttpd_client_t *client, const char *at, siz
       if (new_size > client->server->request_buffer_max_size)
       {
          client->cur_status = ParserState_exceed_buffer;
-         uv_close ((uv_handle_t*) &(client->handle), close_cb);
+         uvllhttpd_client_close (client);
          return false;
       }
 
@@ -116,6 +539,24 @@ static void check_header_complete (uvllhttpd_client_t *client)
    }
 }
 
+static int uvllhttpd_on_message_begin(llhttp_t* parser)
+{
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)parser->data;
+   client->in_message = 1;
+
+   // not while a deferred response still owns the record of the previous request
+   if (client->server->trace == NULL || client->trace != NULL) return 0;
+
+   client->trace = uvllhttpd_trace_sample (client->server->trace);
+   if (client->trace != NULL)
+   {
+      client->trace->connection = client->trace_connection;
+      if (client->request_count == 0) client->trace->accepted = client->accepted_at;
+      client->trace->first_byte = uv_hrtime ();
+   }
+   return 0;
+}
+
 static int uvllhttpd_on_url(llhttp_t* parser, const char *at, size_t length)
 {
    uvllhttpd_client_t *client = (uvllhttpd_client_t *)parser->data;
@@ -176,20 +617,83 @@ static int uvllhttpd_on_header_value(llhttp_t* parser, const char *at, size_t le
    return 0;
 }
 
+static void fill_request_headers (uvllhttpd_client_t *client, struct HttpHeader *headers, size_t header_count)
+{
+   for (size_t i = 0; i < header_count; i++)
+   {
+      headers[i] = (struct HttpHeader) {
+         .field = (uv_buf_t) {
+            .base = client->buffer.base + client->headers[i].key.offset,
+            .len = client->headers[i].key.length,
+         },
+         .value = (uv_buf_t) {
+            .base = client->buffer.base + client->headers[i].value.offset,
+            .len = client->headers[i].value.length,
+         },
+      };
+   }
+}
+
 static int uvllhttpd_on_headers_complete(llhttp_t* parser)
 {
    uvllhttpd_client_t *client = (uvllhttpd_client_t *)parser->data;
    if (client->cur_status == ParserState_exceed_buffer) return 0;
 
    check_header_complete (client);
+
+   if (client->trace != NULL) client->trace->headers_complete = uv_hrtime ();
+
+   if (client->server->on_headers != NULL)
+   {
+      size_t header_count = client->header_cur_index;
+      struct HttpHeader headers[header_count > 0 ? header_count : 1];
+      fill_request_headers (client, headers, header_count);
+
+      struct HttpRequest request = {
+         .__internal_buffer = client->buffer,
+         .uri = {
+            .base = client->buffer.base + client->uri.offset,
+            .len  = client->uri.length,
+         },
+         .header_count = header_count,
+         .headers = header_count > 0 ? headers : NULL,
+         .method = client->parser.method,
+         .upgrade = client->parser.upgrade,
+         .keep_alive = llhttp_should_keep_alive (&(client->parser)),
+         .version = {
+            .major = client->parser.http_major,
+            .minor = client->parser.http_minor,
+         },
+      };
+
+      uint64_t const started = client->server->monitor != NULL ? uv_hrtime () : 0;
+      client->in_on_headers = 1;
+      client->server->on_headers (&(client->handle), &request);
+      client->in_on_headers = 0;
+      if (client->server->monitor != NULL) uvllhttpd_monitor_handler (client->server->monitor, &request, started);
+   }
    return 0;
 }
 
+void uvllhttpd_request_stream_body (uv_tcp_t *handle, uvllhttpd_body_handler on_body, void *data)
+{
+   if (handle == NULL) return;
+
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)handle;
+   client->on_body = on_body;
+   client->on_body_data = data;
+}
+
 static int uvllhttpd_on_body(llhttp_t* parser, const char *at, size_t length)
 {
    uvllhttpd_client_t *client = (uvllhttpd_client_t *)parser->data;
    if (client->cur_status == ParserState_exceed_buffer) return 0;
 
+   if (client->on_body != NULL)
+   {
+      return client->on_body (client->on_body_data, at, length) == 0 ? 0 : -1;
+   }
+
    if (fill_data_to_buffer (client, at, length))
    {
       client->cur_status = ParserState_body;
@@ -207,19 +711,7 @@ static int uvllhttpd_on_message_complete(llhttp_t* parser)
    struct HttpHeader headers[header_count > 0 ? header_count : 1];
    if (header_count > 0)
    {
-      for (size_t i = 0; i < header_count; i++)
-      {
-         headers[i] = (struct HttpHeader) {
-            .field = (uv_buf_t) {
-               .base = client->buffer.base + client->headers[i].key.offset,
-               .len = client->headers[i].key.length,
-            },
-            .value = (uv_buf_t) {
-               .base = client->buffer.base + client->headers[i].value.offset,
-               .len = client->headers[i].value.length,
-            },
-         };
-      }
+      fill_request_headers (client, headers, header_count);
       free (client->headers);
       client->headers = NULL;
       client->header_cur_index = 0;
@@ -240,6 +732,32 @@ static int uvllhttpd_on_message_complete(llhttp_t* parser)
       body.len = 0;
    }
 
+   if (client->on_body != NULL)
+   {
+      int r = client->on_body (client->on_body_data, NULL, 0);
+      client->on_body = NULL;
+      client->on_body_data = NULL;
+      if (r != 0)
+      {
+         free (client->buffer.base);
+         client->buffer.base = NULL;
+         client->buffer.len = 0;
+         return -1;
+      }
+   }
+
+   client->in_message = 0;
+   client->request_count++;
+   client->keep_alive = llhttp_should_keep_alive (&(client->parser));
+   if (client->server->max_requests_per_connection > 0 &&
+         client->request_count >= client->server->max_requests_per_connection)
+   {
+      client->keep_alive = 0;
+   }
+   if (client->server->_draining) client->keep_alive = 0;
+   client->http_major = client->parser.http_major;
+   client->http_minor = client->parser.http_minor;
+
    struct HttpRequest request = {
       .__internal_buffer = client->buffer,
       .uri = {
@@ -251,6 +769,7 @@ static int uvllhttpd_on_message_complete(llhttp_t* parser)
       .headers = header_count > 0 ? headers : NULL,
       .method = client->parser.method,
       .upgrade = client->parser.upgrade,
+      .keep_alive = client->keep_alive,
       .version = {
          .major = client->parser.http_major,
          .minor = client->parser.http_minor,
@@ -267,18 +786,109 @@ static int uvllhttpd_on_message_complete(llhttp_t* parser)
    client->buffer.base = NULL;
    client->buffer.len = 0;
 
-   client->server->on_request (&(client->handle), &request);
+#ifdef UVLLHTTPD_HTTP2
+   if (request.upgrade && client->server->http2 && uvllhttpd_http2_upgrade (client, &request))
+   {
+      // answered on the connection's first HTTP/2 stream
+      trace_commit (client, client->trace, false);
+      client->trace = NULL;
+      free (request.__internal_buffer.base);
+      return 0;
+   }
+#endif
+
+   if (client->trace != NULL)
+   {
+      struct RequestTrace *trace = client->trace;
+      trace->message_complete = uv_hrtime ();
+      trace->method = request.method;
+
+      size_t const length = request.uri.len < sizeof(trace->uri) - 1 ? request.uri.len : sizeof(trace->uri) - 1;
+      memcpy (trace->uri, request.uri.base, length);
+      trace->uri[length] = '\0';
+   }
+
+   // answered by the proxy or the cache instead of on_request
+   bool const proxied = client->proxied;
+   client->proxied = 0;
+
+   // the proxy logs its exchanges, the cache the responses it writes
+   if (client->server->access_log != NULL && client->log_request == NULL && !proxied)
+   {
+      client->log_request = uvllhttpd_access_log_request_line (&request);
+      client->log_started = uv_now (client->handle.loop);
+   }
+
+   if (proxied || (client->server->cache != NULL &&
+         uvllhttpd_cache_serve (client->server->cache, client, &request)))
+   {
+      trace_commit (client, client->trace, false);
+      client->trace = NULL;
+   }
+   else
+   {
+      uvllhttpd_client_dispatch (client, &request);
+   }
 
    free (request.__internal_buffer.base);
 
+   if (!client->keep_alive && client->websocket == NULL)
+   {
+      // ignore pipelined requests following the last one
+      if (client->sse == NULL) uvllhttpd_client_pause (client);
+      return HPE_PAUSED;
+   }
+
+   if (client->cache_wait != NULL || client->proxy != NULL)
+   {
+      // its response must go out before those of the requests following it
+      client->blocked = 1;
+      uvllhttpd_client_pause (client);
+      return HPE_PAUSED;
+   }
+
    return 0;
 }
 
+void uvllhttpd_client_dispatch (uvllhttpd_client_t *client, struct HttpRequest const *request)
+{
+   struct HttpServer *server = client->server;
+
+   uint64_t const started = server->monitor != NULL ? uv_hrtime () : 0;
+   client->in_on_request = 1;
+   client->request_context = NULL;
+   server->on_request (&(client->handle), request);
+   client->in_on_request = 0;
+   if (server->monitor != NULL) uvllhttpd_monitor_handler (server->monitor, request, started);
+
+   // answered later, so the next response on the connection must not take them
+   struct RequestContext *context = client->request_context;
+   client->request_context = NULL;
+   if (context != NULL)
+   {
+      context->_trace = client->trace;
+      client->trace = NULL;
+      context->_log_request = client->log_request;
+      context->_log_started = client->log_started;
+      client->log_request = NULL;
+      context->_cache_fill = client->cache_fill;
+      client->cache_fill = NULL;
+   }
+
+   // answered without a context, nothing tells which response fills the miss
+   if (client->cache_fill != NULL)
+   {
+      uvllhttpd_cache_abandon (client->cache_fill);
+      client->cache_fill = NULL;
+   }
+}
+
 llhttp_settings_t uvllhttpd_get_llhttp_settings (void)
 {
    llhttp_settings_t settings = (llhttp_settings_t) {0};
    llhttp_settings_init(&settings);
 
+   settings.on_message_begin    = uvllhttpd_on_message_begin;
    settings.on_url              = uvllhttpd_on_url;
    settings.on_header_field     = uvllhttpd_on_header_field;
    settings.on_header_value     = uvllhttpd_on_header_value;
@@ -289,13 +899,24 @@ llhttp_settings_t uvllhttpd_get_llhttp_settings (void)
    return settings;
 }
 
-int uvllhttpd_server_listen (struct HttpServer *server)
+static int server_check (struct HttpServer *server)
 {
    if (server == NULL) return UV_EINVAL;
    if (server->loop == NULL || server->on_request == NULL) return UV_EINVAL;
    if (server->request_buffer_max_size == 0) return UV_EINVAL;
+#ifndef UVLLHTTPD_TLS
+   if (server->tls != NULL) return UV_ENOSYS;
+#endif
+#ifndef UVLLHTTPD_HTTP2
+   if (server->http2) return UV_ENOSYS;
+#endif
+   return 0;
+}
 
-   int r;
+int uvllhttpd_server_listen (struct HttpServer *server)
+{
+   int r = server_check (server);
+   if (r != 0) return r;
 
    struct sockaddr_in addr;
    r = uv_ip4_addr (server->host, server->port, &addr);
@@ -307,14 +928,252 @@ int uvllhttpd_server_listen (struct HttpServer *server)
    r = uv_tcp_bind (&(server->handle), (struct sockaddr *) &addr, 0);
    if (r != 0) return r;
 
-   r = uv_listen ((uv_stream_t *) &(server->handle), server->backlog, connection_cb);
+   return uvllhttpd_server_start (server);
+}
+
+int uvllhttpd_server_start (struct HttpServer *server)
+{
+   int r = server_check (server);
    if (r != 0) return r;
 
 	server->_settings = uvllhttpd_get_llhttp_settings ();
 
+   if (server->backend == HttpServerBackend_io_uring)
+   {
+#ifdef UVLLHTTPD_IO_URING
+      uv_os_fd_t fd;
+      r = uv_fileno ((uv_handle_t *) &(server->handle), &fd);
+      if (r == 0) r = uvllhttpd_uring_listen (server, fd);
+#else
+      r = UV_ENOSYS;
+#endif
+   }
+   else
+   {
+      r = uv_listen ((uv_stream_t *) &(server->handle), server->backlog, connection_cb);
+   }
+   if (r != 0) return r;
+
+   if (server->write_coalesce_size > 0)
+   {
+      uv_prepare_init (server->loop, &(server->_write_prepare));
+      uv_check_init (server->loop, &(server->_write_check));
+      server->_write_prepare.data = server;
+      server->_write_check.data = server;
+   }
+
    return r;
 }
 
+// a connection is idle once nothing it received is still being answered
+static bool client_idle (uvllhttpd_client_t *client)
+{
+   return !client->in_message && client->open_responses == 0 && client->contexts == NULL &&
+      client->proxy == NULL && client->cache_wait == NULL && !client->out_pending &&
+      client->handle.write_queue_size == 0;
+}
+
+static void drain_sweep (struct HttpServer *server, bool force)
+{
+   for (uvllhttpd_client_t *c = server->_clients; c != NULL; c = c->next_client)
+   {
+      if (uv_is_closing ((uv_handle_t*) &(c->handle))) continue;
+
+      if (force || c->sse != NULL)
+      {
+         uvllhttpd_client_close (c);
+      }
+      else if (c->websocket != NULL)
+      {
+         if (!c->websocket->_close_sent) uvllhttpd_websocket_close (c->websocket, 1001);
+      }
+#ifdef UVLLHTTPD_HTTP2
+      else if (c->http2 != NULL)
+      {
+         uvllhttpd_http2_drain (c->http2);
+      }
+#endif
+      else if (client_idle (c))
+      {
+         uvllhttpd_client_close (c);
+      }
+      else if (c->keep_alive)
+      {
+         // the request being answered is the last one read
+         c->keep_alive = 0;
+         if (!c->in_message) uvllhttpd_client_pause (c);
+      }
+   }
+}
+
+static void drain_check_cb (uv_check_t *handle)
+{
+   drain_sweep ((struct HttpServer *)handle->data, false);
+}
+
+static void drain_timer_cb (uv_timer_t *handle)
+{
+   drain_sweep ((struct HttpServer *)handle->data, true);
+}
+
+static void drain_release (struct HttpServer *server)
+{
+   if (--server->_closing_handles == 0 && server->_on_shutdown != NULL) server->_on_shutdown (server);
+}
+
+static void server_handle_closed (uv_handle_t *handle)
+{
+   drain_release ((struct HttpServer *)handle->data);
+}
+
+static void server_handle_close (struct HttpServer *server, uv_handle_t *handle)
+{
+   handle->data = server;
+   server->_closing_handles++;
+   uv_close (handle, server_handle_closed);
+}
+
+static void drain_finish (struct HttpServer *server)
+{
+   server->_draining = 2;
+
+   uv_check_stop (&(server->_drain_check));
+   server_handle_close (server, (uv_handle_t *) &(server->_drain_check));
+   server_handle_close (server, (uv_handle_t *) &(server->_drain_timer));
+   if (server->write_coalesce_size > 0)
+   {
+      server_handle_close (server, (uv_handle_t *) &(server->_write_prepare));
+      server_handle_close (server, (uv_handle_t *) &(server->_write_check));
+   }
+   drain_release (server);
+}
+
+int uvllhttpd_server_shutdown (struct HttpServer *server, unsigned int timeout, uvllhttpd_shutdown_cb on_shutdown)
+{
+   if (server == NULL || server->loop == NULL) return UV_EINVAL;
+   if (server->_draining) return UV_EALREADY;
+
+   server->_draining = 1;
+   server->_on_shutdown = on_shutdown;
+
+   // held until the last connection is closed
+   server->_closing_handles = 1;
+   server_handle_close (server, (uv_handle_t *) &(server->handle));
+#ifdef UVLLHTTPD_IO_URING
+   if (server->_uring != NULL) uvllhttpd_uring_close (server->_uring);
+   server->_uring = NULL;
+#endif
+
+   uv_check_init (server->loop, &(server->_drain_check));
+   server->_drain_check.data = server;
+   uv_check_start (&(server->_drain_check), drain_check_cb);
+   uv_timer_init (server->loop, &(server->_drain_timer));
+   server->_drain_timer.data = server;
+   if (timeout > 0) uv_timer_start (&(server->_drain_timer), drain_timer_cb, timeout, 0);
+
+   drain_sweep (server, false);
+   if (server->_clients == NULL) drain_finish (server);
+   return 0;
+}
+
+struct RequestContext *uvllhttpd_request_context (uv_tcp_t *handle)
+{
+   if (handle == NULL) return NULL;
+
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)handle;
+
+   struct RequestContext *context = calloc (1, sizeof(struct RequestContext));
+   atomic_init (&(context->cancelled), uv_is_closing ((uv_handle_t *)handle) != 0);
+   context->_refcount = 1;
+
+   if (!atomic_load (&(context->cancelled)))
+   {
+      context->_handle = handle;
+      context->_next = client->contexts;
+      client->contexts = context;
+
+      if (client->in_on_headers)
+      {
+         // the request is not complete, so not yet the connection's current one
+         context->_keep_alive = llhttp_should_keep_alive (&(client->parser));
+         context->_version_major = client->parser.http_major;
+         context->_version_minor = client->parser.http_minor;
+      }
+      else
+      {
+         context->_keep_alive = client->keep_alive;
+         context->_version_major = client->http_major;
+         context->_version_minor = client->http_minor;
+      }
+      if (client->in_on_request && client->request_context == NULL) client->request_context = context;
+   }
+   return context;
+}
+
+struct RequestContext *uvllhttpd_context_ref (struct RequestContext *context)
+{
+   context->_refcount++;
+   return context;
+}
+
+void uvllhttpd_context_unref (struct RequestContext *context)
+{
+   if (--context->_refcount > 0) return;
+
+   if (context->_handle != NULL)
+   {
+      uvllhttpd_client_t *client = (uvllhttpd_client_t *)context->_handle;
+      struct RequestContext **p = &(client->contexts);
+      while (*p != context) p = &((*p)->_next);
+      *p = context->_next;
+      if (client->request_context == context) client->request_context = NULL;
+      context_drop_request (client, context);
+   }
+   free (context);
+}
+
+struct HttpResponse *uvllhttpd_context_response_init (struct RequestContext *context)
+{
+   if (context == NULL || context->_handle == NULL) return NULL;
+   if (uv_is_closing ((uv_handle_t *)context->_handle)) return NULL;
+
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)context->_handle;
+   struct HttpResponse *response = response_new (client);
+   response->keep_alive = context->_keep_alive;
+   response->version.major = context->_version_major;
+   response->version.minor = context->_version_minor;
+
+   // only the first response started from the context answers the request
+   response->_trace = context->_trace;
+   context->_trace = NULL;
+   response->_log_request = context->_log_request;
+   response->_log_started = context->_log_started;
+   context->_log_request = NULL;
+   if (context->_cache_fill != NULL)
+   {
+      response->_cache_entry = context->_cache_fill;
+      response->cache_ttl = client->server->cache->ttl;
+      context->_cache_fill = NULL;
+   }
+
+   return response;
+}
+
+struct HttpHeader const *uvllhttpd_request_find_header (struct HttpRequest const *request, char const *field, size_t length)
+{
+   if (request == NULL) return NULL;
+
+   for (size_t i = 0; i < request->header_count; i++)
+   {
+      if (request->headers[i].field.len == length &&
+            strncasecmp (request->headers[i].field.base, field, length) == 0)
+      {
+         return &(request->headers[i]);
+      }
+   }
+   return NULL;
+}
+
 #if 0
 void uvllhttpd_request_free (struct HttpRequest *request)
 {
@@ -327,12 +1186,72 @@ void uvllhttpd_request_free (struct HttpRequest *request)
 }
 #endif
 
+struct HttpBodyRef {
+   // position in response->body the referenced bytes follow
+   size_t offset;
+   uv_buf_t buf;
+   uvllhttpd_release_cb release_cb;
+   void *ctx;
+};
+
+struct SharedBuffer *uvllhttpd_shared_buffer_new (char const *s, size_t length)
+{
+   struct SharedBuffer *buffer = malloc (sizeof(struct SharedBuffer) + length);
+   if (buffer == NULL) return NULL;
+   buffer->refcount = 1;
+   buffer->len = length;
+   if (s != NULL && length > 0) memcpy (buffer->base, s, length);
+
+   return buffer;
+}
+
+struct SharedBuffer *uvllhttpd_shared_buffer_ref (struct SharedBuffer *buffer)
+{
+   if (buffer != NULL) buffer->refcount++;
+   return buffer;
+}
+
+void uvllhttpd_shared_buffer_unref (struct SharedBuffer *buffer)
+{
+   if (buffer != NULL && --buffer->refcount == 0) free (buffer);
+}
+
+static void shared_buffer_release_cb (void *ctx)
+{
+   uvllhttpd_shared_buffer_unref ((struct SharedBuffer *)ctx);
+}
+
+static struct HttpResponse *response_new (uvllhttpd_client_t *client)
+{
+   struct HttpResponse *response = calloc (1, sizeof(struct HttpResponse));
+   response->handle = &(client->handle);
+   client->open_responses++;
+   return response;
+}
+
 struct HttpResponse *uvllhttpd_response_init (uv_tcp_t *handle)
 {
    if (handle == NULL) return NULL;
 
-   struct HttpResponse *response = calloc (1, sizeof(struct HttpResponse));
-   response->handle = handle;
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)handle;
+
+   struct HttpResponse *response = response_new (client);
+   response->keep_alive = client->keep_alive;
+   response->version.major = client->http_major;
+   response->version.minor = client->http_minor;
+
+   if (client->cache_fill != NULL)
+   {
+      response->_cache_entry = client->cache_fill;
+      response->cache_ttl = client->server->cache->ttl;
+      client->cache_fill = NULL;
+   }
+
+   response->_trace = client->trace;
+   client->trace = NULL;
+   response->_log_request = client->log_request;
+   response->_log_started = client->log_started;
+   client->log_request = NULL;
 
    return response;
 }
@@ -358,14 +1277,82 @@ void uvllhttpd_response_append_body (struct HttpResponse *response, char const *
    response->body.len += length;
 }
 
-static void write_cb (uv_write_t* req, int status)
+void uvllhttpd_response_append_ref (struct HttpResponse *response, char const *s, size_t length,
+      uvllhttpd_release_cb release_cb, void *ctx)
 {
-   struct HttpResponse *response = (struct HttpResponse *)req->data;
+   if (response == NULL)
+   {
+      if (release_cb != NULL) release_cb (ctx);
+      return;
+   }
+
+   if (response->_ref_count == response->_ref_capacity)
+   {
+      response->_ref_capacity = response->_ref_capacity > 0 ? response->_ref_capacity * 2 : 4;
+      response->_refs = realloc (response->_refs, sizeof(struct HttpBodyRef) * response->_ref_capacity);
+   }
+
+   response->_refs[response->_ref_count++] = (struct HttpBodyRef) {
+      .offset = response->body.len,
+      .buf = { .base = (char *)s, .len = length },
+      .release_cb = release_cb,
+      .ctx = ctx,
+   };
+}
+
+void uvllhttpd_response_append_shared (struct HttpResponse *response, struct SharedBuffer *buffer)
+{
+   if (buffer == NULL) return;
+
+   uvllhttpd_response_append_ref (response, buffer->base, buffer->len,
+         shared_buffer_release_cb, uvllhttpd_shared_buffer_ref (buffer));
+}
+
+static void response_free (struct HttpResponse *response)
+{
+   ((uvllhttpd_client_t *)response->handle)->open_responses--;
+   // dropped unfinished
+   if (response->_cache_entry != NULL) uvllhttpd_cache_abandon (response->_cache_entry);
+   for (size_t i = 0; i < response->_ref_count; i++)
+   {
+      if (response->_refs[i].release_cb != NULL) response->_refs[i].release_cb (response->_refs[i].ctx);
+   }
+   if (response->_refs != NULL) free (response->_refs);
+   if (response->_trace != NULL) free (response->_trace);
+   if (response->_log_request != NULL) free (response->_log_request);
 
    if (response->headers.base != NULL) free (response->headers.base);
    if (response->body.base != NULL) free (response->body.base);
 
    free (response);
+}
+
+void uvllhttpd_response_release (struct HttpResponse *response, bool written)
+{
+   trace_commit ((uvllhttpd_client_t *)response->handle, response->_trace, written);
+   response->_trace = NULL;
+   response_free (response);
+}
+
+static void response_written (struct HttpResponse *response)
+{
+   if (response->_trace != NULL)
+   {
+      trace_commit ((uvllhttpd_client_t *)response->handle, response->_trace, true);
+      response->_trace = NULL;
+   }
+
+   if (!response->keep_alive)
+   {
+      uvllhttpd_client_close ((uvllhttpd_client_t *)response->handle);
+   }
+
+   response_free (response);
+}
+
+static void write_cb (uv_write_t* req, int status)
+{
+   response_written ((struct HttpResponse *)req->data);
    free (req);
 }
 
@@ -373,18 +1360,147 @@ void uvllhttpd_response_finish (struct HttpResponse *response)
 {
    if (response == NULL) return;
 
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)response->handle;
+
+   if (response->_trace != NULL)
+   {
+      response->_trace->response_finished = uv_hrtime ();
+      response->_trace->status = response->status;
+   }
+
+   // created before a shutdown began, it still ends its connection
+   if (client->server != NULL && client->server->_draining) response->keep_alive = 0;
+
+   // HTTP/1.0 needs an explicit keep-alive, HTTP/1.1 an explicit close
+   bool const is_http10 = response->version.major == 1 && response->version.minor == 0;
+   char const *connection = "";
+   if (response->keep_alive && is_http10) connection = "Connection: keep-alive\r\n";
+   else if (!response->keep_alive && !is_http10) connection = "Connection: close\r\n";
+
+   // the status line and Content-Length are only copied to the heap
+   // if the socket does not take the whole response at once
    size_t const buffer_size = 64;
-   uv_write_t *req = malloc (sizeof(uv_write_t) + buffer_size*2);
-   char * const buffer_base = (char *)req + sizeof(uv_write_t);
+   char buffer_base[buffer_size*2];
 
-   uv_buf_t bufs[4];
-   bufs[0].base = buffer_base;
-   bufs[0].len = snprintf (bufs[0].base, buffer_size, "HTTP/1.1 %d OK\r\n", response->status);
+   size_t content_length = response->body.len;
+   for (size_t i = 0; i < response->_ref_count; i++) content_length += response->_refs[i].buf.len;
+
+   if (response->_log_request != NULL)
+   {
+      uvllhttpd_access_log_record (client->server->access_log, client->peer, response->_log_request,
+            response->status, content_length, response->_log_started);
+   }
+
+   uv_buf_t bufs[5 + response->_ref_count * 2];
    bufs[1] = response->headers;
-   bufs[2].base = buffer_base + buffer_size;
-   bufs[2].len = snprintf (bufs[2].base, buffer_size, "Content-Length: %zd\r\n\r\n", response->body.len);
-   bufs[3] = response->body;
+   bufs[2].base = (char *)connection;
+   bufs[2].len = strlen (connection);
+   if (response->_head.base != NULL)
+   {
+      bufs[0] = response->_head;
+      bufs[3].base = (char *)"\r\n";
+      bufs[3].len = 2;
+   }
+   else
+   {
+      bufs[0].base = buffer_base;
+      bufs[0].len = snprintf (bufs[0].base, buffer_size, "HTTP/1.%d %d OK\r\n",
+            is_http10 ? 0 : 1, response->status);
+      bufs[3].base = buffer_base + buffer_size;
+      bufs[3].len = snprintf (bufs[3].base, buffer_size, "Content-Length: %zd\r\n\r\n", content_length);
+   }
+
+   // copied body bytes interleaved with the referenced ones, in append order
+   size_t nbufs = 4;
+   size_t offset = 0;
+   for (size_t i = 0; i < response->_ref_count; i++)
+   {
+      struct HttpBodyRef const *ref = &(response->_refs[i]);
+      if (ref->offset > offset)
+      {
+         bufs[nbufs].base = response->body.base + offset;
+         bufs[nbufs++].len = ref->offset - offset;
+         offset = ref->offset;
+      }
+      if (ref->buf.len > 0) bufs[nbufs++] = ref->buf;
+   }
+   if (response->body.len > offset)
+   {
+      bufs[nbufs].base = response->body.base + offset;
+      bufs[nbufs++].len = response->body.len - offset;
+   }
+
+#ifdef UVLLHTTPD_HTTP2
+   if (client->http2_stream != NULL)
+   {
+      // framed by nghttp2, which takes the body from bufs as the stream's window allows
+      uvllhttpd_http2_respond (client->http2_stream, response, bufs + 4, nbufs - 4, content_length);
+      return;
+   }
+#endif
+
+   if (response->_cache_entry != NULL)
+   {
+      // the cache writes its own copy to this and every waiting connection
+      uvllhttpd_cache_complete (response, bufs, nbufs, content_length);
+      trace_commit (client, response->_trace, true);
+      response->_trace = NULL;
+      response_free (response);
+      return;
+   }
+
+   size_t total = 0;
+   for (size_t i = 0; i < nbufs; i++) total += bufs[i].len;
+
+   if (client->server != NULL && total <= client->server->write_coalesce_size)
+   {
+      client_coalesce (client, bufs, nbufs, total);
+      if (!response->keep_alive) client->close_after_flush = 1;
+      if (response->_trace != NULL)
+      {
+         response->_trace->_next = client->out_traces;
+         client->out_traces = response->_trace;
+         response->_trace = NULL;
+      }
+      response_free (response);
+      return;
+   }
+
+   uvllhttpd_client_flush (client);
+
+   int n = uvllhttpd_client_try_write (client, bufs, nbufs);
+   if (n >= 0 && (size_t)n == total)
+   {
+      response_written (response);
+      return;
+   }
+
+   // queue whatever the socket did not take
+   size_t skip = n > 0 ? (size_t)n : 0;
+   size_t first = 0;
+   while (first < nbufs && skip >= bufs[first].len)
+   {
+      skip -= bufs[first++].len;
+   }
+   bufs[first].base += skip;
+   bufs[first].len -= skip;
+
+   uv_write_t *req = malloc (sizeof(uv_write_t) + sizeof(buffer_base));
+   char * const copy = (char *)req + sizeof(uv_write_t);
+   memcpy (copy, buffer_base, sizeof(buffer_base));
+   for (size_t i = first; i < nbufs; i++)
+   {
+      if (bufs[i].base >= buffer_base && bufs[i].base < buffer_base + sizeof(buffer_base))
+      {
+         bufs[i].base = copy + (bufs[i].base - buffer_base);
+      }
+   }
 
    req->data = response;
-   uv_write (req, (uv_stream_t *)response->handle, bufs, 4, write_cb);
+   if (uvllhttpd_client_write (req, client, bufs + first, nbufs - first, write_cb) != 0)
+   {
+      free (req);
+      uvllhttpd_response_release (response, false);
+      uvllhttpd_client_close (client);
+   }
 }
@@ -0,0 +1,522 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+#include "uvllhttpd.cache.h"
+
+// a request collapsed onto an in-flight miss, kept in case its response cannot be shared
+struct cache_waiter {
+   uvllhttpd_client_t *client;
+   struct HttpRequest *request;
+};
+
+struct ResponseCacheEntry {
+   struct ResponseCache *cache;
+   struct ResponseCacheEntry *bucket_next;
+   struct ResponseCacheEntry *lru_prev;
+   struct ResponseCacheEntry *lru_next;
+
+   // one for the table, one per in-flight write, one for the filling response
+   size_t refcount;
+   uint64_t hash;
+   // for a pending entry, the time after which requests stop waiting for it
+   uint64_t expires;
+   uint8_t ready;
+   uint8_t linked;
+
+   struct cache_waiter *waiters;
+   size_t waiter_count;
+   size_t waiter_capacity;
+
+   // immutable once ready
+   uv_buf_t response;
+   // for the access log
+   int status;
+   size_t content_length;
+
+   size_t key_length;
+   char key[];
+};
+
+struct cache_write {
+   uv_write_t req;
+   struct ResponseCacheEntry *entry;
+   uvllhttpd_client_t *client;
+   uint8_t close_after;
+   char *log_request;
+   uint64_t log_started;
+};
+
+static uint64_t cache_hash (char const *key, size_t length)
+{
+   // FNV-1a
+   uint64_t hash = 0xcbf29ce484222325ULL;
+   for (size_t i = 0; i < length; i++)
+   {
+      hash ^= (uint8_t)key[i];
+      hash *= 0x100000001b3ULL;
+   }
+   return hash;
+}
+
+static size_t cache_entry_size (struct ResponseCacheEntry const *entry)
+{
+   return sizeof(struct ResponseCacheEntry) + entry->key_length + entry->response.len;
+}
+
+static void cache_entry_release (struct ResponseCacheEntry *entry)
+{
+   if (--entry->refcount > 0) return;
+
+   if (entry->response.base != NULL) free (entry->response.base);
+   for (size_t i = 0; i < entry->waiter_count; i++) free (entry->waiters[i].request);
+   if (entry->waiters != NULL) free (entry->waiters);
+   free (entry);
+}
+
+static void cache_lru_remove (struct ResponseCache *cache, struct ResponseCacheEntry *entry)
+{
+   if (entry->lru_prev != NULL) entry->lru_prev->lru_next = entry->lru_next;
+   else cache->_lru_head = entry->lru_next;
+
+   if (entry->lru_next != NULL) entry->lru_next->lru_prev = entry->lru_prev;
+   else cache->_lru_tail = entry->lru_prev;
+
+   entry->lru_prev = NULL;
+   entry->lru_next = NULL;
+}
+
+static void cache_lru_push_front (struct ResponseCache *cache, struct ResponseCacheEntry *entry)
+{
+   entry->lru_prev = NULL;
+   entry->lru_next = cache->_lru_head;
+   if (cache->_lru_head != NULL) cache->_lru_head->lru_prev = entry;
+   cache->_lru_head = entry;
+   if (cache->_lru_tail == NULL) cache->_lru_tail = entry;
+}
+
+static void cache_unlink (struct ResponseCache *cache, struct ResponseCacheEntry *entry)
+{
+   if (!entry->linked) return;
+
+   struct ResponseCacheEntry **p = &(cache->_buckets[entry->hash % cache->_bucket_count]);
+   while (*p != entry) p = &((*p)->bucket_next);
+   *p = entry->bucket_next;
+   entry->bucket_next = NULL;
+
+   if (entry->ready)
+   {
+      cache_lru_remove (cache, entry);
+      cache->_memory_used -= cache_entry_size (entry);
+   }
+
+   entry->linked = 0;
+   cache->_entry_count--;
+   cache_entry_release (entry);
+}
+
+static void cache_grow (struct ResponseCache *cache)
+{
+   size_t const bucket_count = cache->_bucket_count > 0 ? cache->_bucket_count * 2 : 64;
+   struct ResponseCacheEntry **buckets = calloc (bucket_count, sizeof(struct ResponseCacheEntry *));
+
+   for (size_t i = 0; i < cache->_bucket_count; i++)
+   {
+      struct ResponseCacheEntry *entry = cache->_buckets[i];
+      while (entry != NULL)
+      {
+         struct ResponseCacheEntry *next = entry->bucket_next;
+         entry->bucket_next = buckets[entry->hash % bucket_count];
+         buckets[entry->hash % bucket_count] = entry;
+         entry = next;
+      }
+   }
+
+   if (cache->_buckets != NULL) free (cache->_buckets);
+   cache->_buckets = buckets;
+   cache->_bucket_count = bucket_count;
+}
+
+static struct ResponseCacheEntry *cache_find (struct ResponseCache *cache, uint64_t hash, char const *key, size_t length)
+{
+   if (cache->_bucket_count == 0) return NULL;
+
+   struct ResponseCacheEntry *entry = cache->_buckets[hash % cache->_bucket_count];
+   for (; entry != NULL; entry = entry->bucket_next)
+   {
+      if (entry->hash == hash && entry->key_length == length && memcmp (entry->key, key, length) == 0)
+      {
+         return entry;
+      }
+   }
+   return NULL;
+}
+
+static void cache_log (struct ResponseCacheEntry const *entry, uvllhttpd_client_t *client,
+      char *log_request, uint64_t log_started)
+{
+   if (log_request == NULL) return;
+
+   uvllhttpd_access_log_record (client->server->access_log, client->peer, log_request,
+         entry->status, entry->content_length, log_started);
+   free (log_request);
+}
+
+static void cache_write_cb (uv_write_t *req, int status)
+{
+   struct cache_write *w = (struct cache_write *)req;
+
+   cache_log (w->entry, w->client, w->log_request, w->log_started);
+   if (w->close_after) uvllhttpd_client_close (w->client);
+   cache_entry_release (w->entry);
+   free (w);
+}
+
+// logged: takes the client's log line, recorded once written; the response
+// filling the entry was logged when it was finished
+static void cache_write (struct ResponseCacheEntry *entry, uvllhttpd_client_t *client, bool close_after, bool logged)
+{
+   if (uv_is_closing ((uv_handle_t *)&(client->handle))) return;
+
+   char *log_request = logged ? client->log_request : NULL;
+   uint64_t const log_started = client->log_started;
+   if (logged) client->log_request = NULL;
+
+   uvllhttpd_client_flush (client);
+
+   int n = uvllhttpd_client_try_write (client, &(entry->response), 1);
+   if (n >= 0 && (size_t)n == entry->response.len)
+   {
+      cache_log (entry, client, log_request, log_started);
+      if (close_after) uvllhttpd_client_close (client);
+      return;
+   }
+   if (n < 0) n = 0;
+
+   struct cache_write *w = malloc (sizeof(struct cache_write));
+   w->entry = entry;
+   w->client = client;
+   w->close_after = close_after;
+   w->log_request = log_request;
+   w->log_started = log_started;
+   entry->refcount++;
+
+   uv_buf_t const rest = { .base = entry->response.base + n, .len = entry->response.len - n };
+   if (uvllhttpd_client_write (&(w->req), client, &rest, 1, cache_write_cb) != 0)
+   {
+      if (log_request != NULL) free (log_request);
+      cache_entry_release (entry);
+      free (w);
+      uvllhttpd_client_close (client);
+   }
+}
+
+// the request outlives the parser's buffer, which its slices point into
+static struct HttpRequest *request_copy (struct HttpRequest const *request)
+{
+   uv_buf_t const buffer = request->__internal_buffer;
+   size_t const headers_size = sizeof(struct HttpHeader) * request->header_count;
+
+   char *p = malloc (sizeof(struct HttpRequest) + headers_size + buffer.len);
+   struct HttpHeader *headers = (struct HttpHeader *)(p + sizeof(struct HttpRequest));
+   char *base = (char *)headers + headers_size;
+   if (buffer.len > 0) memcpy (base, buffer.base, buffer.len);
+
+   for (size_t i = 0; i < request->header_count; i++)
+   {
+      headers[i].field.base = base + (request->headers[i].field.base - buffer.base);
+      headers[i].field.len = request->headers[i].field.len;
+      headers[i].value.base = base + (request->headers[i].value.base - buffer.base);
+      headers[i].value.len = request->headers[i].value.len;
+   }
+
+   struct HttpRequest const copy = {
+      .uri = { .base = base + (request->uri.base - buffer.base), .len = request->uri.len },
+      .body = {
+         .base = request->body.base != NULL ? base + (request->body.base - buffer.base) : NULL,
+         .len = request->body.len,
+      },
+      .headers = request->header_count > 0 ? headers : NULL,
+      .header_count = request->header_count,
+      .method = request->method,
+      .version = { .major = request->version.major, .minor = request->version.minor },
+      .upgrade = request->upgrade,
+      .keep_alive = request->keep_alive,
+   };
+   memcpy (p, &copy, sizeof(copy));
+   return (struct HttpRequest *)p;
+}
+
+// responses meant for one client only, or depending on more than the key
+static bool response_shareable (struct HttpResponse const *response)
+{
+   char const *p = response->headers.base;
+   char const *end = p + response->headers.len;
+
+   while (p < end)
+   {
+      char const *eol = memchr (p, '\r', end - p);
+      if (eol == NULL) eol = end;
+      size_t const length = eol - p;
+
+      if ((length >= 11 && strncasecmp (p, "Set-Cookie:", 11) == 0) ||
+            (length >= 5 && strncasecmp (p, "Vary:", 5) == 0))
+      {
+         return false;
+      }
+      if (length >= 14 && strncasecmp (p, "Cache-Control:", 14) == 0)
+      {
+         for (char const *q = p + 14; q < eol; q++)
+         {
+            if ((eol - q >= 7 && strncasecmp (q, "private", 7) == 0) ||
+                  (eol - q >= 8 && strncasecmp (q, "no-store", 8) == 0))
+            {
+               return false;
+            }
+         }
+      }
+      p = eol + 2;
+   }
+   return response->keep_alive && response->version.major == 1 && response->version.minor == 1;
+}
+
+// takes the waiters, the entry may be waited on again once they are answered
+static struct cache_waiter *cache_take_waiters (struct ResponseCacheEntry *entry, size_t *count)
+{
+   struct cache_waiter *waiters = entry->waiters;
+   *count = entry->waiter_count;
+   entry->waiters = NULL;
+   entry->waiter_count = 0;
+   entry->waiter_capacity = 0;
+
+   for (size_t i = 0; i < *count; i++)
+   {
+      if (waiters[i].client != NULL) waiters[i].client->cache_wait = NULL;
+   }
+   return waiters;
+}
+
+// the waiters that were not written the response are passed to on_request after all
+static void cache_release_waiters (struct cache_waiter *waiters, size_t count, bool answered)
+{
+   for (size_t i = 0; i < count; i++)
+   {
+      uvllhttpd_client_t *client = waiters[i].client;
+      if (client != NULL && !uv_is_closing ((uv_handle_t *)&(client->handle)))
+      {
+         if (!answered) uvllhttpd_client_dispatch (client, waiters[i].request);
+         uvllhttpd_client_unblock (client);
+      }
+      free (waiters[i].request);
+   }
+   if (waiters != NULL) free (waiters);
+}
+
+bool uvllhttpd_cache_serve (struct ResponseCache *cache, uvllhttpd_client_t *client, struct HttpRequest const *request)
+{
+   if (cache->memory_budget == 0) return false;
+   if (request->method != HTTP_GET && request->method != HTTP_HEAD) return false;
+
+   // cached bytes are serialized for HTTP/1.1 keep-alive connections
+   if (!request->keep_alive || request->version.major != 1 || request->version.minor != 1) return false;
+   if (client->cache_fill != NULL || client->cache_wait != NULL) return false;
+
+   // answered for this client only
+   if (uvllhttpd_request_find_header (request, "Authorization", 13) != NULL ||
+         uvllhttpd_request_find_header (request, "Cookie", 6) != NULL)
+   {
+      return false;
+   }
+
+   // the encoding negotiated, e.g. by uvllhttpd_bundle_serve, depends on Accept-Encoding
+   struct HttpHeader const *host = uvllhttpd_request_find_header (request, "Host", 4);
+   struct HttpHeader const *encoding = uvllhttpd_request_find_header (request, "Accept-Encoding", 15);
+   size_t const host_length = host != NULL ? host->value.len : 0;
+   size_t const encoding_length = encoding != NULL ? encoding->value.len : 0;
+
+   size_t const key_length = 1 + host_length + 1 + encoding_length + 1 + request->uri.len;
+   char key[key_length];
+   char *p = key;
+   *p++ = (char)request->method;
+   if (host_length > 0) memcpy (p, host->value.base, host_length);
+   p += host_length;
+   *p++ = '\n';
+   if (encoding_length > 0) memcpy (p, encoding->value.base, encoding_length);
+   p += encoding_length;
+   *p++ = '\n';
+   memcpy (p, request->uri.base, request->uri.len);
+
+   uint64_t const hash = cache_hash (key, key_length);
+   uint64_t const now = uv_now (client->handle.loop);
+
+   struct ResponseCacheEntry *entry = cache_find (cache, hash, key, key_length);
+   if (entry != NULL && entry->ready)
+   {
+      if (entry->expires > now)
+      {
+         cache->hits++;
+         cache_lru_remove (cache, entry);
+         cache_lru_push_front (cache, entry);
+         cache_write (entry, client, false, true);
+         return true;
+      }
+
+      cache_unlink (cache, entry);
+      entry = NULL;
+   }
+
+   if (entry != NULL)
+   {
+      // a miss for the same key is in flight, wait for its response
+      // unless it is taking so long that it has been given up on
+      if (entry->expires <= now) return false;
+
+      if (entry->waiter_count == entry->waiter_capacity)
+      {
+         entry->waiter_capacity = entry->waiter_capacity > 0 ? entry->waiter_capacity * 2 : 4;
+         entry->waiters = realloc (entry->waiters, sizeof(struct cache_waiter) * entry->waiter_capacity);
+      }
+      entry->waiters[entry->waiter_count++] = (struct cache_waiter) {
+         .client = client,
+         .request = request_copy (request),
+      };
+      client->cache_wait = entry;
+
+      cache->collapsed++;
+      return true;
+   }
+
+   cache->misses++;
+
+   if (cache->_entry_count >= cache->_bucket_count) cache_grow (cache);
+
+   entry = calloc (1, sizeof(struct ResponseCacheEntry) + key_length);
+   entry->cache = cache;
+   entry->hash = hash;
+   entry->expires = now + cache->ttl;
+   entry->key_length = key_length;
+   memcpy (entry->key, key, key_length);
+
+   entry->linked = 1;
+   entry->refcount = 2;
+   entry->bucket_next = cache->_buckets[hash % cache->_bucket_count];
+   cache->_buckets[hash % cache->_bucket_count] = entry;
+   cache->_entry_count++;
+
+   client->cache_fill = entry;
+   return false;
+}
+
+void uvllhttpd_cache_complete (struct HttpResponse *response, uv_buf_t const *bufs, size_t nbufs, size_t content_length)
+{
+   struct ResponseCacheEntry *entry = response->_cache_entry;
+   struct ResponseCache *cache = entry->cache;
+   response->_cache_entry = NULL;
+
+   size_t length = 0;
+   for (size_t i = 0; i < nbufs; i++) length += bufs[i].len;
+
+   entry->response.base = malloc (length);
+   entry->response.len = length;
+   char *p = entry->response.base;
+   for (size_t i = 0; i < nbufs; i++)
+   {
+      if (bufs[i].len == 0) continue;
+      memcpy (p, bufs[i].base, bufs[i].len);
+      p += bufs[i].len;
+   }
+
+   entry->status = response->status;
+   entry->content_length = content_length;
+   cache_write (entry, (uvllhttpd_client_t *)response->handle, !response->keep_alive, false);
+
+   size_t waiter_count;
+   struct cache_waiter *waiters = cache_take_waiters (entry, &waiter_count);
+   bool const shareable = response_shareable (response);
+   if (shareable)
+   {
+      for (size_t i = 0; i < waiter_count; i++)
+      {
+         if (waiters[i].client != NULL) cache_write (entry, waiters[i].client, false, true);
+      }
+   }
+
+   bool const cacheable = shareable && entry->linked && response->status == 200 && response->cache_ttl > 0 &&
+      cache_entry_size (entry) <= cache->memory_budget;
+
+   if (cacheable)
+   {
+      entry->ready = 1;
+      entry->expires = uv_now (response->handle->loop) + response->cache_ttl;
+      cache->_memory_used += cache_entry_size (entry);
+      cache_lru_push_front (cache, entry);
+
+      while (cache->_memory_used > cache->memory_budget && cache->_lru_tail != entry)
+      {
+         cache_unlink (cache, cache->_lru_tail);
+      }
+   }
+   else
+   {
+      cache_unlink (cache, entry);
+   }
+
+   cache_release_waiters (waiters, waiter_count, shareable);
+   cache_entry_release (entry);
+}
+
+void uvllhttpd_cache_abandon (struct ResponseCacheEntry *entry)
+{
+   size_t waiter_count;
+   struct cache_waiter *waiters = cache_take_waiters (entry, &waiter_count);
+   cache_unlink (entry->cache, entry);
+
+   cache_release_waiters (waiters, waiter_count, false);
+   cache_entry_release (entry);
+}
+
+void uvllhttpd_cache_client_closed (uvllhttpd_client_t *client)
+{
+   struct ResponseCacheEntry *entry = client->cache_wait;
+   if (entry != NULL)
+   {
+      for (size_t i = 0; i < entry->waiter_count; i++)
+      {
+         if (entry->waiters[i].client == client) entry->waiters[i].client = NULL;
+      }
+      client->cache_wait = NULL;
+   }
+
+   // closed by on_request, before anything could fill the entry
+   entry = client->cache_fill;
+   if (entry != NULL)
+   {
+      client->cache_fill = NULL;
+      uvllhttpd_cache_abandon (entry);
+   }
+}
+
+void uvllhttpd_cache_clear (struct ResponseCache *cache)
+{
+   while (cache->_lru_tail != NULL)
+   {
+      cache_unlink (cache, cache->_lru_tail);
+   }
+}
+
+void uvllhttpd_cache_free (struct ResponseCache *cache)
+{
+   for (size_t i = 0; i < cache->_bucket_count; i++)
+   {
+      while (cache->_buckets[i] != NULL)
+      {
+         cache_unlink (cache, cache->_buckets[i]);
+      }
+   }
+
+   if (cache->_buckets != NULL) free (cache->_buckets);
+   cache->_buckets = NULL;
+   cache->_bucket_count = 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "uvllhttpd.h"
+
+struct ResponseCacheEntry;
+
+// Caches fully serialized responses to GET and HEAD requests, keyed by
+// method, Host, Accept-Encoding and URI. Requests with Authorization or
+// Cookie, and responses with Set-Cookie, Vary or Cache-Control private or
+// no-store are left out. Meant to be used by the servers of a single loop.
+// Set memory_budget and ttl, then point HttpServer.cache at it.
+struct ResponseCache {
+   // 0 disables the cache. Least recently used entries are evicted beyond it.
+   size_t memory_budget;
+   // milliseconds, default for HttpResponse.cache_ttl
+   uint64_t ttl;
+
+   uint64_t hits;
+   uint64_t misses;
+   // requests which waited for the response of an in-flight miss
+   uint64_t collapsed;
+
+   size_t _memory_used;
+   size_t _entry_count;
+   size_t _bucket_count;
+   struct ResponseCacheEntry **_buckets;
+   struct ResponseCacheEntry *_lru_head;
+   struct ResponseCacheEntry *_lru_tail;
+};
+
+// Drops every cached response. In-flight misses are kept.
+void uvllhttpd_cache_clear (struct ResponseCache *cache);
+// Must not be called while requests are in flight.
+void uvllhttpd_cache_free (struct ResponseCache *cache);
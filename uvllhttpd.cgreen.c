@@ -5,6 +5,30 @@
 
 #include "uvllhttpd.h"
 #include "uvllhttpd.impl.h"
+#include "uvllhttpd.websocket.h"
+#include "uvllhttpd.form.h"
+#include "uvllhttpd.cache.h"
+#include "uvllhttpd.trace.h"
+#include "uvllhttpd.log.h"
+#include "uvllhttpd.monitor.h"
+#include "uvllhttpd.proxy.h"
+#include "uvllhttpd.sse.h"
+#include "uvllhttpd.bundle.h"
+#include "uvllhttpd.tls.h"
+
+#ifdef UVLLHTTPD_HTTP2
+#include <nghttp2/nghttp2.h>
+#endif
+#ifdef UVLLHTTPD_IO_URING
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+#ifdef UVLLHTTPD_TLS
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#endif
 
 
 static struct HttpServer make_default_server (uvllhttpd_request_handler handler)
@@ -44,39 +68,190 @@ int uv_run (uv_loop_t* loop, uv_run_mode mode)
    return (int) mock (loop, mode);
 }
 
+static uv_close_cb last_close_cb;
 void uv_close (uv_handle_t* handle, uv_close_cb close_cb)
 {
    mock (handle, close_cb);
+   last_close_cb = close_cb;
 }
 
-static uv_buf_t write_buffer;
-int uv_write (
-      uv_write_t* req,
-      uv_stream_t* handle,
-      const uv_buf_t bufs[],
-      unsigned int nbufs,
-      uv_write_cb cb)
+int uv_read_stop (uv_stream_t* stream)
 {
-   int r = (int) mock (req, handle, bufs, nbufs, cb);
+   return (int) mock (stream);
+}
+
+static uv_stream_t *last_read_stream;
+static uv_alloc_cb last_alloc_cb;
+static uv_read_cb last_read_cb;
+int uv_read_start (uv_stream_t* stream, uv_alloc_cb alloc_cb, uv_read_cb read_cb)
+{
+   last_read_stream = stream;
+   last_alloc_cb = alloc_cb;
+   last_read_cb = read_cb;
+   return (int) mock (stream, alloc_cb, read_cb);
+}
+
+int uv_tcp_nodelay (uv_tcp_t* handle, int enable) { return 0; }
+
+static uv_connect_t *last_connect_req;
+static uv_connect_cb last_connect_cb;
+int uv_tcp_connect (uv_connect_t* req, uv_tcp_t* handle, const struct sockaddr* addr, uv_connect_cb cb)
+{
+   last_connect_req = req;
+   last_connect_cb = cb;
+   return 0;
+}
 
+int uv_timer_init (uv_loop_t* loop, uv_timer_t* handle) { return 0; }
+int uv_timer_start (uv_timer_t* handle, uv_timer_cb cb, uint64_t timeout, uint64_t repeat) { return 0; }
+
+uint64_t uv_now (const uv_loop_t* loop)
+{
+   return (uint64_t) mock (loop);
+}
+
+int uv_loop_configure (uv_loop_t* loop, uv_loop_option option, ...)
+{
+   return (int) mock (loop, option);
+}
+
+uint64_t uv_metrics_idle_time (uv_loop_t* loop)
+{
+   return (uint64_t) mock (loop);
+}
+
+// advances one microsecond per call
+static uint64_t fake_hrtime;
+uint64_t uv_hrtime (void)
+{
+   return fake_hrtime += 1000;
+}
+
+static uv_buf_t write_buffer;
+static size_t capture_write (const uv_buf_t bufs[], unsigned int nbufs)
+{
    size_t sum_length = write_buffer.len;
    for (unsigned int i = 0; i < nbufs; i++) sum_length += bufs[i].len;
 
-   write_buffer.base = realloc (write_buffer.base, sum_length);
+   write_buffer.base = realloc (write_buffer.base, sum_length + 1);
 
-   //size_t pos = write_buffer.len;
    char *p = write_buffer.base + write_buffer.len;
    for (unsigned int i = 0; i < nbufs; i++)
    {
       memcpy (p, bufs[i].base, bufs[i].len);
       p += bufs[i].len;
    }
+   *p = '\0';
+
+   size_t const written = sum_length - write_buffer.len;
+   write_buffer.len = sum_length;
+   return written;
+}
+
+static uv_write_t *last_write_req;
+static uv_write_cb last_write_cb;
+int uv_write (
+      uv_write_t* req,
+      uv_stream_t* handle,
+      const uv_buf_t bufs[],
+      unsigned int nbufs,
+      uv_write_cb cb)
+{
+   int r = (int) mock (req, handle, bufs, nbufs, cb);
+   last_write_req = req;
+   last_write_cb = cb;
 
+   capture_write (bufs, nbufs);
    return r;
 }
 
+// the socket takes nothing unless a test says otherwise
+static bool try_write_accepts = false;
+int uv_try_write (uv_stream_t* handle, const uv_buf_t bufs[], unsigned int nbufs)
+{
+   if (!try_write_accepts) return UV_EAGAIN;
+   return (int) capture_write (bufs, nbufs);
+}
+
+static uv_fs_t *last_fs_req;
+static uv_fs_cb last_fs_cb;
+int uv_fs_write (uv_loop_t* loop, uv_fs_t* req, uv_file file, const uv_buf_t bufs[], unsigned int nbufs,
+      int64_t offset, uv_fs_cb cb)
+{
+   // as uv_fs_req_cleanup expects it
+   memset (req, 0, sizeof(*req));
+   req->fs_type = UV_FS_WRITE;
+   req->bufs = req->bufsml;
+   last_fs_req = req;
+   last_fs_cb = cb;
+
+   capture_write (bufs, nbufs);
+   return (int) mock (file, offset);
+}
+
+static uv_check_cb started_check_cb;
+static uv_prepare_t *started_prepare;
+static uv_prepare_cb started_prepare_cb;
+int uv_prepare_init (uv_loop_t* loop, uv_prepare_t* prepare) { return 0; }
+int uv_prepare_start (uv_prepare_t* prepare, uv_prepare_cb cb)
+{
+   started_prepare = prepare;
+   started_prepare_cb = cb;
+   return 0;
+}
+int uv_prepare_stop (uv_prepare_t* prepare) { return 0; }
+int uv_check_init (uv_loop_t* loop, uv_check_t* check) { return 0; }
+int uv_check_start (uv_check_t* check, uv_check_cb cb)
+{
+   started_check_cb = cb;
+   return 0;
+}
+int uv_check_stop (uv_check_t* check)
+{
+   started_check_cb = NULL;
+   return 0;
+}
+
+#ifdef UVLLHTTPD_IO_URING
+// the io_uring backend gets a real listening socket; what it accepts is only recorded
+static int uring_listen_fd = -1;
+static int uring_accepted_fd = -1;
+int uv_fileno (const uv_handle_t* handle, uv_os_fd_t* fd)
+{
+   if (uring_listen_fd < 0) return UV_EBADF;
+   *fd = uring_listen_fd;
+   return 0;
+}
+
+int uv_tcp_open (uv_tcp_t* handle, uv_os_sock_t sock)
+{
+   uring_accepted_fd = sock;
+   return 0;
+}
+
+static uv_poll_t *started_poll;
+static uv_poll_cb started_poll_cb;
+int uv_poll_init (uv_loop_t* loop, uv_poll_t* handle, int fd) { return 0; }
+int uv_poll_start (uv_poll_t* handle, int events, uv_poll_cb cb)
+{
+   started_poll = handle;
+   started_poll_cb = cb;
+   return 0;
+}
+#endif
+
 static uv_loop_t dummy_loop = {0};
 static uvllhttpd_client_t test_client;
+
+static uvllhttpd_client_t make_client_after_request (uint8_t keep_alive, uint8_t major, uint8_t minor)
+{
+   uvllhttpd_client_t client = {0};
+   client.keep_alive = keep_alive;
+   client.http_major = major;
+   client.http_minor = minor;
+
+   return client;
+}
 static void dummy_request_handler (uv_tcp_t *handle, struct HttpRequest const *request) {}
 
 
@@ -299,179 +474,2333 @@ Ensure(HttpServer, successive_requests)
    assert_that (err, is_equal_to (HPE_OK));
 }
 
-Ensure(HttpServer, check_server_init_nullity)
+static void mock_handler_keep_alive (uv_tcp_t *handle, struct HttpRequest const *request)
 {
-   int r = uvllhttpd_server_listen (NULL);
-   assert_that (r, is_equal_to (UV_EINVAL));
+   mock (handle, request);
+
+   assert_that (request->keep_alive, is_equal_to (1));
 }
 
-Ensure(HttpServer, check_server_without_buffer_settings)
+Ensure(HttpServer, keep_alive_http11_by_default)
 {
-   struct HttpServer server = {
-      .loop = &dummy_loop,
-      .on_request = dummy_request_handler,
-   };
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_keep_alive);
 
-   int r = uvllhttpd_server_listen (&server);
-   assert_that (r, is_equal_to (UV_EINVAL));
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+
+   const char* string = "GET / HTTP/1.1\r\n\r\n";
+   int string_len = strlen(string);
+
+   expect (mock_handler_keep_alive);
+   never_expect (uv_read_stop);
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_OK));
+   assert_that (test_client.keep_alive, is_equal_to (1));
+   assert_that (test_client.http_major, is_equal_to (1));
+   assert_that (test_client.http_minor, is_equal_to (1));
 }
 
-Ensure(HttpServer, server_init_with_invalid_host)
+Ensure(HttpServer, keep_alive_http10_with_header)
 {
-   struct HttpServer server = {
-      .loop = &dummy_loop,
-      .on_request = dummy_request_handler,
-      .host = "foo", .port = 12345,
-      .request_buffer_max_size = 10240,
-   };
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_keep_alive);
 
-   int r = uvllhttpd_server_listen (&server);
-   assert_that (r, is_equal_to (UV_EINVAL));
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+
+   const char* string = "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n";
+   int string_len = strlen(string);
+
+   expect (mock_handler_keep_alive);
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_OK));
+   assert_that (test_client.http_minor, is_equal_to (0));
 }
 
-Ensure(HttpServer, server_init_when_tcp_init_failed)
+static void mock_handler_connection_close (uv_tcp_t *handle, struct HttpRequest const *request)
 {
-   struct HttpServer server = {
-      .loop = &dummy_loop,
-      .on_request = dummy_request_handler,
-      .host = "127.0.0.1", .port = 12345,
-      .request_buffer_max_size = 10240,
-   };
-
-   expect (uv_tcp_init,
-         when (loop, is_equal_to (&dummy_loop)),
-         will_return (UV_EINVAL));
+   mock (handle, request);
 
-   int r = uvllhttpd_server_listen (&server);
-   assert_that (r, is_equal_to (UV_EINVAL));
+   assert_that (request->keep_alive, is_equal_to (0));
 }
 
-Ensure(HttpServer, server_init_when_tcp_bind_failed)
+Ensure(HttpServer, connection_close_ignores_pipelined_requests)
 {
-   struct HttpServer server = {
-      .loop = &dummy_loop,
-      .on_request = dummy_request_handler,
-      .host = "127.0.0.1", .port = 12345,
-      .request_buffer_max_size = 10240,
-   };
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_connection_close);
 
-   expect (uv_tcp_init,
-         when (loop, is_equal_to (&dummy_loop)),
-         will_return (0));
-   expect (uv_tcp_bind, will_return (UV_EINVAL));
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
 
-   int r = uvllhttpd_server_listen (&server);
-   assert_that (r, is_equal_to (UV_EINVAL));
+   const char* string = "GET / HTTP/1.1\r\nConnection: close\r\n\r\n" "GET / HTTP/1.1\r\n\r\n";
+   int string_len = strlen(string);
+
+   expect (mock_handler_connection_close);
+   expect (uv_read_stop, when (stream, is_equal_to (&test_client)));
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_PAUSED));
 }
 
-Ensure(HttpServer, server_init_when_tcp_listen_failed)
+Ensure(HttpServer, connection_close_for_http10)
 {
-   struct HttpServer server = {
-      .loop = &dummy_loop,
-      .on_request = dummy_request_handler,
-      .host = "127.0.0.1", .port = 12345,
-      .request_buffer_max_size = 10240,
-   };
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_connection_close);
 
-   expect (uv_tcp_init,
-         when (loop, is_equal_to (&dummy_loop)),
-         will_return (0));
-   expect (uv_tcp_bind, will_return (0));
-   expect (uv_listen,
-         when (backlog, is_equal_to (server.backlog)),
-         will_return (UV_EINVAL));
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
 
-   int r = uvllhttpd_server_listen (&server);
-   assert_that (r, is_equal_to (UV_EINVAL));
+   const char* string = "GET / HTTP/1.0\r\n\r\n";
+   int string_len = strlen(string);
+
+   expect (mock_handler_connection_close);
+   expect (uv_read_stop);
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_PAUSED));
 }
 
-Ensure(HttpServer, server_init_when_everything_is_ok)
+static void mock_handler_max_requests (uv_tcp_t *handle, struct HttpRequest const *request)
 {
-   struct HttpServer server = {
-      .loop = &dummy_loop,
-      .on_request = dummy_request_handler,
-      .host = "127.0.0.1", .port = 12345,
-      .request_buffer_max_size = 10240,
-   };
+   mock (handle, request);
+}
 
-   expect (uv_tcp_init,
-         when (loop, is_equal_to (&dummy_loop)),
-         will_return (0));
-   expect (uv_tcp_bind, will_return (0));
-   expect (uv_listen,
-         when (backlog, is_equal_to (server.backlog)),
-         will_return (0));
-   never_expect (uv_run);
+Ensure(HttpServer, max_requests_per_connection)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_max_requests);
+   server.max_requests_per_connection = 2;
 
-   int r = uvllhttpd_server_listen (&server);
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
 
-   assert_that (r, is_equal_to (0));
-   assert_that (server.loop, is_equal_to (server.loop));
-   assert_that (server.on_request, is_equal_to (dummy_request_handler));
+   const char* string = "GET / HTTP/1.1\r\n\r\n" "GET / HTTP/1.1\r\n\r\n" "GET / HTTP/1.1\r\n\r\n";
+   int string_len = strlen(string);
+
+   expect (mock_handler_max_requests);
+   expect (mock_handler_max_requests);
+   expect (uv_read_stop);
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_PAUSED));
+   assert_that (test_client.request_count, is_equal_to (2));
+   assert_that (test_client.keep_alive, is_equal_to (0));
 }
 
-Ensure(HttpServer, response_init_with_tcp_handle_null)
+static char streamed_body[64];
+static size_t streamed_body_length;
+
+static int mock_body_handler (void *data, char const *at, size_t length)
 {
-   struct HttpResponse *response = uvllhttpd_response_init (NULL);
-   assert_that (response, is_null);
+   mock (data, at, length);
+
+   if (at != NULL)
+   {
+      memcpy (streamed_body + streamed_body_length, at, length);
+      streamed_body_length += length;
+   }
+   return 0;
 }
 
-Ensure(HttpServer, response_init_with_tcp_handle_not_null)
+static void handler_stream_body_headers (uv_tcp_t *handle, struct HttpRequest const *request)
 {
-   uv_tcp_t handle = {0};
-   struct HttpResponse *response = uvllhttpd_response_init (&handle);
-   assert_that (response, is_not_null);
+   assert_that (request->uri.base, is_equal_to_string ("/upload"));
+   assert_that (request->header_count, is_equal_to (1));
+
+   uvllhttpd_request_stream_body (handle, mock_body_handler, &streamed_body);
 }
 
-Ensure(HttpServer, response_no_header)
+static void mock_handler_stream_body (uv_tcp_t *handle, struct HttpRequest const *request)
 {
-   uv_tcp_t handle = {0};
-   struct HttpResponse *response = uvllhttpd_response_init (&handle);
-   assert_that (response, is_not_null);
+   mock (handle, request);
 
-   response->status = 200;
+   assert_that (request->body.len, is_equal_to (0));
+}
 
-   char body[] = "Hello World.";
-   uvllhttpd_response_append_body (response, body, sizeof(body)-1);
+Ensure(HttpServer, stream_body)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = {
+      .on_request = mock_handler_stream_body,
+      .on_headers = handler_stream_body_headers,
+      .request_buffer_max_size = 30,
+   };
 
-   expect (uv_write);
-   write_buffer.base = NULL;
-   write_buffer.len = 0;
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+   streamed_body_length = 0;
 
-   uvllhttpd_response_finish (response);
+   // the body alone exceeds request_buffer_max_size, it must not be buffered
+   const char* string = "POST /upload HTTP/1.1\r\nContent-Length: 40\r\n\r\n"
+      "0123456789012345678901234567890123456789";
+   int string_len = strlen(string);
 
-   assert_that (write_buffer.base, is_equal_to_string (
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Length: 12\r\n"
-            "\r\n"
-            "Hello World."
-            ));
+   expect (mock_body_handler, when (data, is_equal_to (&streamed_body)), when (length, is_equal_to (40)));
+   expect (mock_body_handler, when (at, is_null));
+   expect (mock_handler_stream_body);
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_OK));
+   assert_that (streamed_body_length, is_equal_to (40));
+   assert_that (test_client.on_body, is_null);
 }
 
-Ensure(HttpServer, response_basic_usage)
+static void mock_handler_cached (uv_tcp_t *handle, struct HttpRequest const *request)
 {
-   uv_tcp_t handle = {0};
-   struct HttpResponse *response = uvllhttpd_response_init (&handle);
-   assert_that (response, is_not_null);
+   mock (handle, request);
 
+   struct HttpResponse *response = uvllhttpd_response_init (handle);
    response->status = 200;
-   char contentType[] = "Content-Type: text/plain";
-   uvllhttpd_response_add_header (response, contentType, sizeof(contentType)-1);
-
-   char body[] = "Hello World.";
+   char body[] = "cached";
    uvllhttpd_response_append_body (response, body, sizeof(body)-1);
-
-   expect (uv_write);
-   write_buffer.base = NULL;
-   write_buffer.len = 0;
-
    uvllhttpd_response_finish (response);
+}
+
+Ensure(HttpServer, cache_hit_skips_handler)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_cached);
+   struct ResponseCache cache = {
+      .memory_budget = 4096,
+      .ttl = 1000,
+   };
+   server.cache = &cache;
+
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+
+   const char* string = "GET /cached HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "GET /cached HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "GET /cached HTTP/1.1\r\nHost: example.com\r\n\r\n";
+   int string_len = strlen(string);
+
+   always_expect (uv_now, will_return (100));
+   expect (mock_handler_cached);
+   expect (mock_handler_cached);
+   expect (uv_write);
+   expect (uv_write);
+   expect (uv_write);
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_OK));
+   assert_that (cache.hits, is_equal_to (1));
+   assert_that (cache.misses, is_equal_to (2));
+   assert_that (write_buffer.base, is_equal_to_string (
+            "HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\ncached"
+            "HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\ncached"
+            "HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\ncached"));
+
+   uvllhttpd_cache_free (&cache);
+}
+
+Ensure(HttpServer, cache_hit_logged_with_the_cached_status_and_size)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_cached);
+   struct ResponseCache cache = {
+      .memory_budget = 4096,
+      .ttl = 1000,
+   };
+   server.cache = &cache;
+   char ring[4096];
+   struct AccessLog log = {
+      .buffer_size = sizeof(ring),
+      ._loop = &dummy_loop,
+      ._ring = ring,
+      ._date_second = -1,
+   };
+   server.access_log = &log;
+
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   strcpy (test_client.peer, "127.0.0.1");
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+
+   const char* string = "GET /cached HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "GET /cached HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+   always_expect (uv_now, will_return (1000));
+   expect (mock_handler_cached);
+   try_write_accepts = true;
+   assert_that (llhttp_execute (&(test_client.parser), string, strlen (string)), is_equal_to (HPE_OK));
+   try_write_accepts = false;
+   assert_that (cache.hits, is_equal_to (1));
+
+   char const expected[] =
+      "127.0.0.1 - - [01/Jan/1970:00:00:01 +0000] \"GET /cached HTTP/1.1\" 200 6 0\n"
+      "127.0.0.1 - - [01/Jan/1970:00:00:01 +0000] \"GET /cached HTTP/1.1\" 200 6 0\n";
+   assert_that (atomic_load (&(log._head)), is_equal_to (sizeof(expected)-1));
+   assert_that (ring, is_equal_to_contents_of (expected, sizeof(expected)-1));
+
+   uvllhttpd_cache_free (&cache);
+}
+
+static struct RequestContext *cache_contexts[2];
+static bool cache_handler_answers;
+
+static void mock_handler_deferred (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   mock (handle, request);
+
+   if (cache_handler_answers)
+   {
+      struct HttpResponse *response = uvllhttpd_response_init (handle);
+      response->status = 200;
+      uvllhttpd_response_add_header (response, "Set-Cookie: id=1", 16);
+      uvllhttpd_response_finish (response);
+      return;
+   }
+   struct RequestContext **context = &cache_contexts[cache_contexts[0] != NULL ? 1 : 0];
+   *context = uvllhttpd_request_context (handle);
+}
+
+static void cache_test_clients (struct HttpServer *server, uvllhttpd_client_t clients[2])
+{
+   static llhttp_settings_t settings;
+   settings = uvllhttpd_get_llhttp_settings ();
+   memset (clients, 0, sizeof(uvllhttpd_client_t) * 2);
+   for (int i = 0; i < 2; i++)
+   {
+      clients[i].server = server;
+      clients[i].keep_alive = 1;
+      llhttp_init (&(clients[i].parser), HTTP_REQUEST, &settings);
+      clients[i].parser.data = &clients[i];
+   }
+   cache_contexts[0] = cache_contexts[1] = NULL;
+   cache_handler_answers = false;
+}
+
+Ensure(HttpServer, cache_collapses_concurrent_misses)
+{
+   struct HttpServer server = make_default_server (mock_handler_deferred);
+   struct ResponseCache cache = {
+      .memory_budget = 4096,
+      .ttl = 1000,
+   };
+   server.cache = &cache;
+   uvllhttpd_client_t clients[2];
+   cache_test_clients (&server, clients);
+
+   const char* string = "GET /slow HTTP/1.1\r\n\r\n";
+   int string_len = strlen(string);
+
+   always_expect (uv_now, will_return (100));
+   expect (mock_handler_deferred, when (handle, is_equal_to (&clients[0])));
+   uvllhttpd_client_received (&clients[0], string, string_len);
+
+   // the waiter reads no further until it is answered
+   const char* pipelined = "GET /slow HTTP/1.1\r\n\r\nGET /next HTTP/1.1\r\n\r\n";
+   expect (uv_read_stop, when (stream, is_equal_to (&clients[1])));
+   uvllhttpd_client_received (&clients[1], pipelined, strlen (pipelined));
+   assert_that (cache.collapsed, is_equal_to (1));
+   assert_that (clients[1].blocked, is_true);
+
+   // a response started outside the request's context does not fill the entry
+   struct HttpResponse *other = uvllhttpd_response_init (&(clients[0].handle));
+   assert_that (other->_cache_entry, is_null);
+   uvllhttpd_response_release (other, false);
+
+   // the deferred response is written to both connections, then the held request is parsed
+   expect (uv_write, when (handle, is_equal_to (&clients[0])));
+   expect (uv_write, when (handle, is_equal_to (&clients[1])));
+   expect (mock_handler_deferred, when (handle, is_equal_to (&clients[1])));
+   expect (uv_read_start, when (stream, is_equal_to (&clients[1])));
+
+   struct HttpResponse *response = uvllhttpd_context_response_init (cache_contexts[0]);
+   response->status = 200;
+   uvllhttpd_response_finish (response);
+
+   assert_that (clients[1].cache_wait, is_null);
+   assert_that (clients[1].blocked, is_false);
+
+   uvllhttpd_context_unref (cache_contexts[0]);
+   uvllhttpd_context_unref (cache_contexts[1]);
+   uvllhttpd_cache_free (&cache);
+}
+
+Ensure(HttpServer, cache_waiters_not_given_a_private_response)
+{
+   struct HttpServer server = make_default_server (mock_handler_deferred);
+   struct ResponseCache cache = {
+      .memory_budget = 4096,
+      .ttl = 1000,
+   };
+   server.cache = &cache;
+   uvllhttpd_client_t clients[2];
+   cache_test_clients (&server, clients);
+
+   const char* string = "GET /me HTTP/1.1\r\n\r\n";
+   always_expect (uv_now, will_return (100));
+   always_expect (uv_read_stop);
+   expect (mock_handler_deferred, when (handle, is_equal_to (&clients[0])));
+   uvllhttpd_client_received (&clients[0], string, strlen (string));
+   uvllhttpd_client_received (&clients[1], string, strlen (string));
+   assert_that (cache.collapsed, is_equal_to (1));
+
+   // the waiter's request goes to on_request after all, which answers it itself
+   cache_handler_answers = true;
+   expect (uv_write, when (handle, is_equal_to (&clients[0])));
+   expect (mock_handler_deferred, when (handle, is_equal_to (&clients[1])));
+   expect (uv_write, when (handle, is_equal_to (&clients[1])));
+   expect (uv_read_start, when (stream, is_equal_to (&clients[1])));
+
+   struct HttpResponse *response = uvllhttpd_context_response_init (cache_contexts[0]);
+   response->status = 200;
+   uvllhttpd_response_add_header (response, "Set-Cookie: id=0", 16);
+   write_buffer.len = 0;
+   uvllhttpd_response_finish (response);
+   assert_that (cache._entry_count, is_equal_to (0));
+   assert_that (write_buffer.base, contains_string ("id=0\r\nContent-Length: 0\r\n\r\nHTTP/1.1 200 OK\r\nSet-Cookie: id=1"));
+
+   uvllhttpd_context_unref (cache_contexts[0]);
+   uvllhttpd_cache_free (&cache);
+}
+
+static void mock_handler_cached_close (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   mock (handle, request);
+
+   struct HttpResponse *response = uvllhttpd_response_init (handle);
+   response->status = 200;
+   response->keep_alive = 0;
+   uvllhttpd_response_finish (response);
+}
+
+Ensure(HttpServer, cache_skips_private_requests_and_keys_on_accept_encoding)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_cached);
+   struct ResponseCache cache = {
+      .memory_budget = 4096,
+      .ttl = 1000,
+   };
+   server.cache = &cache;
+
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+
+   const char* string = "GET /a HTTP/1.1\r\nCookie: id=1\r\n\r\n"
+      "GET /a HTTP/1.1\r\nAuthorization: Basic eDp5\r\n\r\n"
+      "GET /a HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n"
+      "GET /a HTTP/1.1\r\n\r\n";
+
+   always_expect (uv_now, will_return (100));
+   always_expect (uv_write);
+   expect (mock_handler_cached);
+   expect (mock_handler_cached);
+   expect (mock_handler_cached);
+   expect (mock_handler_cached);
+
+   enum llhttp_errno err = llhttp_execute (&(test_client.parser), string, strlen (string));
+   assert_that (err, is_equal_to (HPE_OK));
+   assert_that (cache.hits, is_equal_to (0));
+   assert_that (cache.misses, is_equal_to (2));
+
+   uvllhttpd_cache_free (&cache);
+}
+
+Ensure(HttpServer, cache_fill_closes_a_connection_it_ends)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_cached_close);
+   struct ResponseCache cache = {
+      .memory_budget = 4096,
+      .ttl = 1000,
+   };
+   server.cache = &cache;
+
+   uvllhttpd_client_t *client = calloc (1, sizeof(uvllhttpd_client_t));
+   client->server = &server;
+   llhttp_init (&(client->parser), HTTP_REQUEST, &settings);
+   client->parser.data = client;
+
+   const char* string = "GET /bye HTTP/1.1\r\n\r\n";
+   always_expect (uv_now, will_return (100));
+   expect (mock_handler_cached_close);
+   expect (uv_write, when (handle, is_equal_to (client)));
+   expect (uv_close, when (handle, is_equal_to (client)));
+
+   llhttp_execute (&(client->parser), string, strlen (string));
+   last_write_cb (last_write_req, 0);
+   assert_that (cache._entry_count, is_equal_to (0));
+
+   last_close_cb ((uv_handle_t *)client);
+   uvllhttpd_cache_free (&cache);
+}
+
+Ensure(HttpServer, check_server_init_nullity)
+{
+   int r = uvllhttpd_server_listen (NULL);
+   assert_that (r, is_equal_to (UV_EINVAL));
+}
+
+Ensure(HttpServer, check_server_without_buffer_settings)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = dummy_request_handler,
+   };
+
+   int r = uvllhttpd_server_listen (&server);
+   assert_that (r, is_equal_to (UV_EINVAL));
+}
+
+Ensure(HttpServer, server_init_with_invalid_host)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = dummy_request_handler,
+      .host = "foo", .port = 12345,
+      .request_buffer_max_size = 10240,
+   };
+
+   int r = uvllhttpd_server_listen (&server);
+   assert_that (r, is_equal_to (UV_EINVAL));
+}
+
+Ensure(HttpServer, server_init_when_tcp_init_failed)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = dummy_request_handler,
+      .host = "127.0.0.1", .port = 12345,
+      .request_buffer_max_size = 10240,
+   };
+
+   expect (uv_tcp_init,
+         when (loop, is_equal_to (&dummy_loop)),
+         will_return (UV_EINVAL));
+
+   int r = uvllhttpd_server_listen (&server);
+   assert_that (r, is_equal_to (UV_EINVAL));
+}
+
+Ensure(HttpServer, server_init_when_tcp_bind_failed)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = dummy_request_handler,
+      .host = "127.0.0.1", .port = 12345,
+      .request_buffer_max_size = 10240,
+   };
+
+   expect (uv_tcp_init,
+         when (loop, is_equal_to (&dummy_loop)),
+         will_return (0));
+   expect (uv_tcp_bind, will_return (UV_EINVAL));
+
+   int r = uvllhttpd_server_listen (&server);
+   assert_that (r, is_equal_to (UV_EINVAL));
+}
+
+Ensure(HttpServer, server_init_when_tcp_listen_failed)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = dummy_request_handler,
+      .host = "127.0.0.1", .port = 12345,
+      .request_buffer_max_size = 10240,
+   };
+
+   expect (uv_tcp_init,
+         when (loop, is_equal_to (&dummy_loop)),
+         will_return (0));
+   expect (uv_tcp_bind, will_return (0));
+   expect (uv_listen,
+         when (backlog, is_equal_to (server.backlog)),
+         will_return (UV_EINVAL));
+
+   int r = uvllhttpd_server_listen (&server);
+   assert_that (r, is_equal_to (UV_EINVAL));
+}
+
+#ifndef UVLLHTTPD_IO_URING
+Ensure(HttpServer, server_init_with_io_uring_backend_not_built)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = dummy_request_handler,
+      .host = "127.0.0.1", .port = 12345,
+      .request_buffer_max_size = 10240,
+      .backend = HttpServerBackend_io_uring,
+   };
+
+   expect (uv_tcp_init,
+         when (loop, is_equal_to (&dummy_loop)),
+         will_return (0));
+   expect (uv_tcp_bind, will_return (0));
+   never_expect (uv_listen);
+
+   int r = uvllhttpd_server_listen (&server);
+   assert_that (r, is_equal_to (UV_ENOSYS));
+}
+#else
+static char uring_uris[64];
+static uv_tcp_t *uring_client;
+static void handler_uring (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   uring_client = handle;
+   strcat (uring_uris, request->uri.base);
+
+   struct HttpResponse *response = uvllhttpd_response_init (handle);
+   response->status = 200;
+   uvllhttpd_response_finish (response);
+}
+
+// runs the loop's share of the backend: the prepare submits, the poll completes
+static void uring_run (bool submit)
+{
+   for (int i = 0; i < 20; i++)
+   {
+      if (submit) started_prepare_cb (started_prepare);
+      usleep (1000);
+      started_poll_cb (started_poll, 0, UV_READABLE);
+   }
+}
+
+Ensure(HttpServer, io_uring_backend_holds_what_it_reads_while_paused)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = handler_uring,
+      .request_buffer_max_size = 10240,
+      .backend = HttpServerBackend_io_uring,
+   };
+   struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl (INADDR_LOOPBACK) };
+   socklen_t addr_len = sizeof(addr);
+   uring_listen_fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+   bind (uring_listen_fd, (struct sockaddr *)&addr, addr_len);
+   getsockname (uring_listen_fd, (struct sockaddr *)&addr, &addr_len);
+   assert_that (uvllhttpd_server_start (&server), is_equal_to (0));
+
+   int peer = socket (AF_INET, SOCK_STREAM, 0);
+   assert_that (connect (peer, (struct sockaddr *)&addr, addr_len), is_equal_to (0));
+   always_expect (uv_tcp_init, will_return (0));
+   try_write_accepts = true;
+   write_buffer.len = 0;
+   uring_uris[0] = '\0';
+   char const a[] = "GET /a HTTP/1.1\r\n\r\n";
+   send (peer, a, sizeof(a)-1, 0);
+   uring_run (true);
+   assert_that (uring_uris, is_equal_to_string ("/a"));
+   assert_that (write_buffer.base, begins_with_string ("HTTP/1.1 200 OK\r\n"));
+
+   // completed before the pause is submitted, the read waits for the resume
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)uring_client;
+   uvllhttpd_client_pause (client);
+   char const b[] = "GET /b HTTP/1.1\r\n\r\n";
+   send (peer, b, sizeof(b)-1, 0);
+   uring_run (false);
+   assert_that (uring_uris, is_equal_to_string ("/a"));
+   uvllhttpd_client_resume (client);
+   assert_that (uring_uris, is_equal_to_string ("/a"));
+   uring_run (true);
+   assert_that (uring_uris, is_equal_to_string ("/a/b"));
+
+   // and the receive is armed again after the cancel
+   char const c[] = "GET /c HTTP/1.1\r\n\r\n";
+   send (peer, c, sizeof(c)-1, 0);
+   uring_run (true);
+   assert_that (uring_uris, is_equal_to_string ("/a/b/c"));
+   try_write_accepts = false;
+
+   expect (uv_close, when (handle, is_equal_to (client)));
+   uvllhttpd_client_close (client);
+   last_close_cb ((uv_handle_t *)client);
+
+   expect (uv_close, when (handle, is_equal_to (started_poll)));
+   expect (uv_close, when (handle, is_equal_to (started_prepare)));
+   uvllhttpd_uring_close (server._uring);
+   uring_run (false);
+   last_close_cb ((uv_handle_t *)started_poll);
+   last_close_cb ((uv_handle_t *)started_prepare);
+
+   close (peer);
+   close (uring_accepted_fd);
+   close (uring_listen_fd);
+   uring_listen_fd = -1;
+}
+#endif
+
+Ensure(HttpServer, server_init_when_everything_is_ok)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = dummy_request_handler,
+      .host = "127.0.0.1", .port = 12345,
+      .request_buffer_max_size = 10240,
+   };
+
+   expect (uv_tcp_init,
+         when (loop, is_equal_to (&dummy_loop)),
+         will_return (0));
+   expect (uv_tcp_bind, will_return (0));
+   expect (uv_listen,
+         when (backlog, is_equal_to (server.backlog)),
+         will_return (0));
+   never_expect (uv_run);
+
+   int r = uvllhttpd_server_listen (&server);
+
+   assert_that (r, is_equal_to (0));
+   assert_that (server.loop, is_equal_to (server.loop));
+   assert_that (server.on_request, is_equal_to (dummy_request_handler));
+}
+
+Ensure(HttpServer, response_init_with_tcp_handle_null)
+{
+   struct HttpResponse *response = uvllhttpd_response_init (NULL);
+   assert_that (response, is_null);
+}
+
+Ensure(HttpServer, response_init_with_tcp_handle_not_null)
+{
+   uvllhttpd_client_t client = {0};
+   struct HttpResponse *response = uvllhttpd_response_init (&(client.handle));
+   assert_that (response, is_not_null);
+}
+
+Ensure(HttpServer, response_no_header)
+{
+   uvllhttpd_client_t client = make_client_after_request (1, 1, 1);
+   struct HttpResponse *response = uvllhttpd_response_init (&(client.handle));
+   assert_that (response, is_not_null);
+
+   response->status = 200;
+
+   char body[] = "Hello World.";
+   uvllhttpd_response_append_body (response, body, sizeof(body)-1);
+
+   expect (uv_write);
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+
+   uvllhttpd_response_finish (response);
+
+   assert_that (write_buffer.base, is_equal_to_string (
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Length: 12\r\n"
+            "\r\n"
+            "Hello World."
+            ));
+}
+
+Ensure(HttpServer, response_basic_usage)
+{
+   uvllhttpd_client_t client = make_client_after_request (1, 1, 1);
+   struct HttpResponse *response = uvllhttpd_response_init (&(client.handle));
+   assert_that (response, is_not_null);
+
+   response->status = 200;
+   char contentType[] = "Content-Type: text/plain";
+   uvllhttpd_response_add_header (response, contentType, sizeof(contentType)-1);
+
+   char body[] = "Hello World.";
+   uvllhttpd_response_append_body (response, body, sizeof(body)-1);
+
+   expect (uv_write);
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+
+   uvllhttpd_response_finish (response);
+
+   assert_that (write_buffer.base, is_equal_to_string (
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: 12\r\n"
+            "\r\n"
+            "Hello World."
+            ));
+}
+
+Ensure(HttpServer, response_connection_close)
+{
+   uvllhttpd_client_t client = make_client_after_request (0, 1, 1);
+   struct HttpResponse *response = uvllhttpd_response_init (&(client.handle));
+   assert_that (response->keep_alive, is_equal_to (0));
+
+   response->status = 200;
+
+   expect (uv_write);
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+
+   uvllhttpd_response_finish (response);
+
+   assert_that (write_buffer.base, is_equal_to_string (
+            "HTTP/1.1 200 OK\r\n"
+            "Connection: close\r\n"
+            "Content-Length: 0\r\n"
+            "\r\n"
+            ));
+}
+
+Ensure(HttpServer, response_http10_keep_alive)
+{
+   uvllhttpd_client_t client = make_client_after_request (1, 1, 0);
+   struct HttpResponse *response = uvllhttpd_response_init (&(client.handle));
+
+   response->status = 200;
+   char body[] = "Hello World.";
+   uvllhttpd_response_append_body (response, body, sizeof(body)-1);
+
+   expect (uv_write);
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+
+   uvllhttpd_response_finish (response);
+
+   assert_that (write_buffer.base, is_equal_to_string (
+            "HTTP/1.0 200 OK\r\n"
+            "Connection: keep-alive\r\n"
+            "Content-Length: 12\r\n"
+            "\r\n"
+            "Hello World."
+            ));
+}
+
+
+static uv_buf_t string_buf (char const *s)
+{
+   return (uv_buf_t) { .base = (char *)s, .len = strlen (s) };
+}
+
+static struct HttpHeader websocket_upgrade_headers[5];
+
+static void make_websocket_upgrade_headers (void)
+{
+   char const * const strings[][2] = {
+      { "Host", "localhost" },
+      { "upgrade", "websocket" },
+      { "Connection", "keep-alive, Upgrade" },
+      { "Sec-WebSocket-Key", "dGhlIHNhbXBsZSBub25jZQ==" },
+      { "Sec-WebSocket-Version", "13" },
+   };
+   for (size_t i = 0; i < 5; i++)
+   {
+      websocket_upgrade_headers[i].field = string_buf (strings[i][0]);
+      websocket_upgrade_headers[i].value = string_buf (strings[i][1]);
+   }
+}
+
+static void mock_release_cb (void *ctx)
+{
+   mock (ctx);
+}
+
+Ensure(HttpServer, response_body_refs_in_append_order)
+{
+   uvllhttpd_client_t client = make_client_after_request (1, 1, 1);
+   struct HttpResponse *response = uvllhttpd_response_init (&(client.handle));
+   response->status = 200;
+
+   static char const header[] = "<html>";
+   static char const footer[] = "</html>";
+   int ctx = 0;
+
+   uvllhttpd_response_append_ref (response, header, sizeof(header)-1, mock_release_cb, &ctx);
+   uvllhttpd_response_append_body (response, "copied", 6);
+   uvllhttpd_response_append_ref (response, footer, sizeof(footer)-1, NULL, NULL);
+
+   struct SharedBuffer *shared = uvllhttpd_shared_buffer_new ("!", 1);
+   uvllhttpd_response_append_shared (response, shared);
+   assert_that (shared->refcount, is_equal_to (2));
+
+   expect (uv_write, when (nbufs, is_equal_to (8)));
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+
+   uvllhttpd_response_finish (response);
+
+   assert_that (write_buffer.base, is_equal_to_string (
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Length: 20\r\n"
+            "\r\n"
+            "<html>copied</html>!"
+            ));
+
+   // references are released once the write completes
+   expect (mock_release_cb, when (ctx, is_equal_to (&ctx)));
+   last_write_cb (last_write_req, 0);
+
+   assert_that (shared->refcount, is_equal_to (1));
+   uvllhttpd_shared_buffer_unref (shared);
+}
+
+Ensure(HttpServer, response_written_at_once_without_write_request)
+{
+   uvllhttpd_client_t client = make_client_after_request (1, 1, 1);
+   struct HttpResponse *response = uvllhttpd_response_init (&(client.handle));
+   response->status = 200;
+   uvllhttpd_response_append_body (response, "Hello World.", 12);
+
+   // uv_write is not expected
+   try_write_accepts = true;
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+
+   uvllhttpd_response_finish (response);
+
+   assert_that (write_buffer.base, is_equal_to_string (
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Length: 12\r\n"
+            "\r\n"
+            "Hello World."
+            ));
+}
+
+Ensure(HttpServer, response_released_when_write_fails)
+{
+   uvllhttpd_client_t client = make_client_after_request (1, 1, 1);
+   struct HttpResponse *response = uvllhttpd_response_init (&(client.handle));
+   response->status = 200;
+   int ctx = 0;
+   uvllhttpd_response_append_ref (response, "Hello", 5, mock_release_cb, &ctx);
+   assert_that (client.open_responses, is_equal_to (1));
+
+   write_buffer.len = 0;
+   expect (uv_write, will_return (UV_EPIPE));
+   expect (mock_release_cb, when (ctx, is_equal_to (&ctx)));
+   expect (uv_close, when (handle, is_equal_to (&client)));
+   uvllhttpd_response_finish (response);
+
+   assert_that (client.open_responses, is_equal_to (0));
+}
+
+static void mock_handler_hello (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   mock (handle, request);
+
+   struct HttpResponse *response = uvllhttpd_response_init (handle);
+   response->status = 200;
+   uvllhttpd_response_append_body (response, "Hello", 5);
+   uvllhttpd_response_finish (response);
+}
+
+Ensure(HttpServer, pipelined_responses_coalesced_into_one_write)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_hello);
+   server.write_coalesce_size = 256;
+   server._write_check.data = &server;
+
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+
+   const char* string = "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\n";
+   int string_len = strlen(string);
+
+   expect (mock_handler_hello);
+   expect (mock_handler_hello);
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_OK));
+   assert_that (write_buffer.base, is_null);
+   assert_that (server._pending_writes, is_equal_to (&test_client));
+   assert_that (started_check_cb, is_not_null);
+
+   expect (uv_write, when (nbufs, is_equal_to (1)));
+   started_check_cb (&(server._write_check));
+
+   assert_that (write_buffer.base, is_equal_to_string (
+            "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nHello"
+            "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nHello"));
+   assert_that (server._pending_writes, is_null);
+   assert_that (started_check_cb, is_null);
+
+   last_write_cb (last_write_req, 0);
+}
+
+Ensure(HttpServer, trace_samples_requests)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_hello);
+   struct HttpTrace trace;
+   assert_that (uvllhttpd_trace_init (&trace, 4, 2), is_equal_to (0));
+   server.trace = &trace;
+
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+
+   const char* string = "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\nGET /c HTTP/1.1\r\n\r\n";
+   int string_len = strlen(string);
+
+   expect (mock_handler_hello);
+   expect (mock_handler_hello);
+   expect (mock_handler_hello);
+   try_write_accepts = true;
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_OK));
+   assert_that (trace._count, is_equal_to (2));
+
+   char *json = NULL;
+   size_t json_length = 0;
+   FILE *out = open_memstream (&json, &json_length);
+   assert_that (uvllhttpd_trace_dump (&trace, out), is_equal_to (0));
+   fclose (out);
+
+   assert_that (json, begins_with_string ("{\"traceEvents\":["));
+   assert_that (json, contains_string (
+            "{\"name\":\"request\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":1.000,\"dur\":4.000,"
+            "\"args\":{\"request\":1,\"method\":\"GET\",\"uri\":\"/a\",\"status\":200}}"));
+   assert_that (json, contains_string (
+            "{\"name\":\"handler\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":8.000,\"dur\":1.000}"));
+   assert_that (json, contains_string ("\"uri\":\"/c\""));
+   assert_that (json, does_not_contain_string ("\"uri\":\"/b\""));
+
+   free (json);
+   uvllhttpd_trace_free (&trace);
+}
+
+Ensure(HttpServer, access_log_formats_on_the_loop)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_hello);
+
+   // the ring alone, without the writer thread
+   char ring[4096];
+   struct AccessLog log = {
+      .buffer_size = sizeof(ring),
+      ._loop = &dummy_loop,
+      ._ring = ring,
+      ._date_second = -1,
+   };
+   server.access_log = &log;
+
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   strcpy (test_client.peer, "127.0.0.1");
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+
+   const char* string = "GET /a HTTP/1.1\r\n\r\n";
+   int string_len = strlen(string);
+
+   always_expect (uv_now, will_return (1000));
+   expect (mock_handler_hello);
+   try_write_accepts = true;
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_OK));
+
+   char const expected[] = "127.0.0.1 - - [01/Jan/1970:00:00:01 +0000] \"GET /a HTTP/1.1\" 200 5 0\n";
+   assert_that (atomic_load (&(log._head)), is_equal_to (sizeof(expected)-1));
+   assert_that (ring, is_equal_to_contents_of (expected, sizeof(expected)-1));
+}
+
+static void mock_slow_handler_cb (struct LoopMonitor *monitor, struct HttpRequest const *request, uint64_t elapsed)
+{
+   mock (monitor, request, elapsed);
+}
+
+Ensure(HttpServer, monitor_reports_slow_handlers)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (mock_handler_hello);
+   struct LoopMonitor monitor = {
+      .slow_handler_threshold = 1,
+      .on_slow_handler = mock_slow_handler_cb,
+   };
+   server.monitor = &monitor;
+
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+
+   const char* string = "POST /slow HTTP/1.1\r\n\r\n";
+   int string_len = strlen(string);
+
+   expect (mock_handler_hello);
+   expect (mock_slow_handler_cb, when (monitor, is_equal_to (&monitor)), when (elapsed, is_equal_to (1)));
+   try_write_accepts = true;
+
+   enum llhttp_errno err = llhttp_execute(&(test_client.parser), string, string_len);
+   assert_that (err, is_equal_to (HPE_OK));
+
+   struct LoopStats stats;
+   uvllhttpd_monitor_stats (&monitor, &stats);
+   assert_that (stats.handler.count, is_equal_to (1));
+   assert_that (stats.handler.max, is_equal_to (1));
+   assert_that (stats.slow_handlers, is_equal_to (1));
+   assert_that (monitor.slowest.uri, is_equal_to_string ("/slow"));
+   assert_that (monitor.slowest.method, is_equal_to (HTTP_POST));
+}
+
+// blocks the loop for 5 ms, as far as uv_hrtime can tell
+static void handler_sleep (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   fake_hrtime += 5000000;
+
+   struct HttpResponse *response = uvllhttpd_response_init (handle);
+   response->status = 204;
+   uvllhttpd_response_finish (response);
+}
+
+Ensure(HttpServer, monitor_iteration_includes_handlers_run_by_reads)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = make_default_server (handler_sleep);
+   struct LoopMonitor monitor = {0};
+   server.monitor = &monitor;
+
+   expect (uv_loop_configure,
+         when (loop, is_equal_to (&dummy_loop)),
+         when (option, is_equal_to (UV_METRICS_IDLE_TIME)),
+         will_return (0));
+   assert_that (uvllhttpd_monitor_start (&monitor, &dummy_loop), is_equal_to (0));
+   expect (uv_metrics_idle_time, will_return (1000000));
+   started_prepare_cb (started_prepare);
+
+   // the poll waits 2 ms, then the read it returns runs the handler
+   fake_hrtime += 2000000;
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+   try_write_accepts = true;
+   const char* string = "GET /sleep HTTP/1.1\r\n\r\n";
+   assert_that (llhttp_execute (&(test_client.parser), string, strlen (string)), is_equal_to (HPE_OK));
+   try_write_accepts = false;
+
+   expect (uv_metrics_idle_time, will_return (3000000));
+   started_prepare_cb (started_prepare);
+
+   struct LoopStats stats;
+   uvllhttpd_monitor_stats (&monitor, &stats);
+   assert_that (stats.iteration.count, is_equal_to (1));
+   assert_that (stats.iteration.max, is_greater_than (4999));
+   assert_that (stats.iteration.max, is_less_than (5100));
+   assert_that (stats.handler.max, is_greater_than (4999));
+}
+
+Ensure(HttpServer, histogram_percentiles)
+{
+   struct LatencyHistogram histogram = {0};
+   for (uint64_t i = 0; i < 98; i++) uvllhttpd_histogram_add (&histogram, 100);
+   uvllhttpd_histogram_add (&histogram, 5000);
+   uvllhttpd_histogram_add (&histogram, 70000);
+
+   // 100 falls in [64, 128)
+   assert_that (uvllhttpd_histogram_percentile (&histogram, 50), is_equal_to (127));
+   assert_that (uvllhttpd_histogram_percentile (&histogram, 99), is_equal_to (8191));
+   assert_that (uvllhttpd_histogram_percentile (&histogram, 100), is_equal_to (70000));
+   assert_that (histogram.count, is_equal_to (100));
+}
+
+static void mock_cancel_cb (struct RequestContext *context)
+{
+   mock (context);
+   assert_that (atomic_load (&(context->cancelled)), is_true);
+}
+
+Ensure(HttpServer, request_context_cancelled_on_close)
+{
+   uvllhttpd_client_t *client = calloc (1, sizeof(uvllhttpd_client_t));
+
+   struct RequestContext *context = uvllhttpd_request_context (&(client->handle));
+   context->on_cancel = mock_cancel_cb;
+   struct RequestContext *done = uvllhttpd_request_context (&(client->handle));
+   uvllhttpd_context_unref (done);
+   assert_that (atomic_load (&(context->cancelled)), is_false);
+
+   expect (uv_close);
+   uvllhttpd_client_close (client);
+
+   expect (mock_cancel_cb, when (context, is_equal_to (context)));
+   last_close_cb ((uv_handle_t *)client);
+
+   // the response to a closed connection is dropped
+   struct HttpResponse *response = uvllhttpd_context_response_init (context);
+   assert_that (response, is_null);
+   uvllhttpd_response_append_body (response, "late", 4);
+   uvllhttpd_response_finish (response);
+
+   uvllhttpd_context_unref (context);
+}
+
+static struct RequestContext *held_context;
+static void handler_answer_later (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   held_context = uvllhttpd_request_context (handle);
+}
+
+static void handler_answer_first_later (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   if (strcmp (request->uri.base, "/later") == 0)
+   {
+      held_context = uvllhttpd_request_context (handle);
+      return;
+   }
+
+   struct HttpResponse *response = uvllhttpd_response_init (handle);
+   response->status = 200;
+   uvllhttpd_response_finish (response);
+}
+
+Ensure(HttpServer, context_response_follows_its_own_request)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = handler_answer_first_later,
+      .request_buffer_max_size = 10240,
+   };
+   server._settings = uvllhttpd_get_llhttp_settings ();
+   uvllhttpd_client_t *client = calloc (1, sizeof(uvllhttpd_client_t));
+   assert_that (uvllhttpd_client_start (&server, client), is_true);
+
+   // the second request, answered first, ends the connection
+   try_write_accepts = true;
+   write_buffer.len = 0;
+   always_expect (uv_read_stop, will_return (0));
+   expect (uv_close, when (handle, is_equal_to (client)));
+   char request[] =
+      "GET /later HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+      "GET /now HTTP/1.1\r\nConnection: close\r\n\r\n";
+   uvllhttpd_client_received (client, request, sizeof(request)-1);
+   assert_that (write_buffer.base, contains_string ("Connection: close\r\n"));
+
+   struct HttpResponse *response = uvllhttpd_context_response_init (held_context);
+   assert_that (response->keep_alive, is_equal_to (1));
+   assert_that (response->version.major, is_equal_to (1));
+   assert_that (response->version.minor, is_equal_to (0));
+   response->status = 200;
+   write_buffer.len = 0;
+   uvllhttpd_response_finish (response);
+   try_write_accepts = false;
+   assert_that (write_buffer.base, contains_string ("HTTP/1.0 200 OK\r\n"));
+   assert_that (write_buffer.base, contains_string ("Connection: keep-alive\r\n"));
+
+   uvllhttpd_context_unref (held_context);
+   held_context = NULL;
+   last_close_cb ((uv_handle_t *)client);
+}
+
+static void mock_shutdown_cb (struct HttpServer *server)
+{
+   mock (server);
+}
+
+Ensure(HttpServer, shutdown_closes_idle_connections_and_drains_busy_ones)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = handler_answer_later,
+      .request_buffer_max_size = 10240,
+   };
+   server._settings = uvllhttpd_get_llhttp_settings ();
+   uvllhttpd_client_t *idle = calloc (1, sizeof(uvllhttpd_client_t));
+   uvllhttpd_client_t *busy = calloc (1, sizeof(uvllhttpd_client_t));
+   assert_that (uvllhttpd_client_start (&server, idle), is_true);
+   assert_that (uvllhttpd_client_start (&server, busy), is_true);
+
+   always_expect (uv_read_stop, will_return (0));
+   char request[] = "GET / HTTP/1.1\r\n\r\n";
+   uvllhttpd_client_received (busy, request, sizeof(request)-1);
+   assert_that (held_context, is_not_null);
+   struct HttpResponse *response = uvllhttpd_context_response_init (held_context);
+   assert_that (response->keep_alive, is_equal_to (1));
+
+   expect (uv_close, when (handle, is_equal_to (&(server.handle))));
+   expect (uv_close, when (handle, is_equal_to (idle)));
+   assert_that (uvllhttpd_server_shutdown (&server, 0, mock_shutdown_cb), is_equal_to (0));
+   assert_that (uvllhttpd_server_shutdown (&server, 0, mock_shutdown_cb), is_equal_to (UV_EALREADY));
+   last_close_cb ((uv_handle_t *)idle);
+
+   // started before the shutdown began, the response still ends the connection
+   try_write_accepts = true;
+   write_buffer.len = 0;
+   expect (uv_close, when (handle, is_equal_to (busy)));
+   response->status = 200;
+   uvllhttpd_response_finish (response);
+   try_write_accepts = false;
+   assert_that (write_buffer.base, contains_string ("Connection: close\r\n"));
+   uvllhttpd_context_unref (held_context);
+   held_context = NULL;
+
+   expect (uv_close, when (handle, is_equal_to (&(server._drain_check))));
+   expect (uv_close, when (handle, is_equal_to (&(server._drain_timer))));
+   last_close_cb ((uv_handle_t *)busy);
+   assert_that (server._clients, is_null);
+
+   expect (mock_shutdown_cb, when (server, is_equal_to (&server)));
+   last_close_cb ((uv_handle_t *)&(server.handle));
+   last_close_cb ((uv_handle_t *)&(server._drain_check));
+   last_close_cb ((uv_handle_t *)&(server._drain_timer));
+}
+
+static struct ProxyUpstream test_upstream;
+
+static void handler_proxy_headers (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   assert_that (uvllhttpd_proxy_request (handle, request, &test_upstream), is_equal_to (0));
+}
+
+Ensure(HttpServer, proxy_forwards_without_hop_by_hop_headers)
+{
+   llhttp_settings_t settings = uvllhttpd_get_llhttp_settings ();
+   struct HttpServer server = {
+      .on_request = dummy_request_handler,
+      .on_headers = handler_proxy_headers,
+      .request_buffer_max_size = 1024,
+   };
+
+   char ring[4096];
+   struct AccessLog log = {
+      .buffer_size = sizeof(ring),
+      ._loop = &dummy_loop,
+      ._ring = ring,
+      ._date_second = -1,
+   };
+   server.access_log = &log;
+   always_expect (uv_now, will_return (1000));
+
+   test_upstream = (struct ProxyUpstream) { .idle_timeout = 0 };
+   assert_that (uvllhttpd_upstream_init_tcp (&test_upstream, &dummy_loop, "127.0.0.1", 8080), is_equal_to (0));
+
+   test_client = (uvllhttpd_client_t) {0};
+   test_client.server = &server;
+   strcpy (test_client.peer, "127.0.0.1");
+   llhttp_init (&(test_client.parser), HTTP_REQUEST, &settings);
+   test_client.parser.data = &test_client;
+   write_buffer.len = 0;
+
+   // the pipelined request is not parsed before the first exchange is over
+   const char* string = "GET /a HTTP/1.1\r\nHost: x\r\nConnection: keep-alive, X-Hop\r\nX-Hop: 1\r\nX-A: 1\r\n\r\n"
+      "GET /b HTTP/1.1\r\nHost: x\r\n\r\n";
+
+   expect (uv_tcp_init);
+   expect (uv_write);
+   expect (uv_read_stop, when (stream, is_equal_to (&(test_client.handle))));
+   uvllhttpd_client_received (&test_client, string, strlen (string));
+   assert_that (test_client.blocked, is_true);
+   assert_that (write_buffer.base, is_equal_to_string ("GET /a HTTP/1.1\r\nHost: x\r\nX-A: 1\r\n\r\n"));
+
+   expect (uv_read_start);
+   last_connect_cb (last_connect_req, 0);
+   uv_stream_t *upstream_stream = last_read_stream;
+   uv_alloc_cb upstream_alloc_cb = last_alloc_cb;
+   uv_read_cb upstream_read_cb = last_read_cb;
+
+   const char* upstream_response = "HTTP/1.1 200 OK\r\nX-Secret: 1\r\nContent-Length: 5\r\nKeep-Alive: timeout=5\r\n"
+      "Connection: X-Secret\r\n\r\nHello";
+   uv_buf_t buf;
+   upstream_alloc_cb ((uv_handle_t *)upstream_stream, 0, &buf);
+   memcpy (buf.base, upstream_response, strlen (upstream_response));
+   write_buffer.len = 0;
+
+   // a response coalesced before the exchange goes out first
+   test_client.out.base = strdup ("HTTP/1.1 204 No Content\r\n\r\n");
+   test_client.out.len = strlen (test_client.out.base);
+
+   // the body is written from the read buffer, the connection goes back to the pool
+   // and the held request takes it
+   expect (uv_write, when (handle, is_equal_to (&(test_client.handle))));
+   expect (uv_write, when (handle, is_equal_to (&(test_client.handle))), when (nbufs, is_equal_to (1)));
+   expect (uv_write, when (handle, is_equal_to (&(test_client.handle))), when (nbufs, is_equal_to (1)));
+   expect (uv_write, when (handle, is_equal_to (upstream_stream)));
+   expect (uv_read_stop, when (stream, is_equal_to (&(test_client.handle))));
+   upstream_read_cb (upstream_stream, strlen (upstream_response), &buf);
+
+   assert_that (write_buffer.base, is_equal_to_string ("HTTP/1.1 204 No Content\r\n\r\n"
+            "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nHello"
+            "GET /b HTTP/1.1\r\nHost: x\r\n\r\n"));
+   assert_that (test_upstream._idle_count, is_equal_to (0));
+   assert_that (test_client.proxy, is_not_null);
+   assert_that (test_client.blocked, is_true);
+
+   // logged once the exchange is over, with what the upstream answered
+   char const expected[] = "127.0.0.1 - - [01/Jan/1970:00:00:01 +0000] \"GET /a HTTP/1.1\" 200 5 0\n";
+   assert_that (atomic_load (&(log._head)), is_equal_to (sizeof(expected)-1));
+   assert_that (ring, is_equal_to_contents_of (expected, sizeof(expected)-1));
+}
+
+Ensure(HttpServer, sse_events_queued_and_slow_subscriber_dropped)
+{
+   struct HttpServer server = make_default_server (dummy_request_handler);
+   struct SseChannel channel = { .max_queued_bytes = 200 };
+   assert_that (uvllhttpd_sse_channel_init (&channel, &dummy_loop), is_equal_to (0));
+
+   uvllhttpd_client_t *client = calloc (1, sizeof(uvllhttpd_client_t));
+   client->server = &server;
+   write_buffer.len = 0;
+   always_expect (uv_now, will_return (0));
+
+   expect (uv_write, when (handle, is_equal_to (&(client->handle))));
+   assert_that (uvllhttpd_sse_subscribe (&(client->handle), &channel), is_equal_to (0));
+   assert_that (write_buffer.base, begins_with_string ("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"));
+   assert_that (channel.subscriber_count, is_equal_to (1));
+
+   // a line break in the event or id would inject a field
+   assert_that (uvllhttpd_sse_publish (&channel, "tick\ndata: x", "7", "a", 1), is_equal_to (0));
+   assert_that (uvllhttpd_sse_publish (&channel, "tick", "7\r", "a", 1), is_equal_to (0));
+
+   // queued behind the head, written once it is; CR, LF and CRLF all end a line
+   assert_that (uvllhttpd_sse_publish (&channel, "tick", "7", "a\r\nb\rc\n", 7), is_equal_to (1));
+   write_buffer.len = 0;
+   expect (uv_write);
+   last_write_cb (last_write_req, 0);
+   assert_that (write_buffer.base, is_equal_to_string ("event: tick\nid: 7\ndata: a\ndata: b\ndata: c\ndata: \n\n"));
+
+   uv_write_t *event_write_req = last_write_req;
+   uv_write_cb event_write_cb = last_write_cb;
+
+   char data[200];
+   memset (data, 'x', sizeof(data));
+   expect (uv_close, when (handle, is_equal_to (client)));
+   assert_that (uvllhttpd_sse_publish (&channel, NULL, NULL, data, sizeof(data)), is_equal_to (0));
+   assert_that (channel.dropped, is_equal_to (1));
+
+   event_write_cb (event_write_req, 0);
+   last_close_cb ((uv_handle_t *)client);
+   assert_that (channel.subscriber_count, is_equal_to (0));
+}
+
+// what uvllhttpd-bundle generates for a single file, which always hashes to slot 0
+static char const bundle_head_identity[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 12\r\n";
+static char const bundle_head_gzip[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Encoding: gzip\r\nContent-Length: 4\r\n";
+static char const bundle_not_modified[] = "HTTP/1.1 304 Not Modified\r\nETag: \"1\"\r\n";
+static struct BundleAsset const bundle_assets[] = {
+   {
+      .path = { "/a.txt", 6 },
+      .etag = { "\"1\"", 3 },
+      .variants = {
+         [BundleEncoding_identity] = { { bundle_head_identity, sizeof(bundle_head_identity)-1 }, { "Hello World.", 12 } },
+         [BundleEncoding_gzip] = { { bundle_head_gzip, sizeof(bundle_head_gzip)-1 }, { "GZIP", 4 } },
+      },
+      .not_modified = { bundle_not_modified, sizeof(bundle_not_modified)-1 },
+   },
+};
+static uint32_t const bundle_displacements[] = { 0 };
+static struct AssetBundle const test_bundle = {
+   .asset_count = 1,
+   .assets = bundle_assets,
+   .bucket_count = 1,
+   .displacements = bundle_displacements,
+};
+
+Ensure(HttpServer, bundle_serves_accepted_variant)
+{
+   struct HttpServer server = make_default_server (dummy_request_handler);
+   uvllhttpd_client_t client = make_client_after_request (1, 1, 1);
+   client.server = &server;
+   try_write_accepts = true;
+
+   struct HttpHeader headers[] = {
+      { .field = string_buf ("Accept-Encoding"), .value = string_buf ("br;q=1, gzip") },
+   };
+   struct HttpRequest request = {
+      .uri = string_buf ("/a.txt?v=2"),
+      .method = HTTP_GET,
+      .headers = headers,
+      .header_count = 1,
+   };
+
+   write_buffer.len = 0;
+   assert_that (uvllhttpd_bundle_serve (&(client.handle), &request, &test_bundle), is_true);
+   assert_that (write_buffer.base, is_equal_to_string (
+            "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Encoding: gzip\r\nContent-Length: 4\r\n\r\nGZIP"));
+
+   headers[0] = (struct HttpHeader) { .field = string_buf ("If-None-Match"), .value = string_buf ("\"1\"") };
+   write_buffer.len = 0;
+   assert_that (uvllhttpd_bundle_serve (&(client.handle), &request, &test_bundle), is_true);
+   assert_that (write_buffer.base, is_equal_to_string ("HTTP/1.1 304 Not Modified\r\nETag: \"1\"\r\n\r\n"));
+
+   struct HttpRequest missing = {
+      .uri = string_buf ("/b.txt"),
+      .method = HTTP_GET,
+   };
+   assert_that (uvllhttpd_bundle_serve (&(client.handle), &missing, &test_bundle), is_false);
+}
+
+#ifndef UVLLHTTPD_TLS
+Ensure(HttpServer, server_init_with_tls_not_built)
+{
+   struct TlsContext tls = {0};
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = dummy_request_handler,
+      .host = "127.0.0.1", .port = 12345,
+      .request_buffer_max_size = 10240,
+      .tls = &tls,
+   };
+
+   never_expect (uv_tcp_init);
+   assert_that (uvllhttpd_server_listen (&server), is_equal_to (UV_ENOSYS));
+}
+#else
+static void write_self_signed (char const *certificate_file, char const *key_file)
+{
+   EVP_PKEY *key = EVP_EC_gen ("P-256");
+   X509 *x509 = X509_new ();
+   ASN1_INTEGER_set (X509_get_serialNumber (x509), 1);
+   X509_gmtime_adj (X509_getm_notBefore (x509), 0);
+   X509_gmtime_adj (X509_getm_notAfter (x509), 3600);
+   X509_set_pubkey (x509, key);
+   X509_NAME_add_entry_by_txt (X509_get_subject_name (x509), "CN", MBSTRING_ASC,
+         (unsigned char const *)"localhost", -1, -1, 0);
+   X509_set_issuer_name (x509, X509_get_subject_name (x509));
+   X509_sign (x509, key, EVP_sha256 ());
+
+   FILE *f = fopen (certificate_file, "w");
+   PEM_write_X509 (f, x509);
+   fclose (f);
+   f = fopen (key_file, "w");
+   PEM_write_PrivateKey (f, key, NULL, NULL, 0, NULL, NULL);
+   fclose (f);
+
+   X509_free (x509);
+   EVP_PKEY_free (key);
+}
+
+// hands what the peer wrote to the server, then what the server wrote to the peer
+static void tls_exchange (BIO *from_server, BIO *to_server)
+{
+   char bytes[4096];
+   int n;
+   while ((n = BIO_read (to_server, bytes, sizeof(bytes))) > 0)
+   {
+      uvllhttpd_client_read (&test_client, bytes, n);
+   }
+   BIO_write (from_server, write_buffer.base, (int)write_buffer.len);
+   write_buffer.len = 0;
+}
+
+static void mock_handler_tls_request (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   mock (handle, request);
+   assert_that (request->uri.base, is_equal_to_string ("/secret"));
+
+   struct HttpResponse *response = uvllhttpd_response_init (handle);
+   response->status = 200;
+   uvllhttpd_response_append_body (response, "hidden", 6);
+   uvllhttpd_response_finish (response);
+}
+
+Ensure(HttpServer, tls_decrypts_requests_and_encrypts_responses)
+{
+   write_self_signed ("uvllhttpd-test-cert.pem", "uvllhttpd-test-key.pem");
+   struct TlsContext tls = {
+      .certificate_file = "uvllhttpd-test-cert.pem",
+      .key_file = "uvllhttpd-test-key.pem",
+      .disable_ktls = 1,
+   };
+   assert_that (uvllhttpd_tls_init (&tls), is_equal_to (0));
+
+   struct HttpServer server = make_default_server (mock_handler_tls_request);
+   server._settings = uvllhttpd_get_llhttp_settings ();
+   server.tls = &tls;
+   test_client = (uvllhttpd_client_t) {0};
+   assert_that (uvllhttpd_client_start (&server, &test_client), is_true);
+   always_expect (uv_write, will_return (0));
+   write_buffer.len = 0;
+
+   SSL_CTX *peer_ctx = SSL_CTX_new (TLS_client_method ());
+   SSL *peer = SSL_new (peer_ctx);
+   BIO *from_server = BIO_new (BIO_s_mem ());
+   BIO *to_server = BIO_new (BIO_s_mem ());
+   SSL_set_bio (peer, from_server, to_server);
+   SSL_set_connect_state (peer);
+
+   for (int i = 0; i < 4 && SSL_do_handshake (peer) != 1; i++) tls_exchange (from_server, to_server);
+   assert_that (SSL_is_init_finished (peer), is_true);
+
+   expect (mock_handler_tls_request, when (handle, is_equal_to (&test_client)));
+   char const request[] = "GET /secret HTTP/1.1\r\n\r\n";
+   SSL_write (peer, request, sizeof(request)-1);
+   tls_exchange (from_server, to_server);
+
+   char response[256];
+   int const n = SSL_read (peer, response, sizeof(response)-1);
+   assert_that (n, is_greater_than (0));
+   response[n > 0 ? n : 0] = '\0';
+   assert_that (response, is_equal_to_string ("HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\nhidden"));
+   assert_that (tls.handshakes, is_equal_to (1));
+
+   uvllhttpd_tls_connection_free (test_client.tls);
+   SSL_free (peer);
+   SSL_CTX_free (peer_ctx);
+   uvllhttpd_tls_free (&tls);
+}
+
+static void mock_tls_websocket_message (struct WebSocket *ws, enum WebSocketOpcode opcode, uv_buf_t message)
+{
+   mock (ws, opcode);
+   assert_that (message.base, is_equal_to_string ("Hello"));
+}
+
+static void handler_tls_websocket (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   assert_that (uvllhttpd_websocket_accept (handle, request, mock_tls_websocket_message, NULL, 0), is_not_null);
+}
+
+Ensure(HttpServer, tls_websocket_frames_are_decrypted)
+{
+   write_self_signed ("uvllhttpd-test-cert.pem", "uvllhttpd-test-key.pem");
+   struct TlsContext tls = {
+      .certificate_file = "uvllhttpd-test-cert.pem",
+      .key_file = "uvllhttpd-test-key.pem",
+      .disable_ktls = 1,
+   };
+   assert_that (uvllhttpd_tls_init (&tls), is_equal_to (0));
+
+   struct HttpServer server = make_default_server (handler_tls_websocket);
+   server._settings = uvllhttpd_get_llhttp_settings ();
+   server.tls = &tls;
+   test_client = (uvllhttpd_client_t) {0};
+   assert_that (uvllhttpd_client_start (&server, &test_client), is_true);
+   always_expect (uv_write, will_return (0));
+   write_buffer.len = 0;
+
+   SSL_CTX *peer_ctx = SSL_CTX_new (TLS_client_method ());
+   SSL *peer = SSL_new (peer_ctx);
+   BIO *from_server = BIO_new (BIO_s_mem ());
+   BIO *to_server = BIO_new (BIO_s_mem ());
+   SSL_set_bio (peer, from_server, to_server);
+   SSL_set_connect_state (peer);
+
+   for (int i = 0; i < 4 && SSL_do_handshake (peer) != 1; i++) tls_exchange (from_server, to_server);
+   assert_that (SSL_is_init_finished (peer), is_true);
+
+   char const upgrade[] = "GET /chat HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+      "Sec-WebSocket-Version: 13\r\n"
+      "\r\n";
+   SSL_write (peer, upgrade, sizeof(upgrade)-1);
+   tls_exchange (from_server, to_server);
+   assert_that (test_client.websocket, is_not_null);
+
+   char response[256];
+   int const n = SSL_read (peer, response, sizeof(response)-1);
+   assert_that (n, is_greater_than (0));
+   response[n > 0 ? n : 0] = '\0';
+   assert_that (response, begins_with_string ("HTTP/1.1 101 Switching Protocols\r\n"));
+
+   // the frame reaches the parser decrypted, as the masked text "Hello"
+   unsigned char const frame[] = { 0x81, 0x85, 0x37, 0xfa, 0x21, 0x3d, 0x7f, 0x9f, 0x4d, 0x51, 0x58 };
+   expect (mock_tls_websocket_message, when (opcode, is_equal_to (WebSocketOpcode_text)));
+   SSL_write (peer, frame, sizeof(frame));
+   tls_exchange (from_server, to_server);
+
+   uvllhttpd_websocket_free (test_client.websocket);
+   uvllhttpd_tls_connection_free (test_client.tls);
+   SSL_free (peer);
+   SSL_CTX_free (peer_ctx);
+   uvllhttpd_tls_free (&tls);
+}
+#endif
+
+#ifndef UVLLHTTPD_HTTP2
+Ensure(HttpServer, server_init_with_http2_not_built)
+{
+   struct HttpServer server = {
+      .loop = &dummy_loop,
+      .on_request = dummy_request_handler,
+      .host = "127.0.0.1", .port = 12345,
+      .request_buffer_max_size = 10240,
+      .http2 = 1,
+   };
+
+   never_expect (uv_tcp_init);
+   assert_that (uvllhttpd_server_listen (&server), is_equal_to (UV_ENOSYS));
+}
+#else
+static void mock_handler_http2_request (uv_tcp_t *handle, struct HttpRequest const *request)
+{
+   mock (handle, request);
+   assert_that (request->version.major, is_equal_to (2));
+   assert_that (request->uri.base, is_equal_to_string ("/stream"));
+   assert_that (request->body.base, is_equal_to_string ("ping"));
+   struct HttpHeader const *host = uvllhttpd_request_find_header (request, "Host", 4);
+   assert_that (host, is_not_null);
+   assert_that (host->value.base, is_equal_to_string ("example.com"));
+
+   struct HttpResponse *response = uvllhttpd_response_init (handle);
+   response->status = 201;
+   uvllhttpd_response_add_header (response, "Content-Type: text/plain", 24);
+   uvllhttpd_response_append_body (response, "pong", 4);
+   uvllhttpd_response_finish (response);
+}
+
+struct http2_peer {
+   char status[4];
+   char body[16];
+   size_t body_length;
+   uint8_t closed;
+};
+
+static int http2_peer_header_cb (nghttp2_session *session, nghttp2_frame const *frame, uint8_t const *name,
+      size_t namelen, uint8_t const *value, size_t valuelen, uint8_t flags, void *user_data)
+{
+   struct http2_peer *peer = user_data;
+   if (namelen == 7 && memcmp (name, ":status", 7) == 0 && valuelen == 3) memcpy (peer->status, value, 3);
+   return 0;
+}
+
+static int http2_peer_data_cb (nghttp2_session *session, uint8_t flags, int32_t stream_id,
+      uint8_t const *data, size_t len, void *user_data)
+{
+   struct http2_peer *peer = user_data;
+   if (peer->body_length + len < sizeof(peer->body)) memcpy (peer->body + peer->body_length, data, len);
+   peer->body_length += len;
+   return 0;
+}
+
+static int http2_peer_close_cb (nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+   ((struct http2_peer *)user_data)->closed = 1;
+   return 0;
+}
+
+static ssize_t http2_peer_body_cb (nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+      uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+   memcpy (buf, "ping", 4);
+   *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+   return 4;
+}
+
+#define HTTP2_NV(name, value) { (uint8_t *)name, (uint8_t *)value, sizeof(name)-1, sizeof(value)-1, NGHTTP2_NV_FLAG_NONE }
+
+Ensure(HttpServer, http2_prior_knowledge_stream_reaches_on_request)
+{
+   struct HttpServer server = make_default_server (mock_handler_http2_request);
+   server.http2 = 1;
+   server._settings = uvllhttpd_get_llhttp_settings ();
+   test_client = (uvllhttpd_client_t) {0};
+   assert_that (uvllhttpd_client_start (&server, &test_client), is_true);
+
+   struct http2_peer peer = {0};
+   nghttp2_session_callbacks *callbacks;
+   nghttp2_session_callbacks_new (&callbacks);
+   nghttp2_session_callbacks_set_on_header_callback (callbacks, http2_peer_header_cb);
+   nghttp2_session_callbacks_set_on_data_chunk_recv_callback (callbacks, http2_peer_data_cb);
+   nghttp2_session_callbacks_set_on_stream_close_callback (callbacks, http2_peer_close_cb);
+   nghttp2_session *session;
+   nghttp2_session_client_new (&session, callbacks, &peer);
+   nghttp2_session_callbacks_del (callbacks);
+
+   nghttp2_nv const nva[] = {
+      HTTP2_NV (":method", "POST"),
+      HTTP2_NV (":path", "/stream"),
+      HTTP2_NV (":scheme", "http"),
+      HTTP2_NV (":authority", "example.com"),
+   };
+   nghttp2_data_provider body = { .read_callback = http2_peer_body_cb };
+   nghttp2_submit_settings (session, NGHTTP2_FLAG_NONE, NULL, 0);
+   assert_that (nghttp2_submit_request (session, NULL, nva, 4, &body, NULL), is_equal_to (1));
+
+   // the preface, SETTINGS, HEADERS and DATA, read at once
+   try_write_accepts = true;
+   write_buffer.len = 0;
+   char sent[512];
+   size_t sent_length = 0;
+   uint8_t const *data;
+   for (ssize_t n; (n = nghttp2_session_mem_send (session, &data)) > 0; sent_length += n)
+   {
+      memcpy (sent + sent_length, data, n);
+   }
+   expect (mock_handler_http2_request);
+   uvllhttpd_client_received (&test_client, sent, sent_length);
+   assert_that (test_client.http2, is_not_null);
+
+   assert_that (nghttp2_session_mem_recv (session, (uint8_t *)write_buffer.base, write_buffer.len),
+         is_equal_to (write_buffer.len));
+   try_write_accepts = false;
+   assert_that (peer.status, is_equal_to_string ("201"));
+   assert_that (peer.body, is_equal_to_string ("pong"));
+   assert_that (peer.closed, is_true);
+
+   nghttp2_session_del (session);
+   uvllhttpd_http2_free (test_client.http2);
+}
+#endif
+
+
+Describe(WebSocket);
+BeforeEach(WebSocket)
+{
+   make_websocket_upgrade_headers ();
+}
+AfterEach(WebSocket) {}
+
+static void mock_websocket_on_message (struct WebSocket *ws, enum WebSocketOpcode opcode, uv_buf_t message)
+{
+   mock (ws, opcode, message.base, message.len);
+
+   assert_that (opcode, is_equal_to (WebSocketOpcode_text));
+   assert_that (message.base, is_equal_to_string ("Hello"));
+   assert_that (message.len, is_equal_to (5));
+}
+
+static struct WebSocket *accept_test_websocket (uvllhttpd_client_t *client)
+{
+   struct HttpRequest request = {
+      .headers = websocket_upgrade_headers,
+      .header_count = sizeof(websocket_upgrade_headers) / sizeof(websocket_upgrade_headers[0]),
+      .method = HTTP_GET,
+      .upgrade = 1,
+   };
+
+   expect (uv_write);
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+
+   return uvllhttpd_websocket_accept (&(client->handle), &request, mock_websocket_on_message, NULL, 0);
+}
 
+Ensure(WebSocket, compute_accept_key)
+{
+   char accept[29];
+   uvllhttpd_websocket_compute_accept_key ("dGhlIHNhbXBsZSBub25jZQ==", 24, accept);
+   assert_that (accept, is_equal_to_string ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo="));
+}
+
+Ensure(WebSocket, accept_writes_handshake)
+{
+   uvllhttpd_client_t client = {0};
+   struct WebSocket *ws = accept_test_websocket (&client);
+
+   assert_that (ws, is_not_null);
+   assert_that (client.websocket, is_equal_to (ws));
    assert_that (write_buffer.base, is_equal_to_string (
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/plain\r\n"
-            "Content-Length: 12\r\n"
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
             "\r\n"
-            "Hello World."
             ));
+
+   uvllhttpd_websocket_free (ws);
+}
+
+Ensure(WebSocket, accept_rejects_plain_request)
+{
+   uvllhttpd_client_t client = {0};
+   struct HttpRequest request = {
+      .headers = websocket_upgrade_headers,
+      .header_count = 1,
+      .method = HTTP_GET,
+   };
+
+   never_expect (uv_write);
+
+   struct WebSocket *ws = uvllhttpd_websocket_accept (&(client.handle), &request, mock_websocket_on_message, NULL, 0);
+   assert_that (ws, is_null);
+   assert_that (client.websocket, is_null);
+}
+
+Ensure(WebSocket, masked_text_frame_split_into_bytes)
+{
+   uvllhttpd_client_t client = {0};
+   struct WebSocket *ws = accept_test_websocket (&client);
+
+   // single-frame masked text message "Hello" from RFC 6455 section 5.7
+   unsigned char const frame[] = { 0x81, 0x85, 0x37, 0xfa, 0x21, 0x3d, 0x7f, 0x9f, 0x4d, 0x51, 0x58 };
+
+   expect (mock_websocket_on_message);
+
+   for (size_t i = 0; i < sizeof(frame); i++)
+   {
+      uvllhttpd_websocket_feed (ws, (char const *)frame + i, 1);
+   }
+
+   uvllhttpd_websocket_free (ws);
+}
+
+Ensure(WebSocket, fragmented_message_with_interleaved_ping)
+{
+   uvllhttpd_client_t client = {0};
+   struct WebSocket *ws = accept_test_websocket (&client);
+
+   unsigned char const frames[] = {
+      0x01, 0x83, 0x37, 0xfa, 0x21, 0x3d, 0x7f, 0x9f, 0x4d,   // "Hel"
+      0x89, 0x80, 0x01, 0x02, 0x03, 0x04,                     // empty ping
+      0x80, 0x82, 0x37, 0xfa, 0x21, 0x3d, 0x5b, 0x95,         // "lo"
+   };
+
+   expect (uv_write);   // pong
+   expect (mock_websocket_on_message);
+
+   uvllhttpd_websocket_feed (ws, (char const *)frames, sizeof(frames));
+
+   uvllhttpd_websocket_free (ws);
+}
+
+Ensure(WebSocket, unmasked_frame_is_protocol_error)
+{
+   uvllhttpd_client_t client = {0};
+   struct WebSocket *ws = accept_test_websocket (&client);
+
+   unsigned char const frame[] = { 0x81, 0x05, 'H', 'e', 'l', 'l', 'o' };
+
+   never_expect (mock_websocket_on_message);
+   expect (uv_write);   // close frame
+
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+   uvllhttpd_websocket_feed (ws, (char const *)frame, sizeof(frame));
+
+   assert_that (write_buffer.len, is_equal_to (4));
+   assert_that (write_buffer.base, is_equal_to_contents_of ("\x88\x02\x03\xea", 4));
+
+   uvllhttpd_websocket_free (ws);
+}
+
+Ensure(WebSocket, claimed_length_beyond_default_cap_closes_without_allocating)
+{
+   uvllhttpd_client_t client = {0};
+   struct WebSocket *ws = accept_test_websocket (&client);
+   assert_that (ws->max_message_size, is_equal_to (1024 * 1024));
+
+   // a binary frame claiming 1 TiB, of which only the header arrives
+   unsigned char const frame[] = { 0x82, 0xff, 0, 0, 0x01, 0, 0, 0, 0, 0, 0x37, 0xfa, 0x21, 0x3d };
+
+   never_expect (mock_websocket_on_message);
+   expect (uv_write);   // close frame
+
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+   uvllhttpd_websocket_feed (ws, (char const *)frame, sizeof(frame));
+
+   assert_that (write_buffer.base, is_equal_to_contents_of ("\x88\x02\x03\xf1", 4));
+   assert_that (ws->_parser.message.base, is_null);
+
+   uvllhttpd_websocket_free (ws);
+}
+
+Ensure(WebSocket, message_buffer_grows_with_the_payload_received)
+{
+   uvllhttpd_client_t client = {0};
+   struct WebSocket *ws = accept_test_websocket (&client);
+
+   // claims 65535 bytes, sends 5 of them
+   unsigned char const frame[] = { 0x82, 0xfe, 0xff, 0xff, 0x37, 0xfa, 0x21, 0x3d, 0x7f, 0x9f, 0x4d, 0x51, 0x58 };
+
+   never_expect (mock_websocket_on_message);
+   uvllhttpd_websocket_feed (ws, (char const *)frame, sizeof(frame));
+
+   assert_that (ws->_parser.message_length, is_equal_to (5));
+   assert_that (ws->_parser.message.len, is_less_than (65536));
+
+   uvllhttpd_websocket_free (ws);
+}
+
+Ensure(WebSocket, text_ending_inside_a_character_across_fragments_is_invalid)
+{
+   uvllhttpd_client_t client = {0};
+   struct WebSocket *ws = accept_test_websocket (&client);
+
+   // the first two bytes of U+20AC, split over two frames, and nothing after them
+   unsigned char const frames[] = {
+      0x01, 0x81, 0, 0, 0, 0, 0xe2,
+      0x80, 0x81, 0, 0, 0, 0, 0x82,
+   };
+
+   never_expect (mock_websocket_on_message);
+   expect (uv_write);   // close frame
+
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+   uvllhttpd_websocket_feed (ws, (char const *)frames, sizeof(frames));
+
+   assert_that (write_buffer.base, is_equal_to_contents_of ("\x88\x02\x03\xef", 4));
+
+   uvllhttpd_websocket_free (ws);
+}
+
+Ensure(WebSocket, close_payloads_are_checked)
+{
+   // a 1-byte payload is a protocol error
+   uvllhttpd_client_t client = {0};
+   struct WebSocket *ws = accept_test_websocket (&client);
+   unsigned char const short_close[] = { 0x88, 0x81, 0, 0, 0, 0, 0x03 };
+
+   expect (uv_write);
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+   uvllhttpd_websocket_feed (ws, (char const *)short_close, sizeof(short_close));
+   assert_that (write_buffer.base, is_equal_to_contents_of ("\x88\x02\x03\xea", 4));
+   uvllhttpd_websocket_free (ws);
+
+   // a surrogate in the reason is not UTF-8
+   uvllhttpd_client_t other = {0};
+   ws = accept_test_websocket (&other);
+   unsigned char const bad_reason[] = { 0x88, 0x85, 0, 0, 0, 0, 0x03, 0xe8, 0xed, 0xa0, 0x80 };
+
+   expect (uv_write);
+   write_buffer.base = NULL;
+   write_buffer.len = 0;
+   uvllhttpd_websocket_feed (ws, (char const *)bad_reason, sizeof(bad_reason));
+   assert_that (write_buffer.base, is_equal_to_contents_of ("\x88\x02\x03\xef", 4));
+   uvllhttpd_websocket_free (ws);
+}
+
+
+Describe(HttpRequestUri);
+BeforeEach(HttpRequestUri) {}
+AfterEach(HttpRequestUri) {}
+
+Ensure(HttpRequestUri, split_path_query_fragment)
+{
+   char uri[] = "/search/a%20b?q=hello+world&page=2#top";
+   struct HttpRequest request = {
+      .uri = { .base = uri, .len = sizeof(uri)-1 },
+   };
+
+   struct HttpUriParts parts;
+   uvllhttpd_request_split_uri (&request, &parts);
+
+   assert_that (parts.path.base, is_equal_to (uri));
+   assert_that (parts.path.len, is_equal_to (13));
+   assert_that (parts.query.base, is_equal_to (uri + 14));
+   assert_that (parts.query.len, is_equal_to (20));
+   assert_that (parts.fragment.base, is_equal_to (uri + 35));
+   assert_that (parts.fragment.len, is_equal_to (3));
+}
+
+Ensure(HttpRequestUri, split_absolute_form)
+{
+   char uri[] = "http://localhost:8080/index.html";
+   struct HttpRequest request = {
+      .uri = { .base = uri, .len = sizeof(uri)-1 },
+   };
+
+   struct HttpUriParts parts;
+   uvllhttpd_request_split_uri (&request, &parts);
+
+   assert_that (parts.path.base, is_equal_to (uri + 21));
+   assert_that (parts.path.len, is_equal_to (11));
+   assert_that (parts.query.len, is_equal_to (0));
+}
+
+Ensure(HttpRequestUri, split_absolute_form_without_path)
+{
+   char uri[] = "http://host?x=1";
+   struct HttpRequest request = {
+      .uri = { .base = uri, .len = sizeof(uri)-1 },
+   };
+
+   struct HttpUriParts parts;
+   uvllhttpd_request_split_uri (&request, &parts);
+
+   assert_that (parts.path.len, is_equal_to (0));
+   assert_that (parts.query.base, is_equal_to (uri + 12));
+   assert_that (parts.query.len, is_equal_to (3));
+   assert_that (parts.fragment.len, is_equal_to (0));
+}
+
+Ensure(HttpRequestUri, iterate_query_parameters)
+{
+   char query[] = "a=1&&flag&b=";
+   struct HttpQueryIterator iterator;
+   uvllhttpd_query_iterator_init (&iterator, (uv_buf_t) { .base = query, .len = sizeof(query)-1 });
+
+   uv_buf_t key, value;
+   assert_that (uvllhttpd_query_iterator_next (&iterator, &key, &value), is_true);
+   assert_that (key.base, is_equal_to (query));
+   assert_that (key.len, is_equal_to (1));
+   assert_that (value.base, is_equal_to (query + 2));
+   assert_that (value.len, is_equal_to (1));
+
+   assert_that (uvllhttpd_query_iterator_next (&iterator, &key, &value), is_true);
+   assert_that (key.base, is_equal_to (query + 5));
+   assert_that (key.len, is_equal_to (4));
+   assert_that (value.len, is_equal_to (0));
+
+   assert_that (uvllhttpd_query_iterator_next (&iterator, &key, &value), is_true);
+   assert_that (key.len, is_equal_to (1));
+   assert_that (value.len, is_equal_to (0));
+
+   assert_that (uvllhttpd_query_iterator_next (&iterator, &key, &value), is_false);
+}
+
+Ensure(HttpRequestUri, find_query_parameter)
+{
+   char query[] = "q=hello&page=2";
+   uv_buf_t value;
+
+   assert_that (uvllhttpd_query_find ((uv_buf_t) { .base = query, .len = sizeof(query)-1 }, "page", 4, &value), is_true);
+   assert_that (value.base, is_equal_to (query + 13));
+   assert_that (value.len, is_equal_to (1));
+
+   assert_that (uvllhttpd_query_find ((uv_buf_t) { .base = query, .len = sizeof(query)-1 }, "pag", 3, &value), is_false);
+}
+
+Ensure(HttpRequestUri, url_decode)
+{
+   char out[64];
+   char const s[] = "hello+w%6Frld%2f%E3%81%82 and more text without escapes";
+   ssize_t n = uvllhttpd_url_decode (s, sizeof(s)-1, out, sizeof(out), true);
+
+   assert_that (n, is_equal_to (sizeof(s)-1 - 10));
+   assert_that (out, is_equal_to_contents_of ("hello world/\xE3\x81\x82 and more text without escapes", n));
+}
+
+Ensure(HttpRequestUri, url_decode_in_place)
+{
+   char s[] = "a%20b";
+   ssize_t n = uvllhttpd_url_decode (s, sizeof(s)-1, s, sizeof(s), false);
+
+   assert_that (n, is_equal_to (3));
+   assert_that (s, is_equal_to_contents_of ("a b", 3));
+}
+
+Ensure(HttpRequestUri, url_decode_errors)
+{
+   char out[4];
+   assert_that (uvllhttpd_url_decode ("a%2", 3, out, sizeof(out), false), is_equal_to (UV_EINVAL));
+   assert_that (uvllhttpd_url_decode ("a%zz", 4, out, sizeof(out), false), is_equal_to (UV_EINVAL));
+   assert_that (uvllhttpd_url_decode ("abcdef", 6, out, sizeof(out), false), is_equal_to (UV_ENOBUFS));
+}
+
+
+Describe(Form);
+BeforeEach(Form) {}
+AfterEach(Form) {}
+
+static char form_events[512];
+static size_t form_events_length;
+
+static void form_event (char const *s, size_t length)
+{
+   memcpy (form_events + form_events_length, s, length);
+   form_events_length += length;
+   form_events[form_events_length] = '\0';
 }
+
+static int multipart_on_part_begin (struct MultipartParser *parser)
+{
+   form_event ("<", 1);
+   return 0;
+}
+
+static int multipart_on_header (struct MultipartParser *parser, uv_buf_t field, uv_buf_t value)
+{
+   uv_buf_t name;
+   if (uvllhttpd_header_param (value, "name", 4, &name))
+   {
+      form_event (name.base, name.len);
+      form_event (":", 1);
+   }
+   return 0;
+}
+
+static int multipart_on_part_data (struct MultipartParser *parser, char const *at, size_t length)
+{
+   form_event (at, length);
+   return 0;
+}
+
+static int multipart_on_part_end (struct MultipartParser *parser)
+{
+   form_event (">", 1);
+   return 0;
+}
+
+static void parse_multipart_in_chunks (size_t chunk_size)
+{
+   char const body[] =
+      "preamble\r\n"
+      "--XyZ\r\n"
+      "Content-Disposition: form-data; name=\"a\"\r\n"
+      "\r\n"
+      "one\r\n--Xy\r\n"
+      "--XyZ \t\r\n"
+      "Content-Disposition: form-data; name=\"b\"; filename=\"b.txt\"\r\n"
+      "Content-Type: text/plain\r\n"
+      "\r\n"
+      "two\r\r\n"
+      "--XyZ--\r\n"
+      "epilogue";
+   char content_type[] = "multipart/form-data; boundary=XyZ";
+
+   struct MultipartParser parser = {
+      .on_part_begin = multipart_on_part_begin,
+      .on_header = multipart_on_header,
+      .on_part_data = multipart_on_part_data,
+      .on_part_end = multipart_on_part_end,
+   };
+   int r = uvllhttpd_multipart_init (&parser, (uv_buf_t) { .base = content_type, .len = sizeof(content_type)-1 });
+   assert_that (r, is_equal_to (0));
+
+   form_events_length = 0;
+   for (size_t i = 0; i < sizeof(body)-1; i += chunk_size)
+   {
+      size_t n = (i + chunk_size > sizeof(body)-1) ? sizeof(body)-1 - i : chunk_size;
+      r = uvllhttpd_multipart_execute (&parser, body + i, n);
+      assert_that (r, is_equal_to (0));
+   }
+
+   assert_that (uvllhttpd_multipart_finish (&parser), is_equal_to (0));
+   assert_that (form_events, is_equal_to_string ("<a:one\r\n--Xy><b:two\r>"));
+}
+
+Ensure(Form, multipart_whole_body)
+{
+   parse_multipart_in_chunks (1024);
+}
+
+Ensure(Form, multipart_chunked_at_every_position)
+{
+   for (size_t chunk_size = 1; chunk_size < 16; chunk_size++)
+   {
+      parse_multipart_in_chunks (chunk_size);
+   }
+}
+
+static int multipart_on_headers_to_fd (struct MultipartParser *parser)
+{
+   // the first part goes to a file
+   if (form_events_length == 3) parser->fd = 7;
+   return 0;
+}
+
+Ensure(Form, multipart_part_written_to_fd_before_the_body_goes_on)
+{
+   char const body[] =
+      "--XyZ\r\n"
+      "Content-Disposition: form-data; name=\"f\"; filename=\"f.bin\"\r\n"
+      "\r\n"
+      "file data\r\n"
+      "--XyZ\r\n"
+      "Content-Disposition: form-data; name=\"g\"\r\n"
+      "\r\n"
+      "two\r\n"
+      "--XyZ--\r\n";
+   char content_type[] = "multipart/form-data; boundary=XyZ";
+
+   uvllhttpd_client_t *client = calloc (1, sizeof(uvllhttpd_client_t));
+   client->handle.loop = &dummy_loop;
+   struct MultipartParser parser = {
+      .on_part_begin = multipart_on_part_begin,
+      .on_header = multipart_on_header,
+      .on_headers_complete = multipart_on_headers_to_fd,
+      .on_part_data = multipart_on_part_data,
+      .on_part_end = multipart_on_part_end,
+      .handle = &(client->handle),
+   };
+   assert_that (uvllhttpd_multipart_init (&parser, (uv_buf_t) { .base = content_type, .len = sizeof(content_type)-1 }),
+         is_equal_to (0));
+
+   form_events_length = 0;
+   write_buffer.len = 0;
+   expect (uv_fs_write, when (file, is_equal_to (7)), when (offset, is_equal_to (-1)), will_return (0));
+   expect (uv_read_stop, when (stream, is_equal_to (client)));
+   assert_that (uvllhttpd_multipart_execute (&parser, body, sizeof(body)-1), is_equal_to (0));
+   assert_that (uvllhttpd_multipart_finish (&parser), is_equal_to (0));
+   assert_that (write_buffer.base, is_equal_to_string ("file data"));
+   assert_that (form_events, is_equal_to_string ("<f:"));
+
+   // the rest of a short write is written next
+   expect (uv_fs_write, when (file, is_equal_to (7)), will_return (0));
+   last_fs_req->result = 5;
+   last_fs_cb (last_fs_req);
+   assert_that (write_buffer.base, is_equal_to_string ("file datadata"));
+   assert_that (form_events, is_equal_to_string ("<f:"));
+
+   expect (uv_read_start, when (stream, is_equal_to (client)));
+   last_fs_req->result = 4;
+   last_fs_cb (last_fs_req);
+   assert_that (form_events, is_equal_to_string ("<f:><g:two>"));
+   assert_that (parser._state, is_equal_to (MultipartState_epilogue));
+
+   uvllhttpd_multipart_free (&parser);
+   free (client);
+}
+
+Ensure(Form, multipart_rejects_missing_boundary)
+{
+   struct MultipartParser parser = {0};
+   char content_type[] = "multipart/form-data";
+   int r = uvllhttpd_multipart_init (&parser, (uv_buf_t) { .base = content_type, .len = sizeof(content_type)-1 });
+   assert_that (r, is_equal_to (UV_EINVAL));
+}
+
+Ensure(Form, multipart_unterminated_body)
+{
+   char const body[] = "--XyZ\r\n\r\ndata";
+   char content_type[] = "multipart/form-data; boundary=\"XyZ\"";
+
+   struct MultipartParser parser = {0};
+   uvllhttpd_multipart_init (&parser, (uv_buf_t) { .base = content_type, .len = sizeof(content_type)-1 });
+
+   assert_that (uvllhttpd_multipart_execute (&parser, body, sizeof(body)-1), is_equal_to (0));
+   assert_that (uvllhttpd_multipart_finish (&parser), is_equal_to (UV_EINVAL));
+}
+
+static int urlencoded_on_field (struct UrlencodedParser *parser, uv_buf_t key, uv_buf_t value)
+{
+   form_event (key.base, key.len);
+   form_event ("=", 1);
+   form_event (value.base, value.len);
+   form_event (";", 1);
+   return 0;
+}
+
+Ensure(Form, urlencoded_chunked)
+{
+   char const body[] = "a=1&msg=hello+w%6Frld&&flag";
+
+   for (size_t chunk_size = 1; chunk_size < sizeof(body); chunk_size++)
+   {
+      struct UrlencodedParser parser = {
+         .on_field = urlencoded_on_field,
+      };
+      form_events_length = 0;
+
+      for (size_t i = 0; i < sizeof(body)-1; i += chunk_size)
+      {
+         size_t n = (i + chunk_size > sizeof(body)-1) ? sizeof(body)-1 - i : chunk_size;
+         assert_that (uvllhttpd_urlencoded_body_handler (&parser, body + i, n), is_equal_to (0));
+      }
+      assert_that (uvllhttpd_urlencoded_body_handler (&parser, NULL, 0), is_equal_to (0));
+
+      assert_that (form_events, is_equal_to_string ("a=1;msg=hello world;flag=;"));
+   }
+}
+
+Ensure(Form, urlencoded_field_too_large)
+{
+   char const body[] = "key=0123456789";
+   struct UrlencodedParser parser = {
+      .on_field = urlencoded_on_field,
+      .max_field_size = 8,
+   };
+
+   assert_that (uvllhttpd_urlencoded_execute (&parser, body, sizeof(body)-1), is_equal_to (UV_E2BIG));
+   uvllhttpd_urlencoded_free (&parser);
+}
+
@@ -0,0 +1,606 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+#include "uvllhttpd.form.h"
+
+// a copy of part data, written to fd on the loop's thread pool
+struct multipart_write {
+   uv_fs_t req;
+   // NULL once the parser has been freed
+   struct MultipartParser *parser;
+   struct multipart_write *next;
+   int fd;
+   size_t length;
+   size_t written;
+   char data[];
+};
+
+bool uvllhttpd_header_param (uv_buf_t value, char const *name, size_t length, uv_buf_t *param)
+{
+   char const *p = value.base;
+   char const *end = value.base + value.len;
+
+   // skip the media type or the disposition type
+   p = memchr (p, ';', end - p);
+   if (p == NULL) return false;
+
+   while (p < end)
+   {
+      p++;
+      while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+      char const *key = p;
+      while (p < end && *p != '=' && *p != ';') p++;
+      char const *key_end = p;
+      while (key_end > key && (key_end[-1] == ' ' || key_end[-1] == '\t')) key_end--;
+      if (p == end || *p == ';') continue;
+
+      p++;
+      while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+      char const *v;
+      char const *v_end;
+      if (p < end && *p == '"')
+      {
+         v = ++p;
+         while (p < end && *p != '"')
+         {
+            if (*p == '\\' && p + 1 < end) p++;
+            p++;
+         }
+         v_end = p;
+         while (p < end && *p != ';') p++;
+      }
+      else
+      {
+         v = p;
+         while (p < end && *p != ';') p++;
+         v_end = p;
+         while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) v_end--;
+      }
+
+      if ((size_t)(key_end - key) == length && strncasecmp (key, name, length) == 0)
+      {
+         param->base = (char *)v;
+         param->len = v_end - v;
+         return true;
+      }
+   }
+   return false;
+}
+
+int uvllhttpd_multipart_init (struct MultipartParser *parser, uv_buf_t content_type)
+{
+   if (parser == NULL) return UV_EINVAL;
+
+   static char const multipart[] = "multipart/";
+   if (content_type.len < sizeof(multipart)-1 ||
+         strncasecmp (content_type.base, multipart, sizeof(multipart)-1) != 0)
+   {
+      return UV_EINVAL;
+   }
+
+   uv_buf_t boundary;
+   if (!uvllhttpd_header_param (content_type, "boundary", 8, &boundary)) return UV_EINVAL;
+   if (boundary.len == 0 || boundary.len > sizeof(parser->_delimiter) - 4) return UV_EINVAL;
+
+   memcpy (parser->_delimiter, "\r\n--", 4);
+   memcpy (parser->_delimiter + 4, boundary.base, boundary.len);
+   parser->_delimiter_length = boundary.len + 4;
+
+   // the first boundary usually starts the body, without the leading CRLF
+   parser->_state = MultipartState_preamble;
+   parser->_match = 2;
+   parser->_boundary_end_length = 0;
+   parser->_header_length = 0;
+   parser->_in_part = 0;
+   parser->fd = -1;
+   parser->_writes = NULL;
+   parser->_writes_tail = NULL;
+   parser->_write_pending = 0;
+   parser->_held = (uv_buf_t) { .base = NULL, .len = 0 };
+   parser->_waiting = 0;
+   parser->_finishing = 0;
+   parser->_paused = 0;
+   parser->_error = 0;
+
+   return 0;
+}
+
+// the connection is read no further while the body waits for the writes
+static void multipart_pace (struct MultipartParser *parser)
+{
+   if (parser->handle == NULL) return;
+
+   bool const pause = parser->_waiting || parser->_write_pending > UVLLHTTPD_MULTIPART_WRITE_MAX;
+   if (pause == (bool)parser->_paused) return;
+
+   parser->_paused = pause;
+   if (pause) uvllhttpd_client_pause ((uvllhttpd_client_t *)parser->handle);
+   else uvllhttpd_client_resume ((uvllhttpd_client_t *)parser->handle);
+}
+
+static void multipart_writes_free (struct MultipartParser *parser)
+{
+   while (parser->_writes != NULL)
+   {
+      struct multipart_write *w = parser->_writes;
+      parser->_writes = w->next;
+      free (w);
+   }
+   parser->_writes_tail = NULL;
+   parser->_write_pending = 0;
+}
+
+static void multipart_fail (struct MultipartParser *parser, int error)
+{
+   parser->_error = error;
+   parser->_waiting = 0;
+   parser->_finishing = 0;
+   multipart_writes_free (parser);
+   if (parser->_held.base != NULL) free (parser->_held.base);
+   parser->_held = (uv_buf_t) { .base = NULL, .len = 0 };
+
+   if (parser->handle != NULL) uvllhttpd_client_close ((uvllhttpd_client_t *)parser->handle);
+}
+
+static void multipart_write_cb (uv_fs_t *req);
+
+static void multipart_write_start (struct multipart_write *w)
+{
+   uv_buf_t const buf = { .base = w->data + w->written, .len = w->length - w->written };
+   int const r = uv_fs_write (w->parser->handle->loop, &(w->req), w->fd, &buf, 1, -1, multipart_write_cb);
+   if (r != 0)
+   {
+      // not in flight, freed with the others
+      multipart_fail (w->parser, r);
+   }
+}
+
+// the body held at the end of a part is parsed once the part is written
+static void multipart_resume (struct MultipartParser *parser)
+{
+   parser->_waiting = 0;
+   uv_buf_t const held = parser->_held;
+   parser->_held = (uv_buf_t) { .base = NULL, .len = 0 };
+
+   int r = held.len > 0 ? uvllhttpd_multipart_execute (parser, held.base, held.len) : 0;
+   if (held.base != NULL) free (held.base);
+   if (r == 0 && parser->_finishing && !parser->_waiting)
+   {
+      parser->_finishing = 0;
+      r = uvllhttpd_multipart_finish (parser);
+   }
+   if (r != 0) multipart_fail (parser, r);
+}
+
+static void multipart_write_cb (uv_fs_t *req)
+{
+   struct multipart_write *w = (struct multipart_write *)req;
+   struct MultipartParser *parser = w->parser;
+   ssize_t const result = req->result;
+   uv_fs_req_cleanup (req);
+
+   if (parser == NULL)
+   {
+      free (w);
+      return;
+   }
+   if (result < 0)
+   {
+      multipart_fail (parser, (int)result);
+      return;
+   }
+
+   w->written += result;
+   if (w->written < w->length)
+   {
+      multipart_write_start (w);
+      return;
+   }
+
+   parser->_writes = w->next;
+   if (parser->_writes == NULL) parser->_writes_tail = NULL;
+   parser->_write_pending -= w->length;
+   free (w);
+
+   if (parser->_writes != NULL) multipart_write_start (parser->_writes);
+   else if (parser->_waiting) multipart_resume (parser);
+
+   multipart_pace (parser);
+}
+
+static int multipart_write (struct MultipartParser *parser, char const *at, size_t length)
+{
+   if (parser->handle == NULL) return UV_EINVAL;
+
+   struct multipart_write *w = malloc (sizeof(struct multipart_write) + length);
+   if (w == NULL) return UV_ENOMEM;
+   memcpy (w->data, at, length);
+   w->parser = parser;
+   w->next = NULL;
+   w->fd = parser->fd;
+   w->length = length;
+   w->written = 0;
+
+   parser->_write_pending += length;
+   if (parser->_writes_tail != NULL)
+   {
+      parser->_writes_tail->next = w;
+      parser->_writes_tail = w;
+      multipart_pace (parser);
+      return 0;
+   }
+
+   parser->_writes = parser->_writes_tail = w;
+   multipart_write_start (w);
+   return parser->_error;
+}
+
+static int multipart_emit (struct MultipartParser *parser, char const *at, size_t length)
+{
+   if (length == 0 || parser->_state == MultipartState_preamble) return 0;
+
+   if (parser->fd >= 0) return multipart_write (parser, at, length);
+
+   if (parser->on_part_data != NULL) return parser->on_part_data (parser, at, length);
+   return 0;
+}
+
+static int multipart_delimiter_found (struct MultipartParser *parser)
+{
+   parser->_match = 0;
+   parser->_boundary_end_length = 0;
+   parser->_state = MultipartState_boundary_end;
+   return 0;
+}
+
+// Emits part data up to the next delimiter. Only a '\r' can start the
+// delimiter, so the data is skipped with memchr until a candidate is found.
+// A delimiter prefix at the end of the chunk is held back in _match; since
+// those bytes equal the delimiter, they are re-emitted from it on a mismatch.
+static int multipart_scan_data (struct MultipartParser *parser, char const **pos, char const *end)
+{
+   char const *at = *pos;
+   char const * const delimiter = parser->_delimiter;
+   size_t const delimiter_length = parser->_delimiter_length;
+   int r;
+
+   if (parser->_match > 0)
+   {
+      size_t m = parser->_match;
+      while (m < delimiter_length && at < end && *at == delimiter[m])
+      {
+         m++;
+         at++;
+      }
+
+      if (m == delimiter_length)
+      {
+         *pos = at;
+         return multipart_delimiter_found (parser);
+      }
+      if (at == end)
+      {
+         parser->_match = m;
+         *pos = at;
+         return 0;
+      }
+
+      parser->_match = 0;
+      r = multipart_emit (parser, delimiter, m);
+      if (r != 0) return r;
+   }
+
+   char const *data = at;
+   while (at < end)
+   {
+      char const *cr = memchr (at, '\r', end - at);
+      if (cr == NULL) break;
+
+      size_t available = end - cr;
+      size_t n = available < delimiter_length ? available : delimiter_length;
+      if (memcmp (cr, delimiter, n) == 0)
+      {
+         r = multipart_emit (parser, data, cr - data);
+         if (r != 0) return r;
+
+         if (n == delimiter_length)
+         {
+            *pos = cr + n;
+            return multipart_delimiter_found (parser);
+         }
+
+         parser->_match = n;
+         *pos = end;
+         return 0;
+      }
+      at = cr + 1;
+   }
+
+   *pos = end;
+   return multipart_emit (parser, data, end - data);
+}
+
+static int multipart_header_line (struct MultipartParser *parser, char *line, size_t length)
+{
+   if (length == 0)
+   {
+      parser->_state = MultipartState_data;
+      return parser->on_headers_complete != NULL ? parser->on_headers_complete (parser) : 0;
+   }
+
+   char *colon = memchr (line, ':', length);
+   if (colon == NULL) return UV_EINVAL;
+
+   char *field_end = colon;
+   while (field_end > line && (field_end[-1] == ' ' || field_end[-1] == '\t')) field_end--;
+
+   char *value = colon + 1;
+   char *value_end = line + length;
+   while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+   while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+   if (parser->on_header == NULL) return 0;
+
+   uv_buf_t f = { .base = line, .len = field_end - line };
+   uv_buf_t v = { .base = value, .len = value_end - value };
+   return parser->on_header (parser, f, v);
+}
+
+// keeps the rest of the body until the writes before it are done
+static void multipart_hold (struct MultipartParser *parser, char const *at, size_t length)
+{
+   if (length == 0) return;
+
+   parser->_held.base = realloc (parser->_held.base, parser->_held.len + length);
+   memcpy (parser->_held.base + parser->_held.len, at, length);
+   parser->_held.len += length;
+}
+
+int uvllhttpd_multipart_execute (struct MultipartParser *parser, char const *at, size_t length)
+{
+   if (parser->_error != 0) return parser->_error;
+   if (parser->_waiting)
+   {
+      multipart_hold (parser, at, length);
+      return 0;
+   }
+
+   char const *end = at + length;
+   int r = 0;
+
+   while (at < end && r == 0)
+   {
+      switch (parser->_state)
+      {
+         case MultipartState_preamble:
+         case MultipartState_data:
+            r = multipart_scan_data (parser, &at, end);
+            break;
+
+         case MultipartState_boundary_end:
+            if (parser->_in_part && parser->_writes != NULL)
+            {
+               // the part ends once it is written
+               parser->_waiting = 1;
+               multipart_hold (parser, at, end - at);
+               multipart_pace (parser);
+               return 0;
+            }
+
+            // transport padding may follow a delimiter (RFC 2046)
+            if (parser->_boundary_end_length == 0 && (*at == ' ' || *at == '\t'))
+            {
+               at++;
+               break;
+            }
+            parser->_boundary_end[parser->_boundary_end_length++] = *at++;
+            if (parser->_boundary_end_length < 2) break;
+
+            if (parser->_in_part)
+            {
+               parser->_in_part = 0;
+               parser->fd = -1;
+               if (parser->on_part_end != NULL) r = parser->on_part_end (parser);
+               if (r != 0) break;
+            }
+
+            if (memcmp (parser->_boundary_end, "--", 2) == 0)
+            {
+               parser->_state = MultipartState_epilogue;
+               if (parser->on_end != NULL) r = parser->on_end (parser);
+            }
+            else if (memcmp (parser->_boundary_end, "\r\n", 2) == 0)
+            {
+               parser->_state = MultipartState_header;
+               parser->_header_length = 0;
+               parser->_in_part = 1;
+               parser->fd = -1;
+               if (parser->on_part_begin != NULL) r = parser->on_part_begin (parser);
+            }
+            else
+            {
+               r = UV_EINVAL;
+            }
+            break;
+
+         case MultipartState_header:
+            {
+               char const *newline = memchr (at, '\n', end - at);
+               char const *line_end = newline != NULL ? newline + 1 : end;
+               size_t n = line_end - at;
+               if (parser->_header_length + n > sizeof(parser->_header))
+               {
+                  r = UV_E2BIG;
+                  break;
+               }
+
+               memcpy (parser->_header + parser->_header_length, at, n);
+               parser->_header_length += n;
+               at = line_end;
+               if (newline == NULL) break;
+
+               size_t line_length = parser->_header_length;
+               parser->_header_length = 0;
+               if (line_length < 2 || parser->_header[line_length - 2] != '\r')
+               {
+                  r = UV_EINVAL;
+                  break;
+               }
+               r = multipart_header_line (parser, parser->_header, line_length - 2);
+            }
+            break;
+
+         case MultipartState_epilogue:
+            return 0;
+      }
+   }
+   return r;
+}
+
+int uvllhttpd_multipart_finish (struct MultipartParser *parser)
+{
+   if (parser->_error != 0) return parser->_error;
+   if (parser->_waiting)
+   {
+      parser->_finishing = 1;
+      return 0;
+   }
+   return parser->_state == MultipartState_epilogue ? 0 : UV_EINVAL;
+}
+
+void uvllhttpd_multipart_free (struct MultipartParser *parser)
+{
+   // the write in flight frees itself
+   struct multipart_write *w = parser->_writes;
+   if (w != NULL)
+   {
+      parser->_writes = w->next;
+      w->parser = NULL;
+   }
+   multipart_writes_free (parser);
+
+   if (parser->_held.base != NULL) free (parser->_held.base);
+   parser->_held = (uv_buf_t) { .base = NULL, .len = 0 };
+   parser->_waiting = 0;
+   parser->_finishing = 0;
+}
+
+int uvllhttpd_multipart_body_handler (void *data, char const *at, size_t length)
+{
+   struct MultipartParser *parser = (struct MultipartParser *)data;
+
+   if (at == NULL) return uvllhttpd_multipart_finish (parser);
+   return uvllhttpd_multipart_execute (parser, at, length);
+}
+
+
+static bool urlencoded_reserve (struct UrlencodedParser *parser, size_t length)
+{
+   if (parser->max_field_size > 0 && length > parser->max_field_size) return false;
+
+   if (length > parser->_buffer.len)
+   {
+      size_t size = parser->_buffer.len > 0 ? parser->_buffer.len : 64;
+      while (size < length) size *= 2;
+
+      parser->_buffer.base = realloc (parser->_buffer.base, size);
+      parser->_buffer.len = size;
+   }
+   return true;
+}
+
+// Decodes the pair into the buffer, pair may point into the buffer itself.
+static int urlencoded_emit (struct UrlencodedParser *parser, char const *pair, size_t length)
+{
+   if (length == 0) return 0;
+   if (!urlencoded_reserve (parser, length)) return UV_E2BIG;
+
+   char const *equal = memchr (pair, '=', length);
+   size_t const key_length = equal != NULL ? (size_t)(equal - pair) : length;
+
+   ssize_t k = uvllhttpd_url_decode (pair, key_length, parser->_buffer.base, parser->_buffer.len, true);
+   if (k < 0) return k;
+
+   ssize_t v = 0;
+   if (equal != NULL)
+   {
+      v = uvllhttpd_url_decode (equal + 1, length - key_length - 1,
+            parser->_buffer.base + k, parser->_buffer.len - k, true);
+      if (v < 0) return v;
+   }
+
+   if (parser->on_field == NULL) return 0;
+
+   uv_buf_t key = { .base = parser->_buffer.base, .len = k };
+   uv_buf_t value = { .base = parser->_buffer.base + k, .len = v };
+   return parser->on_field (parser, key, value);
+}
+
+int uvllhttpd_urlencoded_execute (struct UrlencodedParser *parser, char const *at, size_t length)
+{
+   char const *end = at + length;
+   int r;
+
+   while (at < end)
+   {
+      char const *amp = memchr (at, '&', end - at);
+      char const *pair_end = amp != NULL ? amp : end;
+      size_t n = pair_end - at;
+
+      if (amp != NULL && parser->_length == 0)
+      {
+         // the whole pair is in this chunk, decode it straight from there
+         r = urlencoded_emit (parser, at, n);
+         if (r != 0) return r;
+      }
+      else
+      {
+         if (!urlencoded_reserve (parser, parser->_length + n)) return UV_E2BIG;
+         memcpy (parser->_buffer.base + parser->_length, at, n);
+         parser->_length += n;
+
+         if (amp != NULL)
+         {
+            size_t pair_length = parser->_length;
+            parser->_length = 0;
+            r = urlencoded_emit (parser, parser->_buffer.base, pair_length);
+            if (r != 0) return r;
+         }
+      }
+
+      at = amp != NULL ? amp + 1 : end;
+   }
+   return 0;
+}
+
+int uvllhttpd_urlencoded_finish (struct UrlencodedParser *parser)
+{
+   size_t pair_length = parser->_length;
+   parser->_length = 0;
+   return urlencoded_emit (parser, parser->_buffer.base, pair_length);
+}
+
+void uvllhttpd_urlencoded_free (struct UrlencodedParser *parser)
+{
+   if (parser->_buffer.base != NULL) free (parser->_buffer.base);
+   parser->_buffer.base = NULL;
+   parser->_buffer.len = 0;
+   parser->_length = 0;
+}
+
+int uvllhttpd_urlencoded_body_handler (void *data, char const *at, size_t length)
+{
+   struct UrlencodedParser *parser = (struct UrlencodedParser *)data;
+
+   if (at != NULL) return uvllhttpd_urlencoded_execute (parser, at, length);
+
+   int r = uvllhttpd_urlencoded_finish (parser);
+   uvllhttpd_urlencoded_free (parser);
+   return r;
+}
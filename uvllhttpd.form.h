@@ -0,0 +1,108 @@
+#pragma once
+
+#include "uvllhttpd.h"
+
+// bytes of part data waiting to be written to fd before the connection is read no further
+#define UVLLHTTPD_MULTIPART_WRITE_MAX (1024 * 1024)
+
+struct MultipartParser;
+struct multipart_write;
+
+// Non-zero return from any callback aborts parsing and is returned by uvllhttpd_multipart_execute.
+typedef int (*uvllhttpd_multipart_cb) (struct MultipartParser *parser);
+typedef int (*uvllhttpd_multipart_header_cb) (struct MultipartParser *parser, uv_buf_t field, uv_buf_t value);
+typedef int (*uvllhttpd_multipart_data_cb) (struct MultipartParser *parser, char const *at, size_t length);
+
+struct MultipartParser {
+   void *data;
+
+   uvllhttpd_multipart_cb on_part_begin;
+   uvllhttpd_multipart_header_cb on_header;
+   uvllhttpd_multipart_cb on_headers_complete;
+   uvllhttpd_multipart_data_cb on_part_data;
+   uvllhttpd_multipart_cb on_part_end;
+   uvllhttpd_multipart_cb on_end;
+
+   // Reset to -1 for each part. When set by on_headers_complete, the part
+   // data is written to this file descriptor with uv_fs_write instead of
+   // calling on_part_data, one write at a time. The body that follows is
+   // parsed once the part is written, so on_part_end and on_end may come
+   // after the body handler has returned: answer from on_end. A failed write
+   // closes the connection.
+   int fd;
+   // the request's connection, required by fd: its loop writes, and it is
+   // paused while the writes fall behind
+   uv_tcp_t *handle;
+
+   enum MultipartState {
+      MultipartState_preamble,
+      MultipartState_boundary_end,
+      MultipartState_header,
+      MultipartState_data,
+      MultipartState_epilogue,
+   } _state;
+
+   // "\r\n--" followed by the boundary, at most 70 characters (RFC 2046)
+   char _delimiter[74];
+   size_t _delimiter_length;
+   size_t _match;
+
+   char _boundary_end[2];
+   size_t _boundary_end_length;
+   uint8_t _in_part;
+
+   char _header[1024];
+   size_t _header_length;
+
+   // part data waiting to be written, the first one being written
+   struct multipart_write *_writes;
+   struct multipart_write *_writes_tail;
+   size_t _write_pending;
+   // the body received while the end of a part waits for its writes
+   uv_buf_t _held;
+   uint8_t _waiting;
+   uint8_t _finishing;
+   uint8_t _paused;
+   int _error;
+};
+
+// content_type is the value of the request's Content-Type header.
+// Returns UV_EINVAL if it is not a multipart type with a valid boundary.
+int uvllhttpd_multipart_init (struct MultipartParser *parser, uv_buf_t content_type);
+int uvllhttpd_multipart_execute (struct MultipartParser *parser, char const *at, size_t length);
+// Returns UV_EINVAL if the closing boundary has not been seen. While part data
+// is still being written, the check is made once it is, and failing closes
+// the connection.
+int uvllhttpd_multipart_finish (struct MultipartParser *parser);
+// Frees what is held for the writes to fd, which are no longer followed up.
+void uvllhttpd_multipart_free (struct MultipartParser *parser);
+// uvllhttpd_body_handler for uvllhttpd_request_stream_body, data is the parser
+int uvllhttpd_multipart_body_handler (void *data, char const *at, size_t length);
+
+// Finds a parameter such as name or filename in a header value like
+// `form-data; name="field"; filename="a.txt"`. Quotes are removed, nothing is copied.
+bool uvllhttpd_header_param (uv_buf_t value, char const *name, size_t length, uv_buf_t *param);
+
+
+struct UrlencodedParser;
+
+// key and value are percent-decoded and valid only during the call
+typedef int (*uvllhttpd_urlencoded_field_cb) (struct UrlencodedParser *parser, uv_buf_t key, uv_buf_t value);
+
+struct UrlencodedParser {
+   void *data;
+   uvllhttpd_urlencoded_field_cb on_field;
+   // upper bound of a single key=value pair, 0 means unlimited
+   size_t max_field_size;
+
+   uv_buf_t _buffer;
+   size_t _length;
+};
+
+// Fields are emitted as soon as their terminating '&' arrives,
+// only the pair being received is kept in memory.
+int uvllhttpd_urlencoded_execute (struct UrlencodedParser *parser, char const *at, size_t length);
+int uvllhttpd_urlencoded_finish (struct UrlencodedParser *parser);
+void uvllhttpd_urlencoded_free (struct UrlencodedParser *parser);
+// uvllhttpd_body_handler for uvllhttpd_request_stream_body, data is the parser
+int uvllhttpd_urlencoded_body_handler (void *data, char const *at, size_t length);
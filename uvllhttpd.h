@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <uv.h>
 #include <llhttp.h>
 
@@ -20,19 +22,70 @@ struct HttpRequest {
       uint8_t minor;
    } const version;
    uint8_t const upgrade;
+   uint8_t const keep_alive;
 
    uv_buf_t const __internal_buffer;
 };
 
 typedef void (*uvllhttpd_request_handler) (uv_tcp_t *handle, struct HttpRequest const *request);
+struct HttpServer;
+
+// error is a uv error code, UV_EPROTO for malformed requests
+typedef void (*uvllhttpd_error_handler) (struct HttpServer *server, int error, char const *message);
+typedef void (*uvllhttpd_shutdown_cb) (struct HttpServer *server);
+// at is NULL and length 0 once the whole body has been delivered. Non-zero return aborts the request.
+typedef int (*uvllhttpd_body_handler) (void *data, char const *at, size_t length);
+struct HttpHeader const *uvllhttpd_request_find_header (struct HttpRequest const *request, char const *field, size_t length);
+
+// Slices of request->uri, nothing is copied or decoded.
+struct HttpUriParts {
+   uv_buf_t path;
+   uv_buf_t query;
+   uv_buf_t fragment;
+};
+
+struct HttpQueryIterator {
+   char const *pos;
+   char const *end;
+};
+
+void uvllhttpd_request_split_uri (struct HttpRequest const *request, struct HttpUriParts *parts);
+void uvllhttpd_query_iterator_init (struct HttpQueryIterator *iterator, uv_buf_t query);
+bool uvllhttpd_query_iterator_next (struct HttpQueryIterator *iterator, uv_buf_t *key, uv_buf_t *value);
+bool uvllhttpd_query_find (uv_buf_t query, char const *key, size_t length, uv_buf_t *value);
+// Percent-decodes into out, which may be s itself. Returns the decoded length,
+// UV_EINVAL for a malformed escape or UV_ENOBUFS if out is too small.
+ssize_t uvllhttpd_url_decode (char const *s, size_t length, char *out, size_t out_size, bool plus_as_space);
 //struct HttpRequest* uvllhttpd_request_dup (struct HttpRequest const *request);
 //void uvllhttpd_request_free (struct HttpRequest *request);
 
+struct ResponseCache;
+struct HttpTrace;
+struct AccessLog;
+struct LoopMonitor;
+struct RequestTrace;
+struct ResponseCacheEntry;
+struct uvllhttpd_client_s;
+struct UringBackend;
+struct TlsContext;
+
+enum HttpServerBackend {
+   HttpServerBackend_libuv,
+   // Linux only, when built with UVLLHTTPD_IO_URING
+   HttpServerBackend_io_uring,
+};
+
 struct HttpServer {
    uv_tcp_t handle;
 
    uv_loop_t * const loop;
    uvllhttpd_request_handler const on_request;
+   // Optional. Called when the headers are parsed, before the body arrives.
+   // request->body is empty here; see uvllhttpd_request_stream_body.
+   uvllhttpd_request_handler const on_headers;
+   // Optional. Failed accepts and reads and malformed requests, each of which
+   // closes the connection concerned.
+   uvllhttpd_error_handler const on_error;
    char const * const host;
    unsigned short const port;
    unsigned int const backlog;
@@ -40,21 +93,166 @@ struct HttpServer {
    size_t request_buffer_increase_unit;
    size_t request_buffer_max_size;
 
+   // 0 means unlimited. The response to the last allowed request carries
+   // "Connection: close" and the connection is closed once it is written.
+   unsigned int max_requests_per_connection;
+
+   // Optional, see uvllhttpd.cache.h. Requests answered from the cache
+   // never reach on_request.
+   struct ResponseCache *cache;
+
+   // Optional, see uvllhttpd.trace.h
+   struct HttpTrace *trace;
+   // Optional, see uvllhttpd.log.h
+   struct AccessLog *access_log;
+   // Optional, see uvllhttpd.monitor.h
+   struct LoopMonitor *monitor;
+   // Optional, see uvllhttpd.tls.h
+   struct TlsContext *tls;
+
+   // Responses up to this size are copied into a per-connection buffer and
+   // written together once per loop iteration. 0 writes every response at once.
+   size_t write_coalesce_size;
+
+   // How connections are accepted and read. Writes always go through libuv.
+   enum HttpServerBackend backend;
+
+   // Serves HTTP/2 without TLS as well, to clients that start with the
+   // HTTP/2 preface or ask for "Upgrade: h2c"; needs UVLLHTTPD_HTTP2. Each
+   // stream's request goes to on_request. The cache, on_headers and the
+   // proxy only apply to HTTP/1.1 requests.
+   uint8_t http2;
+
+   uv_prepare_t _write_prepare;
+   uv_check_t _write_check;
+   struct uvllhttpd_client_s *_pending_writes;
+   struct UringBackend *_uring;
+
+   struct uvllhttpd_client_s *_clients;
+   uint8_t _draining;
+   uv_check_t _drain_check;
+   uv_timer_t _drain_timer;
+   unsigned int _closing_handles;
+   uvllhttpd_shutdown_cb _on_shutdown;
+
    llhttp_settings_t _settings;
 };
 
+// UV_ENOSYS if the backend, TLS or HTTP/2 is not built in; the io_uring backend may also
+// fail with the kernel's error, in which case HttpServerBackend_libuv works.
 int uvllhttpd_server_listen (struct HttpServer *server);
 
+// Stops accepting and drains the connections: idle ones are closed at once,
+// responses to requests already received carry "Connection: close", and
+// every connection is closed once it has nothing in flight. Websockets are
+// sent a 1001 close frame, event streams are closed. Requests answered
+// asynchronously count as in flight while they hold a RequestContext.
+// After timeout milliseconds, unless 0, the remaining connections are
+// closed anyway. on_shutdown is called once every connection and handle of
+// the server is closed.
+int uvllhttpd_server_shutdown (struct HttpServer *server, unsigned int timeout, uvllhttpd_shutdown_cb on_shutdown);
+
+// Called from on_headers, delivers the body of the current request to on_body
+// in chunks as it arrives instead of buffering it into request->body.
+void uvllhttpd_request_stream_body (uv_tcp_t *handle, uvllhttpd_body_handler on_body, void *data);
+
+struct RequestContext;
+typedef void (*uvllhttpd_cancel_cb) (struct RequestContext *context);
+
+// Keeps track of a connection across asynchronous work, so that the
+// response can be started after the connection may have been closed.
+// The refcount is not atomic, ref and unref from the loop thread.
+struct RequestContext {
+   void *data;
+   // Called on the loop when the connection closes, e.g. to uv_cancel the work.
+   uvllhttpd_cancel_cb on_cancel;
+   // Set before on_cancel is called. Worker threads may poll it to give up early.
+   atomic_bool cancelled;
+
+   uv_tcp_t *_handle;
+   size_t _refcount;
+   struct RequestContext *_next;
+
+   // taken from the request, for the response started from the context
+   uint8_t _keep_alive;
+   uint8_t _version_major;
+   uint8_t _version_minor;
+   struct RequestTrace *_trace;
+   char *_log_request;
+   uint64_t _log_started;
+   struct ResponseCacheEntry *_cache_fill;
+};
+
+// Called from a request handler. The context starts with one reference.
+struct RequestContext *uvllhttpd_request_context (uv_tcp_t *handle);
+struct RequestContext *uvllhttpd_context_ref (struct RequestContext *context);
+void uvllhttpd_context_unref (struct RequestContext *context);
+// Returns NULL once the connection is closed; the response functions
+// accept NULL and do nothing, so the response is dropped.
+struct HttpResponse *uvllhttpd_context_response_init (struct RequestContext *context);
+
+typedef void (*uvllhttpd_release_cb) (void *ctx);
+
+// Immutable refcounted bytes, so that the same payload can be queued on many
+// connections without copying. The refcount is not atomic, use it from the loop thread.
+struct SharedBuffer {
+   size_t refcount;
+   size_t len;
+   char base[];
+};
+
+// Copies s once, or leaves the bytes for the caller to fill when s is NULL.
+// The new buffer holds one reference; NULL if out of memory.
+struct SharedBuffer *uvllhttpd_shared_buffer_new (char const *s, size_t length);
+struct SharedBuffer *uvllhttpd_shared_buffer_ref (struct SharedBuffer *buffer);
+void uvllhttpd_shared_buffer_unref (struct SharedBuffer *buffer);
+
+struct HttpBodyRef;
+
 struct HttpResponse {
    void *data;
    uv_tcp_t *handle;
    uint16_t status;
+
+   // Initialized from the request answered: the one on_request is running
+   // for, or the one whose RequestContext started the response.
+   // When keep_alive is 0, the connection is closed after this response is written.
+   uint8_t keep_alive;
+   struct {
+      uint8_t major;
+      uint8_t minor;
+   } version;
+
    uv_buf_t headers;
    uv_buf_t body;
+
+   // Milliseconds this response is kept in HttpServer.cache. Initialized to
+   // the cache's ttl when the request was a cache miss; set 0 to not cache it.
+   // Only 200 responses are cached.
+   uint64_t cache_ttl;
+   struct ResponseCacheEntry *_cache_entry;
+
+   struct HttpBodyRef *_refs;
+   size_t _ref_count;
+   size_t _ref_capacity;
+
+   struct RequestTrace *_trace;
+   char *_log_request;
+   uint64_t _log_started;
+
+   // serialized status line and headers, Content-Length included, written in
+   // place of the status line and Content-Length; see uvllhttpd.bundle.h
+   uv_buf_t _head;
 };
 
 struct HttpResponse *uvllhttpd_response_init (uv_tcp_t *handle);
 void uvllhttpd_response_add_header (struct HttpResponse *response, char const *s, size_t length);
 void uvllhttpd_response_append_body (struct HttpResponse *response, char const *s, size_t length);
+// Appends s without copying it. s must stay valid until release_cb (if any)
+// is called with ctx, once the response has been written or dropped.
+void uvllhttpd_response_append_ref (struct HttpResponse *response, char const *s, size_t length,
+      uvllhttpd_release_cb release_cb, void *ctx);
+// Appends the buffer without copying it, holding a reference until written.
+void uvllhttpd_response_append_shared (struct HttpResponse *response, struct SharedBuffer *buffer);
 void uvllhttpd_response_finish (struct HttpResponse *response);
 
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+#include "uvllhttpd.handoff.h"
+
+// Both sides use libuv's IPC pipes, which carry one handle per write as
+// SCM_RIGHTS alongside a byte of data.
+
+static void closed_cb (uv_handle_t *handle)
+{
+   struct ListenerHandoff *handoff = (struct ListenerHandoff *)handle->data;
+   if (--handoff->_closing > 0) return;
+
+   free (handoff->_writes);
+   handoff->_writes = NULL;
+   if (handoff->on_complete != NULL) handoff->on_complete (handoff, handoff->_status);
+}
+
+static void handoff_close (struct ListenerHandoff *handoff, int status)
+{
+   if (uv_is_closing ((uv_handle_t *)&(handoff->_pipe))) return;
+
+   handoff->_status = status;
+   handoff->_closing = 1;
+   uv_close ((uv_handle_t *)&(handoff->_pipe), closed_cb);
+   if (handoff->_peer.loop != NULL)
+   {
+      handoff->_closing++;
+      uv_close ((uv_handle_t *)&(handoff->_peer), closed_cb);
+   }
+}
+
+static void handoff_reset (struct ListenerHandoff *handoff)
+{
+   memset (&(handoff->_pipe), 0, sizeof(handoff->_pipe));
+   memset (&(handoff->_peer), 0, sizeof(handoff->_peer));
+   handoff->_writes = NULL;
+   handoff->_written = 0;
+   handoff->_status = 0;
+   handoff->_closing = 0;
+   handoff->received = 0;
+}
+
+// the old process
+
+static void offer_write_cb (uv_write_t *req, int status)
+{
+   struct ListenerHandoff *handoff = (struct ListenerHandoff *)req->handle->data;
+
+   if (status < 0) handoff_close (handoff, status);
+   else if (++handoff->_written == handoff->server_count) handoff_close (handoff, 0);
+}
+
+static void offer_connection_cb (uv_stream_t *stream, int status)
+{
+   struct ListenerHandoff *handoff = (struct ListenerHandoff *)stream->data;
+   if (status < 0 || handoff->_peer.loop != NULL)
+   {
+      handoff_close (handoff, status < 0 ? status : UV_EBUSY);
+      return;
+   }
+
+   uv_pipe_init (stream->loop, &(handoff->_peer), 1);
+   handoff->_peer.data = handoff;
+   int r = uv_accept (stream, (uv_stream_t *)&(handoff->_peer));
+   if (r != 0)
+   {
+      handoff_close (handoff, r);
+      return;
+   }
+
+   handoff->_writes = calloc (handoff->server_count, sizeof(uv_write_t));
+   uv_buf_t const buf = { .base = (char *)"L", .len = 1 };
+   for (size_t i = 0; i < handoff->server_count; i++)
+   {
+      r = uv_write2 (&(handoff->_writes[i]), (uv_stream_t *)&(handoff->_peer), &buf, 1,
+            (uv_stream_t *)&(handoff->servers[i]->handle), offer_write_cb);
+      if (r != 0)
+      {
+         handoff_close (handoff, r);
+         return;
+      }
+   }
+}
+
+int uvllhttpd_handoff_offer (struct ListenerHandoff *handoff, uv_loop_t *loop, char const *path)
+{
+   if (handoff == NULL || loop == NULL || path == NULL || handoff->server_count == 0) return UV_EINVAL;
+
+   // a socket there was left behind by a process that did not get to hand
+   // over, anything else is not ours to remove
+   struct stat st;
+   if (lstat (path, &st) == 0)
+   {
+      if (!S_ISSOCK (st.st_mode)) return UV_EEXIST;
+      unlink (path);
+   }
+
+   handoff_reset (handoff);
+   uv_pipe_init (loop, &(handoff->_pipe), 0);
+   handoff->_pipe.data = handoff;
+
+   int r = uv_pipe_bind (&(handoff->_pipe), path);
+   if (r == 0) r = uv_listen ((uv_stream_t *)&(handoff->_pipe), 1, offer_connection_cb);
+   if (r != 0) uv_close ((uv_handle_t *)&(handoff->_pipe), NULL);
+   return r;
+}
+
+// the new process
+
+static void receive_alloc_cb (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+   buf->base = (char*) malloc(suggested_size);
+   buf->len = suggested_size;
+}
+
+static void receive_read_cb (uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+   struct ListenerHandoff *handoff = (struct ListenerHandoff *)stream->data;
+   free (buf->base);
+
+   uv_pipe_t *pipe = &(handoff->_pipe);
+   while (uv_pipe_pending_count (pipe) > 0 && uv_pipe_pending_type (pipe) == UV_TCP &&
+         handoff->received < handoff->server_count)
+   {
+      struct HttpServer *server = handoff->servers[handoff->received];
+      uv_tcp_init (stream->loop, &(server->handle));
+      int r = uv_accept (stream, (uv_stream_t *)&(server->handle));
+      if (r == 0) r = uvllhttpd_server_start (server);
+      if (r != 0)
+      {
+         uv_close ((uv_handle_t *)&(server->handle), NULL);
+         handoff_close (handoff, r);
+         return;
+      }
+      handoff->received++;
+   }
+
+   if (nread == UV_EOF)
+   {
+      // sockets not taken are closed along with the pipe
+      handoff_close (handoff, handoff->received == handoff->server_count ? 0 : UV_ENOENT);
+   }
+   else if (nread < 0)
+   {
+      handoff_close (handoff, nread);
+   }
+}
+
+static void receive_connect_cb (uv_connect_t *req, int status)
+{
+   struct ListenerHandoff *handoff = (struct ListenerHandoff *)req->handle->data;
+   if (status < 0)
+   {
+      handoff_close (handoff, status);
+      return;
+   }
+
+   int const r = uv_read_start ((uv_stream_t *)&(handoff->_pipe), receive_alloc_cb, receive_read_cb);
+   if (r != 0) handoff_close (handoff, r);
+}
+
+int uvllhttpd_handoff_receive (struct ListenerHandoff *handoff, uv_loop_t *loop, char const *path)
+{
+   if (handoff == NULL || loop == NULL || path == NULL || handoff->server_count == 0) return UV_EINVAL;
+
+   handoff_reset (handoff);
+   uv_pipe_init (loop, &(handoff->_pipe), 1);
+   handoff->_pipe.data = handoff;
+   uv_pipe_connect (&(handoff->_connect), &(handoff->_pipe), path, receive_connect_cb);
+   return 0;
+}
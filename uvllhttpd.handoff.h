@@ -0,0 +1,44 @@
+#pragma once
+
+#include "uvllhttpd.h"
+
+struct ListenerHandoff;
+// status is 0 or a uv error code
+typedef void (*uvllhttpd_handoff_cb) (struct ListenerHandoff *handoff, int status);
+
+// Passes the listening sockets of a running process to the process replacing
+// it, over a Unix socket with SCM_RIGHTS, so that connections keep being
+// accepted while the old process drains with uvllhttpd_server_shutdown.
+struct ListenerHandoff {
+   void *data;
+
+   // the same servers, in the same order, in both processes
+   struct HttpServer **servers;
+   size_t server_count;
+
+   // Old process: the sockets have been passed, time to shut the servers down.
+   // New process: the servers that received a socket are accepting on it,
+   // status is UV_ENOENT if not all of them did. Either way the handoff is
+   // closed and may be freed.
+   uvllhttpd_handoff_cb on_complete;
+   // new process: servers[0] to servers[received-1] got a socket
+   size_t received;
+
+   uv_pipe_t _pipe;
+   uv_pipe_t _peer;
+   uv_connect_t _connect;
+   uv_write_t *_writes;
+   size_t _written;
+   int _status;
+   uint8_t _closing;
+};
+
+// Old process: waits on path, removing a stale socket file there, for the
+// new process to connect, then sends it every server's socket once.
+// Returns UV_EEXIST if something other than a socket is at path, or the
+// bind or listen error; later failures go to on_complete.
+int uvllhttpd_handoff_offer (struct ListenerHandoff *handoff, uv_loop_t *loop, char const *path);
+
+// New process: instead of uvllhttpd_server_listen, takes the servers'
+// sockets from the process offering them at path.
+int uvllhttpd_handoff_receive (struct ListenerHandoff *handoff, uv_loop_t *loop, char const *path);
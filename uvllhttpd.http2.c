@@ -0,0 +1,762 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <nghttp2/nghttp2.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+
+// advertised in the server's SETTINGS
+#define HTTP2_MAX_CONCURRENT_STREAMS 100
+// frames are gathered into writes of about this size
+#define HTTP2_WRITE_SIZE 65536
+// no more frames are produced, nor requests read, while this much waits to be written
+#define HTTP2_WRITE_QUEUE_MAX (1 << 20)
+// an HTTP2-Settings header carrying more settings is not upgraded
+#define HTTP2_UPGRADE_SETTINGS_MAX 64
+
+static char const preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static char const switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+struct Http2Session;
+
+struct Http2Stream {
+   // what on_request and the response functions see as the connection; the
+   // request is received into its buffer and headers like on a connection
+   uvllhttpd_client_t client;
+   struct Http2Session *session;
+   int32_t id;
+   enum llhttp_method method;
+   // reset for a request that does not fit or is not understood
+   uint8_t rejected;
+   uint8_t has_host;
+
+   // the response whose body nghttp2 reads as flow control allows
+   struct HttpResponse *response;
+   uv_buf_t *bufs;
+   size_t nbufs;
+   size_t buf_index;
+   size_t buf_offset;
+
+   struct Http2Stream *prev;
+   struct Http2Stream *next;
+};
+
+struct Http2Session {
+   uvllhttpd_client_t *client;
+   nghttp2_session *session;
+   struct Http2Stream *streams;
+
+   // frames waiting for the next write
+   uv_buf_t out;
+   size_t out_capacity;
+
+   // inside nghttp2, which must not be entered again
+   uint8_t busy;
+   uint8_t paused;
+   uint8_t goaway;
+};
+
+struct http2_write {
+   uv_write_t req;
+   uvllhttpd_client_t *client;
+   char *base;
+};
+
+static void session_send (struct Http2Session *session);
+
+static struct Http2Stream *stream_new (struct Http2Session *session, int32_t id)
+{
+   uvllhttpd_client_t *connection = session->client;
+
+   struct Http2Stream *stream = calloc (1, sizeof(struct Http2Stream));
+   stream->session = session;
+   stream->id = id;
+   stream->method = HTTP_GET;
+
+   uvllhttpd_client_t *client = &(stream->client);
+   client->server = connection->server;
+   client->handle.loop = connection->handle.loop;
+   client->keep_alive = 1;
+   client->http_major = 2;
+   client->http2_stream = stream;
+   memcpy (client->peer, connection->peer, sizeof(client->peer));
+
+   stream->next = session->streams;
+   if (session->streams != NULL) session->streams->prev = stream;
+   session->streams = stream;
+   return stream;
+}
+
+static void stream_release_response (struct Http2Stream *stream, bool written)
+{
+   if (stream->response == NULL) return;
+
+   free (stream->bufs);
+   stream->bufs = NULL;
+   uvllhttpd_response_release (stream->response, written);
+   stream->response = NULL;
+}
+
+static void stream_free (struct Http2Stream *stream)
+{
+   struct Http2Session *session = stream->session;
+   if (stream->prev != NULL) stream->prev->next = stream->next;
+   else session->streams = stream->next;
+   if (stream->next != NULL) stream->next->prev = stream->prev;
+
+   stream_release_response (stream, false);
+
+   uvllhttpd_client_t *client = &(stream->client);
+   if (client->contexts != NULL) uvllhttpd_client_cancel_contexts (client);
+   free (client->buffer.base);
+   free (client->headers);
+   free (client->log_request);
+   free (stream);
+}
+
+static void stream_reject (struct Http2Stream *stream, uint32_t error_code)
+{
+   stream->rejected = 1;
+   nghttp2_submit_rst_stream (stream->session->session, NGHTTP2_FLAG_NONE, stream->id, error_code);
+}
+
+// copies s into the request buffer, '\0' terminated if it is a header
+static bool stream_append (struct Http2Stream *stream, char const *s, size_t length, bool terminate,
+      struct string_in_buffer *at)
+{
+   uvllhttpd_client_t *client = &(stream->client);
+   struct HttpServer *server = client->server;
+
+   // and room left for the '\0' after the body
+   size_t const required = client->buffer_cur_pos + length + (terminate ? 1 : 0) + 1;
+   if (required > client->buffer.len)
+   {
+      size_t new_size = client->buffer.len + server->request_buffer_increase_unit;
+      if (new_size < required) new_size = required;
+      if (new_size > server->request_buffer_max_size) return false;
+
+      client->buffer.base = realloc (client->buffer.base, new_size);
+      client->buffer.len = new_size;
+   }
+
+   if (at != NULL)
+   {
+      at->offset = client->buffer_cur_pos;
+      at->length = length;
+   }
+   memcpy (client->buffer.base + client->buffer_cur_pos, s, length);
+   client->buffer_cur_pos += length;
+   if (terminate) client->buffer.base[client->buffer_cur_pos++] = '\0';
+   return true;
+}
+
+static bool stream_add_header (struct Http2Stream *stream, char const *field, size_t field_length,
+      char const *value, size_t value_length)
+{
+   uvllhttpd_client_t *client = &(stream->client);
+   if (client->header_cur_index == client->header_count)
+   {
+      client->header_count += 10;
+      client->headers = realloc (client->headers, sizeof(struct key_value_in_buffer) * client->header_count);
+   }
+
+   struct key_value_in_buffer *header = &(client->headers[client->header_cur_index]);
+   if (!stream_append (stream, field, field_length, true, &(header->key)) ||
+         !stream_append (stream, value, value_length, true, &(header->value)))
+   {
+      return false;
+   }
+   client->header_cur_index++;
+   return true;
+}
+
+static bool parse_method (char const *s, size_t length, enum llhttp_method *method)
+{
+#define HTTP2_METHOD(num, name, string) \
+   if (length == sizeof(#string)-1 && memcmp (s, #string, length) == 0) \
+   { \
+      *method = HTTP_##name; \
+      return true; \
+   }
+   HTTP_METHOD_MAP(HTTP2_METHOD)
+#undef HTTP2_METHOD
+   return false;
+}
+
+// the request that asked for the upgrade, or one received on a stream
+static void stream_request (struct Http2Stream *stream, struct HttpRequest const *request)
+{
+   uvllhttpd_client_t *client = &(stream->client);
+   struct HttpServer *server = client->server;
+
+   if (server->access_log != NULL)
+   {
+      char const *method = llhttp_method_name (request->method);
+      size_t const length = strlen (method) + 1 + request->uri.len + 10;
+      client->log_request = malloc (length);
+      snprintf (client->log_request, length, "%s %.*s HTTP/2.0", method, (int)request->uri.len, request->uri.base);
+      client->log_started = uv_now (client->handle.loop);
+   }
+
+   uvllhttpd_client_dispatch (client, request);
+}
+
+static void stream_dispatch (struct Http2Stream *stream)
+{
+   uvllhttpd_client_t *client = &(stream->client);
+   if (client->buffer.base == NULL)
+   {
+      // CONNECT, the only request without a :path
+      stream_reject (stream, NGHTTP2_REFUSED_STREAM);
+      return;
+   }
+
+   size_t const header_count = client->header_cur_index;
+   struct HttpHeader headers[header_count > 0 ? header_count : 1];
+   for (size_t i = 0; i < header_count; i++)
+   {
+      headers[i] = (struct HttpHeader) {
+         .field = { .base = client->buffer.base + client->headers[i].key.offset, .len = client->headers[i].key.length },
+         .value = { .base = client->buffer.base + client->headers[i].value.offset, .len = client->headers[i].value.length },
+      };
+   }
+
+   client->buffer.base[client->buffer_cur_pos] = '\0';
+   size_t const body_length = client->buffer_cur_pos - client->string_begin_pos;
+
+   struct HttpRequest const request = {
+      .__internal_buffer = client->buffer,
+      .uri = {
+         .base = client->buffer.base + client->uri.offset,
+         .len = client->uri.length,
+      },
+      .body = {
+         .base = body_length > 0 ? client->buffer.base + client->string_begin_pos : NULL,
+         .len = body_length,
+      },
+      .header_count = header_count,
+      .headers = header_count > 0 ? headers : NULL,
+      .method = stream->method,
+      .keep_alive = 1,
+      .version = { .major = 2, .minor = 0 },
+   };
+
+   free (client->headers);
+   client->headers = NULL;
+   client->header_cur_index = 0;
+   client->header_count = 0;
+   client->buffer = (uv_buf_t) {0};
+   client->buffer_cur_pos = 0;
+   client->string_begin_pos = 0;
+
+   stream_request (stream, &request);
+   free (request.__internal_buffer.base);
+}
+
+static int on_begin_headers_cb (nghttp2_session *ngh, nghttp2_frame const *frame, void *user_data)
+{
+   if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) return 0;
+
+   struct Http2Stream *stream = stream_new ((struct Http2Session *)user_data, frame->hd.stream_id);
+   nghttp2_session_set_stream_user_data (ngh, frame->hd.stream_id, stream);
+   return 0;
+}
+
+static int on_header_cb (nghttp2_session *ngh, nghttp2_frame const *frame, uint8_t const *name, size_t namelen,
+      uint8_t const *value, size_t valuelen, uint8_t flags, void *user_data)
+{
+   // trailers are dropped, as by the HTTP/1.1 parser
+   if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) return 0;
+
+   struct Http2Stream *stream = nghttp2_session_get_stream_user_data (ngh, frame->hd.stream_id);
+   if (stream == NULL || stream->rejected) return 0;
+
+   char const *field = (char const *)name;
+   char const *s = (char const *)value;
+   bool ok = true;
+
+   if (namelen == 7 && memcmp (field, ":method", 7) == 0)
+   {
+      if (!parse_method (s, valuelen, &(stream->method)))
+      {
+         stream_reject (stream, NGHTTP2_REFUSED_STREAM);
+         return 0;
+      }
+   }
+   else if (namelen == 5 && memcmp (field, ":path", 5) == 0)
+   {
+      ok = stream_append (stream, s, valuelen, true, &(stream->client.uri));
+   }
+   else if ((namelen == 10 && memcmp (field, ":authority", 10) == 0) || (namelen == 4 && memcmp (field, "host", 4) == 0))
+   {
+      // handlers written for HTTP/1.1 look for Host
+      if (!stream->has_host) ok = stream_add_header (stream, "host", 4, s, valuelen);
+      stream->has_host = 1;
+   }
+   else if (namelen > 0 && field[0] != ':')
+   {
+      ok = stream_add_header (stream, field, namelen, s, valuelen);
+   }
+
+   if (!ok) stream_reject (stream, NGHTTP2_REFUSED_STREAM);
+   return 0;
+}
+
+static int on_data_chunk_recv_cb (nghttp2_session *ngh, uint8_t flags, int32_t stream_id, uint8_t const *data,
+      size_t len, void *user_data)
+{
+   struct Http2Stream *stream = nghttp2_session_get_stream_user_data (ngh, stream_id);
+   if (stream == NULL || stream->rejected) return 0;
+
+   if (!stream_append (stream, (char const *)data, len, false, NULL)) stream_reject (stream, NGHTTP2_REFUSED_STREAM);
+   return 0;
+}
+
+static int on_frame_recv_cb (nghttp2_session *ngh, nghttp2_frame const *frame, void *user_data)
+{
+   if (frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) return 0;
+
+   struct Http2Stream *stream = nghttp2_session_get_stream_user_data (ngh, frame->hd.stream_id);
+   if (stream == NULL || stream->rejected) return 0;
+
+   // the body follows the headers in the buffer
+   if (frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_REQUEST)
+   {
+      stream->client.string_begin_pos = stream->client.buffer_cur_pos;
+   }
+   if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) stream_dispatch (stream);
+   return 0;
+}
+
+static int on_stream_close_cb (nghttp2_session *ngh, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+   struct Http2Stream *stream = nghttp2_session_get_stream_user_data (ngh, stream_id);
+   if (stream != NULL) stream_free (stream);
+   return 0;
+}
+
+// copies as much of the body as the stream's and the connection's windows allow
+static ssize_t response_read_cb (nghttp2_session *ngh, int32_t stream_id, uint8_t *buf, size_t length,
+      uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+   struct Http2Stream *stream = (struct Http2Stream *)source->ptr;
+
+   size_t copied = 0;
+   while (copied < length && stream->buf_index < stream->nbufs)
+   {
+      uv_buf_t const *b = &(stream->bufs[stream->buf_index]);
+      size_t n = b->len - stream->buf_offset;
+      if (n > length - copied) n = length - copied;
+
+      memcpy (buf + copied, b->base + stream->buf_offset, n);
+      copied += n;
+      stream->buf_offset += n;
+      if (stream->buf_offset == b->len)
+      {
+         stream->buf_index++;
+         stream->buf_offset = 0;
+      }
+   }
+
+   if (stream->buf_index == stream->nbufs)
+   {
+      *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+      // everything is copied into frames, the references go now
+      stream_release_response (stream, true);
+   }
+   return (ssize_t)copied;
+}
+
+static bool is_connection_specific (char const *field, size_t length)
+{
+   static char const * const fields[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade" };
+   for (size_t i = 0; i < sizeof(fields)/sizeof(fields[0]); i++)
+   {
+      if (length == strlen (fields[i]) && strncasecmp (field, fields[i], length) == 0) return true;
+   }
+   return false;
+}
+
+// "Field: value\r\n" lines as HTTP/2 fields, the names lowercased into lower
+static size_t response_fields (uv_buf_t lines, char *lower, nghttp2_nv *nva, size_t count)
+{
+   char const *p = lines.base;
+   char const *end = lines.base + lines.len;
+   while (p < end)
+   {
+      char const *eol = memchr (p, '\n', end - p);
+      char const *next = eol != NULL ? eol + 1 : end;
+      if (eol == NULL) eol = end;
+      if (eol > p && eol[-1] == '\r') eol--;
+
+      char const *colon = memchr (p, ':', eol - p);
+      if (colon != NULL && colon > p && !is_connection_specific (p, colon - p))
+      {
+         size_t const length = colon - p;
+         char const *value = colon + 1;
+         while (value < eol && (*value == ' ' || *value == '\t')) value++;
+
+         char *name = lower + (p - lines.base);
+         for (size_t i = 0; i < length; i++) name[i] = tolower ((unsigned char)p[i]);
+
+         nva[count++] = (nghttp2_nv) {
+            .name = (uint8_t *)name,
+            .value = (uint8_t *)value,
+            .namelen = length,
+            .valuelen = eol - value,
+            .flags = NGHTTP2_NV_FLAG_NONE,
+         };
+      }
+      p = next;
+   }
+   return count;
+}
+
+static size_t count_lines (uv_buf_t lines)
+{
+   size_t count = 1;
+   if (lines.base == NULL) return count;
+   for (char const *p = lines.base; (p = memchr (p, '\n', lines.base + lines.len - p)) != NULL; p++) count++;
+   return count;
+}
+
+void uvllhttpd_http2_respond (struct Http2Stream *stream, struct HttpResponse *response,
+      uv_buf_t const *bufs, size_t nbufs, size_t content_length)
+{
+   struct Http2Session *session = stream->session;
+   if (stream->rejected || stream->response != NULL)
+   {
+      // a second response to the same request
+      uvllhttpd_response_release (response, false);
+      return;
+   }
+
+   // the status line of a serialized head is replaced by :status
+   uv_buf_t head = response->_head;
+   if (head.base != NULL)
+   {
+      char const *eol = memchr (head.base, '\n', head.len);
+      size_t const skip = eol != NULL ? (size_t)(eol + 1 - head.base) : head.len;
+      head.base += skip;
+      head.len -= skip;
+   }
+
+   size_t const capacity = 2 + count_lines (head) + count_lines (response->headers);
+   nghttp2_nv nva[capacity];
+   char *lower = malloc (head.len + response->headers.len + 1);
+
+   char status[8];
+   char length[24];
+   nva[0] = (nghttp2_nv) {
+      .name = (uint8_t *)":status",
+      .value = (uint8_t *)status,
+      .namelen = 7,
+      .valuelen = snprintf (status, sizeof(status), "%d", response->status),
+   };
+   size_t nvlen = 1;
+   if (head.base == NULL)
+   {
+      nva[nvlen++] = (nghttp2_nv) {
+         .name = (uint8_t *)"content-length",
+         .value = (uint8_t *)length,
+         .namelen = 14,
+         .valuelen = snprintf (length, sizeof(length), "%zu", content_length),
+      };
+   }
+   nvlen = response_fields (head, lower, nva, nvlen);
+   nvlen = response_fields (response->headers, lower + head.len, nva, nvlen);
+
+   // a HEAD response ends with its headers
+   bool const has_data = content_length > 0 && stream->method != HTTP_HEAD;
+   nghttp2_data_provider provider = {
+      .source = { .ptr = stream },
+      .read_callback = response_read_cb,
+   };
+   int const r = nghttp2_submit_response (session->session, stream->id, nva, nvlen,
+         has_data ? &provider : NULL);
+   free (lower);
+
+   if (r == 0 && has_data)
+   {
+      stream->response = response;
+      stream->bufs = malloc (sizeof(uv_buf_t) * nbufs);
+      memcpy (stream->bufs, bufs, sizeof(uv_buf_t) * nbufs);
+      stream->nbufs = nbufs;
+   }
+   else
+   {
+      uvllhttpd_response_release (response, r == 0);
+   }
+
+   session_send (session);
+}
+
+void uvllhttpd_http2_stream_close (struct Http2Stream *stream)
+{
+   struct Http2Session *session = stream->session;
+   stream_reject (stream, NGHTTP2_CANCEL);
+   session_send (session);
+}
+
+static void write_cb (uv_write_t *req, int status)
+{
+   struct http2_write *w = (struct http2_write *)req;
+   uvllhttpd_client_t *client = w->client;
+   free (w->base);
+   free (w);
+
+   if (status == 0 && client->http2 != NULL && !uv_is_closing ((uv_handle_t *)&(client->handle)))
+   {
+      session_send (client->http2);
+   }
+}
+
+static void out_append (struct Http2Session *session, char const *s, size_t length)
+{
+   if (session->out.len + length > session->out_capacity)
+   {
+      size_t capacity = session->out_capacity > 0 ? session->out_capacity * 2 : HTTP2_WRITE_SIZE;
+      if (capacity < session->out.len + length) capacity = session->out.len + length;
+      session->out.base = realloc (session->out.base, capacity);
+      session->out_capacity = capacity;
+   }
+   memcpy (session->out.base + session->out.len, s, length);
+   session->out.len += length;
+}
+
+static bool out_flush (struct Http2Session *session)
+{
+   if (session->out.len == 0) return true;
+
+   uvllhttpd_client_t *client = session->client;
+   uv_buf_t const buf = session->out;
+   session->out.len = 0;
+
+   int const n = uvllhttpd_client_try_write (client, &buf, 1);
+   // the buffer is kept for the next frames
+   if (n >= 0 && (size_t)n == buf.len) return true;
+
+   // the rest is written from the buffer itself
+   session->out.base = NULL;
+   session->out_capacity = 0;
+
+   size_t const taken = n > 0 ? (size_t)n : 0;
+   struct http2_write *w = malloc (sizeof(struct http2_write));
+   w->client = client;
+   w->base = buf.base;
+
+   uv_buf_t const rest = { .base = buf.base + taken, .len = buf.len - taken };
+   if (uvllhttpd_client_write (&(w->req), client, &rest, 1, write_cb) != 0)
+   {
+      free (buf.base);
+      free (w);
+      return false;
+   }
+   return true;
+}
+
+static void session_send (struct Http2Session *session)
+{
+   uvllhttpd_client_t *client = session->client;
+   if (session->busy || uv_is_closing ((uv_handle_t *)&(client->handle))) return;
+
+   bool ok = true;
+   session->busy = 1;
+   while (ok && client->handle.write_queue_size < HTTP2_WRITE_QUEUE_MAX)
+   {
+      uint8_t const *data;
+      ssize_t const n = nghttp2_session_mem_send (session->session, &data);
+      if (n <= 0)
+      {
+         ok = n == 0;
+         break;
+      }
+
+      out_append (session, (char const *)data, n);
+      if (session->out.len >= HTTP2_WRITE_SIZE) ok = out_flush (session);
+   }
+   if (ok) ok = out_flush (session);
+   session->busy = 0;
+
+   if (!ok)
+   {
+      uvllhttpd_client_close (client);
+      return;
+   }
+
+   // the peer is read again once the frames waiting for it are written
+   bool const full = client->handle.write_queue_size >= HTTP2_WRITE_QUEUE_MAX;
+   if (full && !session->paused) uvllhttpd_client_pause (client);
+   else if (!full && session->paused) uvllhttpd_client_resume (client);
+   session->paused = full;
+
+   // after GOAWAY, once the last stream is done
+   if (!nghttp2_session_want_read (session->session) && !nghttp2_session_want_write (session->session) &&
+         client->handle.write_queue_size == 0)
+   {
+      uvllhttpd_client_close (client);
+   }
+}
+
+static struct Http2Session *session_new (uvllhttpd_client_t *client)
+{
+   nghttp2_session_callbacks *callbacks;
+   if (nghttp2_session_callbacks_new (&callbacks) != 0) return NULL;
+
+   nghttp2_session_callbacks_set_on_begin_headers_callback (callbacks, on_begin_headers_cb);
+   nghttp2_session_callbacks_set_on_header_callback (callbacks, on_header_cb);
+   nghttp2_session_callbacks_set_on_data_chunk_recv_callback (callbacks, on_data_chunk_recv_cb);
+   nghttp2_session_callbacks_set_on_frame_recv_callback (callbacks, on_frame_recv_cb);
+   nghttp2_session_callbacks_set_on_stream_close_callback (callbacks, on_stream_close_cb);
+
+   struct Http2Session *session = calloc (1, sizeof(struct Http2Session));
+   session->client = client;
+   int const r = nghttp2_session_server_new (&(session->session), callbacks, session);
+   nghttp2_session_callbacks_del (callbacks);
+   if (r != 0)
+   {
+      free (session);
+      return NULL;
+   }
+
+   nghttp2_settings_entry const settings[] = {
+      { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, HTTP2_MAX_CONCURRENT_STREAMS },
+   };
+   nghttp2_submit_settings (session->session, NGHTTP2_FLAG_NONE, settings, sizeof(settings)/sizeof(settings[0]));
+   return session;
+}
+
+void uvllhttpd_http2_free (struct Http2Session *session)
+{
+   while (session->streams != NULL) stream_free (session->streams);
+   nghttp2_session_del (session->session);
+   free (session->out.base);
+   free (session);
+}
+
+bool uvllhttpd_http2_is_preface (char const *base, size_t length)
+{
+   size_t const n = length < sizeof(preface)-1 ? length : sizeof(preface)-1;
+   // "PRI " starts no HTTP/1.1 request
+   return n >= 4 && memcmp (base, preface, n) == 0;
+}
+
+bool uvllhttpd_http2_start (uvllhttpd_client_t *client)
+{
+   client->http2 = session_new (client);
+   return client->http2 != NULL;
+}
+
+void uvllhttpd_http2_feed (struct Http2Session *session, char const *base, size_t length)
+{
+   uvllhttpd_client_t *client = session->client;
+
+   session->busy = 1;
+   ssize_t const r = nghttp2_session_mem_recv (session->session, (uint8_t const *)base, length);
+   session->busy = 0;
+
+   if (r < 0)
+   {
+      struct HttpServer *server = client->server;
+      if (server->on_error != NULL) server->on_error (server, UV_EPROTO, nghttp2_strerror ((int)r));
+      uvllhttpd_client_close (client);
+      return;
+   }
+   session_send (session);
+}
+
+static bool has_token (struct HttpHeader const *header, char const *token, size_t length)
+{
+   if (header == NULL) return false;
+
+   char const *p = header->value.base;
+   char const *end = p + header->value.len;
+   while (p < end)
+   {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+      char const *start = p;
+      while (p < end && *p != ',' && *p != ' ' && *p != '\t') p++;
+      if ((size_t)(p - start) == length && strncasecmp (start, token, length) == 0) return true;
+   }
+   return false;
+}
+
+// HTTP2-Settings is base64url without padding
+static ssize_t base64url_decode (char const *s, size_t length, uint8_t *out)
+{
+   uint32_t bits = 0;
+   int count = 0;
+   ssize_t n = 0;
+   for (size_t i = 0; i < length; i++)
+   {
+      char const c = s[i];
+      int v;
+      if (c >= 'A' && c <= 'Z') v = c - 'A';
+      else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+      else if (c >= '0' && c <= '9') v = c - '0' + 52;
+      else if (c == '-') v = 62;
+      else if (c == '_') v = 63;
+      else if (c == '=') break;
+      else return -1;
+
+      bits = (bits << 6) | (uint32_t)v;
+      count += 6;
+      if (count >= 8)
+      {
+         count -= 8;
+         out[n++] = (uint8_t)(bits >> count);
+      }
+   }
+   return n;
+}
+
+bool uvllhttpd_http2_upgrade (uvllhttpd_client_t *client, struct HttpRequest const *request)
+{
+   if (client->server->_draining || request->version.major != 1 || request->version.minor != 1) return false;
+   if (!has_token (uvllhttpd_request_find_header (request, "Upgrade", 7), "h2c", 3)) return false;
+
+   struct HttpHeader const *header = uvllhttpd_request_find_header (request, "HTTP2-Settings", 14);
+   // each setting is 6 bytes, 8 characters of base64url
+   if (header == NULL || header->value.len > HTTP2_UPGRADE_SETTINGS_MAX * 8) return false;
+   uint8_t settings[HTTP2_UPGRADE_SETTINGS_MAX * 6];
+   ssize_t const settings_length = base64url_decode (header->value.base, header->value.len, settings);
+   if (settings_length < 0) return false;
+
+   struct Http2Session *session = session_new (client);
+   if (session == NULL) return false;
+
+   struct Http2Stream *stream = stream_new (session, 1);
+   stream->method = request->method;
+   if (nghttp2_session_upgrade2 (session->session, settings, settings_length,
+            request->method == HTTP_HEAD, stream) != 0)
+   {
+      uvllhttpd_http2_free (session);
+      return false;
+   }
+
+   // responses to requests pipelined before this one go first
+   uvllhttpd_client_flush (client);
+   out_append (session, switching, sizeof(switching)-1);
+   client->http2 = session;
+
+   // answered on stream 1, which the upgrade half-closed
+   session->busy = 1;
+   stream_request (stream, request);
+   session->busy = 0;
+   session_send (session);
+   return true;
+}
+
+void uvllhttpd_http2_drain (struct Http2Session *session)
+{
+   if (session->goaway) return;
+
+   session->goaway = 1;
+   nghttp2_submit_goaway (session->session, NGHTTP2_FLAG_NONE,
+         nghttp2_session_get_last_proc_stream_id (session->session), NGHTTP2_NO_ERROR, NULL, 0);
+   session_send (session);
+}
@@ -3,8 +3,18 @@
 #include <uv.h>
 #include <llhttp.h>
 
+#include "uvllhttpd.h"
+
 llhttp_settings_t uvllhttpd_get_llhttp_settings (void);
 
+struct WebSocket;
+struct ProxyExchange;
+struct SseSubscriber;
+struct UringConnection;
+struct TlsConnection;
+struct Http2Session;
+struct Http2Stream;
+
 struct string_in_buffer {
    size_t offset;
    size_t length;
@@ -15,7 +25,7 @@ struct key_value_in_buffer {
    struct string_in_buffer value;
 };
 
-typedef struct {
+typedef struct uvllhttpd_client_s {
    uv_tcp_t handle;
    struct HttpServer *server;
 
@@ -32,10 +42,182 @@ typedef struct {
    size_t string_begin_pos;
    size_t buffer_cur_pos;
 
+   unsigned int request_count;
+   uint8_t keep_alive;
+   uint8_t http_major;
+   uint8_t http_minor;
+
+   uvllhttpd_body_handler on_body;
+   void *on_body_data;
+
    struct string_in_buffer uri;
    struct key_value_in_buffer *headers;
    size_t header_count;
    size_t header_cur_index;
 
    llhttp_t parser;
+
+   // set once the connection has been taken over by uvllhttpd_websocket_accept
+   struct WebSocket *websocket;
+
+   // the cache miss the response started in on_request fills, or the one waited for
+   struct ResponseCacheEntry *cache_fill;
+   struct ResponseCacheEntry *cache_wait;
+
+   // parsing stops after a request answered out of band, until it is; what is read
+   // in the meantime is held
+   uint8_t blocked;
+   uv_buf_t held;
+
+   // small responses coalesced until the end of the loop iteration
+   uv_buf_t out;
+   size_t out_capacity;
+   uint8_t out_pending;
+   uint8_t close_after_flush;
+   struct uvllhttpd_client_s *next_pending;
+
+   // the sampled request being received, and those waiting in out
+   uint64_t trace_connection;
+   uint64_t accepted_at;
+   struct RequestTrace *trace;
+   struct RequestTrace *out_traces;
+
+   // access log: the peer address, and the request line waiting for its response
+   char peer[46];
+   char *log_request;
+   uint64_t log_started;
+
+   // cancelled when the connection closes
+   struct RequestContext *contexts;
+   // the first context taken while on_request runs, which the request's
+   // trace and log line go to if it is not answered right away
+   struct RequestContext *request_context;
+   uint8_t in_on_request;
+
+   // set while on_headers runs
+   uint8_t in_on_headers;
+   // the current request is forwarded, not passed to on_request
+   uint8_t proxied;
+   struct ProxyExchange *proxy;
+
+   // set once the connection streams events, nothing more is parsed
+   struct SseSubscriber *sse;
+
+   // read by the server's io_uring instead of uv_read_start
+   struct UringConnection *uring;
+
+   // everything read and written goes through TLS
+   struct TlsConnection *tls;
+
+   // all connections of the server, for draining it
+   struct uvllhttpd_client_s *prev_client;
+   struct uvllhttpd_client_s *next_client;
+   // between the first byte of a request and its last
+   uint8_t in_message;
+   // created by uvllhttpd_response_init and not yet written
+   unsigned int open_responses;
+
+   // set once the connection speaks HTTP/2
+   struct Http2Session *http2;
+   // set on the stand-in that a request received on an HTTP/2 stream sees
+   // as its connection, the stream it is answered on
+   struct Http2Stream *http2_stream;
 } uvllhttpd_client_t;
+
+// starts accepting on the bound or received server->handle
+int uvllhttpd_server_start (struct HttpServer *server);
+
+// sets up a connection accepted on server before it is read, false if it
+// could not be and is being closed
+bool uvllhttpd_client_start (struct HttpServer *server, uvllhttpd_client_t *client);
+// nread bytes at base read from the connection, or a uv error
+void uvllhttpd_client_read (uvllhttpd_client_t *client, char const *base, ssize_t nread);
+// the same once decrypted, passed on to the parser
+void uvllhttpd_client_received (uvllhttpd_client_t *client, char const *base, ssize_t nread);
+// uv_try_write and uv_write to the connection, through TLS if it uses it
+int uvllhttpd_client_try_write (uvllhttpd_client_t *client, uv_buf_t const bufs[], unsigned int nbufs);
+int uvllhttpd_client_write (uv_write_t *req, uvllhttpd_client_t *client, uv_buf_t const bufs[],
+      unsigned int nbufs, uv_write_cb cb);
+
+void uvllhttpd_client_close (uvllhttpd_client_t *client);
+// cancels the request contexts of a connection that has ended
+void uvllhttpd_client_cancel_contexts (uvllhttpd_client_t *client);
+// passes a parsed request to on_request
+void uvllhttpd_client_dispatch (uvllhttpd_client_t *client, struct HttpRequest const *request);
+// writes out coalesced responses, before anything else is written to the connection
+void uvllhttpd_client_flush (uvllhttpd_client_t *client);
+// stops and restarts reading requests, for backpressure
+void uvllhttpd_client_pause (uvllhttpd_client_t *client);
+void uvllhttpd_client_resume (uvllhttpd_client_t *client);
+// parses what was held and reads on, once the request that blocked the connection is answered
+void uvllhttpd_client_unblock (uvllhttpd_client_t *client);
+
+void uvllhttpd_websocket_feed (struct WebSocket *ws, char const *at, size_t length);
+void uvllhttpd_websocket_free (struct WebSocket *ws);
+
+// frees a response the connection has taken over, once it has been written or dropped
+void uvllhttpd_response_release (struct HttpResponse *response, bool written);
+
+bool uvllhttpd_cache_serve (struct ResponseCache *cache, uvllhttpd_client_t *client, struct HttpRequest const *request);
+void uvllhttpd_cache_complete (struct HttpResponse *response, uv_buf_t const *bufs, size_t nbufs, size_t content_length);
+void uvllhttpd_cache_client_closed (uvllhttpd_client_t *client);
+// nothing will fill the entry, its waiters are passed to on_request
+void uvllhttpd_cache_abandon (struct ResponseCacheEntry *entry);
+
+// NULL unless this request is to be traced
+struct RequestTrace *uvllhttpd_trace_sample (struct HttpTrace *trace);
+// moves a list of records into the ring and frees them
+void uvllhttpd_trace_commit (struct HttpTrace *trace, struct RequestTrace *records);
+
+// records the time since started, in uv_hrtime
+void uvllhttpd_monitor_handler (struct LoopMonitor *monitor, struct HttpRequest const *request, uint64_t started);
+
+// unlinks the subscriber from its channel and frees it
+void uvllhttpd_sse_client_closed (struct SseSubscriber *subscriber);
+
+#ifdef UVLLHTTPD_IO_URING
+// listens on the bound fd and accepts into the server's ring
+int uvllhttpd_uring_listen (struct HttpServer *server, uv_os_fd_t fd);
+// cancels the receive, the connection is freed once it has ended
+void uvllhttpd_uring_client_closed (struct UringConnection *connection);
+void uvllhttpd_uring_client_pause (struct UringConnection *connection);
+void uvllhttpd_uring_client_resume (struct UringConnection *connection);
+// stops accepting, the ring goes once its connections have ended
+void uvllhttpd_uring_close (struct UringBackend *backend);
+#endif
+
+#ifdef UVLLHTTPD_TLS
+// NULL if OpenSSL fails to set up the connection
+struct TlsConnection *uvllhttpd_tls_connection_new (struct TlsContext *tls, uvllhttpd_client_t *client);
+void uvllhttpd_tls_connection_free (struct TlsConnection *connection);
+// decrypts into uvllhttpd_client_received, after the handshake
+void uvllhttpd_tls_read (struct TlsConnection *connection, char const *base, ssize_t nread);
+int uvllhttpd_tls_try_write (struct TlsConnection *connection, uv_buf_t const bufs[], unsigned int nbufs);
+int uvllhttpd_tls_write (uv_write_t *req, struct TlsConnection *connection, uv_buf_t const bufs[],
+      unsigned int nbufs, uv_write_cb cb);
+#endif
+
+#ifdef UVLLHTTPD_HTTP2
+// whether a connection's first bytes are, or start, the HTTP/2 connection preface
+bool uvllhttpd_http2_is_preface (char const *base, size_t length);
+// the connection speaks HTTP/2 from now on, false if nghttp2 fails to set up
+bool uvllhttpd_http2_start (uvllhttpd_client_t *client);
+// answers "Upgrade: h2c" and passes the request to on_request on stream 1,
+// false if the request does not ask for a valid upgrade
+bool uvllhttpd_http2_upgrade (uvllhttpd_client_t *client, struct HttpRequest const *request);
+void uvllhttpd_http2_feed (struct Http2Session *session, char const *base, size_t length);
+// takes over the response, bufs being its body
+void uvllhttpd_http2_respond (struct Http2Stream *stream, struct HttpResponse *response,
+      uv_buf_t const *bufs, size_t nbufs, size_t content_length);
+// resets the stream
+void uvllhttpd_http2_stream_close (struct Http2Stream *stream);
+// sends GOAWAY, the connection is closed once its streams are done
+void uvllhttpd_http2_drain (struct Http2Session *session);
+void uvllhttpd_http2_free (struct Http2Session *session);
+#endif
+
+// "GET /uri HTTP/1.1", to be freed
+char *uvllhttpd_access_log_request_line (struct HttpRequest const *request);
+// status 0 logs the status and size as unknown
+void uvllhttpd_access_log_record (struct AccessLog *log, char const *peer, char const *request_line,
+      int status, size_t bytes, uint64_t started);
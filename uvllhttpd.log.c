@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+#include "uvllhttpd.log.h"
+
+static void error_async_cb (uv_async_t *handle)
+{
+   struct AccessLog *log = (struct AccessLog *)handle->data;
+
+   int const error = atomic_exchange (&(log->_error), 0);
+   if (error != 0 && log->on_error != NULL) log->on_error (log, error);
+}
+
+// writer thread, reported on the loop
+static void report_error (struct AccessLog *log, int error)
+{
+   atomic_store (&(log->_error), error);
+   uv_async_send (&(log->_error_async));
+}
+
+static int open_log (char const *path, size_t *size)
+{
+   int fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+   if (fd < 0) return uv_translate_sys_error (errno);
+
+   struct stat st;
+   *size = fstat (fd, &st) == 0 ? (size_t)st.st_size : 0;
+   return fd;
+}
+
+static void rotate (struct AccessLog *log)
+{
+   size_t const length = strlen (log->path);
+   char rotated[length + 3];
+   memcpy (rotated, log->path, length);
+   memcpy (rotated + length, ".1", 3);
+
+   close (log->_fd);
+   log->_fd = -1;
+   if (rename (log->path, rotated) != 0) report_error (log, uv_translate_sys_error (errno));
+
+   int fd = open_log (log->path, &(log->_file_size));
+   if (fd < 0) report_error (log, fd);
+   else log->_fd = fd;
+}
+
+static void flush (struct AccessLog *log, size_t tail, size_t head)
+{
+   if (log->rotate_size > 0 && log->_file_size > 0 && log->_file_size + (head - tail) > log->rotate_size)
+   {
+      rotate (log);
+   }
+
+   while (tail != head)
+   {
+      size_t const offset = tail % log->buffer_size;
+      size_t length = head - tail;
+      if (length > log->buffer_size - offset) length = log->buffer_size - offset;
+
+      ssize_t n = log->_fd >= 0 ? write (log->_fd, log->_ring + offset, length) : (ssize_t)length;
+      if (n < 0)
+      {
+         if (errno == EINTR) continue;
+
+         // the batch is lost rather than blocking the loop once the ring is full
+         report_error (log, uv_translate_sys_error (errno));
+         n = length;
+      }
+      else
+      {
+         log->_file_size += n;
+      }
+
+      tail += n;
+      atomic_store_explicit (&(log->_tail), tail, memory_order_release);
+   }
+}
+
+static void writer_thread (void *arg)
+{
+   struct AccessLog *log = (struct AccessLog *)arg;
+   size_t const half = log->buffer_size / 2;
+   uint64_t const timeout = (uint64_t)log->flush_interval * 1000000;
+
+   for (;;)
+   {
+      size_t const tail = atomic_load_explicit (&(log->_tail), memory_order_relaxed);
+
+      uv_mutex_lock (&(log->_mutex));
+      size_t head = atomic_load_explicit (&(log->_head), memory_order_acquire);
+      bool stop = atomic_load (&(log->_stop));
+      if (!stop && head - tail < half)
+      {
+         uv_cond_timedwait (&(log->_cond), &(log->_mutex), timeout);
+         head = atomic_load_explicit (&(log->_head), memory_order_acquire);
+         stop = atomic_load (&(log->_stop));
+      }
+      uv_mutex_unlock (&(log->_mutex));
+
+      if (head != tail) flush (log, tail, head);
+      else if (stop) break;
+   }
+}
+
+int uvllhttpd_access_log_start (struct AccessLog *log, uv_loop_t *loop)
+{
+   if (log == NULL || loop == NULL || log->path == NULL) return UV_EINVAL;
+
+   if (log->buffer_size == 0) log->buffer_size = 1 << 20;
+   if (log->flush_interval == 0) log->flush_interval = 1000;
+
+   log->_loop = loop;
+   log->_ring = malloc (log->buffer_size);
+   if (log->_ring == NULL) return UV_ENOMEM;
+   atomic_init (&(log->_head), 0);
+   atomic_init (&(log->_tail), 0);
+   atomic_init (&(log->_error), 0);
+   atomic_init (&(log->_stop), false);
+
+   log->_wall_offset = (int64_t)time (NULL) * 1000 - (int64_t)uv_now (loop);
+   log->_date_second = -1;
+
+   int r = open_log (log->path, &(log->_file_size));
+   if (r < 0) goto free_ring;
+   log->_fd = r;
+
+   r = uv_async_init (loop, &(log->_error_async), error_async_cb);
+   if (r != 0) goto close_fd;
+   log->_error_async.data = log;
+
+   uv_mutex_init (&(log->_mutex));
+   uv_cond_init (&(log->_cond));
+
+   r = uv_thread_create (&(log->_thread), writer_thread, log);
+   if (r != 0)
+   {
+      uv_cond_destroy (&(log->_cond));
+      uv_mutex_destroy (&(log->_mutex));
+      uv_close ((uv_handle_t *)&(log->_error_async), NULL);
+      goto close_fd;
+   }
+
+   return 0;
+
+close_fd:
+   close (log->_fd);
+free_ring:
+   free (log->_ring);
+   log->_ring = NULL;
+   return r;
+}
+
+void uvllhttpd_access_log_stop (struct AccessLog *log)
+{
+   if (log->_ring == NULL) return;
+
+   uv_mutex_lock (&(log->_mutex));
+   atomic_store (&(log->_stop), true);
+   uv_cond_signal (&(log->_cond));
+   uv_mutex_unlock (&(log->_mutex));
+
+   uv_thread_join (&(log->_thread));
+
+   // errors of the final flush
+   error_async_cb (&(log->_error_async));
+   uv_close ((uv_handle_t *)&(log->_error_async), NULL);
+
+   uv_cond_destroy (&(log->_cond));
+   uv_mutex_destroy (&(log->_mutex));
+   if (log->_fd >= 0) close (log->_fd);
+   free (log->_ring);
+   log->_ring = NULL;
+}
+
+void uvllhttpd_access_log_write (struct AccessLog *log, char const *s, size_t length)
+{
+   size_t const head = atomic_load_explicit (&(log->_head), memory_order_relaxed);
+   size_t const tail = atomic_load_explicit (&(log->_tail), memory_order_acquire);
+
+   if (length > log->buffer_size - (head - tail))
+   {
+      log->dropped++;
+      return;
+   }
+
+   size_t const offset = head % log->buffer_size;
+   size_t const first = length < log->buffer_size - offset ? length : log->buffer_size - offset;
+   memcpy (log->_ring + offset, s, first);
+   memcpy (log->_ring, s + first, length - first);
+
+   atomic_store_explicit (&(log->_head), head + length, memory_order_release);
+
+   // the writer is only woken up when the ring becomes half full
+   size_t const half = log->buffer_size / 2;
+   if (head - tail < half && head + length - tail >= half)
+   {
+      uv_mutex_lock (&(log->_mutex));
+      uv_cond_signal (&(log->_cond));
+      uv_mutex_unlock (&(log->_mutex));
+   }
+}
+
+char *uvllhttpd_access_log_request_line (struct HttpRequest const *request)
+{
+   char const *method = llhttp_method_name (request->method);
+   size_t const length = strlen (method) + 1 + request->uri.len + 10;
+   char *line = malloc (length);
+   snprintf (line, length, "%s %.*s HTTP/%d.%d", method,
+         (int)request->uri.len, request->uri.base, request->version.major, request->version.minor);
+   return line;
+}
+
+void uvllhttpd_access_log_record (struct AccessLog *log, char const *peer, char const *request_line,
+      int status, size_t bytes, uint64_t started)
+{
+   static char const months[12][4] = {
+      "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+   };
+
+   uint64_t const now = uv_now (log->_loop);
+   int64_t const second = ((int64_t)now + log->_wall_offset) / 1000;
+   if (second != log->_date_second)
+   {
+      time_t const t = (time_t)second;
+      struct tm tm;
+      gmtime_r (&t, &tm);
+      snprintf (log->_date, sizeof(log->_date), "%02d/%s/%04d:%02d:%02d:%02d +0000",
+            tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+      log->_date_second = second;
+   }
+
+   char status_string[12] = "-";
+   char bytes_string[24] = "-";
+   if (status > 0)
+   {
+      snprintf (status_string, sizeof(status_string), "%d", status);
+      snprintf (bytes_string, sizeof(bytes_string), "%zu", bytes);
+   }
+
+   char line[1024];
+   int n = snprintf (line, sizeof(line), "%s - - [%s] \"%s\" %s %s %" PRIu64 "\n",
+         peer[0] != '\0' ? peer : "-", log->_date, request_line,
+         status_string, bytes_string, now - started);
+   if (n < 0) return;
+   if ((size_t)n >= sizeof(line))
+   {
+      // an overlong request line is cut short
+      n = sizeof(line) - 1;
+      line[n - 1] = '\n';
+   }
+
+   uvllhttpd_access_log_write (log, line, n);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdatomic.h>
+
+#include "uvllhttpd.h"
+
+struct AccessLog;
+
+// called on the loop thread with a uv error code
+typedef void (*uvllhttpd_access_log_error_handler) (struct AccessLog *log, int error);
+
+// Access log in the common log format, extended with the response time in
+// milliseconds. Records are formatted on the loop into a ring buffer which a
+// background thread writes out in batches, so logging costs the loop no
+// system calls. Meant to be used by the servers of a single loop; set its
+// fields, start it, then point HttpServer.access_log at it.
+struct AccessLog {
+   void *data;
+
+   // opened for appending
+   char const *path;
+   // once the file grows past this, it is renamed to path.1 and a new one
+   // is started. 0 never rotates.
+   size_t rotate_size;
+   // bytes buffered between the loop and the writer; records which do not
+   // fit are dropped and counted. Defaults to 1 MiB.
+   size_t buffer_size;
+   // milliseconds the writer waits for the buffer to fill up to half.
+   // Defaults to 1000.
+   unsigned int flush_interval;
+   uvllhttpd_access_log_error_handler on_error;
+
+   uint64_t dropped;
+
+   uv_loop_t *_loop;
+   uv_thread_t _thread;
+   uv_mutex_t _mutex;
+   uv_cond_t _cond;
+   uv_async_t _error_async;
+
+   char *_ring;
+   // only ever increase, written by the loop and the writer respectively
+   atomic_size_t _head;
+   atomic_size_t _tail;
+   atomic_int _error;
+   atomic_bool _stop;
+
+   int _fd;
+   size_t _file_size;
+
+   // wall clock of the loop time, with the formatted date cached per second
+   int64_t _wall_offset;
+   int64_t _date_second;
+   char _date[32];
+};
+
+int uvllhttpd_access_log_start (struct AccessLog *log, uv_loop_t *loop);
+// Writes out what is buffered and joins the writer thread.
+void uvllhttpd_access_log_stop (struct AccessLog *log);
+// Queues a line as is; it should end with a newline. Loop thread only.
+void uvllhttpd_access_log_write (struct AccessLog *log, char const *s, size_t length);
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+#include "uvllhttpd.monitor.h"
+
+void uvllhttpd_histogram_add (struct LatencyHistogram *histogram, uint64_t value)
+{
+   size_t bucket = 0;
+   while (bucket < UVLLHTTPD_HISTOGRAM_BUCKETS - 1 && (value >> bucket) != 0) bucket++;
+
+   histogram->buckets[bucket]++;
+   histogram->count++;
+   histogram->sum += value;
+   if (value > histogram->max) histogram->max = value;
+}
+
+uint64_t uvllhttpd_histogram_percentile (struct LatencyHistogram const *histogram, double percentile)
+{
+   if (histogram->count == 0) return 0;
+
+   uint64_t rank = (uint64_t)(histogram->count * percentile / 100.0 + 0.5);
+   if (rank == 0) rank = 1;
+
+   uint64_t seen = 0;
+   for (size_t i = 0; i < UVLLHTTPD_HISTOGRAM_BUCKETS - 1; i++)
+   {
+      seen += histogram->buckets[i];
+      if (seen >= rank)
+      {
+         uint64_t const bound = i == 0 ? 0 : ((uint64_t)1 << i) - 1;
+         return bound < histogram->max ? bound : histogram->max;
+      }
+   }
+   return histogram->max;
+}
+
+static void timer_cb (uv_timer_t *handle)
+{
+   struct LoopMonitor *monitor = (struct LoopMonitor *)handle->data;
+
+   uint64_t const now = uv_hrtime ();
+   uvllhttpd_histogram_add (&(monitor->lag), now > monitor->_timer_due ? (now - monitor->_timer_due) / 1000 : 0);
+   monitor->_timer_due = now + (uint64_t)monitor->interval * 1000000;
+}
+
+static void prepare_cb (uv_prepare_t *handle)
+{
+   struct LoopMonitor *monitor = (struct LoopMonitor *)handle->data;
+
+   // the previous iteration, less the time its poll waited
+   uint64_t const now = uv_hrtime ();
+   uint64_t const idle = uv_metrics_idle_time (handle->loop);
+   if (monitor->_prepare_time != 0)
+   {
+      uint64_t const elapsed = now - monitor->_prepare_time;
+      uint64_t const waited = idle - monitor->_idle_time;
+      uvllhttpd_histogram_add (&(monitor->iteration), elapsed > waited ? (elapsed - waited) / 1000 : 0);
+   }
+   monitor->_prepare_time = now;
+   monitor->_idle_time = idle;
+}
+
+int uvllhttpd_monitor_start (struct LoopMonitor *monitor, uv_loop_t *loop)
+{
+   if (monitor == NULL || loop == NULL) return UV_EINVAL;
+
+   int const r = uv_loop_configure (loop, UV_METRICS_IDLE_TIME);
+   if (r != 0) return r;
+
+   if (monitor->interval == 0) monitor->interval = 100;
+
+   uv_timer_init (loop, &(monitor->_timer));
+   uv_prepare_init (loop, &(monitor->_prepare));
+   monitor->_timer.data = monitor;
+   monitor->_prepare.data = monitor;
+
+   monitor->_timer_due = uv_hrtime () + (uint64_t)monitor->interval * 1000000;
+   monitor->_prepare_time = 0;
+
+   uv_timer_start (&(monitor->_timer), timer_cb, monitor->interval, monitor->interval);
+   uv_prepare_start (&(monitor->_prepare), prepare_cb);
+
+   uv_unref ((uv_handle_t *)&(monitor->_timer));
+   uv_unref ((uv_handle_t *)&(monitor->_prepare));
+
+   return 0;
+}
+
+void uvllhttpd_monitor_stop (struct LoopMonitor *monitor)
+{
+   uv_close ((uv_handle_t *)&(monitor->_timer), NULL);
+   uv_close ((uv_handle_t *)&(monitor->_prepare), NULL);
+}
+
+static struct LatencySummary summarize (struct LatencyHistogram const *histogram)
+{
+   return (struct LatencySummary) {
+      .count = histogram->count,
+      .mean = histogram->count > 0 ? histogram->sum / histogram->count : 0,
+      .p50 = uvllhttpd_histogram_percentile (histogram, 50),
+      .p99 = uvllhttpd_histogram_percentile (histogram, 99),
+      .max = histogram->max,
+   };
+}
+
+void uvllhttpd_monitor_stats (struct LoopMonitor const *monitor, struct LoopStats *stats)
+{
+   stats->lag = summarize (&(monitor->lag));
+   stats->iteration = summarize (&(monitor->iteration));
+   stats->handler = summarize (&(monitor->handler));
+   stats->slow_handlers = monitor->slow_handlers;
+}
+
+void uvllhttpd_monitor_reset (struct LoopMonitor *monitor)
+{
+   memset (&(monitor->lag), 0, sizeof(monitor->lag));
+   memset (&(monitor->iteration), 0, sizeof(monitor->iteration));
+   memset (&(monitor->handler), 0, sizeof(monitor->handler));
+   memset (&(monitor->slowest), 0, sizeof(monitor->slowest));
+   monitor->slow_handlers = 0;
+}
+
+void uvllhttpd_monitor_handler (struct LoopMonitor *monitor, struct HttpRequest const *request, uint64_t started)
+{
+   uint64_t const elapsed = (uv_hrtime () - started) / 1000;
+   uvllhttpd_histogram_add (&(monitor->handler), elapsed);
+
+   if (monitor->slow_handler_threshold == 0 || elapsed < monitor->slow_handler_threshold) return;
+
+   monitor->slow_handlers++;
+   if (elapsed > monitor->slowest.elapsed)
+   {
+      size_t const length = request->uri.len < sizeof(monitor->slowest.uri) - 1 ?
+         request->uri.len : sizeof(monitor->slowest.uri) - 1;
+      memcpy (monitor->slowest.uri, request->uri.base, length);
+      monitor->slowest.uri[length] = '\0';
+      monitor->slowest.method = request->method;
+      monitor->slowest.elapsed = elapsed;
+   }
+
+   if (monitor->on_slow_handler != NULL) monitor->on_slow_handler (monitor, request, elapsed);
+}
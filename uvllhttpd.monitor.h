@@ -0,0 +1,83 @@
+#pragma once
+
+#include "uvllhttpd.h"
+
+#define UVLLHTTPD_HISTOGRAM_BUCKETS 32
+
+// Microseconds in power of two buckets: bucket 0 counts 0,
+// bucket i the values in [2^(i-1), 2^i), the last one everything above.
+struct LatencyHistogram {
+   uint64_t count;
+   uint64_t sum;
+   uint64_t max;
+   uint64_t buckets[UVLLHTTPD_HISTOGRAM_BUCKETS];
+};
+
+void uvllhttpd_histogram_add (struct LatencyHistogram *histogram, uint64_t value);
+// upper bound of the bucket holding the given percentile (0 to 100), at most max
+uint64_t uvllhttpd_histogram_percentile (struct LatencyHistogram const *histogram, double percentile);
+
+struct LoopMonitor;
+
+// request is the one the handler was given; elapsed is in microseconds
+typedef void (*uvllhttpd_slow_handler_cb) (struct LoopMonitor *monitor, struct HttpRequest const *request, uint64_t elapsed);
+
+// Measures how late the loop runs timers, how long each iteration works
+// outside of waiting in poll, and how long each request handler runs.
+// Starting it configures the loop with UV_METRICS_IDLE_TIME. Meant to be
+// shared by the servers of a single loop; start it, then point
+// HttpServer.monitor at it.
+struct LoopMonitor {
+   void *data;
+
+   // milliseconds between lag samples, defaults to 100
+   unsigned int interval;
+   // microseconds, 0 disables slow handler reports
+   uint64_t slow_handler_threshold;
+   uvllhttpd_slow_handler_cb on_slow_handler;
+
+   // how much later than scheduled the sampling timer fired
+   struct LatencyHistogram lag;
+   // time between two prepares not spent waiting for events, so including
+   // the I/O callbacks and the handlers they run
+   struct LatencyHistogram iteration;
+   // on_headers and on_request calls
+   struct LatencyHistogram handler;
+
+   uint64_t slow_handlers;
+   // the slowest handler so far
+   struct {
+      uint64_t elapsed;
+      uint8_t method;
+      char uri[64];
+   } slowest;
+
+   uv_timer_t _timer;
+   uv_prepare_t _prepare;
+   uint64_t _timer_due;
+   // when the last prepare ran, and the loop's idle time then
+   uint64_t _prepare_time;
+   uint64_t _idle_time;
+};
+
+struct LatencySummary {
+   uint64_t count;
+   uint64_t mean;
+   uint64_t p50;
+   uint64_t p99;
+   uint64_t max;
+};
+
+struct LoopStats {
+   struct LatencySummary lag;
+   struct LatencySummary iteration;
+   struct LatencySummary handler;
+   uint64_t slow_handlers;
+};
+
+// The handles do not keep the loop alive.
+int uvllhttpd_monitor_start (struct LoopMonitor *monitor, uv_loop_t *loop);
+void uvllhttpd_monitor_stop (struct LoopMonitor *monitor);
+void uvllhttpd_monitor_stats (struct LoopMonitor const *monitor, struct LoopStats *stats);
+// Clears the histograms and the slow handler records.
+void uvllhttpd_monitor_reset (struct LoopMonitor *monitor);
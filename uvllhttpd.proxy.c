@@ -0,0 +1,1011 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+#include "uvllhttpd.proxy.h"
+
+// bytes queued for writing on one side before reading from the other pauses
+#define PROXY_HIGH_WATER (256 * 1024)
+#define PROXY_LOW_WATER (64 * 1024)
+#define PROXY_READ_SIZE (64 * 1024)
+
+struct ProxyConnection {
+   union {
+      uv_handle_t handle;
+      uv_stream_t stream;
+      uv_tcp_t tcp;
+      uv_pipe_t pipe;
+   } handle;
+   uv_connect_t connect;
+   struct ProxyUpstream *upstream;
+   struct ProxyConnection *next_idle;
+   struct ProxyExchange *exchange;
+
+   llhttp_t parser;
+   // the buffer being parsed, referenced by the body writes to the client
+   struct SharedBuffer *read_buffer;
+   uint64_t idle_since;
+   uint8_t idle;
+   uint8_t paused;
+};
+
+enum ProxyHeadState {
+   ProxyHeadState_status,
+   ProxyHeadState_field,
+   ProxyHeadState_value,
+};
+
+struct ProxyExchange {
+   // one for the exchange, one per queued write
+   size_t refcount;
+   struct ProxyUpstream *upstream;
+   struct ProxyConnection *connection;
+   struct RequestContext *context;
+
+   // kept to retry on a fresh connection
+   uv_buf_t request_head;
+   uint8_t method;
+   uint8_t request_chunked;
+   uint8_t request_body_sent;
+   uint8_t request_complete;
+   uint8_t retried;
+   uint8_t client_paused;
+
+   // the response head, rebuilt without hop-by-hop headers
+   uv_buf_t head;
+   size_t head_capacity;
+   size_t field_start;
+   size_t field_length;
+   enum ProxyHeadState head_state;
+   uint8_t has_length;
+   // the values of the response's Connection headers, naming more hop-by-hop ones
+   uv_buf_t connection_tokens;
+
+   uint8_t http10;
+   uint8_t keep_alive;
+   uint8_t interim;
+   uint8_t response_started;
+   uint8_t response_chunked;
+   uint8_t response_complete;
+   uint8_t close_client;
+   size_t client_writes;
+   uint8_t finished;
+
+   // the access log line, recorded with the status and body size the client was sent
+   char *log_request;
+   uint64_t log_started;
+   unsigned int status;
+   size_t response_bytes;
+};
+
+struct proxy_write {
+   uv_write_t req;
+   struct ProxyExchange *exchange;
+   struct SharedBuffer *buffer;
+   char bytes[];
+};
+
+static struct ProxyConnection *connection_open (struct ProxyUpstream *upstream);
+static void connection_close (struct ProxyConnection *connection);
+static void exchange_upstream_failed (struct ProxyExchange *exchange);
+static void exchange_finish (struct ProxyExchange *exchange);
+
+static bool is_hop_by_hop (char const *field, size_t length)
+{
+   static char const * const names[] = {
+      "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding", "Upgrade",
+   };
+   for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+   {
+      if (strlen (names[i]) == length && strncasecmp (names[i], field, length) == 0) return true;
+   }
+   return false;
+}
+
+// whether the comma separated tokens of a Connection header name the field
+static bool tokens_name (char const *tokens, size_t tokens_length, char const *field, size_t length)
+{
+   char const *p = tokens;
+   char const *end = tokens + tokens_length;
+   while (p < end)
+   {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+
+      char const *begin = p;
+      while (p < end && *p != ',') p++;
+
+      char const *last = p;
+      while (last > begin && (last[-1] == ' ' || last[-1] == '\t')) last--;
+
+      if ((size_t)(last - begin) == length && strncasecmp (begin, field, length) == 0) return true;
+   }
+   return false;
+}
+
+static bool request_connection_names (struct HttpRequest const *request, char const *field, size_t length)
+{
+   for (size_t i = 0; i < request->header_count; i++)
+   {
+      struct HttpHeader const *header = &(request->headers[i]);
+      if (header->field.len == 10 && strncasecmp (header->field.base, "Connection", 10) == 0 &&
+            tokens_name (header->value.base, header->value.len, field, length))
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+static uvllhttpd_client_t *exchange_client (struct ProxyExchange *exchange)
+{
+   uv_tcp_t *handle = exchange->context->_handle;
+   if (handle == NULL || uv_is_closing ((uv_handle_t *)handle)) return NULL;
+   return (uvllhttpd_client_t *)handle;
+}
+
+static void exchange_release (struct ProxyExchange *exchange)
+{
+   if (--exchange->refcount > 0) return;
+
+   free (exchange->request_head.base);
+   if (exchange->head.base != NULL) free (exchange->head.base);
+   if (exchange->connection_tokens.base != NULL) free (exchange->connection_tokens.base);
+   if (exchange->log_request != NULL) free (exchange->log_request);
+   uvllhttpd_context_unref (exchange->context);
+   free (exchange);
+}
+
+// writing to the client
+
+static void client_write_cb (uv_write_t *req, int status)
+{
+   struct proxy_write *w = (struct proxy_write *)req;
+   struct ProxyExchange *exchange = w->exchange;
+   uvllhttpd_client_t *client = exchange_client (exchange);
+
+   exchange->client_writes--;
+   if (client != NULL)
+   {
+      struct ProxyConnection *connection = exchange->connection;
+      if (connection != NULL && connection->paused &&
+            client->handle.write_queue_size < PROXY_LOW_WATER)
+      {
+         connection->paused = 0;
+         uv_read_start (&(connection->handle.stream), connection->handle.stream.alloc_cb, connection->handle.stream.read_cb);
+      }
+
+      if (exchange->close_client && exchange->response_complete && exchange->client_writes == 0)
+      {
+         uvllhttpd_client_close (client);
+      }
+   }
+
+   if (w->buffer != NULL) uvllhttpd_shared_buffer_unref (w->buffer);
+   exchange_release (exchange);
+   free (w);
+}
+
+// The first copied bufs are copied, the others must stay valid: static or within buffer.
+static void client_write (struct ProxyExchange *exchange, uv_buf_t const *bufs, size_t nbufs, size_t copied,
+      struct SharedBuffer *buffer)
+{
+   uvllhttpd_client_t *client = exchange_client (exchange);
+   if (client == NULL) return;
+
+   // after the responses coalesced before it
+   uvllhttpd_client_flush (client);
+
+   size_t copy_length = 0;
+   for (size_t i = 0; i < copied; i++) copy_length += bufs[i].len;
+
+   struct proxy_write *w = malloc (sizeof(struct proxy_write) + copy_length);
+   uv_buf_t out[nbufs];
+   char *p = w->bytes;
+   for (size_t i = 0; i < nbufs; i++)
+   {
+      out[i] = bufs[i];
+      if (i < copied)
+      {
+         memcpy (p, bufs[i].base, bufs[i].len);
+         out[i].base = p;
+         p += bufs[i].len;
+      }
+   }
+
+   w->exchange = exchange;
+   w->buffer = buffer != NULL ? uvllhttpd_shared_buffer_ref (buffer) : NULL;
+   exchange->refcount++;
+   exchange->client_writes++;
+
+   if (uvllhttpd_client_write (&(w->req), client, out, nbufs, client_write_cb) != 0)
+   {
+      if (w->buffer != NULL) uvllhttpd_shared_buffer_unref (w->buffer);
+      exchange->client_writes--;
+      exchange->refcount--;
+      free (w);
+      uvllhttpd_client_close (client);
+      return;
+   }
+
+   struct ProxyConnection *connection = exchange->connection;
+   if (connection != NULL && !connection->paused && client->handle.write_queue_size > PROXY_HIGH_WATER)
+   {
+      connection->paused = 1;
+      uv_read_stop (&(connection->handle.stream));
+   }
+}
+
+// writing to the upstream
+
+static void upstream_write_cb (uv_write_t *req, int status)
+{
+   struct proxy_write *w = (struct proxy_write *)req;
+   struct ProxyExchange *exchange = w->exchange;
+
+   struct ProxyConnection *connection = exchange->connection;
+   uvllhttpd_client_t *client = exchange_client (exchange);
+   if (exchange->client_paused && client != NULL &&
+         (connection == NULL || connection->handle.stream.write_queue_size < PROXY_LOW_WATER))
+   {
+      exchange->client_paused = 0;
+      uvllhttpd_client_resume (client);
+   }
+
+   exchange_release (exchange);
+   free (w);
+}
+
+static void upstream_write (struct ProxyExchange *exchange, uv_buf_t const *bufs, size_t nbufs)
+{
+   struct ProxyConnection *connection = exchange->connection;
+   if (connection == NULL) return;
+
+   size_t length = 0;
+   for (size_t i = 0; i < nbufs; i++) length += bufs[i].len;
+
+   struct proxy_write *w = malloc (sizeof(struct proxy_write) + length);
+   w->exchange = exchange;
+   w->buffer = NULL;
+   char *p = w->bytes;
+   for (size_t i = 0; i < nbufs; i++)
+   {
+      memcpy (p, bufs[i].base, bufs[i].len);
+      p += bufs[i].len;
+   }
+   exchange->refcount++;
+
+   // queued by libuv while the connection is still connecting
+   uv_buf_t const buf = { .base = w->bytes, .len = length };
+   if (uv_write (&(w->req), &(connection->handle.stream), &buf, 1, upstream_write_cb) != 0)
+   {
+      exchange->refcount--;
+      free (w);
+      connection_close (connection);
+      exchange_upstream_failed (exchange);
+      return;
+   }
+
+   uvllhttpd_client_t *client = exchange_client (exchange);
+   if (client != NULL && !exchange->client_paused &&
+         connection->handle.stream.write_queue_size > PROXY_HIGH_WATER)
+   {
+      exchange->client_paused = 1;
+      uvllhttpd_client_pause (client);
+   }
+}
+
+// the response head
+
+static void head_append (struct ProxyExchange *exchange, char const *s, size_t length)
+{
+   if (exchange->head.len + length > exchange->head_capacity)
+   {
+      size_t capacity = exchange->head_capacity > 0 ? exchange->head_capacity * 2 : 512;
+      if (capacity < exchange->head.len + length) capacity = exchange->head.len + length;
+      exchange->head.base = realloc (exchange->head.base, capacity);
+      exchange->head_capacity = capacity;
+   }
+   memcpy (exchange->head.base + exchange->head.len, s, length);
+   exchange->head.len += length;
+}
+
+static void head_status (struct ProxyExchange *exchange, llhttp_t const *parser)
+{
+   if (exchange->head.len > 0) return;
+
+   char line[16];
+   int n = snprintf (line, sizeof(line), "HTTP/1.1 %03u ", parser->status_code);
+   head_append (exchange, line, n);
+}
+
+// ends the status line or the last header, which is dropped if hop-by-hop
+static void head_end_line (struct ProxyExchange *exchange, llhttp_t const *parser)
+{
+   if (exchange->head_state == ProxyHeadState_status)
+   {
+      head_status (exchange, parser);
+      head_append (exchange, "\r\n", 2);
+   }
+   else if (exchange->head_state == ProxyHeadState_value)
+   {
+      char const *field = exchange->head.base + exchange->field_start;
+      if (exchange->field_length == 10 && strncasecmp (field, "Connection", 10) == 0)
+      {
+         char const *value = field + exchange->field_length + 2;
+         size_t const value_length = exchange->head.base + exchange->head.len - value;
+         uv_buf_t *tokens = &(exchange->connection_tokens);
+         tokens->base = realloc (tokens->base, tokens->len + value_length + 1);
+         memcpy (tokens->base + tokens->len, value, value_length);
+         tokens->len += value_length;
+         tokens->base[tokens->len++] = ',';
+      }
+      if (is_hop_by_hop (field, exchange->field_length))
+      {
+         exchange->head.len = exchange->field_start;
+         return;
+      }
+      if (exchange->field_length == 14 && strncasecmp (field, "Content-Length", 14) == 0)
+      {
+         exchange->has_length = 1;
+      }
+      head_append (exchange, "\r\n", 2);
+   }
+}
+
+// drops the header lines named by the Connection headers, which may follow them
+static void head_drop_connection_tokens (struct ProxyExchange *exchange)
+{
+   uv_buf_t const tokens = exchange->connection_tokens;
+   if (tokens.len == 0) return;
+
+   char *line = memchr (exchange->head.base, '\n', exchange->head.len) + 1;
+   char *out = line;
+   char * const end = exchange->head.base + exchange->head.len;
+   while (line < end)
+   {
+      char *next = memchr (line, '\n', end - line) + 1;
+      char const *colon = memchr (line, ':', next - line);
+      if (colon == NULL || !tokens_name (tokens.base, tokens.len, line, colon - line))
+      {
+         memmove (out, line, next - line);
+         out += next - line;
+      }
+      line = next;
+   }
+   exchange->head.len = out - exchange->head.base;
+}
+
+static void head_reset (struct ProxyExchange *exchange)
+{
+   exchange->head.len = 0;
+   exchange->head_state = ProxyHeadState_status;
+   exchange->has_length = 0;
+   exchange->connection_tokens.len = 0;
+}
+
+static int proxy_on_status (llhttp_t *parser, char const *at, size_t length)
+{
+   struct ProxyExchange *exchange = ((struct ProxyConnection *)parser->data)->exchange;
+
+   head_status (exchange, parser);
+   head_append (exchange, at, length);
+   return 0;
+}
+
+static int proxy_on_header_field (llhttp_t *parser, char const *at, size_t length)
+{
+   struct ProxyExchange *exchange = ((struct ProxyConnection *)parser->data)->exchange;
+
+   if (exchange->head_state != ProxyHeadState_field)
+   {
+      head_end_line (exchange, parser);
+      exchange->field_start = exchange->head.len;
+      exchange->head_state = ProxyHeadState_field;
+   }
+   head_append (exchange, at, length);
+   return 0;
+}
+
+static int proxy_on_header_value (llhttp_t *parser, char const *at, size_t length)
+{
+   struct ProxyExchange *exchange = ((struct ProxyConnection *)parser->data)->exchange;
+
+   if (exchange->head_state == ProxyHeadState_field)
+   {
+      exchange->field_length = exchange->head.len - exchange->field_start;
+      head_append (exchange, ": ", 2);
+      exchange->head_state = ProxyHeadState_value;
+   }
+   head_append (exchange, at, length);
+   return 0;
+}
+
+static int proxy_on_headers_complete (llhttp_t *parser)
+{
+   struct ProxyExchange *exchange = ((struct ProxyConnection *)parser->data)->exchange;
+   head_end_line (exchange, parser);
+   head_drop_connection_tokens (exchange);
+
+   unsigned int const status = parser->status_code;
+   if (status >= 100 && status < 200)
+   {
+      // interim responses are passed on for 100 Continue only
+      exchange->interim = 1;
+      if (status == 100)
+      {
+         head_append (exchange, "\r\n", 2);
+         client_write (exchange, &(exchange->head), 1, 1, NULL);
+      }
+      head_reset (exchange);
+      return 0;
+   }
+
+   exchange->status = status;
+   bool const no_body = exchange->method == HTTP_HEAD || status == 204 || status == 304;
+   if (!no_body && !exchange->has_length)
+   {
+      // re-chunked, or delimited by closing an HTTP/1.0 client
+      if (exchange->http10) exchange->close_client = 1;
+      else exchange->response_chunked = 1;
+   }
+   // a shutdown may have begun since the request was sent up
+   uvllhttpd_client_t *client = exchange_client (exchange);
+   if (!exchange->keep_alive || (client != NULL && client->server->_draining)) exchange->close_client = 1;
+
+   if (exchange->close_client && !exchange->http10) head_append (exchange, "Connection: close\r\n", 19);
+   else if (!exchange->close_client && exchange->http10) head_append (exchange, "Connection: keep-alive\r\n", 24);
+   if (exchange->response_chunked) head_append (exchange, "Transfer-Encoding: chunked\r\n", 28);
+   head_append (exchange, "\r\n", 2);
+
+   exchange->response_started = 1;
+   client_write (exchange, &(exchange->head), 1, 1, NULL);
+
+   // no body follows the headers of a response to HEAD
+   return exchange->method == HTTP_HEAD ? 1 : 0;
+}
+
+static int proxy_on_body (llhttp_t *parser, char const *at, size_t length)
+{
+   struct ProxyConnection *connection = (struct ProxyConnection *)parser->data;
+   struct ProxyExchange *exchange = connection->exchange;
+   exchange->response_bytes += length;
+
+   uv_buf_t body = { .base = (char *)at, .len = length };
+   if (exchange->response_chunked)
+   {
+      char line[20];
+      uv_buf_t bufs[3] = {
+         { .base = line, .len = snprintf (line, sizeof(line), "%zx\r\n", length) },
+         body,
+         { .base = (char *)"\r\n", .len = 2 },
+      };
+      client_write (exchange, bufs, 3, 1, connection->read_buffer);
+   }
+   else
+   {
+      client_write (exchange, &body, 1, 0, connection->read_buffer);
+   }
+   return 0;
+}
+
+static int proxy_on_message_complete (llhttp_t *parser)
+{
+   struct ProxyConnection *connection = (struct ProxyConnection *)parser->data;
+   struct ProxyExchange *exchange = connection->exchange;
+
+   if (exchange->interim)
+   {
+      exchange->interim = 0;
+      return 0;
+   }
+
+   if (exchange->response_chunked)
+   {
+      uv_buf_t const last = { .base = (char *)"0\r\n\r\n", .len = 5 };
+      client_write (exchange, &last, 1, 1, NULL);
+   }
+   exchange->response_complete = 1;
+
+   uvllhttpd_client_t *client = exchange_client (exchange);
+   if (exchange->close_client && exchange->client_writes == 0 && client != NULL)
+   {
+      uvllhttpd_client_close (client);
+   }
+
+   // the upstream answered before the whole body was sent, the connection is not reusable
+   if (!exchange->request_complete) connection_close (connection);
+
+   // nothing else is expected on this connection until the next request; the exchange is
+   // finished once llhttp_execute has returned, as the next request may take the connection
+   return HPE_PAUSED;
+}
+
+static llhttp_settings_t const response_settings = {
+   .on_status           = proxy_on_status,
+   .on_header_field     = proxy_on_header_field,
+   .on_header_value     = proxy_on_header_value,
+   .on_headers_complete = proxy_on_headers_complete,
+   .on_body             = proxy_on_body,
+   .on_message_complete = proxy_on_message_complete,
+};
+
+// upstream connections
+
+static void connection_close_cb (uv_handle_t *handle)
+{
+   free (handle);
+}
+
+static void idle_remove (struct ProxyConnection *connection)
+{
+   struct ProxyUpstream *upstream = connection->upstream;
+   struct ProxyConnection **p = &(upstream->_idle);
+   while (*p != connection) p = &((*p)->next_idle);
+   *p = connection->next_idle;
+
+   connection->next_idle = NULL;
+   connection->idle = 0;
+   upstream->_idle_count--;
+}
+
+static void connection_close (struct ProxyConnection *connection)
+{
+   if (connection->idle) idle_remove (connection);
+   if (connection->exchange != NULL)
+   {
+      connection->exchange->connection = NULL;
+      connection->exchange = NULL;
+   }
+
+   if (!uv_is_closing (&(connection->handle.handle)))
+   {
+      uv_close (&(connection->handle.handle), connection_close_cb);
+   }
+}
+
+// the connection has failed, and with it the exchange it carried
+static void connection_fail (struct ProxyConnection *connection)
+{
+   struct ProxyExchange *exchange = connection->exchange;
+   connection_close (connection);
+   if (exchange != NULL) exchange_upstream_failed (exchange);
+}
+
+static void connection_alloc_cb (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+   struct SharedBuffer *buffer = uvllhttpd_shared_buffer_new (NULL, PROXY_READ_SIZE);
+   buf->base = buffer->base;
+   buf->len = buffer->len;
+}
+
+static bool connection_answered (struct ProxyConnection *connection)
+{
+   struct ProxyExchange *exchange = connection->exchange;
+   return exchange != NULL && exchange->response_complete && exchange->request_complete;
+}
+
+static void connection_read_cb (uv_stream_t *stream, ssize_t nread, uv_buf_t const *buf)
+{
+   struct ProxyConnection *connection = (struct ProxyConnection *)stream;
+   struct SharedBuffer *buffer = buf->base != NULL ?
+      (struct SharedBuffer *)(buf->base - offsetof(struct SharedBuffer, base)) : NULL;
+
+   if (nread > 0)
+   {
+      if (connection->exchange == NULL)
+      {
+         // an idle connection has nothing to say
+         connection_close (connection);
+      }
+      else
+      {
+         connection->read_buffer = buffer;
+         enum llhttp_errno err = llhttp_execute (&(connection->parser), buf->base, nread);
+         connection->read_buffer = NULL;
+
+         if (connection_answered (connection)) exchange_finish (connection->exchange);
+         else if (err != HPE_OK && err != HPE_PAUSED) connection_fail (connection);
+      }
+   }
+   else if (nread < 0)
+   {
+      // a response without length ends with the connection
+      if (nread == UV_EOF && connection->exchange != NULL && connection->exchange->response_started)
+      {
+         llhttp_finish (&(connection->parser));
+      }
+
+      if (connection_answered (connection)) exchange_finish (connection->exchange);
+      else if (connection->exchange != NULL) connection_fail (connection);
+      else connection_close (connection);
+   }
+
+   if (buffer != NULL) uvllhttpd_shared_buffer_unref (buffer);
+}
+
+static void connect_cb (uv_connect_t *req, int status)
+{
+   struct ProxyConnection *connection = (struct ProxyConnection *)
+      ((char *)req - offsetof(struct ProxyConnection, connect));
+
+   if (uv_is_closing (&(connection->handle.handle))) return;
+
+   if (status < 0)
+   {
+      connection_fail (connection);
+      return;
+   }
+
+   uv_read_start (&(connection->handle.stream), connection_alloc_cb, connection_read_cb);
+}
+
+static struct ProxyConnection *connection_open (struct ProxyUpstream *upstream)
+{
+   struct ProxyConnection *connection = calloc (1, sizeof(struct ProxyConnection));
+   connection->upstream = upstream;
+
+   if (upstream->_path != NULL)
+   {
+      uv_pipe_init (upstream->_loop, &(connection->handle.pipe), 0);
+      uv_pipe_connect (&(connection->connect), &(connection->handle.pipe), upstream->_path, connect_cb);
+   }
+   else
+   {
+      uv_tcp_init (upstream->_loop, &(connection->handle.tcp));
+      uv_tcp_nodelay (&(connection->handle.tcp), 1);
+      if (uv_tcp_connect (&(connection->connect), &(connection->handle.tcp),
+               (struct sockaddr const *)&(upstream->_addr), connect_cb) != 0)
+      {
+         uv_close (&(connection->handle.handle), connection_close_cb);
+         return NULL;
+      }
+   }
+   return connection;
+}
+
+// the pool
+
+static void pool_push (struct ProxyConnection *connection)
+{
+   struct ProxyUpstream *upstream = connection->upstream;
+   if (upstream->_idle_count >= upstream->max_idle)
+   {
+      connection_close (connection);
+      return;
+   }
+
+   connection->idle = 1;
+   connection->idle_since = uv_now (upstream->_loop);
+   connection->next_idle = upstream->_idle;
+   upstream->_idle = connection;
+   upstream->_idle_count++;
+}
+
+// connects ahead of time, so that requests find an open connection
+static void pool_fill (struct ProxyUpstream *upstream)
+{
+   while (upstream->_idle_count < upstream->min_idle && upstream->_idle_count < upstream->max_idle)
+   {
+      struct ProxyConnection *connection = connection_open (upstream);
+      if (connection == NULL) break;
+      pool_push (connection);
+   }
+}
+
+static void idle_timer_cb (uv_timer_t *handle)
+{
+   struct ProxyUpstream *upstream = (struct ProxyUpstream *)handle->data;
+   uint64_t const now = uv_now (upstream->_loop);
+
+   struct ProxyConnection *connection = upstream->_idle;
+   while (connection != NULL && upstream->_idle_count > upstream->min_idle)
+   {
+      struct ProxyConnection *next = connection->next_idle;
+      if (now - connection->idle_since >= upstream->idle_timeout) connection_close (connection);
+      connection = next;
+   }
+}
+
+static int upstream_start (struct ProxyUpstream *upstream, uv_loop_t *loop)
+{
+   upstream->_loop = loop;
+   upstream->_idle = NULL;
+   upstream->_idle_count = 0;
+   if (upstream->max_idle == 0) upstream->max_idle = 16;
+
+   uv_timer_init (loop, &(upstream->_timer));
+   upstream->_timer.data = upstream;
+   if (upstream->idle_timeout > 0)
+   {
+      uv_timer_start (&(upstream->_timer), idle_timer_cb, upstream->idle_timeout, upstream->idle_timeout);
+      uv_unref ((uv_handle_t *)&(upstream->_timer));
+   }
+
+   pool_fill (upstream);
+   return 0;
+}
+
+int uvllhttpd_upstream_init_tcp (struct ProxyUpstream *upstream, uv_loop_t *loop, char const *host, unsigned short port)
+{
+   if (upstream == NULL || loop == NULL || host == NULL) return UV_EINVAL;
+
+   int r = uv_ip4_addr (host, port, (struct sockaddr_in *)&(upstream->_addr));
+   if (r != 0) r = uv_ip6_addr (host, port, (struct sockaddr_in6 *)&(upstream->_addr));
+   if (r != 0) return r;
+
+   upstream->_path = NULL;
+   return upstream_start (upstream, loop);
+}
+
+int uvllhttpd_upstream_init_unix (struct ProxyUpstream *upstream, uv_loop_t *loop, char const *path)
+{
+   if (upstream == NULL || loop == NULL || path == NULL) return UV_EINVAL;
+
+   upstream->_path = strdup (path);
+   return upstream_start (upstream, loop);
+}
+
+void uvllhttpd_upstream_close (struct ProxyUpstream *upstream)
+{
+   uv_close ((uv_handle_t *)&(upstream->_timer), NULL);
+
+   while (upstream->_idle != NULL) connection_close (upstream->_idle);
+
+   if (upstream->_path != NULL) free (upstream->_path);
+   upstream->_path = NULL;
+}
+
+// the exchange
+
+static void exchange_dispatch (struct ProxyExchange *exchange)
+{
+   struct ProxyUpstream *upstream = exchange->upstream;
+
+   struct ProxyConnection *connection = upstream->_idle;
+   if (connection != NULL) idle_remove (connection);
+   else connection = connection_open (upstream);
+
+   pool_fill (upstream);
+
+   if (connection == NULL)
+   {
+      exchange_upstream_failed (exchange);
+      return;
+   }
+
+   connection->exchange = exchange;
+   exchange->connection = connection;
+   llhttp_init (&(connection->parser), HTTP_RESPONSE, &response_settings);
+   connection->parser.data = connection;
+
+   head_reset (exchange);
+   upstream_write (exchange, &(exchange->request_head), 1);
+}
+
+static void exchange_upstream_failed (struct ProxyExchange *exchange)
+{
+   uvllhttpd_client_t *client = exchange_client (exchange);
+
+   // an idle connection may have been closed by the upstream just now
+   bool const retryable = !exchange->retried && !exchange->response_started && !exchange->request_body_sent &&
+      (exchange->method == HTTP_GET || exchange->method == HTTP_HEAD);
+   if (retryable && client != NULL)
+   {
+      exchange->retried = 1;
+      exchange_dispatch (exchange);
+      return;
+   }
+
+   if (client != NULL)
+   {
+      if (!exchange->response_started)
+      {
+         exchange->status = 502;
+         struct HttpResponse *response = uvllhttpd_response_init (&(client->handle));
+         response->status = 502;
+         response->keep_alive = 0;
+         uvllhttpd_response_finish (response);
+      }
+      else
+      {
+         uvllhttpd_client_close (client);
+      }
+   }
+
+   // the rest of the request body, if any, is dropped
+   exchange->response_complete = 1;
+   if (exchange->request_complete) exchange_finish (exchange);
+}
+
+// unless the client went away before the exchange ended
+static void exchange_log (struct ProxyExchange *exchange)
+{
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)exchange->context->_handle;
+   if (exchange->log_request == NULL || client == NULL) return;
+
+   uvllhttpd_access_log_record (client->server->access_log, client->peer, exchange->log_request,
+         exchange->status, exchange->response_bytes, exchange->log_started);
+   free (exchange->log_request);
+   exchange->log_request = NULL;
+}
+
+static void exchange_finish (struct ProxyExchange *exchange)
+{
+   if (exchange->finished) return;
+   exchange->finished = 1;
+   exchange_log (exchange);
+
+   uvllhttpd_client_t *client = exchange_client (exchange);
+   bool const client_paused = exchange->client_paused;
+   if (client != NULL && client->proxy == exchange) client->proxy = NULL;
+   exchange->client_paused = 0;
+
+   struct ProxyConnection *connection = exchange->connection;
+   if (connection != NULL)
+   {
+      connection->exchange = NULL;
+      exchange->connection = NULL;
+
+      if (exchange->response_complete && llhttp_should_keep_alive (&(connection->parser)))
+      {
+         // read while idle, to notice the upstream closing it
+         if (connection->paused)
+         {
+            connection->paused = 0;
+            uv_read_start (&(connection->handle.stream), connection_alloc_cb, connection_read_cb);
+         }
+         pool_push (connection);
+      }
+      else
+      {
+         connection_close (connection);
+      }
+   }
+
+   exchange_release (exchange);
+
+   if (client != NULL)
+   {
+      // the requests read after this one are parsed now, and may take the connection just pooled
+      if (client->blocked) uvllhttpd_client_unblock (client);
+      else if (client_paused) uvllhttpd_client_resume (client);
+   }
+}
+
+static int proxy_body_handler (void *data, char const *at, size_t length)
+{
+   struct ProxyExchange *exchange = (struct ProxyExchange *)data;
+
+   if (at == NULL)
+   {
+      if (exchange->request_chunked)
+      {
+         uv_buf_t const last = { .base = (char *)"0\r\n\r\n", .len = 5 };
+         upstream_write (exchange, &last, 1);
+      }
+      exchange->request_complete = 1;
+      if (exchange->response_complete) exchange_finish (exchange);
+      return 0;
+   }
+
+   exchange->request_body_sent = 1;
+   uv_buf_t body = { .base = (char *)at, .len = length };
+   if (exchange->request_chunked)
+   {
+      char line[20];
+      uv_buf_t bufs[3] = {
+         { .base = line, .len = snprintf (line, sizeof(line), "%zx\r\n", length) },
+         body,
+         { .base = (char *)"\r\n", .len = 2 },
+      };
+      upstream_write (exchange, bufs, 3);
+   }
+   else
+   {
+      upstream_write (exchange, &body, 1);
+   }
+   return 0;
+}
+
+static void proxy_cancel_cb (struct RequestContext *context)
+{
+   struct ProxyExchange *exchange = (struct ProxyExchange *)context->data;
+   if (exchange->finished) return;
+
+   // the client is gone: no more body, and a half sent response makes the connection unusable
+   exchange->request_complete = 1;
+   if (exchange->connection != NULL && !exchange->response_complete) connection_close (exchange->connection);
+   exchange_finish (exchange);
+}
+
+int uvllhttpd_proxy_request (uv_tcp_t *handle, struct HttpRequest const *request, struct ProxyUpstream *upstream)
+{
+   if (handle == NULL || request == NULL || upstream == NULL) return UV_EINVAL;
+
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)handle;
+   if (!client->in_on_headers) return UV_EINVAL;
+   if (request->upgrade) return UV_ENOTSUP;
+
+   char const *method = llhttp_method_name (request->method);
+   size_t const method_length = strlen (method);
+
+   size_t length = method_length + 1 + request->uri.len + 11 + 28 + 2;
+   for (size_t i = 0; i < request->header_count; i++)
+   {
+      length += request->headers[i].field.len + 2 + request->headers[i].value.len + 2;
+   }
+
+   struct ProxyExchange *exchange = calloc (1, sizeof(struct ProxyExchange));
+   exchange->refcount = 1;
+   exchange->upstream = upstream;
+   exchange->method = request->method;
+   exchange->http10 = request->version.major == 1 && request->version.minor == 0;
+   exchange->keep_alive = request->keep_alive &&
+      !(client->server->max_requests_per_connection > 0 &&
+            client->request_count + 1 >= client->server->max_requests_per_connection);
+   if (client->server->access_log != NULL)
+   {
+      exchange->log_request = uvllhttpd_access_log_request_line (request);
+      exchange->log_started = uv_now (client->handle.loop);
+   }
+
+   char *p = exchange->request_head.base = malloc (length);
+   memcpy (p, method, method_length);
+   p += method_length;
+   *p++ = ' ';
+   memcpy (p, request->uri.base, request->uri.len);
+   p += request->uri.len;
+   memcpy (p, " HTTP/1.1\r\n", 11);
+   p += 11;
+
+   for (size_t i = 0; i < request->header_count; i++)
+   {
+      struct HttpHeader const *header = &(request->headers[i]);
+      if (header->field.len == 17 && strncasecmp (header->field.base, "Transfer-Encoding", 17) == 0 &&
+            header->value.len >= 7 && strncasecmp (header->value.base + header->value.len - 7, "chunked", 7) == 0)
+      {
+         exchange->request_chunked = 1;
+      }
+      if (is_hop_by_hop (header->field.base, header->field.len) ||
+            request_connection_names (request, header->field.base, header->field.len))
+      {
+         continue;
+      }
+
+      memcpy (p, header->field.base, header->field.len);
+      p += header->field.len;
+      *p++ = ':';
+      *p++ = ' ';
+      memcpy (p, header->value.base, header->value.len);
+      p += header->value.len;
+      *p++ = '\r';
+      *p++ = '\n';
+   }
+
+   // the body arrives dechunked, and is chunked again on its way up
+   if (exchange->request_chunked)
+   {
+      memcpy (p, "Transfer-Encoding: chunked\r\n", 28);
+      p += 28;
+   }
+   *p++ = '\r';
+   *p++ = '\n';
+   exchange->request_head.len = p - exchange->request_head.base;
+
+   exchange->context = uvllhttpd_request_context (handle);
+   exchange->context->data = exchange;
+   exchange->context->on_cancel = proxy_cancel_cb;
+
+   client->proxy = exchange;
+   client->proxied = 1;
+   uvllhttpd_request_stream_body (handle, proxy_body_handler, exchange);
+   uvllhttpd_client_flush (client);
+
+   exchange_dispatch (exchange);
+   return 0;
+}
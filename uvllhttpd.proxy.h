@@ -0,0 +1,41 @@
+#pragma once
+
+#include "uvllhttpd.h"
+
+struct ProxyConnection;
+
+// A backend reached over TCP or a Unix socket, with a pool of keep-alive
+// connections. Meant to be used by the servers of a single loop.
+struct ProxyUpstream {
+   void *data;
+
+   // idle connections kept open for reuse, defaults to 16
+   size_t max_idle;
+   // connections opened ahead of the requests needing them, so that these
+   // rarely wait for a connect. At most max_idle.
+   size_t min_idle;
+   // milliseconds after which idle connections are closed, 0 keeps them
+   uint64_t idle_timeout;
+
+   uv_loop_t *_loop;
+   struct sockaddr_storage _addr;
+   char *_path;
+   uv_timer_t _timer;
+
+   // connected or still connecting
+   struct ProxyConnection *_idle;
+   size_t _idle_count;
+};
+
+// Set the public fields first; the pool is filled up to min_idle right away.
+int uvllhttpd_upstream_init_tcp (struct ProxyUpstream *upstream, uv_loop_t *loop, char const *host, unsigned short port);
+int uvllhttpd_upstream_init_unix (struct ProxyUpstream *upstream, uv_loop_t *loop, char const *path);
+// Closes the idle connections. Must not be called while requests are in flight.
+void uvllhttpd_upstream_close (struct ProxyUpstream *upstream);
+
+// Called from HttpServer.on_headers, forwards the request to the upstream and
+// its response back, streaming both bodies. The request then does not reach
+// on_request. A 502 is sent if the upstream fails before responding. The
+// connection's next request is not parsed before the exchange is over.
+// Returns UV_ENOTSUP for upgrade requests; the handler should then respond itself.
+int uvllhttpd_proxy_request (uv_tcp_t *handle, struct HttpRequest const *request, struct ProxyUpstream *upstream);
@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+#include "uvllhttpd.sse.h"
+
+// queued buffers handed to a single uv_write
+#define SSE_MAX_WRITE_BUFS 64
+
+struct SseSubscriber {
+   struct SseChannel *channel;
+   uvllhttpd_client_t *client;
+   struct SseSubscriber *prev;
+   struct SseSubscriber *next;
+
+   uv_write_t write;
+   // ring of queued buffers, the first `writing` of them are being written
+   struct SharedBuffer **queue;
+   size_t capacity;
+   size_t first;
+   size_t count;
+   size_t writing;
+   size_t queued_bytes;
+
+   uint64_t last_queued;
+   uint8_t dropped;
+};
+
+static char const head[] = "HTTP/1.1 200 OK\r\n"
+   "Content-Type: text/event-stream\r\n"
+   "Cache-Control: no-cache\r\n"
+   "Connection: close\r\n"
+   "\r\n";
+
+static void subscriber_write (struct SseSubscriber *subscriber);
+
+static void write_cb (uv_write_t *req, int status)
+{
+   struct SseSubscriber *subscriber = (struct SseSubscriber *)
+      ((char *)req - offsetof(struct SseSubscriber, write));
+
+   for (size_t i = 0; i < subscriber->writing; i++)
+   {
+      struct SharedBuffer *buffer = subscriber->queue[subscriber->first];
+      subscriber->queued_bytes -= buffer->len;
+      uvllhttpd_shared_buffer_unref (buffer);
+      subscriber->first = (subscriber->first + 1) & (subscriber->capacity - 1);
+   }
+   subscriber->count -= subscriber->writing;
+   subscriber->writing = 0;
+
+   if (status < 0)
+   {
+      uvllhttpd_client_close (subscriber->client);
+      return;
+   }
+   if (subscriber->count > 0) subscriber_write (subscriber);
+}
+
+static void subscriber_write (struct SseSubscriber *subscriber)
+{
+   if (uv_is_closing ((uv_handle_t *)&(subscriber->client->handle))) return;
+
+   size_t const n = subscriber->count < SSE_MAX_WRITE_BUFS ? subscriber->count : SSE_MAX_WRITE_BUFS;
+   uv_buf_t bufs[SSE_MAX_WRITE_BUFS];
+   for (size_t i = 0; i < n; i++)
+   {
+      struct SharedBuffer *buffer = subscriber->queue[(subscriber->first + i) & (subscriber->capacity - 1)];
+      bufs[i].base = buffer->base;
+      bufs[i].len = buffer->len;
+   }
+
+   subscriber->writing = n;
+   if (uvllhttpd_client_write (&(subscriber->write), subscriber->client, bufs, n, write_cb) != 0)
+   {
+      subscriber->writing = 0;
+      uvllhttpd_client_close (subscriber->client);
+   }
+}
+
+static bool subscriber_queue (struct SseSubscriber *subscriber, struct SharedBuffer *buffer)
+{
+   struct SseChannel *channel = subscriber->channel;
+   if (subscriber->dropped) return false;
+
+   if (subscriber->queued_bytes + buffer->len > channel->max_queued_bytes)
+   {
+      // too slow a reader, its queue would grow without bound
+      subscriber->dropped = 1;
+      channel->dropped++;
+      uvllhttpd_client_close (subscriber->client);
+      return false;
+   }
+
+   if (subscriber->count == subscriber->capacity)
+   {
+      size_t const capacity = subscriber->capacity > 0 ? subscriber->capacity * 2 : 16;
+      struct SharedBuffer **queue = malloc (capacity * sizeof(struct SharedBuffer *));
+      for (size_t i = 0; i < subscriber->count; i++)
+      {
+         queue[i] = subscriber->queue[(subscriber->first + i) & (subscriber->capacity - 1)];
+      }
+      free (subscriber->queue);
+      subscriber->queue = queue;
+      subscriber->capacity = capacity;
+      subscriber->first = 0;
+   }
+
+   subscriber->queue[(subscriber->first + subscriber->count) & (subscriber->capacity - 1)] =
+      uvllhttpd_shared_buffer_ref (buffer);
+   subscriber->count++;
+   subscriber->queued_bytes += buffer->len;
+   subscriber->last_queued = uv_now (channel->_timer.loop);
+
+   if (subscriber->writing == 0) subscriber_write (subscriber);
+   return true;
+}
+
+void uvllhttpd_sse_client_closed (struct SseSubscriber *subscriber)
+{
+   struct SseChannel *channel = subscriber->channel;
+   if (channel != NULL)
+   {
+      if (subscriber->prev != NULL) subscriber->prev->next = subscriber->next;
+      else channel->_subscribers = subscriber->next;
+      if (subscriber->next != NULL) subscriber->next->prev = subscriber->prev;
+      channel->subscriber_count--;
+   }
+
+   // no write is in flight once the connection is closed
+   for (size_t i = 0; i < subscriber->count; i++)
+   {
+      uvllhttpd_shared_buffer_unref (subscriber->queue[(subscriber->first + i) & (subscriber->capacity - 1)]);
+   }
+   free (subscriber->queue);
+   free (subscriber);
+}
+
+static void heartbeat_cb (uv_timer_t *handle)
+{
+   struct SseChannel *channel = (struct SseChannel *)handle->data;
+   uint64_t const now = uv_now (handle->loop);
+
+   for (struct SseSubscriber *s = channel->_subscribers; s != NULL; s = s->next)
+   {
+      if (s->count == 0 && now - s->last_queued >= channel->heartbeat_interval)
+      {
+         subscriber_queue (s, channel->_heartbeat);
+      }
+   }
+}
+
+int uvllhttpd_sse_channel_init (struct SseChannel *channel, uv_loop_t *loop)
+{
+   if (channel == NULL || loop == NULL) return UV_EINVAL;
+
+   if (channel->heartbeat_interval == 0) channel->heartbeat_interval = 15000;
+   if (channel->max_queued_bytes == 0) channel->max_queued_bytes = 1024 * 1024;
+   channel->subscriber_count = 0;
+   channel->dropped = 0;
+   channel->_subscribers = NULL;
+   channel->_head = uvllhttpd_shared_buffer_new (head, sizeof(head)-1);
+   channel->_heartbeat = uvllhttpd_shared_buffer_new (":\n\n", 3);
+
+   uv_timer_init (loop, &(channel->_timer));
+   channel->_timer.data = channel;
+   uv_timer_start (&(channel->_timer), heartbeat_cb, channel->heartbeat_interval, channel->heartbeat_interval);
+   uv_unref ((uv_handle_t *)&(channel->_timer));
+
+   return 0;
+}
+
+void uvllhttpd_sse_channel_close (struct SseChannel *channel)
+{
+   uv_close ((uv_handle_t *)&(channel->_timer), NULL);
+
+   struct SseSubscriber *s = channel->_subscribers;
+   channel->_subscribers = NULL;
+   channel->subscriber_count = 0;
+   while (s != NULL)
+   {
+      struct SseSubscriber *next = s->next;
+      s->channel = NULL;
+      s->dropped = 1;
+      uvllhttpd_client_close (s->client);
+      s = next;
+   }
+
+   uvllhttpd_shared_buffer_unref (channel->_head);
+   uvllhttpd_shared_buffer_unref (channel->_heartbeat);
+   channel->_head = NULL;
+   channel->_heartbeat = NULL;
+}
+
+int uvllhttpd_sse_subscribe (uv_tcp_t *handle, struct SseChannel *channel)
+{
+   if (handle == NULL || channel == NULL) return UV_EINVAL;
+
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)handle;
+   if (client->sse != NULL || uv_is_closing ((uv_handle_t *)handle)) return UV_EINVAL;
+   // the stream would need to be a response body that never ends
+   if (client->http2_stream != NULL) return UV_ENOTSUP;
+
+   // the stream ends with the connection, later requests are not read
+   client->keep_alive = 0;
+
+   if (client->log_request != NULL)
+   {
+      uvllhttpd_access_log_record (client->server->access_log, client->peer, client->log_request, 200, 0,
+            client->log_started);
+      free (client->log_request);
+      client->log_request = NULL;
+   }
+
+   struct SseSubscriber *subscriber = calloc (1, sizeof(struct SseSubscriber));
+   subscriber->channel = channel;
+   subscriber->client = client;
+   subscriber->next = channel->_subscribers;
+   if (channel->_subscribers != NULL) channel->_subscribers->prev = subscriber;
+   channel->_subscribers = subscriber;
+   channel->subscriber_count++;
+   client->sse = subscriber;
+
+   uvllhttpd_client_flush (client);
+   subscriber_queue (subscriber, channel->_head);
+   return 0;
+}
+
+// the end of the line starting at p: CR, LF, CRLF or the end of the data
+static char const *line_end (char const *p, char const *end)
+{
+   while (p < end && *p != '\r' && *p != '\n') p++;
+   return p;
+}
+
+static char const *line_next (char const *eol, char const *end)
+{
+   if (eol == end) return end;
+   if (*eol == '\r' && eol + 1 < end && eol[1] == '\n') return eol + 2;
+   return eol + 1;
+}
+
+size_t uvllhttpd_sse_publish (struct SseChannel *channel, char const *event, char const *id,
+      char const *data, size_t length)
+{
+   if (channel == NULL || (data == NULL && length > 0)) return 0;
+   if (data == NULL) data = "";
+
+   // a line break would end the field, and start another one
+   if ((event != NULL && strpbrk (event, "\r\n") != NULL) || (id != NULL && strpbrk (id, "\r\n") != NULL))
+   {
+      return 0;
+   }
+
+   size_t const event_length = event != NULL ? strlen (event) : 0;
+   size_t const id_length = id != NULL ? strlen (id) : 0;
+
+   // one data line per line, a break at the end leaving an empty one
+   char const *end = data + length;
+   size_t lines = 1;
+   size_t line_bytes = 0;
+   char const *line = data;
+   for (;;)
+   {
+      char const *eol = line_end (line, end);
+      line_bytes += eol - line;
+      if (eol == end) break;
+      lines++;
+      line = line_next (eol, end);
+   }
+
+   size_t size = line_bytes + lines * 7 + 1;
+   if (event != NULL) size += 8 + event_length;
+   if (id != NULL) size += 5 + id_length;
+
+   struct SharedBuffer *buffer = uvllhttpd_shared_buffer_new (NULL, size);
+   if (buffer == NULL) return 0;
+   char *p = buffer->base;
+   if (event != NULL)
+   {
+      memcpy (p, "event: ", 7);
+      memcpy (p + 7, event, event_length);
+      p[7 + event_length] = '\n';
+      p += 8 + event_length;
+   }
+   if (id != NULL)
+   {
+      memcpy (p, "id: ", 4);
+      memcpy (p + 4, id, id_length);
+      p[4 + id_length] = '\n';
+      p += 5 + id_length;
+   }
+
+   line = data;
+   for (size_t i = 0; i < lines; i++)
+   {
+      char const *eol = line_end (line, end);
+      size_t const line_length = eol - line;
+
+      memcpy (p, "data: ", 6);
+      if (line_length > 0) memcpy (p + 6, line, line_length);
+      p[6 + line_length] = '\n';
+      p += 7 + line_length;
+      line = line_next (eol, end);
+   }
+   *p = '\n';
+
+   size_t queued = 0;
+   for (struct SseSubscriber *s = channel->_subscribers; s != NULL; s = s->next)
+   {
+      if (subscriber_queue (s, buffer)) queued++;
+   }
+
+   uvllhttpd_shared_buffer_unref (buffer);
+   return queued;
+}
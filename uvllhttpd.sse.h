@@ -0,0 +1,43 @@
+#pragma once
+
+#include "uvllhttpd.h"
+
+struct SseSubscriber;
+
+// Server-Sent Events pushed to every subscribed connection. Each event is
+// serialized once into a SharedBuffer; publishing then only queues a
+// reference per subscriber. Meant to be used by the servers of a single loop.
+struct SseChannel {
+   void *data;
+
+   // milliseconds between comment lines sent to idle subscribers, so that
+   // proxies keep the connections open. Defaults to 15000.
+   unsigned int heartbeat_interval;
+   // bytes queued on a subscriber not keeping up before it is disconnected.
+   // Defaults to 1 MiB.
+   size_t max_queued_bytes;
+
+   size_t subscriber_count;
+   uint64_t dropped;
+
+   uv_timer_t _timer;
+   struct SharedBuffer *_head;
+   struct SharedBuffer *_heartbeat;
+   struct SseSubscriber *_subscribers;
+};
+
+// The heartbeat timer does not keep the loop alive.
+int uvllhttpd_sse_channel_init (struct SseChannel *channel, uv_loop_t *loop);
+// Disconnects the subscribers.
+void uvllhttpd_sse_channel_close (struct SseChannel *channel);
+
+// Called from on_request: answers with a text/event-stream response that
+// stays open until the client or the channel closes it. UV_ENOTSUP for a
+// request received over HTTP/2.
+int uvllhttpd_sse_subscribe (uv_tcp_t *handle, struct SseChannel *channel);
+
+// event and id may be NULL, and must not contain CR or LF; data is split
+// into one data line per line, ended by CR, LF or CRLF. Returns the number
+// of subscribers the event was queued on.
+size_t uvllhttpd_sse_publish (struct SseChannel *channel, char const *event, char const *id,
+      char const *data, size_t length);
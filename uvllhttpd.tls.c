@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+#include "uvllhttpd.tls.h"
+
+// plaintext gathered into one record before it is encrypted
+#define TLS_RECORD_SIZE 16384
+
+struct TlsConnection {
+   struct TlsContext *context;
+   uvllhttpd_client_t *client;
+   SSL *ssl;
+   // ciphertext read from the connection
+   BIO *rbio;
+   uint8_t established;
+   // plaintext written to the connection is encrypted by the kernel
+   uint8_t kernel_send;
+};
+
+struct tls_write {
+   uv_write_t req;
+   uv_write_t *user_req;
+   uv_write_cb cb;
+   char bytes[];
+};
+
+int uvllhttpd_tls_init (struct TlsContext *tls)
+{
+   if (tls == NULL || tls->certificate_file == NULL || tls->key_file == NULL) return UV_EINVAL;
+
+   SSL_CTX *ctx = SSL_CTX_new (TLS_server_method ());
+   if (ctx == NULL) return UV_ENOMEM;
+
+   if (SSL_CTX_use_certificate_chain_file (ctx, tls->certificate_file) != 1 ||
+         SSL_CTX_use_PrivateKey_file (ctx, tls->key_file, SSL_FILETYPE_PEM) != 1 ||
+         SSL_CTX_check_private_key (ctx) != 1)
+   {
+      ERR_clear_error ();
+      SSL_CTX_free (ctx);
+      return UV_EINVAL;
+   }
+
+   SSL_CTX_set_min_proto_version (ctx, TLS1_2_VERSION);
+   // resumption by session id from the cache, and by tickets
+   SSL_CTX_set_session_id_context (ctx, (unsigned char const *)"uvllhttpd", 9);
+   SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_SERVER);
+   // idle keep-alive connections do not hold on to record buffers
+   SSL_CTX_set_mode (ctx, SSL_MODE_RELEASE_BUFFERS);
+   if (!tls->disable_ktls) SSL_CTX_set_options (ctx, SSL_OP_ENABLE_KTLS);
+
+   tls->handshakes = 0;
+   tls->resumed = 0;
+   tls->kernel_offloaded = 0;
+   tls->_ctx = ctx;
+   return 0;
+}
+
+void uvllhttpd_tls_free (struct TlsContext *tls)
+{
+   SSL_CTX_free (tls->_ctx);
+   tls->_ctx = NULL;
+}
+
+struct TlsConnection *uvllhttpd_tls_connection_new (struct TlsContext *tls, uvllhttpd_client_t *client)
+{
+   SSL *ssl = SSL_new (tls->_ctx);
+   if (ssl == NULL) return NULL;
+
+   BIO *rbio = BIO_new (BIO_s_mem ());
+   // an empty buffer means more is to come
+   BIO_set_mem_eof_return (rbio, -1);
+
+   // OpenSSL only hands the keys to the kernel when it writes to the socket
+   // itself, which it does for the handshake only
+   BIO *wbio = NULL;
+   uv_os_fd_t fd;
+   if (!tls->disable_ktls && uv_fileno ((uv_handle_t *)&(client->handle), &fd) == 0)
+   {
+      wbio = BIO_new_socket (fd, BIO_NOCLOSE);
+   }
+   if (wbio == NULL) wbio = BIO_new (BIO_s_mem ());
+
+   SSL_set_bio (ssl, rbio, wbio);
+   SSL_set_accept_state (ssl);
+
+   struct TlsConnection *connection = calloc (1, sizeof(struct TlsConnection));
+   connection->context = tls;
+   connection->client = client;
+   connection->ssl = ssl;
+   connection->rbio = rbio;
+   return connection;
+}
+
+void uvllhttpd_tls_connection_free (struct TlsConnection *connection)
+{
+   // no close_notify, the connection is already being closed
+   SSL_free (connection->ssl);
+   free (connection);
+}
+
+static void fail (struct TlsConnection *connection, char const *message)
+{
+   ERR_clear_error ();
+   struct HttpServer *server = connection->client->server;
+   if (server->on_error != NULL) server->on_error (server, UV_EPROTO, message);
+   uvllhttpd_client_close (connection->client);
+}
+
+static void send_cb (uv_write_t *req, int status)
+{
+   struct tls_write *w = (struct tls_write *)req;
+   if (w->cb != NULL)
+   {
+      w->user_req->handle = req->handle;
+      w->cb (w->user_req, status);
+   }
+   free (w);
+}
+
+// writes out the ciphertext waiting in the memory BIO, cb is called once it is written
+static int send_pending (struct TlsConnection *connection, uv_write_t *req, uv_write_cb cb)
+{
+   BIO *wbio = SSL_get_wbio (connection->ssl);
+   size_t const pending = BIO_ctrl_pending (wbio);
+   if (pending == 0 && cb == NULL) return 0;
+
+   struct tls_write *w = malloc (sizeof(struct tls_write) + pending);
+   w->user_req = req;
+   w->cb = cb;
+   if (pending > 0) BIO_read (wbio, w->bytes, (int)pending);
+
+   uv_buf_t const buf = { .base = w->bytes, .len = pending };
+   int const r = uv_write (&(w->req), (uv_stream_t *)&(connection->client->handle), &buf, 1, send_cb);
+   if (r != 0) free (w);
+   return r;
+}
+
+static bool handshake (struct TlsConnection *connection)
+{
+   struct TlsContext *tls = connection->context;
+   SSL *ssl = connection->ssl;
+
+   int const r = SSL_do_handshake (ssl);
+   bool const socket_wbio = BIO_method_type (SSL_get_wbio (ssl)) == BIO_TYPE_SOCKET;
+   if (!socket_wbio && send_pending (connection, NULL, NULL) != 0)
+   {
+      uvllhttpd_client_close (connection->client);
+      return false;
+   }
+
+   if (r != 1)
+   {
+      int const err = SSL_get_error (ssl, r);
+      if (err == SSL_ERROR_WANT_READ) return false;
+      // a handshake flight is far smaller than a socket's send buffer
+      fail (connection, err == SSL_ERROR_WANT_WRITE ? "TLS handshake blocked on write" : "TLS handshake failed");
+      return false;
+   }
+
+   connection->established = 1;
+   tls->handshakes++;
+   if (SSL_session_reused (ssl)) tls->resumed++;
+
+   if (socket_wbio && BIO_get_ktls_send (SSL_get_wbio (ssl)))
+   {
+      connection->kernel_send = 1;
+      tls->kernel_offloaded++;
+   }
+   else if (socket_wbio)
+   {
+      // no kTLS after all, records go through libuv like everything else
+      SSL_set0_wbio (ssl, BIO_new (BIO_s_mem ()));
+   }
+   return true;
+}
+
+void uvllhttpd_tls_read (struct TlsConnection *connection, char const *base, ssize_t nread)
+{
+   uvllhttpd_client_t *client = connection->client;
+   if (nread < 0)
+   {
+      uvllhttpd_client_received (client, NULL, nread);
+      return;
+   }
+
+   ERR_clear_error ();
+   BIO_write (connection->rbio, base, (int)nread);
+   if (!connection->established && !handshake (connection)) return;
+
+   char plain[TLS_RECORD_SIZE];
+   while (!uv_is_closing ((uv_handle_t *)&(client->handle)))
+   {
+      int const n = SSL_read (connection->ssl, plain, sizeof(plain));
+      if (n > 0)
+      {
+         uvllhttpd_client_received (client, plain, n);
+         continue;
+      }
+
+      int const err = SSL_get_error (connection->ssl, n);
+      if (err == SSL_ERROR_ZERO_RETURN) uvllhttpd_client_received (client, NULL, UV_EOF);
+      else if (err != SSL_ERROR_WANT_READ) fail (connection, "TLS record rejected");
+      break;
+   }
+
+   // alerts and replies to post-handshake messages
+   if (!connection->kernel_send && !uv_is_closing ((uv_handle_t *)&(client->handle)))
+   {
+      send_pending (connection, NULL, NULL);
+   }
+}
+
+// encrypts bufs into the memory BIO, small buffers gathered into one record
+static int encrypt (struct TlsConnection *connection, uv_buf_t const bufs[], unsigned int nbufs, size_t *total)
+{
+   char record[TLS_RECORD_SIZE];
+   size_t gathered = 0;
+   *total = 0;
+
+   for (unsigned int i = 0; i < nbufs; i++)
+   {
+      char const *p = bufs[i].base;
+      size_t left = bufs[i].len;
+      *total += left;
+
+      while (left > 0)
+      {
+         if (gathered == 0 && left >= TLS_RECORD_SIZE)
+         {
+            // full records straight from the caller's buffer
+            if (SSL_write (connection->ssl, p, TLS_RECORD_SIZE) <= 0) return UV_EPROTO;
+            p += TLS_RECORD_SIZE;
+            left -= TLS_RECORD_SIZE;
+            continue;
+         }
+
+         size_t const n = left < TLS_RECORD_SIZE - gathered ? left : TLS_RECORD_SIZE - gathered;
+         memcpy (record + gathered, p, n);
+         gathered += n;
+         p += n;
+         left -= n;
+         if (gathered == TLS_RECORD_SIZE)
+         {
+            if (SSL_write (connection->ssl, record, TLS_RECORD_SIZE) <= 0) return UV_EPROTO;
+            gathered = 0;
+         }
+      }
+   }
+
+   if (gathered > 0 && SSL_write (connection->ssl, record, (int)gathered) <= 0) return UV_EPROTO;
+   return 0;
+}
+
+int uvllhttpd_tls_try_write (struct TlsConnection *connection, uv_buf_t const bufs[], unsigned int nbufs)
+{
+   uv_stream_t *stream = (uv_stream_t *)&(connection->client->handle);
+   if (connection->kernel_send) return uv_try_write (stream, bufs, nbufs);
+
+   // the records are queued whole, so everything counts as taken
+   ERR_clear_error ();
+   size_t total;
+   int r = encrypt (connection, bufs, nbufs, &total);
+   if (r == 0) r = send_pending (connection, NULL, NULL);
+   return r != 0 ? r : (int)total;
+}
+
+int uvllhttpd_tls_write (uv_write_t *req, struct TlsConnection *connection, uv_buf_t const bufs[],
+      unsigned int nbufs, uv_write_cb cb)
+{
+   uv_stream_t *stream = (uv_stream_t *)&(connection->client->handle);
+   if (connection->kernel_send) return uv_write (req, stream, bufs, nbufs, cb);
+
+   ERR_clear_error ();
+   size_t total;
+   int const r = encrypt (connection, bufs, nbufs, &total);
+   if (r != 0) return r;
+   return send_pending (connection, req, cb);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "uvllhttpd.h"
+
+struct ssl_ctx_st;
+
+// TLS termination with OpenSSL, built with UVLLHTTPD_TLS. Handshakes and
+// decryption run in userspace; once a handshake completes, encryption of
+// everything written to the connection is handed to the kernel (kTLS)
+// where the kernel and cipher allow it, and done in userspace otherwise.
+struct TlsContext {
+   void *data;
+
+   // PEM files, the certificate file may hold the whole chain
+   char const *certificate_file;
+   char const *key_file;
+   // keeps encryption in userspace even where kTLS is available
+   uint8_t disable_ktls;
+
+   // completed handshakes, how many of them resumed a session, and how many
+   // of them had encryption taken over by the kernel
+   uint64_t handshakes;
+   uint64_t resumed;
+   uint64_t kernel_offloaded;
+
+   struct ssl_ctx_st *_ctx;
+};
+
+// UV_EINVAL if the certificate or key cannot be loaded or do not match
+int uvllhttpd_tls_init (struct TlsContext *tls);
+// Only once no connection uses it anymore.
+void uvllhttpd_tls_free (struct TlsContext *tls);
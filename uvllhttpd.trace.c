@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+#include "uvllhttpd.trace.h"
+
+int uvllhttpd_trace_init (struct HttpTrace *trace, size_t capacity, unsigned int sample_rate)
+{
+   if (trace == NULL || capacity == 0) return UV_EINVAL;
+
+   *trace = (struct HttpTrace) {
+      .sample_rate = sample_rate,
+      ._records = calloc (capacity, sizeof(struct RequestTrace)),
+      ._capacity = capacity,
+   };
+   if (trace->_records == NULL) return UV_ENOMEM;
+
+   return 0;
+}
+
+void uvllhttpd_trace_free (struct HttpTrace *trace)
+{
+   if (trace->_records != NULL) free (trace->_records);
+   trace->_records = NULL;
+   trace->_capacity = 0;
+   trace->_head = 0;
+   trace->_count = 0;
+}
+
+void uvllhttpd_trace_clear (struct HttpTrace *trace)
+{
+   trace->_head = 0;
+   trace->_count = 0;
+}
+
+struct RequestTrace *uvllhttpd_trace_sample (struct HttpTrace *trace)
+{
+   if (trace->sample_rate == 0 || trace->_capacity == 0) return NULL;
+   if (trace->_request_count++ % trace->sample_rate != 0) return NULL;
+
+   struct RequestTrace *record = calloc (1, sizeof(struct RequestTrace));
+   // out of memory, the request goes unsampled
+   if (record == NULL) return NULL;
+   record->request = trace->_request_count;
+   return record;
+}
+
+void uvllhttpd_trace_commit (struct HttpTrace *trace, struct RequestTrace *records)
+{
+   while (records != NULL)
+   {
+      struct RequestTrace *next = records->_next;
+
+      if (trace->_capacity > 0)
+      {
+         struct RequestTrace *slot = &(trace->_records[(trace->_head + trace->_count) % trace->_capacity]);
+         if (trace->_count < trace->_capacity) trace->_count++;
+         else trace->_head = (trace->_head + 1) % trace->_capacity;
+
+         *slot = *records;
+         slot->_next = NULL;
+      }
+
+      free (records);
+      records = next;
+   }
+}
+
+static void dump_timestamp (FILE *out, uint64_t ns)
+{
+   // microseconds, printed exactly
+   fprintf (out, "%" PRIu64 ".%03u", ns / 1000, (unsigned int)(ns % 1000));
+}
+
+static void dump_string (FILE *out, char const *s)
+{
+   fputc ('"', out);
+   for (; *s != '\0'; s++)
+   {
+      unsigned char const c = (unsigned char)*s;
+      if (c == '"' || c == '\\') fprintf (out, "\\%c", c);
+      else if (c < 0x20) fprintf (out, "\\u%04x", c);
+      else fputc (c, out);
+   }
+   fputc ('"', out);
+}
+
+static void dump_span (FILE *out, bool *first, struct RequestTrace const *record,
+      char const *name, uint64_t begin, uint64_t end, bool with_args)
+{
+   if (begin == 0 || end < begin) return;
+
+   fputs (*first ? "\n" : ",\n", out);
+   *first = false;
+
+   fprintf (out, "{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu64 ",\"ts\":",
+         name, record->connection);
+   dump_timestamp (out, begin);
+   fputs (",\"dur\":", out);
+   dump_timestamp (out, end - begin);
+
+   if (with_args)
+   {
+      fprintf (out, ",\"args\":{\"request\":%" PRIu64 ",\"method\":\"%s\",\"uri\":",
+            record->request, llhttp_method_name (record->method));
+      dump_string (out, record->uri);
+      fprintf (out, ",\"status\":%u}", record->status);
+   }
+   fputc ('}', out);
+}
+
+int uvllhttpd_trace_dump (struct HttpTrace const *trace, FILE *out)
+{
+   if (trace == NULL || out == NULL) return UV_EINVAL;
+
+   bool first = true;
+   fputs ("{\"traceEvents\":[", out);
+
+   for (size_t i = 0; i < trace->_count; i++)
+   {
+      struct RequestTrace const *r = &(trace->_records[(trace->_head + i) % trace->_capacity]);
+
+      uint64_t end = r->write_complete;
+      if (end == 0) end = r->response_finished;
+      if (end == 0) end = r->message_complete;
+
+      dump_span (out, &first, r, "request", r->first_byte, end, true);
+      dump_span (out, &first, r, "connect", r->accepted, r->first_byte, false);
+      dump_span (out, &first, r, "headers", r->first_byte, r->headers_complete, false);
+      dump_span (out, &first, r, "body", r->headers_complete, r->message_complete, false);
+      dump_span (out, &first, r, "handler", r->message_complete, r->response_finished, false);
+      dump_span (out, &first, r, "write", r->response_finished, r->write_complete, false);
+   }
+
+   fputs ("\n]}\n", out);
+
+   return ferror (out) ? UV_EIO : 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "uvllhttpd.h"
+
+// uv_hrtime timestamps of one request, 0 where the point was not reached
+struct RequestTrace {
+   uint64_t connection;
+   uint64_t request;
+
+   // only set for the first request of a connection
+   uint64_t accepted;
+   uint64_t first_byte;
+   uint64_t headers_complete;
+   uint64_t message_complete;
+   // uvllhttpd_response_finish called
+   uint64_t response_finished;
+   // the response handed to the kernel in full, or to the cache
+   uint64_t write_complete;
+
+   uint16_t status;
+   uint8_t method;
+   char uri[61];
+
+   struct RequestTrace *_next;
+};
+
+// Samples request lifecycles into a ring buffer. Meant to be shared by the
+// servers of a single loop and only touched from its thread, so it takes no
+// locks. Set sample_rate and point HttpServer.trace at it.
+struct HttpTrace {
+   // one request out of sample_rate is traced, 0 disables tracing
+   unsigned int sample_rate;
+
+   uint64_t _connection_count;
+   uint64_t _request_count;
+
+   // the oldest records are overwritten once the ring is full
+   struct RequestTrace *_records;
+   size_t _capacity;
+   size_t _head;
+   size_t _count;
+};
+
+// Allocates room for capacity records.
+int uvllhttpd_trace_init (struct HttpTrace *trace, size_t capacity, unsigned int sample_rate);
+void uvllhttpd_trace_free (struct HttpTrace *trace);
+// Forgets the recorded requests.
+void uvllhttpd_trace_clear (struct HttpTrace *trace);
+
+// Writes the recorded requests as Chrome trace event JSON, which
+// chrome://tracing and Perfetto open. One row per connection.
+int uvllhttpd_trace_dump (struct HttpTrace const *trace, FILE *out);
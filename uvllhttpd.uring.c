@@ -0,0 +1,602 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+
+// Connections are accepted and read through an io_uring: one multishot accept
+// on the listening socket and one multishot recv per connection, receiving
+// into buffers the kernel picks from a registered ring. The ring signals an
+// eventfd polled by the loop; new submissions are batched until the loop is
+// about to block. Only accept and recv go through the ring: accepted sockets
+// are also opened as uv_tcp_t handles, and responses, TLS records included,
+// are written and closed through them as with the libuv backend.
+
+#define URING_ENTRIES 4096
+// power of two, as the provided buffer ring requires
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_SIZE (16 * 1024)
+#define URING_BUFFER_GROUP 0
+
+// user_data of a completion is a pointer tagged with what it completes;
+// cancellations complete with 0 and are not looked at
+enum UringTag {
+   UringTag_none,
+   UringTag_accept,
+   UringTag_recv,
+   UringTag_mask = 3,
+};
+
+struct UringBackend {
+   struct HttpServer *server;
+   int ring_fd;
+   int event_fd;
+   int listen_fd;
+
+   void *sq_ring;
+   size_t sq_ring_size;
+   void *cq_ring;
+   size_t cq_ring_size;
+   struct io_uring_sqe *sqes;
+   size_t sqes_size;
+
+   unsigned *sq_head;
+   unsigned *sq_tail;
+   unsigned *sq_flags;
+   unsigned sq_mask;
+   unsigned sq_entries;
+   // entries filled, published to the kernel on submit
+   unsigned sqe_tail;
+
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned cq_mask;
+   struct io_uring_cqe *cqes;
+
+   struct io_uring_buf_ring *buf_ring;
+   size_t buf_ring_size;
+   char *buffers;
+   uint16_t buf_tail;
+
+   uv_poll_t poll;
+   uv_prepare_t prepare;
+   uint8_t accept_armed;
+   // resumed connections whose held reads are handed over before blocking
+   struct UringConnection *replay;
+   // connections whose receive has not ended yet
+   size_t connections;
+   uint8_t closing;
+   uint8_t closed_handles;
+};
+
+struct UringConnection {
+   struct UringBackend *backend;
+   // NULL once the connection has been closed
+   uvllhttpd_client_t *client;
+   int fd;
+   // a multishot recv is pending
+   uint8_t armed;
+   uint8_t paused;
+   // in the backend's replay list, or being replayed
+   uint8_t queued;
+   // received while paused, or before what was held could be replayed
+   uv_buf_t held;
+   int held_status;
+   struct UringConnection *next_replay;
+};
+
+static int ring_setup (unsigned entries, struct io_uring_params *params)
+{
+   return (int) syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+   return (int) syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int ring_register (int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+   return (int) syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int submit (struct UringBackend *b)
+{
+   unsigned const pending = b->sqe_tail - __atomic_load_n (b->sq_head, __ATOMIC_ACQUIRE);
+   if (pending == 0) return 0;
+
+   __atomic_store_n (b->sq_tail, b->sqe_tail, __ATOMIC_RELEASE);
+   int const r = ring_enter (b->ring_fd, pending, 0, 0);
+   return r < 0 ? -errno : 0;
+}
+
+// NULL if the submission queue is still full after submitting it
+static struct io_uring_sqe *get_sqe (struct UringBackend *b)
+{
+   if (b->sqe_tail - __atomic_load_n (b->sq_head, __ATOMIC_ACQUIRE) == b->sq_entries)
+   {
+      submit (b);
+      if (b->sqe_tail - __atomic_load_n (b->sq_head, __ATOMIC_ACQUIRE) == b->sq_entries) return NULL;
+   }
+
+   struct io_uring_sqe *sqe = &(b->sqes[b->sqe_tail & b->sq_mask]);
+   memset (sqe, 0, sizeof(*sqe));
+   b->sqe_tail++;
+   return sqe;
+}
+
+// hands a buffer back to the kernel, visible once the tail is published
+static void buffer_recycle (struct UringBackend *b, uint16_t bid)
+{
+   struct io_uring_buf *buf = &(b->buf_ring->bufs[b->buf_tail & (URING_BUFFER_COUNT - 1)]);
+   buf->addr = (uintptr_t)(b->buffers + (size_t)bid * URING_BUFFER_SIZE);
+   buf->len = URING_BUFFER_SIZE;
+   buf->bid = bid;
+   b->buf_tail++;
+}
+
+static void buffers_publish (struct UringBackend *b)
+{
+   __atomic_store_n (&(b->buf_ring->tail), b->buf_tail, __ATOMIC_RELEASE);
+}
+
+static bool arm_accept (struct UringBackend *b)
+{
+   struct io_uring_sqe *sqe = get_sqe (b);
+   if (sqe == NULL) return false;
+
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = b->listen_fd;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+   sqe->user_data = (uintptr_t)b | UringTag_accept;
+   b->accept_armed = 1;
+   return true;
+}
+
+static bool arm_recv (struct UringConnection *connection)
+{
+   struct io_uring_sqe *sqe = get_sqe (connection->backend);
+   if (sqe == NULL) return false;
+
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = connection->fd;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = URING_BUFFER_GROUP;
+   sqe->user_data = (uintptr_t)connection | UringTag_recv;
+   connection->armed = 1;
+   return true;
+}
+
+static void cancel_recv (struct UringConnection *connection)
+{
+   struct io_uring_sqe *sqe = get_sqe (connection->backend);
+   // without a free entry the receive ends when the peer closes
+   if (sqe == NULL) return;
+
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->fd = -1;
+   sqe->addr = (uintptr_t)connection | UringTag_recv;
+   sqe->user_data = 0;
+}
+
+static void backend_free (struct UringBackend *b);
+
+static void handle_closed (uv_handle_t *handle)
+{
+   struct UringBackend *b = (struct UringBackend *)handle->data;
+   if (++b->closed_handles == 2) backend_free (b);
+}
+
+// closing the ring cancels whatever is still pending in it
+static void backend_close (struct UringBackend *b)
+{
+   uv_close ((uv_handle_t *)&(b->poll), handle_closed);
+   uv_close ((uv_handle_t *)&(b->prepare), handle_closed);
+}
+
+static void connection_free (struct UringConnection *connection)
+{
+   struct UringBackend *b = connection->backend;
+   free (connection->held.base);
+   free (connection);
+   if (--b->connections == 0 && b->closing) backend_close (b);
+}
+
+static bool connection_hold (struct UringConnection *connection, char const *base, size_t length)
+{
+   char *held = realloc (connection->held.base, connection->held.len + length);
+   if (held == NULL) return false;
+
+   memcpy (held + connection->held.len, base, length);
+   connection->held.base = held;
+   connection->held.len += length;
+   return true;
+}
+
+static void accepted (struct UringBackend *b, int fd)
+{
+   struct HttpServer *server = b->server;
+   if (b->closing)
+   {
+      close (fd);
+      return;
+   }
+
+   uvllhttpd_client_t *client = calloc (1, sizeof(uvllhttpd_client_t));
+   uv_tcp_init (server->loop, &(client->handle));
+   client->server = server;
+
+   int r = uv_tcp_open (&(client->handle), fd);
+   if (r != 0)
+   {
+      close (fd);
+      uvllhttpd_client_close (client);
+      if (server->on_error != NULL) server->on_error (server, r, uv_strerror (r));
+      return;
+   }
+
+   if (!uvllhttpd_client_start (server, client)) return;
+
+   struct UringConnection *connection = calloc (1, sizeof(struct UringConnection));
+   connection->backend = b;
+   connection->client = client;
+   connection->fd = fd;
+   client->uring = connection;
+   b->connections++;
+
+   if (!arm_recv (connection)) uvllhttpd_client_close (client);
+}
+
+static void recv_complete (struct UringBackend *b, struct UringConnection *connection, struct io_uring_cqe const *cqe)
+{
+   if (!(cqe->flags & IORING_CQE_F_MORE)) connection->armed = 0;
+
+   uvllhttpd_client_t *client = connection->client;
+   bool const closing = client == NULL || uv_is_closing ((uv_handle_t *)&(client->handle));
+   // completed before the cancel of a pause, kept from the parser until resumed
+   bool const hold = connection->paused || connection->queued;
+
+   if (cqe->flags & IORING_CQE_F_BUFFER)
+   {
+      uint16_t const bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      char const *base = b->buffers + (size_t)bid * URING_BUFFER_SIZE;
+      if (!closing && cqe->res > 0)
+      {
+         if (!hold) uvllhttpd_client_read (client, base, cqe->res);
+         else if (!connection_hold (connection, base, cqe->res)) uvllhttpd_client_close (client);
+      }
+      buffer_recycle (b, bid);
+   }
+   else if (closing || cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+   {
+      // out of buffers the receive is rearmed below, once they are handed back
+   }
+   else if (hold)
+   {
+      connection->held_status = cqe->res == 0 ? UV_EOF : cqe->res;
+   }
+   else if (cqe->res == 0)
+   {
+      uvllhttpd_client_read (client, NULL, UV_EOF);
+   }
+   else if (cqe->res < 0)
+   {
+      uvllhttpd_client_read (client, NULL, cqe->res);
+   }
+
+   if (connection->armed) return;
+   if (connection->client == NULL)
+   {
+      if (!connection->queued) connection_free (connection);
+   }
+   else if (!connection->paused && !connection->queued &&
+         !uv_is_closing ((uv_handle_t *)&(connection->client->handle)))
+   {
+      if (!arm_recv (connection)) uvllhttpd_client_close (connection->client);
+   }
+}
+
+static void accept_complete (struct UringBackend *b, struct io_uring_cqe const *cqe)
+{
+   if (!(cqe->flags & IORING_CQE_F_MORE)) b->accept_armed = 0;
+
+   if (cqe->res >= 0)
+   {
+      accepted (b, cqe->res);
+   }
+   else if (cqe->res != -ECANCELED && !b->closing && b->server->on_error != NULL)
+   {
+      // rearmed by the next prepare, not in a loop when out of descriptors
+      b->server->on_error (b->server, cqe->res, uv_strerror (cqe->res));
+   }
+}
+
+static void poll_cb (uv_poll_t *handle, int status, int events)
+{
+   struct UringBackend *b = (struct UringBackend *)handle->data;
+   if (status < 0)
+   {
+      // nothing completes any more, connections already read stay up
+      uv_poll_stop (handle);
+      if (b->server->on_error != NULL) b->server->on_error (b->server, status, uv_strerror (status));
+      return;
+   }
+
+   uint64_t count;
+   while (read (b->event_fd, &count, sizeof(count)) > 0) {}
+
+   unsigned head = *(b->cq_head);
+   for (;;)
+   {
+      unsigned const tail = __atomic_load_n (b->cq_tail, __ATOMIC_ACQUIRE);
+      if (head == tail)
+      {
+         // completions the ring had no room for are flushed by entering it
+         if (!(__atomic_load_n (b->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) break;
+         __atomic_store_n (b->cq_head, head, __ATOMIC_RELEASE);
+         if (ring_enter (b->ring_fd, 0, 0, IORING_ENTER_GETEVENTS) < 0) break;
+         continue;
+      }
+
+      for (; head != tail; head++)
+      {
+         struct io_uring_cqe const *cqe = &(b->cqes[head & b->cq_mask]);
+         void *p = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)UringTag_mask);
+         switch (cqe->user_data & UringTag_mask)
+         {
+            case UringTag_accept:
+               accept_complete (b, cqe);
+               break;
+            case UringTag_recv:
+               recv_complete (b, (struct UringConnection *)p, cqe);
+               break;
+            default:
+               break;
+         }
+      }
+      __atomic_store_n (b->cq_head, head, __ATOMIC_RELEASE);
+   }
+
+   buffers_publish (b);
+}
+
+// hands a resumed connection what it received while paused, in order and
+// before its receive is armed again
+static void replay (struct UringConnection *connection)
+{
+   uv_buf_t const held = connection->held;
+   int const status = connection->held_status;
+   connection->held = (uv_buf_t) { .base = NULL, .len = 0 };
+   connection->held_status = 0;
+
+   // the client may be closed by what it reads, or was while queued
+   uvllhttpd_client_t *client = connection->client;
+   if (held.len > 0 && client != NULL && !uv_is_closing ((uv_handle_t *)&(client->handle)))
+   {
+      uvllhttpd_client_read (client, held.base, held.len);
+   }
+   free (held.base);
+   client = connection->client;
+   if (status != 0 && client != NULL && !uv_is_closing ((uv_handle_t *)&(client->handle)))
+   {
+      uvllhttpd_client_read (client, NULL, status);
+   }
+   connection->queued = 0;
+
+   client = connection->client;
+   if (client == NULL)
+   {
+      if (!connection->armed) connection_free (connection);
+   }
+   else if (!connection->paused && !connection->armed && !uv_is_closing ((uv_handle_t *)&(client->handle)))
+   {
+      if (!arm_recv (connection)) uvllhttpd_client_close (client);
+   }
+}
+
+static void prepare_cb (uv_prepare_t *handle)
+{
+   struct UringBackend *b = (struct UringBackend *)handle->data;
+
+   while (b->replay != NULL)
+   {
+      struct UringConnection *connection = b->replay;
+      b->replay = connection->next_replay;
+      replay (connection);
+   }
+
+   if (!b->accept_armed && !b->closing) arm_accept (b);
+   int const r = submit (b);
+   if (r < 0 && r != -EAGAIN && r != -EBUSY && b->server->on_error != NULL)
+   {
+      b->server->on_error (b->server, r, uv_strerror (r));
+   }
+}
+
+void uvllhttpd_uring_client_closed (struct UringConnection *connection)
+{
+   connection->client = NULL;
+   if (connection->armed)
+   {
+      cancel_recv (connection);
+      return;
+   }
+
+   // freed once taken off the replay list
+   if (!connection->queued) connection_free (connection);
+}
+
+void uvllhttpd_uring_close (struct UringBackend *b)
+{
+   b->closing = 1;
+
+   struct io_uring_sqe *sqe = get_sqe (b);
+   if (sqe != NULL)
+   {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = (uintptr_t)b | UringTag_accept;
+      sqe->user_data = 0;
+      submit (b);
+   }
+
+   if (b->connections == 0) backend_close (b);
+}
+
+void uvllhttpd_uring_client_pause (struct UringConnection *connection)
+{
+   if (connection->paused) return;
+   connection->paused = 1;
+   if (connection->armed) cancel_recv (connection);
+}
+
+void uvllhttpd_uring_client_resume (struct UringConnection *connection)
+{
+   connection->paused = 0;
+   if (connection->queued) return;
+
+   if (connection->held.len > 0 || connection->held_status != 0)
+   {
+      // not from here: resuming may happen while the parser is running
+      struct UringBackend *b = connection->backend;
+      connection->queued = 1;
+      connection->next_replay = b->replay;
+      b->replay = connection;
+      return;
+   }
+   if (!connection->armed && !arm_recv (connection)) uvllhttpd_client_close (connection->client);
+}
+
+static void backend_free (struct UringBackend *b)
+{
+   if (b->buf_ring != NULL) munmap (b->buf_ring, b->buf_ring_size);
+   if (b->sqes != NULL) munmap (b->sqes, b->sqes_size);
+   if (b->cq_ring != NULL && b->cq_ring != b->sq_ring) munmap (b->cq_ring, b->cq_ring_size);
+   if (b->sq_ring != NULL) munmap (b->sq_ring, b->sq_ring_size);
+   if (b->event_fd >= 0) close (b->event_fd);
+   if (b->ring_fd >= 0) close (b->ring_fd);
+   free (b->buffers);
+   free (b);
+}
+
+static int backend_init (struct UringBackend *b)
+{
+   struct io_uring_params params;
+   memset (&params, 0, sizeof(params));
+   params.flags = IORING_SETUP_CLAMP;
+
+   b->ring_fd = ring_setup (URING_ENTRIES, &params);
+   if (b->ring_fd < 0) return -errno;
+   if (!(params.features & IORING_FEAT_NODROP)) return UV_ENOSYS;
+
+   b->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   b->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if (b->cq_ring_size > b->sq_ring_size) b->sq_ring_size = b->cq_ring_size;
+      b->cq_ring_size = b->sq_ring_size;
+   }
+
+   b->sq_ring = mmap (NULL, b->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+         b->ring_fd, IORING_OFF_SQ_RING);
+   if (b->sq_ring == MAP_FAILED) { b->sq_ring = NULL; return -errno; }
+
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      b->cq_ring = b->sq_ring;
+   }
+   else
+   {
+      b->cq_ring = mmap (NULL, b->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            b->ring_fd, IORING_OFF_CQ_RING);
+      if (b->cq_ring == MAP_FAILED) { b->cq_ring = NULL; return -errno; }
+   }
+
+   b->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+   b->sqes = mmap (NULL, b->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+         b->ring_fd, IORING_OFF_SQES);
+   if (b->sqes == MAP_FAILED) { b->sqes = NULL; return -errno; }
+
+   char *sq = b->sq_ring;
+   b->sq_head = (unsigned *)(sq + params.sq_off.head);
+   b->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+   b->sq_flags = (unsigned *)(sq + params.sq_off.flags);
+   b->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+   b->sq_entries = params.sq_entries;
+   b->sqe_tail = *(b->sq_tail);
+   // entries are always filled in order, the indirection is the identity
+   unsigned *array = (unsigned *)(sq + params.sq_off.array);
+   for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+
+   char *cq = b->cq_ring;
+   b->cq_head = (unsigned *)(cq + params.cq_off.head);
+   b->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+   b->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+   b->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+   b->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (b->event_fd < 0) return -errno;
+   if (ring_register (b->ring_fd, IORING_REGISTER_EVENTFD, &(b->event_fd), 1) < 0) return -errno;
+
+   // multishot recv needs 6.0, which is also when provided buffer rings came
+   b->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+   b->buf_ring = mmap (NULL, b->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (b->buf_ring == MAP_FAILED) { b->buf_ring = NULL; return -errno; }
+   b->buffers = malloc ((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+   if (b->buffers == NULL) return UV_ENOMEM;
+
+   struct io_uring_buf_reg reg;
+   memset (&reg, 0, sizeof(reg));
+   reg.ring_addr = (uintptr_t)b->buf_ring;
+   reg.ring_entries = URING_BUFFER_COUNT;
+   reg.bgid = URING_BUFFER_GROUP;
+   if (ring_register (b->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -errno;
+
+   for (uint16_t i = 0; i < URING_BUFFER_COUNT; i++) buffer_recycle (b, i);
+   buffers_publish (b);
+
+   return 0;
+}
+
+int uvllhttpd_uring_listen (struct HttpServer *server, uv_os_fd_t fd)
+{
+   struct UringBackend *b = calloc (1, sizeof(struct UringBackend));
+   if (b == NULL) return UV_ENOMEM;
+   b->server = server;
+   b->ring_fd = -1;
+   b->event_fd = -1;
+   b->listen_fd = fd;
+
+   int r = backend_init (b);
+   if (r == 0 && listen (fd, server->backlog) != 0) r = -errno;
+   if (r == 0 && !arm_accept (b)) r = UV_ENOBUFS;
+   if (r == 0) r = submit (b);
+   if (r == 0) r = uv_poll_init (server->loop, &(b->poll), b->event_fd);
+   if (r != 0)
+   {
+      backend_free (b);
+      return r;
+   }
+
+   b->poll.data = b;
+   uv_poll_start (&(b->poll), UV_READABLE, poll_cb);
+
+   uv_prepare_init (server->loop, &(b->prepare));
+   b->prepare.data = b;
+   uv_prepare_start (&(b->prepare), prepare_cb);
+   uv_unref ((uv_handle_t *)&(b->prepare));
+
+   server->_uring = b;
+   return 0;
+}
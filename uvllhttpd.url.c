@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "uvllhttpd.h"
+
+void uvllhttpd_request_split_uri (struct HttpRequest const *request, struct HttpUriParts *parts)
+{
+   if (request == NULL || parts == NULL) return;
+
+   char *p = request->uri.base;
+   char *end = request->uri.base + request->uri.len;
+
+   // absolute-form, "http://host:port/path?query"; the path may be empty,
+   // so the authority ends at the first '/', '?' or '#'
+   if (p < end && *p != '/')
+   {
+      char *scheme_end = memchr (p, ':', end - p);
+      if (scheme_end != NULL && end - scheme_end >= 3 && scheme_end[1] == '/' && scheme_end[2] == '/')
+      {
+         p = scheme_end + 3;
+         while (p < end && *p != '/' && *p != '?' && *p != '#') p++;
+      }
+   }
+
+   char *fragment = memchr (p, '#', end - p);
+   char *path_end = fragment != NULL ? fragment : end;
+   char *query = memchr (p, '?', path_end - p);
+
+   parts->path.base = p;
+   parts->path.len = (query != NULL ? query : path_end) - p;
+
+   parts->query.base = query != NULL ? query + 1 : path_end;
+   parts->query.len = query != NULL ? path_end - (query + 1) : 0;
+
+   parts->fragment.base = fragment != NULL ? fragment + 1 : end;
+   parts->fragment.len = fragment != NULL ? end - (fragment + 1) : 0;
+}
+
+void uvllhttpd_query_iterator_init (struct HttpQueryIterator *iterator, uv_buf_t query)
+{
+   iterator->pos = query.base;
+   iterator->end = query.base + query.len;
+}
+
+bool uvllhttpd_query_iterator_next (struct HttpQueryIterator *iterator, uv_buf_t *key, uv_buf_t *value)
+{
+   while (iterator->pos < iterator->end)
+   {
+      char const *begin = iterator->pos;
+      char const *pair_end = memchr (begin, '&', iterator->end - begin);
+      if (pair_end == NULL) pair_end = iterator->end;
+
+      iterator->pos = pair_end < iterator->end ? pair_end + 1 : pair_end;
+      if (pair_end == begin) continue;
+
+      char const *equal = memchr (begin, '=', pair_end - begin);
+
+      key->base = (char *)begin;
+      key->len = (equal != NULL ? equal : pair_end) - begin;
+      value->base = (char *)(equal != NULL ? equal + 1 : pair_end);
+      value->len = pair_end - value->base;
+      return true;
+   }
+   return false;
+}
+
+bool uvllhttpd_query_find (uv_buf_t query, char const *key, size_t length, uv_buf_t *value)
+{
+   struct HttpQueryIterator iterator;
+   uvllhttpd_query_iterator_init (&iterator, query);
+
+   uv_buf_t k, v;
+   while (uvllhttpd_query_iterator_next (&iterator, &k, &v))
+   {
+      if (k.len == length && memcmp (k.base, key, length) == 0)
+      {
+         if (value != NULL) *value = v;
+         return true;
+      }
+   }
+   return false;
+}
+
+static size_t find_escape (char const *s, size_t length, bool plus_as_space)
+{
+   size_t i = 0;
+#if defined(__SSE2__)
+   __m128i const percent = _mm_set1_epi8 ('%');
+   __m128i const plus = _mm_set1_epi8 (plus_as_space ? '+' : '%');
+   for (; i + 16 <= length; i += 16)
+   {
+      __m128i v = _mm_loadu_si128 ((__m128i const *)(s + i));
+      int mask = _mm_movemask_epi8 (_mm_or_si128 (
+               _mm_cmpeq_epi8 (v, percent),
+               _mm_cmpeq_epi8 (v, plus)));
+      if (mask != 0) return i + __builtin_ctz ((unsigned int)mask);
+   }
+#endif
+   for (; i < length; i++)
+   {
+      if (s[i] == '%' || (plus_as_space && s[i] == '+')) return i;
+   }
+   return length;
+}
+
+static int hex_value (char c)
+{
+   if (c >= '0' && c <= '9') return c - '0';
+   if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+   if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+   return -1;
+}
+
+ssize_t uvllhttpd_url_decode (char const *s, size_t length, char *out, size_t out_size, bool plus_as_space)
+{
+   // most strings have no escape at all and are copied as they are
+   size_t i = find_escape (s, length, plus_as_space);
+   if (i > out_size) return UV_ENOBUFS;
+   if (out != s) memmove (out, s, i);
+
+   size_t pos = i;
+   while (i < length)
+   {
+      if (pos >= out_size) return UV_ENOBUFS;
+
+      if (s[i] == '%')
+      {
+         if (i + 2 >= length) return UV_EINVAL;
+         int high = hex_value (s[i+1]);
+         int low = hex_value (s[i+2]);
+         if (high < 0 || low < 0) return UV_EINVAL;
+
+         out[pos++] = (char)(high << 4 | low);
+         i += 3;
+      }
+      else if (plus_as_space && s[i] == '+')
+      {
+         out[pos++] = ' ';
+         i++;
+      }
+      else
+      {
+         size_t n = find_escape (s + i, length - i, plus_as_space);
+         if (pos + n > out_size) return UV_ENOBUFS;
+         memmove (out + pos, s + i, n);
+         pos += n;
+         i += n;
+      }
+   }
+   return pos;
+}
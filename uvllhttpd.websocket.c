@@ -0,0 +1,662 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "uvllhttpd.h"
+#include "uvllhttpd.impl.h"
+#include "uvllhttpd.websocket.h"
+
+struct websocket_write {
+   uv_write_t req;
+   struct WebSocket *ws;
+   uint8_t close_after;
+   char bytes[];
+};
+
+static char const websocket_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+
+static uint32_t sha1_rol (uint32_t value, unsigned int bits)
+{
+   return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_block (uint32_t state[5], uint8_t const block[64])
+{
+   uint32_t w[80];
+   for (int i = 0; i < 16; i++)
+   {
+      w[i] = (uint32_t)block[i*4] << 24 | (uint32_t)block[i*4 + 1] << 16 |
+         (uint32_t)block[i*4 + 2] << 8 | (uint32_t)block[i*4 + 3];
+   }
+   for (int i = 16; i < 80; i++)
+   {
+      w[i] = sha1_rol (w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+   }
+
+   uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+   for (int i = 0; i < 80; i++)
+   {
+      uint32_t f, k;
+      if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+      else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+      else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+      else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+
+      uint32_t temp = sha1_rol (a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = sha1_rol (b, 30);
+      b = a;
+      a = temp;
+   }
+
+   state[0] += a;
+   state[1] += b;
+   state[2] += c;
+   state[3] += d;
+   state[4] += e;
+}
+
+// the handshake input is always short, so the whole message is padded in one buffer
+static void sha1 (uint8_t const *data, size_t length, uint8_t digest[20])
+{
+   uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+   size_t const padded_length = ((length + 8) / 64 + 1) * 64;
+   uint8_t padded[padded_length];
+   memset (padded, 0, padded_length);
+   memcpy (padded, data, length);
+   padded[length] = 0x80;
+
+   uint64_t const bits = (uint64_t)length * 8;
+   for (int i = 0; i < 8; i++)
+   {
+      padded[padded_length - 1 - i] = (uint8_t)(bits >> (i * 8));
+   }
+
+   for (size_t offset = 0; offset < padded_length; offset += 64)
+   {
+      sha1_block (state, padded + offset);
+   }
+
+   for (int i = 0; i < 20; i++)
+   {
+      digest[i] = (uint8_t)(state[i / 4] >> (24 - (i % 4) * 8));
+   }
+}
+
+static size_t base64_encode (uint8_t const *data, size_t length, char *out)
+{
+   static char const table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+   size_t pos = 0;
+   for (size_t i = 0; i < length; i += 3)
+   {
+      uint32_t v = (uint32_t)data[i] << 16;
+      if (i + 1 < length) v |= (uint32_t)data[i+1] << 8;
+      if (i + 2 < length) v |= data[i+2];
+
+      out[pos++] = table[(v >> 18) & 0x3F];
+      out[pos++] = table[(v >> 12) & 0x3F];
+      out[pos++] = (i + 1 < length) ? table[(v >> 6) & 0x3F] : '=';
+      out[pos++] = (i + 2 < length) ? table[v & 0x3F] : '=';
+   }
+   out[pos] = '\0';
+   return pos;
+}
+
+void uvllhttpd_websocket_compute_accept_key (char const *key, size_t length, char accept[29])
+{
+   size_t const guid_length = sizeof(websocket_guid) - 1;
+   uint8_t input[length + guid_length];
+   memcpy (input, key, length);
+   memcpy (input + length, websocket_guid, guid_length);
+
+   uint8_t digest[20];
+   sha1 (input, length + guid_length, digest);
+   base64_encode (digest, sizeof(digest), accept);
+}
+
+// XORs the payload with the mask key, offset is the payload position of data
+// so that chunks split at arbitrary positions are unmasked correctly
+static void websocket_unmask (char *data, size_t length, uint8_t const mask[4], uint64_t offset)
+{
+   uint8_t key[8];
+   for (int i = 0; i < 8; i++) key[i] = mask[(offset + i) & 3];
+
+   size_t i = 0;
+#if defined(__SSE2__)
+   int32_t key32;
+   memcpy (&key32, key, sizeof(key32));
+   __m128i const key128 = _mm_set1_epi32 (key32);
+   for (; i + 16 <= length; i += 16)
+   {
+      __m128i v = _mm_loadu_si128 ((__m128i const *)(data + i));
+      _mm_storeu_si128 ((__m128i *)(data + i), _mm_xor_si128 (v, key128));
+   }
+#endif
+
+   uint64_t key64;
+   memcpy (&key64, key, sizeof(key64));
+   for (; i + 8 <= length; i += 8)
+   {
+      uint64_t v;
+      memcpy (&v, data + i, sizeof(v));
+      v ^= key64;
+      memcpy (data + i, &v, sizeof(v));
+   }
+
+   for (; i < length; i++) data[i] ^= key[i & 3];
+}
+
+// Incremental UTF-8 check: the low 2 bits of state count the continuation bytes
+// still expected, the bits above select the range the next one must fall in,
+// which rules out overlong forms, surrogates and code points past U+10FFFF.
+static bool websocket_utf8_check (uint8_t *state, uint8_t const *s, size_t n)
+{
+   static uint8_t const lower[] = { 0x80, 0xA0, 0x80, 0x90, 0x80 };
+   static uint8_t const upper[] = { 0xBF, 0xBF, 0x9F, 0xBF, 0x8F };
+
+   uint8_t st = *state;
+   size_t i = 0;
+   while (i < n)
+   {
+      if (st == 0 && i + 8 <= n)
+      {
+         uint64_t v;
+         memcpy (&v, s + i, sizeof(v));
+         if ((v & 0x8080808080808080ull) == 0)
+         {
+            i += 8;
+            continue;
+         }
+      }
+
+      uint8_t const c = s[i++];
+      if (st != 0)
+      {
+         if (c < lower[st >> 2] || c > upper[st >> 2]) return false;
+         st = (st & 3) - 1;
+      }
+      else if (c < 0x80) {}
+      else if (c >= 0xC2 && c <= 0xDF) st = 1;
+      else if (c == 0xE0) st = 2 | 1 << 2;
+      else if (c == 0xED) st = 2 | 2 << 2;
+      else if (c >= 0xE1 && c <= 0xEF) st = 2;
+      else if (c == 0xF0) st = 3 | 3 << 2;
+      else if (c == 0xF4) st = 3 | 4 << 2;
+      else if (c >= 0xF1 && c <= 0xF3) st = 3;
+      else return false;
+   }
+   *state = st;
+   return true;
+}
+
+static size_t websocket_frame_header (char *out, uint8_t opcode, size_t length)
+{
+   uint8_t *p = (uint8_t *)out;
+   p[0] = 0x80 | opcode;
+   if (length < 126)
+   {
+      p[1] = (uint8_t)length;
+      return 2;
+   }
+   if (length <= 0xFFFF)
+   {
+      p[1] = 126;
+      p[2] = (uint8_t)(length >> 8);
+      p[3] = (uint8_t)length;
+      return 4;
+   }
+
+   p[1] = 127;
+   for (int i = 0; i < 8; i++) p[9 - i] = (uint8_t)((uint64_t)length >> (i * 8));
+   return 10;
+}
+
+static void write_cb (uv_write_t *req, int status)
+{
+   struct websocket_write *w = (struct websocket_write *)req;
+
+   if (w->close_after)
+   {
+      uvllhttpd_client_close ((uvllhttpd_client_t *)w->ws->handle);
+   }
+   free (w);
+}
+
+static int websocket_write_frame (struct WebSocket *ws, uint8_t opcode, char const *s, size_t length, bool close_after)
+{
+   if (uv_is_closing ((uv_handle_t*) ws->handle)) return UV_EPIPE;
+
+   struct websocket_write *w = malloc (sizeof(struct websocket_write) + 10 + length);
+   w->ws = ws;
+   w->close_after = close_after;
+
+   size_t header_length = websocket_frame_header (w->bytes, opcode, length);
+   if (length > 0) memcpy (w->bytes + header_length, s, length);
+
+   uv_buf_t buf = {
+      .base = w->bytes,
+      .len = header_length + length,
+   };
+
+   int r = uvllhttpd_client_write (&(w->req), (uvllhttpd_client_t *)ws->handle, &buf, 1, write_cb);
+   if (r != 0) free (w);
+   return r;
+}
+
+int uvllhttpd_websocket_send (struct WebSocket *ws, enum WebSocketOpcode opcode, char const *s, size_t length)
+{
+   if (ws == NULL) return UV_EINVAL;
+   if (ws->_close_sent) return UV_EPIPE;
+
+   return websocket_write_frame (ws, opcode, s, length, false);
+}
+
+int uvllhttpd_websocket_ping (struct WebSocket *ws, char const *s, size_t length)
+{
+   if (length > 125) return UV_EINVAL;
+
+   return uvllhttpd_websocket_send (ws, WebSocketOpcode_ping, s, length);
+}
+
+void uvllhttpd_websocket_close (struct WebSocket *ws, uint16_t code)
+{
+   if (ws == NULL || ws->_close_sent) return;
+
+   if (!ws->_closing) ws->_close_code = code;
+   ws->_closing = 1;
+   ws->_close_sent = 1;
+
+   // 1005 means no status code was received, it is never sent on the wire
+   char payload[2] = { (char)(code >> 8), (char)(code & 0xFF) };
+   if (websocket_write_frame (ws, WebSocketOpcode_close, payload, code == 1005 ? 0 : 2, true) != 0)
+   {
+      uvllhttpd_client_close ((uvllhttpd_client_t *)ws->handle);
+   }
+}
+
+static void shared_write_cb (uv_write_t *req, int status)
+{
+   uvllhttpd_shared_buffer_unref ((struct SharedBuffer *)req->data);
+   free (req);
+}
+
+size_t uvllhttpd_websocket_broadcast (
+      struct WebSocket * const *sockets, size_t count,
+      enum WebSocketOpcode opcode, char const *s, size_t length)
+{
+   if (sockets == NULL || count == 0) return 0;
+
+   char header[10];
+   size_t const header_length = websocket_frame_header (header, opcode, length);
+
+   struct SharedBuffer *frame = uvllhttpd_shared_buffer_new (NULL, header_length + length);
+   if (frame == NULL) return 0;
+   memcpy (frame->base, header, header_length);
+   if (length > 0) memcpy (frame->base + header_length, s, length);
+
+   uv_buf_t buf = {
+      .base = frame->base,
+      .len = frame->len,
+   };
+
+   size_t written = 0;
+   for (size_t i = 0; i < count; i++)
+   {
+      struct WebSocket *ws = sockets[i];
+      if (ws == NULL || ws->_close_sent || uv_is_closing ((uv_handle_t*) ws->handle)) continue;
+
+      uv_write_t *req = malloc (sizeof(uv_write_t));
+      req->data = uvllhttpd_shared_buffer_ref (frame);
+      if (uvllhttpd_client_write (req, (uvllhttpd_client_t *)ws->handle, &buf, 1, shared_write_cb) != 0)
+      {
+         uvllhttpd_shared_buffer_unref (frame);
+         free (req);
+         continue;
+      }
+      written++;
+   }
+
+   uvllhttpd_shared_buffer_unref (frame);
+   return written;
+}
+
+static uint8_t websocket_header_size (uint8_t const header[2])
+{
+   uint8_t size = 2;
+   if ((header[1] & 0x7F) == 126) size += 2;
+   else if ((header[1] & 0x7F) == 127) size += 8;
+   if (header[1] & 0x80) size += 4;
+   return size;
+}
+
+static bool websocket_frame_begin (struct WebSocket *ws)
+{
+   uint8_t const *header = ws->_parser.header;
+
+   ws->_parser.fin = header[0] & 0x80;
+   ws->_parser.opcode = header[0] & 0x0F;
+   ws->_parser.payload_received = 0;
+
+   // no extension is negotiated, so reserved bits must be 0, and client frames must be masked
+   if ((header[0] & 0x70) != 0 || (header[1] & 0x80) == 0)
+   {
+      uvllhttpd_websocket_close (ws, 1002);
+      return false;
+   }
+
+   size_t pos = 2;
+   uint64_t length = header[1] & 0x7F;
+   if (length == 126)
+   {
+      length = (uint64_t)header[2] << 8 | header[3];
+      pos += 2;
+   }
+   else if (length == 127)
+   {
+      length = 0;
+      for (int i = 0; i < 8; i++) length = length << 8 | header[2 + i];
+      pos += 8;
+      if (length >> 63)
+      {
+         uvllhttpd_websocket_close (ws, 1002);
+         return false;
+      }
+   }
+   ws->_parser.payload_length = length;
+   memcpy (ws->_parser.mask, header + pos, 4);
+
+   uint8_t const opcode = ws->_parser.opcode;
+   if (opcode & 0x08)
+   {
+      if (!ws->_parser.fin || length > 125 ||
+            (opcode != WebSocketOpcode_close && opcode != WebSocketOpcode_ping && opcode != WebSocketOpcode_pong))
+      {
+         uvllhttpd_websocket_close (ws, 1002);
+         return false;
+      }
+      return true;
+   }
+
+   if (opcode == WebSocketOpcode_continuation)
+   {
+      if (ws->_parser.message_opcode == 0)
+      {
+         uvllhttpd_websocket_close (ws, 1002);
+         return false;
+      }
+   }
+   else if (opcode == WebSocketOpcode_text || opcode == WebSocketOpcode_binary)
+   {
+      if (ws->_parser.message_opcode != 0)
+      {
+         uvllhttpd_websocket_close (ws, 1002);
+         return false;
+      }
+      ws->_parser.message_opcode = opcode;
+      ws->_parser.message_length = 0;
+      ws->_parser.utf8_state = 0;
+   }
+   else
+   {
+      uvllhttpd_websocket_close (ws, 1002);
+      return false;
+   }
+
+   // the buffer itself grows as the payload arrives, not by the length the peer claims
+   if (ws->_parser.message_length + length > ws->max_message_size)
+   {
+      uvllhttpd_websocket_close (ws, 1009);
+      return false;
+   }
+   return true;
+}
+
+static bool websocket_message_reserve (struct WebSocket *ws, size_t n)
+{
+   // +1 for the terminating NUL passed to on_message
+   size_t const required = ws->_parser.message_length + n + 1;
+   if (required <= ws->_parser.message.len) return true;
+
+   size_t size = ws->_parser.message.len > 0 ? ws->_parser.message.len * 2 : 4096;
+   if (size < required) size = required;
+   if (size - 1 > ws->max_message_size) size = ws->max_message_size + 1;
+
+   char *base = realloc (ws->_parser.message.base, size);
+   if (base == NULL)
+   {
+      uvllhttpd_websocket_close (ws, 1011);
+      return false;
+   }
+   ws->_parser.message.base = base;
+   ws->_parser.message.len = size;
+   return true;
+}
+
+static void websocket_frame_end (struct WebSocket *ws)
+{
+   ws->_parser.header_length = 0;
+   ws->_parser.header_needed = 2;
+
+   switch (ws->_parser.opcode)
+   {
+      case WebSocketOpcode_close:
+         {
+            // a code alone is 2 bytes, and a reason after it must be UTF-8
+            uint16_t code = 1005;
+            uint8_t utf8_state = 0;
+            if (ws->_parser.payload_length == 1)
+            {
+               uvllhttpd_websocket_close (ws, 1002);
+               break;
+            }
+            if (ws->_parser.payload_length > 2 &&
+                  (!websocket_utf8_check (&utf8_state, (uint8_t const *)ws->_parser.control + 2,
+                     ws->_parser.payload_length - 2) || utf8_state != 0))
+            {
+               uvllhttpd_websocket_close (ws, 1007);
+               break;
+            }
+            if (ws->_parser.payload_length >= 2)
+            {
+               code = (uint16_t)((uint8_t)ws->_parser.control[0] << 8 | (uint8_t)ws->_parser.control[1]);
+            }
+            ws->_close_code = code;
+            ws->_closing = 1;
+            uvllhttpd_websocket_close (ws, code);
+         }
+         break;
+
+      case WebSocketOpcode_ping:
+         websocket_write_frame (ws, WebSocketOpcode_pong,
+               ws->_parser.control, ws->_parser.payload_length, false);
+         break;
+
+      case WebSocketOpcode_pong:
+         break;
+
+      default:
+         if (ws->_parser.fin)
+         {
+            // a text message must not end inside a character
+            if (ws->_parser.message_opcode == WebSocketOpcode_text && ws->_parser.utf8_state != 0)
+            {
+               uvllhttpd_websocket_close (ws, 1007);
+               break;
+            }
+            if (!websocket_message_reserve (ws, 0)) break;
+            uv_buf_t message = {
+               .base = ws->_parser.message.base,
+               .len = ws->_parser.message_length,
+            };
+            message.base[message.len] = '\0';
+
+            enum WebSocketOpcode opcode = ws->_parser.message_opcode;
+            ws->_parser.message_opcode = 0;
+            ws->_parser.message_length = 0;
+
+            ws->on_message (ws, opcode, message);
+         }
+         break;
+   }
+}
+
+void uvllhttpd_websocket_feed (struct WebSocket *ws, char const *at, size_t length)
+{
+   while (length > 0 && !ws->_closing)
+   {
+      if (ws->_parser.header_length < ws->_parser.header_needed)
+      {
+         size_t n = ws->_parser.header_needed - ws->_parser.header_length;
+         if (n > length) n = length;
+
+         memcpy (ws->_parser.header + ws->_parser.header_length, at, n);
+         ws->_parser.header_length += n;
+         at += n;
+         length -= n;
+
+         if (ws->_parser.header_length == 2 && ws->_parser.header_needed == 2)
+         {
+            ws->_parser.header_needed = websocket_header_size (ws->_parser.header);
+         }
+         if (ws->_parser.header_length < ws->_parser.header_needed) continue;
+
+         if (!websocket_frame_begin (ws)) return;
+         if (ws->_parser.payload_length == 0) websocket_frame_end (ws);
+         continue;
+      }
+
+      uint64_t remaining = ws->_parser.payload_length - ws->_parser.payload_received;
+      size_t n = remaining < length ? (size_t)remaining : length;
+
+      char *dest;
+      if (ws->_parser.opcode & 0x08)
+      {
+         dest = ws->_parser.control + ws->_parser.payload_received;
+      }
+      else
+      {
+         if (!websocket_message_reserve (ws, n)) return;
+         dest = ws->_parser.message.base + ws->_parser.message_length;
+         ws->_parser.message_length += n;
+      }
+
+      memcpy (dest, at, n);
+      websocket_unmask (dest, n, ws->_parser.mask, ws->_parser.payload_received);
+      // checked as it arrives, so a character may span frames
+      if (!(ws->_parser.opcode & 0x08) && ws->_parser.message_opcode == WebSocketOpcode_text &&
+            !websocket_utf8_check (&(ws->_parser.utf8_state), (uint8_t const *)dest, n))
+      {
+         uvllhttpd_websocket_close (ws, 1007);
+         return;
+      }
+      ws->_parser.payload_received += n;
+      at += n;
+      length -= n;
+
+      if (ws->_parser.payload_received == ws->_parser.payload_length) websocket_frame_end (ws);
+   }
+}
+
+void uvllhttpd_websocket_free (struct WebSocket *ws)
+{
+   if (ws->on_close != NULL) ws->on_close (ws, ws->_close_code);
+
+   if (ws->_parser.message.base != NULL) free (ws->_parser.message.base);
+   free (ws);
+}
+
+static bool header_has_token (struct HttpHeader const *header, char const *token)
+{
+   if (header == NULL) return false;
+
+   size_t const token_length = strlen (token);
+   char const *p = header->value.base;
+   char const *end = header->value.base + header->value.len;
+
+   while (p < end)
+   {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+
+      char const *begin = p;
+      while (p < end && *p != ',') p++;
+
+      char const *last = p;
+      while (last > begin && (last[-1] == ' ' || last[-1] == '\t')) last--;
+
+      if ((size_t)(last - begin) == token_length && strncasecmp (begin, token, token_length) == 0)
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+struct WebSocket *uvllhttpd_websocket_accept (
+      uv_tcp_t *handle,
+      struct HttpRequest const *request,
+      uvllhttpd_websocket_message_handler on_message,
+      uvllhttpd_websocket_close_handler on_close,
+      size_t max_message_size)
+{
+   if (handle == NULL || request == NULL || on_message == NULL) return NULL;
+
+   uvllhttpd_client_t *client = (uvllhttpd_client_t *)handle;
+   if (client->websocket != NULL) return NULL;
+   if (!request->upgrade || request->method != HTTP_GET) return NULL;
+
+   if (!header_has_token (uvllhttpd_request_find_header (request, "Upgrade", 7), "websocket")) return NULL;
+   if (!header_has_token (uvllhttpd_request_find_header (request, "Connection", 10), "upgrade")) return NULL;
+   if (!header_has_token (uvllhttpd_request_find_header (request, "Sec-WebSocket-Version", 21), "13")) return NULL;
+
+   struct HttpHeader const *key = uvllhttpd_request_find_header (request, "Sec-WebSocket-Key", 17);
+   if (key == NULL || key->value.len != 24) return NULL;
+
+   char accept[29];
+   uvllhttpd_websocket_compute_accept_key (key->value.base, key->value.len, accept);
+
+   struct WebSocket *ws = calloc (1, sizeof(struct WebSocket));
+   ws->handle = handle;
+   ws->on_message = on_message;
+   ws->on_close = on_close;
+   ws->max_message_size = max_message_size > 0 ? max_message_size : 1024 * 1024;
+   ws->_parser.header_needed = 2;
+   ws->_close_code = 1006;
+
+   size_t const buffer_size = 160;
+   struct websocket_write *w = malloc (sizeof(struct websocket_write) + buffer_size);
+   w->ws = ws;
+   w->close_after = 0;
+
+   uv_buf_t buf = {
+      .base = w->bytes,
+      .len = snprintf (w->bytes, buffer_size,
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: %s\r\n"
+            "\r\n", accept),
+   };
+   // responses to pipelined requests before the upgrade go first
+   uvllhttpd_client_flush (client);
+   if (uvllhttpd_client_write (&(w->req), client, &buf, 1, write_cb) != 0)
+   {
+      free (w);
+      free (ws);
+      return NULL;
+   }
+
+   // frames reach uvllhttpd_websocket_feed through uvllhttpd_client_received,
+   // after TLS has decrypted them
+   client->websocket = ws;
+
+   return ws;
+}
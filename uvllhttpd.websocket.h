@@ -0,0 +1,75 @@
+#pragma once
+
+#include "uvllhttpd.h"
+
+enum WebSocketOpcode {
+   WebSocketOpcode_continuation = 0x0,
+   WebSocketOpcode_text         = 0x1,
+   WebSocketOpcode_binary       = 0x2,
+   WebSocketOpcode_close        = 0x8,
+   WebSocketOpcode_ping         = 0x9,
+   WebSocketOpcode_pong         = 0xA,
+};
+
+struct WebSocket;
+
+// message is a complete (reassembled) text or binary message, valid only during the call
+typedef void (*uvllhttpd_websocket_message_handler) (struct WebSocket *ws, enum WebSocketOpcode opcode, uv_buf_t message);
+// called once when the connection is closed, 1006 if no close frame was received
+typedef void (*uvllhttpd_websocket_close_handler) (struct WebSocket *ws, uint16_t code);
+
+struct WebSocket {
+   void *data;
+   uv_tcp_t *handle;
+
+   uvllhttpd_websocket_message_handler on_message;
+   uvllhttpd_websocket_close_handler on_close;
+   size_t max_message_size;
+
+   struct {
+      uint8_t header[14];
+      uint8_t header_length;
+      uint8_t header_needed;
+
+      uint8_t fin;
+      uint8_t opcode;
+      uint8_t mask[4];
+      uint64_t payload_length;
+      uint64_t payload_received;
+
+      uint8_t message_opcode;
+      uint8_t utf8_state;
+      uv_buf_t message;
+      size_t message_length;
+
+      char control[125];
+   } _parser;
+
+   uint16_t _close_code;
+   uint8_t _close_sent;
+   uint8_t _closing;
+};
+
+// Completes the handshake of an upgrade request and takes over the connection.
+// Must be called from the request handler. Returns NULL if the request is
+// not a valid websocket upgrade; the handler should then respond normally.
+// Messages longer than max_message_size (1 MiB if 0) close the connection with 1009,
+// text messages and close reasons that are not UTF-8 with 1007.
+struct WebSocket *uvllhttpd_websocket_accept (
+      uv_tcp_t *handle,
+      struct HttpRequest const *request,
+      uvllhttpd_websocket_message_handler on_message,
+      uvllhttpd_websocket_close_handler on_close,
+      size_t max_message_size);
+
+int uvllhttpd_websocket_send (struct WebSocket *ws, enum WebSocketOpcode opcode, char const *s, size_t length);
+int uvllhttpd_websocket_ping (struct WebSocket *ws, char const *s, size_t length);
+void uvllhttpd_websocket_close (struct WebSocket *ws, uint16_t code);
+
+// Serializes the frame once and queues the same bytes on every websocket.
+// Closing websockets are skipped. Returns the number of websockets written to.
+size_t uvllhttpd_websocket_broadcast (
+      struct WebSocket * const *sockets, size_t count,
+      enum WebSocketOpcode opcode, char const *s, size_t length);
+
+void uvllhttpd_websocket_compute_accept_key (char const *key, size_t length, char accept[29]);